@@ -1,22 +1,23 @@
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
 #include <iostream>
 #include "SDL.h"
 #include "nes_logger.h"
 #include "nes_system.h"
+#include "nes_rom_registry.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#define O_BINARY 0
+#endif
 
 const int TILE_SIZE = 8;
 const int SCREEN_WIDTH = 32 * TILE_SIZE;
 const int SCREEN_HEIGHT = 30 * TILE_SIZE;
 
-const int BYTE2_FLIP_HORIZ_MASK = 0x40;
-const int BYTE2_FLIP_VERT_MASK = 0x80;
-
-const int NAME_TABLE_SIZE = 960;
-
-struct tile {
-    uint32_t* pixels;
-    bool* transparency;
-};
-
 Uint32 make_argb(Uint8 r, Uint8 g, Uint8 b) {
     return static_cast<Uint32>((r << 16) | (g << 8) | b);
 }
@@ -29,103 +30,6 @@ static uint32_t system_palette[] =
                 make_argb(236, 238, 236),   make_argb(168, 204, 236),  make_argb(188, 188, 236),  make_argb(212, 178, 236),  make_argb(236, 174, 236),  make_argb(236, 174, 212),  make_argb(236, 180, 176),  make_argb(228, 196, 144),  make_argb(204, 210, 120),  make_argb(180, 222, 120), make_argb(168, 226, 144),  make_argb(152, 226, 180),  make_argb(160, 214, 228),  make_argb(160, 162, 160), make_argb(0, 0, 0), make_argb(0, 0, 0)
         };
 
-Uint32 *getTilePixels(uint8_t* pattern_table, int tileId, Uint8* palette) {
-    int count = 0x1000 + tileId * 8 * 2;
-    tile res{};
-    res.pixels = new Uint32[8 * 8];
-    for (int row = 0; row < 8; row++){
-        Uint8 tileRow2 = pattern_table[count];
-        Uint8 tileRow1 = pattern_table[count + 8];
-        for(int col = 0; col < 8; col++){
-            Uint8 value = static_cast<Uint8>((((tileRow1 & 0x80) != 0) << 1) | (((tileRow2 & 0x80) != 0)));
-            res.pixels[row * 8 + col] = system_palette[palette[value]];
-            tileRow1 <<= 1;
-            tileRow2 <<= 1;
-        }
-        count++;
-    }
-    return res.pixels;
-}
-
-void fillPixels(uint8_t* pattern_table, Uint32* pixels, int row, int col, int tileId, Uint8* palette){
-    Uint32* pix = getTilePixels(pattern_table, tileId, palette);
-    int count = 0;
-    for(int i = row; i < row + 8; i++){
-        for (int j = col; j < col + 8; j++){
-            if (i < 0 || j < 0) continue;
-            pixels[i * SCREEN_WIDTH + j] = pix[count++];
-        }
-    }
-}
-
-tile* getSpriteTilePixels(tile* res, uint8_t* pattern_table, int tileId, Uint8* palette) {
-    int count = 0x0000 + tileId * 8 * 2;
-    res->pixels = new Uint32[8 * 8];
-    res->transparency = new bool[8 * 8];
-    for (int row = 0; row < 8; row++){
-        Uint8 tileRow2 = pattern_table[count];
-        Uint8 tileRow1 = pattern_table[count + 8];
-        for(int col = 0; col < 8; col++){
-            Uint8 value = static_cast<Uint8>((((tileRow1 & 0x80) != 0) << 1) | (((tileRow2 & 0x80) != 0)));
-            if (value != 0){
-                res->pixels[row * 8 + col] = system_palette[palette[value]];
-                res->transparency[row * 8 + col] = false;
-            } else {
-                res->transparency[row * 8 + col] = true;
-            }
-            tileRow1 <<= 1;
-            tileRow2 <<= 1;
-        }
-        count++;
-    }
-    return res;
-}
-
-void fillSpritePixels(uint8_t* pattern_table, Uint32* pixels, int row, int col, int tileId, Uint8* palette, bool horizMirror, bool vertMirror){
-    tile tile{};
-    getSpriteTilePixels(&tile, pattern_table, tileId, palette);
-    Uint32* pix = tile.pixels;
-    bool* transparency = tile.transparency;
-    int count = 0;
-    if (horizMirror && vertMirror){
-        for(int i = row + 7; i >= row; i--){
-            for (int j = col + 7; j >= col; j--){
-                uint32_t color = pix[count];
-                if (!transparency[count++]){
-                    pixels[i * SCREEN_WIDTH + j] = color;
-                }
-            }
-        }
-    } else if (horizMirror){
-        for(int i = row; i < row + 8; i++){
-            for (int j = col + 7; j >= col; j--){
-                uint32_t color = pix[count];
-                if (!transparency[count++]) {
-                    pixels[i * SCREEN_WIDTH + j] = color;
-                }
-            }
-        }
-    } else if (vertMirror){
-        for(int i = row + 7; i >= row; i--){
-            for (int j = col; j < col + 8; j++){
-                uint32_t color = pix[count];
-                if (!transparency[count++]){
-                    pixels[i * SCREEN_WIDTH + j] = color;
-                }
-            }
-        }
-    } else {
-        for(int i = row; i < row + 8; i++){
-            for (int j = col; j < col + 8; j++){
-                uint32_t color = pix[count];
-                if (!transparency[count++]){
-                    pixels[i * SCREEN_WIDTH + j] = color;
-                }
-            }
-        }
-    }
-}
-
 class sdl_keyboard_controller : public nes_input_device
 {
 public:
@@ -173,6 +77,22 @@ const SDL_Scancode sdl_keyboard_controller::s_buttons[] = {
         SDL_SCANCODE_D
 };
 
+// --trace <file> keeps this many of the last instructions (16 bytes each) and writes them out on exit or crash
+#define TRACE_RECORDS (4 * 1024 * 1024)
+
+// The file is opened up front - a crash may leave the heap or stdio in any state, so the signal handler does
+// nothing but write() the records (see nes_trace::save)
+static int s_trace_fd = -1;
+static nes_trace *s_trace = nullptr;
+
+static void on_crash(int sig)
+{
+    if (s_trace)
+        s_trace->save(s_trace_fd);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
 int main(int argc, char* argv[]) {
     SDL_Window* window = NULL;
     SDL_Surface* surface = NULL;
@@ -194,20 +114,52 @@ int main(int argc, char* argv[]) {
     SDL_RenderSetScale(renderer, 4, 4);
     SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, SCREEN_WIDTH, SCREEN_HEIGHT);
 
-    nes_system system;
-    system.init();
-    system.load_rom("/home/alex/CLionProjects/nesemu2/ic.nes");
+    auto system = std::make_unique<nes_system>();
+    system->init();
 
-    system.getInput()->register_input(0, std::make_shared<sdl_keyboard_controller>());
+    // --jit compiles hot code to native code, --interpreter runs without the block cache (for comparison)
+    // --cache keeps ROM hashes and pre-decoded ROM data in a directory so the next run doesn't redo them
+    // --cheat applies a Game Genie code or raw patch (repeatable)
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--jit") == 0)
+            system->getCpu()->set_engine(nes_cpu_engine::JIT);
+        else if (strcmp(argv[i], "--interpreter") == 0)
+            system->getCpu()->set_engine(nes_cpu_engine::INTERPRETER);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            s_trace_fd = open(argv[++i], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+            if (s_trace_fd < 0)
+                printf("Cannot write trace to %s\n", argv[i]);
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            nes_rom_registry::instance().set_cache_dir(argv[++i]);
+        else if (strcmp(argv[i], "--cheat") == 0 && i + 1 < argc)
+        {
+            nes_patch patch;
+            if (nes_parse_cheat(argv[++i], patch))
+                system->getMem()->add_patch(patch);
+            else
+                printf("Not a Game Genie code or AAAA:VV / AAAA?CC:VV patch: %s\n", argv[i]);
+        }
+    }
 
-    auto* pixels = new Uint32[SCREEN_WIDTH * SCREEN_HEIGHT];
-    memset(pixels, 255, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+    system->load_rom("/home/alex/CLionProjects/nesemu2/ic.nes");
+
+    if (s_trace_fd >= 0)
+    {
+        system->getCpu()->set_trace(TRACE_RECORDS);
+        s_trace = system->getCpu()->get_trace();
+        if (!s_trace)
+            printf("Built without tracing (NES_NO_TRACE) - ignoring --trace\n");
+        signal(SIGSEGV, on_crash);
+        signal(SIGABRT, on_crash);
+    }
 
-    auto* tableRender1 = new Uint32[SCREEN_WIDTH * SCREEN_HEIGHT];
-    memset(tableRender1, 255, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+    system->getInput()->register_input(0, std::make_shared<sdl_keyboard_controller>());
 
-    auto* tableRender2 = new Uint32[SCREEN_WIDTH * SCREEN_HEIGHT];
-    memset(tableRender2, 255, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
+    auto* pixels = new Uint32[SCREEN_WIDTH * SCREEN_HEIGHT];
+    memset(pixels, 255, SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Uint32));
 
     Uint64 prev_counter = SDL_GetPerformanceCounter();
     Uint64 count_per_second = SDL_GetPerformanceFrequency();
@@ -241,95 +193,15 @@ int main(int argc, char* argv[]) {
         if (cpu_cycles > nes_cycle_t(NES_CLOCK_HZ))
             cpu_cycles = nes_cycle_t(NES_CLOCK_HZ);
 
-        for (nes_cycle_t i = nes_cycle_t(0); i < cpu_cycles; ++i)
-            system.step(nes_cycle_t(1));
-
-        uint8_t * chr_table = system.getPpu()->_vram.get();
-        uint8_t * nameTable1 = chr_table + 0x2000;
-        uint8_t * nameTable2 = chr_table + 0x2400;
-        uint8_t * attrib1 = chr_table + 0x23C0;
-        uint8_t * attrib2 = chr_table + 0x27C0;
-        uint8_t * imagePalette = chr_table + 0x3F00;
-        uint8_t * spritePalette = chr_table + 0x3F10;
-
-        uint8_t * spriteOam = system.getPpu()->_oam.get();
-        int count1 = 0;
-        int count2 = 0;
-        bool upper = false;
-        bool left = false;
-        //TABLE RENDER 1
-        for(int row = 0; row < 30; row++){
-            if ((row % 2) == 0) {
-                upper = !upper;
-            }
-            left = false;
-            for(int col = 0; col < 32; col++){
-                if ((col % 2) == 0){
-                    left = !left;
-                }
-                int shift = 0;
-                if (upper && !left){
-                    shift = 2;
-                }
-                if (!upper && left){
-                    shift = 4;
-                }
-                if (!upper && !left){
-                    shift = 6;
-                }
-                fillPixels(chr_table, tableRender1, row * 8, col * 8, nameTable1[count1++], imagePalette + 4 * ((attrib1[(row / 4) * 8 + (col / 4)] >> shift) & 0x3));
-            }
-        }
+        system->step(cpu_cycles);
 
-        count1 = 0;
-        upper = false;
-        left = false;
-        //TABLE RENDER 2
-        for(int row = 0; row < 30; row++){
-            if ((row % 2) == 0) {
-                upper = !upper;
-            }
-            left = false;
-            for(int col = 0; col < 32; col++){
-                if ((col % 2) == 0){
-                    left = !left;
-                }
-                int shift = 0;
-                if (upper && !left){
-                    shift = 2;
-                }
-                if (!upper && left){
-                    shift = 4;
-                }
-                if (!upper && !left){
-                    shift = 6;
-                }
-                fillPixels(chr_table, tableRender2, row * 8, col * 8, nameTable2[count1++], imagePalette + 4 * ((attrib2[(row / 4) * 8 + (col / 4)] >> shift) & 0x3));
-            }
-        }
+        // The PPU renders frames as palette indices - only new ones need converting and presenting
+        if (!system->getPpu()->frame_ready())
+            continue;
 
-        int xScroll = system.getPpu()->_coarse_x_scroll * 8 + system.getPpu()->_fine_x_scroll;
-        for (int row = 0; row < SCREEN_HEIGHT; row++){
-            for (int col = 0; col < SCREEN_WIDTH; col++){
-                if (col >= SCREEN_WIDTH - xScroll){
-                    pixels[row * SCREEN_WIDTH + col] = tableRender2[row * SCREEN_WIDTH + ((col + xScroll) % SCREEN_WIDTH)];
-                } else {
-                    pixels[row * SCREEN_WIDTH + col] = tableRender1[row * SCREEN_WIDTH + col + xScroll];
-                }
-            }
-        }
-
-        int spriteCount = 0;
-        for (int i = 0; i < 64; i++){
-            uint8_t yPos = spriteOam[spriteCount++];
-            uint8_t byte1 = spriteOam[spriteCount++];
-            uint8_t byte2 = spriteOam[spriteCount++];
-            bool horizFlip = byte2 & BYTE2_FLIP_HORIZ_MASK;
-            bool vertFlip = byte2 & BYTE2_FLIP_VERT_MASK;
-            uint8_t paletteNum = byte2 & 0x3;
-            uint8_t xPos = spriteOam[spriteCount++];
-            fillSpritePixels(chr_table, pixels, yPos, xPos, byte1, spritePalette + paletteNum * 4, horizFlip, vertFlip);
-        }
+        const uint8_t *frame = system->getPpu()->frame();
+        for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i)
+            pixels[i] = system_palette[frame[i]];
 
         SDL_UpdateTexture(texture, NULL, pixels, SCREEN_WIDTH * sizeof(Uint32));
         SDL_RenderClear(renderer);
@@ -342,5 +214,12 @@ int main(int argc, char* argv[]) {
     SDL_DestroyWindow(window);
 
     SDL_Quit();
+
+    if (s_trace)
+    {
+        if (!s_trace->save(s_trace_fd))
+            printf("Cannot write trace\n");
+        close(s_trace_fd);
+    }
     return 0;
 }
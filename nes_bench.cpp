@@ -0,0 +1,88 @@
+//
+// CPU interpreter throughput benchmark
+// Runs a CPU-bound 6502 loop straight through nes_cpu::step_to (no PPU) with each CPU engine and reports
+// ns per instruction
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include "nes_system.h"
+
+//
+// Nested loop mixing the common addressing modes and ALU ops, then BRK to stop the system
+//
+static uint8_t s_cpu_loop[] = {
+        0xA0, 0x40,             // 8000: LDY #$40
+        0xA2, 0x00,             // 8002: LDX #$00
+        0xB5, 0x10,             // 8004: LDA $10,X
+        0x69, 0x03,             // 8006: ADC #$03
+        0x9D, 0x00, 0x02,       // 8008: STA $0200,X
+        0x5D, 0x00, 0x03,       // 800B: EOR $0300,X
+        0x11, 0x30,             // 800E: ORA ($30),Y
+        0x85, 0x20,             // 8010: STA $20
+        0x0A,                   // 8012: ASL A
+        0x29, 0x7F,             // 8013: AND #$7F
+        0xE8,                   // 8015: INX
+        0xD0, 0xEC,             // 8016: BNE $8004
+        0x88,                   // 8018: DEY
+        0xD0, 0xE7,             // 8019: BNE $8002
+        0x00,                   // 801B: BRK
+};
+
+#define BENCH_CODE_ADDR 0x8000
+
+static void load_program(nes_system &system)
+{
+    system.init();
+    system.getMem()->map_flat_ram();
+    system.getMem()->set_bytes(BENCH_CODE_ADDR, s_cpu_loop, sizeof(s_cpu_loop));
+    system.getCpu()->reg().PC = BENCH_CODE_ADDR;
+}
+
+// Counts the instructions executed by one run of the program by stepping one instruction at a time
+static int64_t count_instructions(nes_system &system)
+{
+    load_program(system);
+
+    int64_t count = 0;
+    while (!system.stop_requested())
+    {
+        system.getCpu()->exec_one_instruction();
+        count++;
+    }
+
+    return count;
+}
+
+static void bench_engine(nes_system &system, nes_cpu_engine engine, const char *name, int64_t instructions_per_run, int runs)
+{
+    double total_ns = 0;
+    for (int i = 0; i < runs; ++i)
+    {
+        load_program(system);
+        system.getCpu()->set_engine(engine);
+
+        auto start = steady_clock::now();
+        system.getCpu()->step_to(nes_cycle_t::max());
+        total_ns += duration<double, std::nano>(steady_clock::now() - start).count();
+    }
+
+    double instructions = double(instructions_per_run) * runs;
+    printf("%s: %.0f instructions in %.1f ms - %.2f ns/instruction (%.1f MIPS)\n",
+           name, instructions, total_ns / 1e6, total_ns / instructions, instructions * 1e3 / total_ns);
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = (argc > 1) ? atoi(argv[1]) : 200;
+
+    auto system = std::make_unique<nes_system>();
+    int64_t instructions_per_run = count_instructions(*system);
+
+    bench_engine(*system, nes_cpu_engine::INTERPRETER, "interpreter", instructions_per_run, runs);
+    bench_engine(*system, nes_cpu_engine::BLOCK_CACHE, "block cache", instructions_per_run, runs);
+    bench_engine(*system, nes_cpu_engine::JIT, "jit", instructions_per_run, runs);
+
+    return 0;
+}
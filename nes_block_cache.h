@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+class nes_cpu;
+
+// Executes one pre-decoded instruction - raw holds the operand bytes that followed the opcode
+typedef void (*nes_decoded_handler)(nes_cpu &cpu, uint16_t raw);
+
+// Native code compiled from a whole block by nes_jit
+typedef void (*nes_native_code)(nes_cpu *cpu);
+
+struct nes_decoded_op
+{
+    nes_decoded_handler handler;
+    uint16_t raw;                   // operand bytes (little-endian), already fetched
+    uint16_t next_pc;               // PC as the handler expects it - right after the operand bytes
+    uint8_t cycles;                 // base cycle count from opsTable
+    uint8_t op_code;
+};
+
+#define NES_BLOCK_MAX_OPS 16
+#define NES_BLOCK_CACHE_SIZE 2048  // must be a power of 2
+#define NES_BLOCK_PAGE_BUCKETS 256  // must be a power of 2 - see nes_block_cache::bucket
+#define NES_BLOCK_NONE 0xffff
+
+//
+// Straight-line run of instructions ending at the first one that changes PC (branch, JMP, JSR, RTS, RTI,
+// BRK), at the end of the 256-byte page or after NES_BLOCK_MAX_OPS instructions
+// A block never crosses a page so the bytes it was decoded from are always mapped as one piece
+//
+struct nes_block
+{
+    const uint8_t *host;            // host memory of the first instruction - nullptr if the slot is empty
+    uint16_t pc;                    // CPU address of the first instruction
+    uint8_t count;
+    bool idle_loop;                 // jumps back to its own start, and running it again changes nothing
+    uint16_t hits;                  // times executed - nes_jit compiles it once it gets hot
+    int32_t lead_cycles;            // master cycles of all but the last instruction
+    nes_native_code native;         // nullptr until compiled - runs the whole block without stopping
+    uint16_t prev, next;            // other blocks in the same page bucket - see nes_block_cache::set_host
+    nes_decoded_op ops[NES_BLOCK_MAX_OPS];
+};
+
+//
+// Direct-mapped cache of decoded blocks, indexed by PC and tagged by PC + the host memory it was decoded
+// from. The host pointer stands in for the ROM bank - after a bank switch the same PC reads from different
+// host memory and simply misses, while the blocks of the old bank stay valid for when it is switched back.
+// Code in RAM is the only thing that can change under a block - see nes_memory::protect_code
+//
+// Blocks are also chained by the 256 bytes of host memory they start in, hashed into NES_BLOCK_PAGE_BUCKETS
+// lists, so throwing away the blocks of a page only walks the blocks in its bucket
+//
+class nes_block_cache
+{
+public :
+    nes_block_cache() { flush(); }
+
+    void flush()
+    {
+        for (auto &block : _blocks)
+            block.host = nullptr;
+        for (auto &head : _buckets)
+            head = NES_BLOCK_NONE;
+    }
+
+    // Forgets all native code (the JIT code buffer is being recycled) - blocks start counting hits again
+    void drop_native_code()
+    {
+        for (auto &block : _blocks)
+        {
+            block.native = nullptr;
+            block.hits = 0;
+        }
+    }
+
+    // Slot where the block starting at pc lives - it may currently hold another block
+    nes_block &slot(uint16_t pc) { return _blocks[pc & (NES_BLOCK_CACHE_SIZE - 1)]; }
+
+    // Moves the block to host (nullptr empties the slot) - the only way block.host may change
+    void set_host(nes_block &block, const uint8_t *host)
+    {
+        if (block.host)
+            unlink(block);
+
+        block.host = host;
+        if (host)
+        {
+            uint16_t index = uint16_t(&block - _blocks);
+            uint16_t &head = _buckets[bucket(host)];
+            block.prev = NES_BLOCK_NONE;
+            block.next = head;
+            if (head != NES_BLOCK_NONE)
+                _blocks[head].prev = index;
+            head = index;
+        }
+    }
+
+    // Throws away every block decoded from [host, host + size)
+    void invalidate(const uint8_t *host, size_t size)
+    {
+        // One bucket per 256 bytes, but never the same one twice
+        size_t first = bucket(host);
+        size_t count = std::min(bucket_span(host, size), size_t(NES_BLOCK_PAGE_BUCKETS));
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint16_t index = _buckets[(first + i) & (NES_BLOCK_PAGE_BUCKETS - 1)];
+            while (index != NES_BLOCK_NONE)
+            {
+                nes_block &block = _blocks[index];
+                index = block.next;
+                if (block.host >= host && block.host < host + size)
+                {
+                    unlink(block);
+                    block.host = nullptr;
+                }
+            }
+        }
+    }
+
+private :
+    static size_t bucket(const uint8_t *host)
+    {
+        return (uintptr_t(host) >> 8) & (NES_BLOCK_PAGE_BUCKETS - 1);
+    }
+
+    // 256-byte pieces of host memory [host, host + size) touches
+    static size_t bucket_span(const uint8_t *host, size_t size)
+    {
+        return size ? ((uintptr_t(host) + size - 1) >> 8) - (uintptr_t(host) >> 8) + 1 : 0;
+    }
+
+    void unlink(nes_block &block)
+    {
+        if (block.prev != NES_BLOCK_NONE)
+            _blocks[block.prev].next = block.next;
+        else
+            _buckets[bucket(block.host)] = block.next;
+
+        if (block.next != NES_BLOCK_NONE)
+            _blocks[block.next].prev = block.prev;
+    }
+
+private :
+    nes_block _blocks[NES_BLOCK_CACHE_SIZE];
+    uint16_t _buckets[NES_BLOCK_PAGE_BUCKETS];  // first block of each bucket's list
+};
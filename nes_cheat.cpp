@@ -0,0 +1,67 @@
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include "nes_cheat.h"
+
+// Each Game Genie letter is 4 bits - its position in this string
+static const char s_game_genie_letters[] = "APZLGITYEOXUKSVN";
+
+static bool parse_game_genie(const char *code, nes_patch &patch)
+{
+    size_t length = strlen(code);
+    if (length != 6 && length != 8)
+        return false;
+
+    int n[8];
+    for (size_t i = 0; i < length; ++i)
+    {
+        const char *letter = strchr(s_game_genie_letters, toupper((unsigned char)code[i]));
+        if (!letter || !*letter)
+            return false;
+        n[i] = int(letter - s_game_genie_letters);
+    }
+
+    // The bits are scrambled all over the letters
+    patch.addr = uint16_t(0x8000 | ((n[3] & 7) << 12) | ((n[5] & 7) << 8) | ((n[4] & 8) << 8) |
+                          ((n[2] & 7) << 4) | ((n[1] & 8) << 4) | (n[4] & 7) | (n[3] & 8));
+    patch.value = uint8_t(((n[1] & 7) << 4) | ((n[0] & 8) << 4) | (n[0] & 7));
+    if (length == 6)
+    {
+        patch.value |= n[5] & 8;
+        patch.compare = -1;
+    }
+    else
+    {
+        patch.value |= n[7] & 8;
+        patch.compare = int16_t(((n[7] & 7) << 4) | ((n[6] & 8) << 4) | (n[6] & 7) | (n[5] & 8));
+    }
+
+    return true;
+}
+
+static bool parse_raw(const char *code, nes_patch &patch)
+{
+    unsigned addr, compare, value;
+    int end = 0;
+    if (sscanf(code, "%4x?%2x:%2x%n", &addr, &compare, &value, &end) == 3 && code[end] == '\0')
+    {
+        patch.compare = int16_t(compare);
+    }
+    else if (sscanf(code, "%4x:%2x%n", &addr, &value, &end) == 2 && code[end] == '\0')
+    {
+        patch.compare = -1;
+    }
+    else
+    {
+        return false;
+    }
+
+    patch.addr = uint16_t(addr);
+    patch.value = uint8_t(value);
+    return true;
+}
+
+bool nes_parse_cheat(const char *code, nes_patch &patch)
+{
+    return parse_raw(code, patch) || parse_game_genie(code, patch);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+//
+// A cheat - CPU reads of addr return value instead of what is really there. With a compare value, only
+// when what is really there is compare: Game Genie codes for banked ROM use it to hit the right bank only
+//
+struct nes_patch
+{
+    uint16_t addr;
+    uint8_t value;
+    int16_t compare;                // -1 - always
+};
+
+//
+// Parses a cheat code into a patch - false if it isn't one
+// * Game Genie codes - 6 letters, or 8 letters with a compare value
+//   http://wiki.nesdev.com/w/index.php/Game_Genie
+// * Raw patches in hex - "AAAA:VV", or "AAAA?CC:VV" with a compare value
+//
+bool nes_parse_cheat(const char *code, nes_patch &patch);
@@ -0,0 +1,439 @@
+//
+// Golden-trace conformance harness
+// Runs a ROM headless with one of the CPU engines and checks the CPU state against a nintendulator-style
+// reference log (such as nestest.log), stopping at the first line that differs
+//   nesemu2_conformance [--engine interpreter|cache|jit] [--no-cycles] <rom> <reference log>
+// Execution starts at the PC of the first log line - for nestest that is $C000, its automated mode.
+//
+// The CPU charges every instruction its base cycle count from opsTable - the extra cycle of a taken branch
+// (two when it crosses a page) and of indexed reads that cross a page aren't modeled, the same in every
+// engine. A log from real hardware or another emulator (nestest.log) has them, so its CYC column parts
+// from ours at the first taken branch - --no-cycles checks everything but CYC. It only goes with the
+// interpreter: the other engines are checked wherever they stop, by cycle, which needs the cycles to match.
+//
+// The log is memory-mapped and parsed one line at a time, so its size doesn't matter. The interpreter (the
+// default) is checked before every instruction, from the instruction trace (see nes_trace.h) - one
+// instruction is stepped at a time and whatever it recorded (the instruction, or an NMI handler's first
+// instruction too) is compared straight away. Tracing always runs the interpreter, so the block cache and
+// the JIT are checked untraced instead, wherever they stop - see check_engine.
+//
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include "nes_system.h"
+#include "nes_mapped_file.h"
+#include "opcodes.h"
+
+// Records kept between comparisons - one step never runs more than a couple of instructions
+#define TRACE_WINDOW 64
+
+// Exit code for an engine this host doesn't have - ctest reports the test as skipped
+#define CONFORMANCE_SKIPPED 77
+
+struct log_entry
+{
+    uint16_t pc;
+    uint8_t bytes[3];
+    int byte_count;
+    uint8_t a, x, y, p, sp;
+    bool has_cycle;                 // CPU cycle count - only in the newer "PPU:sl,dot CYC:n" format
+    uint64_t cycle;
+};
+
+// Reads up to max_digits hex digits - returns the number read
+static int parse_hex(const char *pos, const char *end, int max_digits, uint32_t &value)
+{
+    value = 0;
+    int digits = 0;
+    for (; pos < end && digits < max_digits && isxdigit((unsigned char)*pos); ++pos, ++digits)
+        value = value * 16 + uint32_t(isdigit((unsigned char)*pos) ? *pos - '0' : (toupper(*pos) - 'A' + 10));
+
+    return digits;
+}
+
+// Position right after the field tag (" A:", " SP:", ...) in [from, end) - nullptr if not there
+static const char *find_field(const char *from, const char *end, const char *tag)
+{
+    const char *found = std::search(from, end, tag, tag + strlen(tag));
+    return (found == end) ? nullptr : found + strlen(tag);
+}
+
+static bool parse_byte_field(const char *from, const char *end, const char *tag, uint8_t &value)
+{
+    const char *pos = find_field(from, end, tag);
+    uint32_t hex;
+    if (!pos || parse_hex(pos, end, 2, hex) != 2)
+        return false;
+
+    value = uint8_t(hex);
+    return true;
+}
+
+//
+//   C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+//
+static bool parse_line(const char *line, const char *end, log_entry &entry)
+{
+    uint32_t hex;
+    if (parse_hex(line, end, 4, hex) != 4)
+        return false;
+    entry.pc = uint16_t(hex);
+
+    // Instruction bytes start at column 6, separated by single spaces
+    entry.byte_count = 0;
+    for (const char *pos = line + 6; entry.byte_count < 3 && pos + 2 <= end; pos += 3)
+    {
+        if (parse_hex(pos, end, 2, hex) != 2)
+            break;
+        entry.bytes[entry.byte_count++] = uint8_t(hex);
+        if (pos + 2 == end || pos[2] != ' ')
+            break;
+    }
+    if (entry.byte_count == 0)
+        return false;
+
+    // Register fields come after the disassembly - search from the first " A:" on
+    const char *regs = find_field(line, end, " A:");
+    if (!regs)
+        return false;
+    regs -= 3;
+
+    if (!parse_byte_field(regs, end, " A:", entry.a) || !parse_byte_field(regs, end, " X:", entry.x) ||
+        !parse_byte_field(regs, end, " Y:", entry.y) || !parse_byte_field(regs, end, " P:", entry.p) ||
+        !parse_byte_field(regs, end, " SP:", entry.sp))
+        return false;
+
+    // The older format has CYC as the PPU dot (followed by SL:) - only CPU cycles are comparable
+    entry.has_cycle = false;
+    const char *cyc = find_field(regs, end, "CYC:");
+    if (cyc && find_field(regs, end, " PPU:"))
+    {
+        entry.cycle = strtoull(cyc, nullptr, 10);
+        entry.has_cycle = true;
+    }
+
+    return true;
+}
+
+struct log_reader
+{
+    const char *pos;
+    const char *end;
+    uint64_t line_no;
+
+    // Next non-empty line as [line, line_end) - false at the end of the log
+    bool next(const char *&line, const char *&line_end)
+    {
+        while (pos < end)
+        {
+            line = pos;
+            const char *newline = (const char *)memchr(pos, '\n', end - pos);
+            line_end = newline ? newline : end;
+            pos = newline ? newline + 1 : end;
+            line_no++;
+
+            while (line_end > line && (line_end[-1] == '\r' || line_end[-1] == ' '))
+                line_end--;
+            if (line_end > line)
+                return true;
+        }
+
+        return false;
+    }
+};
+
+static void report(uint64_t line_no, const char *line, const char *line_end, const char *actual, const char *what)
+{
+    printf("Divergence at line %llu: %s\n", (unsigned long long)line_no, what);
+    printf("  expected: %.*s\n", int(line_end - line), line);
+    printf("  actual:   %s\n", actual);
+}
+
+// What in rec differs from expected - nullptr if nothing does. Cycles count from the first line on both sides
+// CYC only if cycles is set (see --no-cycles)
+static const char *compare(const nes_trace_record &rec, uint32_t actual_base, const log_entry &expected, uint64_t expected_base,
+                           bool cycles)
+{
+    if (rec.pc != expected.pc)
+        return "PC";
+    if (rec.op_code != expected.bytes[0] ||
+        (expected.byte_count > 1 && rec.operand[0] != expected.bytes[1]) ||
+        (expected.byte_count > 2 && rec.operand[1] != expected.bytes[2]))
+        return "instruction bytes";
+    if (rec.a != expected.a)
+        return "A";
+    if (rec.x != expected.x)
+        return "X";
+    if (rec.y != expected.y)
+        return "Y";
+    if (rec.p != expected.p)
+        return "P";
+    if (rec.sp != expected.sp)
+        return "SP";
+    if (cycles && expected.has_cycle && uint32_t(rec.cycle - actual_base) != uint32_t(expected.cycle - expected_base))
+        return "CYC";
+
+    return nullptr;
+}
+
+// The CPU as it is now, as a trace record - it is always between instructions once a step returns
+static nes_trace_record cpu_record(nes_system &system)
+{
+    nes_cpu *cpu = system.getCpu();
+    auto peek = [&system](uint16_t addr) -> uint8_t {
+        const uint8_t *host = system.getMem()->get_code_ptr(addr);
+        return host ? *host : 0;
+    };
+
+    nes_trace_record rec;
+    const cpu_registers &reg = cpu->reg();
+    rec.pc = reg.PC;
+    rec.op_code = peek(reg.PC);
+    rec.operand[0] = peek(uint16_t(reg.PC + 1));
+    rec.operand[1] = peek(uint16_t(reg.PC + 2));
+    rec.a = reg.A;
+    rec.x = reg.X;
+    rec.y = reg.Y;
+    rec.p = reg.P;
+    rec.sp = reg.SP;
+    rec.cycle = uint32_t(duration_cast<nes_cpu_cycle_t>(cpu->cycle()).count());
+    return rec;
+}
+
+//
+// The interpreter - the instruction trace has every instruction it runs, each one is checked
+//
+static int check_traced(nes_system &system, log_reader &reader, const char *line, const char *line_end, log_entry expected, bool cycles,
+                        uint64_t &checked)
+{
+    nes_cpu *cpu = system.getCpu();
+    cpu->set_trace(TRACE_WINDOW);
+    nes_trace *trace = cpu->get_trace();
+    if (!trace)
+    {
+        printf("Built without tracing (NES_NO_TRACE)\n");
+        return 1;
+    }
+
+    uint64_t expected_base = expected.cycle;
+    uint32_t actual_base = 0;
+    char actual[NES_TRACE_LINE_SIZE];
+    for (;;)
+    {
+        if (checked == trace->total())
+        {
+            // Stop in front of opcodes the CPU doesn't implement rather than run into its assert
+            const uint8_t *code = system.getMem()->get_code_ptr(cpu->reg().PC);
+            if (code && opsTable[*code].mode == nes_addr_mode::UNKNOWN)
+            {
+                snprintf(actual, sizeof(actual), "%04X  %02X        (not implemented)", cpu->reg().PC, *code);
+                report(reader.line_no, line, line_end, actual, "unimplemented opcode");
+                return 1;
+            }
+
+            if (system.stop_requested())
+            {
+                snprintf(actual, sizeof(actual), "%04X  (stopped)", cpu->reg().PC);
+                report(reader.line_no, line, line_end, actual, "system stopped");
+                return 1;
+            }
+
+            // One instruction - the CPU runs until it passes the master clock by at least one cycle
+            system.step(std::max(cpu->cycle() - system._master_cycle, nes_cycle_t(0)) + nes_cycle_t(1));
+            continue;
+        }
+
+        const nes_trace_record &rec = trace->at(trace->size() - size_t(trace->total() - checked));
+        if (checked == 0)
+            actual_base = rec.cycle;
+
+        if (const char *what = compare(rec, actual_base, expected, expected_base, cycles))
+        {
+            report(reader.line_no, line, line_end, nes_trace_format(rec, actual, sizeof(actual)), what);
+            return 1;
+        }
+
+        checked++;
+        if (!reader.next(line, line_end))
+            return 0;
+
+        if (!parse_line(line, line_end, expected))
+        {
+            printf("Cannot parse line %llu: %.*s\n", (unsigned long long)reader.line_no, int(line_end - line), line);
+            return 1;
+        }
+    }
+}
+
+//
+// The block cache and the JIT - tracing would run the interpreter instead, so the engine runs freely for
+// a few hundred cycles at a time (uneven, so that steps end all over blocks) and the CPU is checked every
+// time it stops against the line of the cycle it stopped at. Only an interrupt about to be taken there
+// leaves the log without such a line - anything else is a timing divergence
+//
+static int check_engine(nes_system &system, log_reader &reader, const char *line, const char *line_end, log_entry expected, uint64_t &checked)
+{
+    if (!expected.has_cycle)
+    {
+        printf("Only logs with CPU cycles (\"PPU:sl,dot CYC:n\") can check engines other than the interpreter\n");
+        return 1;
+    }
+
+    nes_cpu *cpu = system.getCpu();
+    uint64_t expected_base = expected.cycle;
+    uint32_t actual_base = cpu_record(system).cycle;
+    uint32_t step_seed = 1;
+    char actual[NES_TRACE_LINE_SIZE];
+    for (;;)
+    {
+        nes_trace_record rec = cpu_record(system);
+        uint32_t now = rec.cycle - actual_base;
+
+        // Lines of the instructions run inside the last step
+        while (uint32_t(expected.cycle - expected_base) < now)
+        {
+            if (!reader.next(line, line_end))
+                return 0;
+
+            if (!parse_line(line, line_end, expected) || !expected.has_cycle)
+            {
+                printf("Cannot parse line %llu: %.*s\n", (unsigned long long)reader.line_no, int(line_end - line), line);
+                return 1;
+            }
+        }
+
+        if (uint32_t(expected.cycle - expected_base) == now)
+        {
+            if (const char *what = compare(rec, actual_base, expected, expected_base, true))
+            {
+                report(reader.line_no, line, line_end, nes_trace_format(rec, actual, sizeof(actual)), what);
+                return 1;
+            }
+            checked++;
+        }
+        else if (!cpu->interrupt_pending())
+        {
+            report(reader.line_no, line, line_end, nes_trace_format(rec, actual, sizeof(actual)),
+                   "no instruction starts at this cycle");
+            return 1;
+        }
+
+        if (system.stop_requested())
+        {
+            snprintf(actual, sizeof(actual), "%04X  (stopped)", rec.pc);
+            report(reader.line_no, line, line_end, actual, "system stopped");
+            return 1;
+        }
+
+        step_seed = step_seed * 1103515245 + 12345;
+        nes_cycle_t step = nes_cpu_cycle_t(100 + (step_seed >> 16) % 900);
+        system.step(std::max(cpu->cycle() - system._master_cycle, nes_cycle_t(0)) + step);
+    }
+}
+
+static int run(const char *rom_path, const char *log_path, nes_cpu_engine engine, bool cycles)
+{
+    if (!cycles && engine != nes_cpu_engine::INTERPRETER)
+    {
+        printf("--no-cycles only checks the interpreter - the other engines are checked by cycle\n");
+        return 1;
+    }
+
+    nes_mapped_file log;
+    if (!log.open(log_path, true))
+    {
+        printf("Cannot open %s\n", log_path);
+        return 1;
+    }
+
+    log_reader reader = { (const char *)log.data(), (const char *)log.data() + log.size(), 0 };
+    const char *line, *line_end;
+    log_entry expected;
+    if (!reader.next(line, line_end) || !parse_line(line, line_end, expected))
+    {
+        printf("%s doesn't start with a nintendulator log line\n", log_path);
+        return 1;
+    }
+
+    auto system = std::make_unique<nes_system>();
+    system->init();
+    try
+    {
+        system->load_rom(rom_path);
+    }
+    catch (std::exception &ex)
+    {
+        printf("Cannot load %s: %s\n", rom_path, ex.what());
+        return 1;
+    }
+
+    nes_cpu *cpu = system->getCpu();
+    cpu->reg().PC = expected.pc;
+    cpu->set_engine(engine);
+    if (cpu->engine() != engine)
+    {
+        printf("The JIT isn't available on this host\n");
+        return CONFORMANCE_SKIPPED;
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+
+    // Cycle counts are compared relative to the first line - the log starts after the reset sequence
+    uint64_t checked = 0;
+    int result = (engine == nes_cpu_engine::INTERPRETER) ? check_traced(*system, reader, line, line_end, expected, cycles, checked) :
+                                                           check_engine(*system, reader, line, line_end, expected, checked);
+    if (result != 0)
+        return result;
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time);
+    if (engine == nes_cpu_engine::INTERPRETER)
+        printf("%llu instructions match %s (%lld ms)\n", (unsigned long long)checked, log_path, (long long)elapsed.count());
+    else
+        printf("%llu stops match %s (%lld ms)\n", (unsigned long long)checked, log_path, (long long)elapsed.count());
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    nes_cpu_engine engine = nes_cpu_engine::INTERPRETER;
+    bool cycles = true;
+    bool usage = false;
+    int arg = 1;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0 && !usage)
+    {
+        if (strcmp(argv[arg], "--no-cycles") == 0)
+        {
+            cycles = false;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "--engine") == 0 && arg + 1 < argc)
+        {
+            if (strcmp(argv[arg + 1], "interpreter") == 0)
+                engine = nes_cpu_engine::INTERPRETER;
+            else if (strcmp(argv[arg + 1], "cache") == 0)
+                engine = nes_cpu_engine::BLOCK_CACHE;
+            else if (strcmp(argv[arg + 1], "jit") == 0)
+                engine = nes_cpu_engine::JIT;
+            else
+                usage = true;
+            arg += 2;
+        }
+        else
+        {
+            usage = true;
+        }
+    }
+
+    if (usage || argc - arg < 2)
+    {
+        printf("Usage: %s [--engine interpreter|cache|jit] [--no-cycles] <rom> <reference log>\n", argv[0]);
+        return 1;
+    }
+
+    return run(argv[arg], argv[arg + 1], engine, cycles);
+}
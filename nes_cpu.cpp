@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include "nes_cpu.h"
 #include "nes_system.h"
@@ -7,38 +8,76 @@ void nes_cpu::NMI()
 {
     // As per neswiki: NMI should set I(bit 5) but clear B(bit 4)
     // http://wiki.nesdev.com/w/index.php/CPU_status_flag_behavior
-    push_word(registers.PC);
-    push_byte(registers.P | 0x20);
+    push_word(_state.registers.PC);
+    push_byte(get_status() | 0x20);
 
-    //step_cpu(7);
-    registers.PC = peek_word(NMI_HANDLER);
+    _state.cycle += nes_cpu_cycle_t(7);
+    _state.registers.PC = peek_word(NMI_HANDLER);
+}
+
+void nes_cpu::IRQ()
+{
+    // Same as NMI except for the vector - and I is set so the still asserted line doesn't come right back
+    push_word(_state.registers.PC);
+    push_byte((get_status() & ~PROCESSOR_STATUS_B_MASK) | 0x20);
+    set_interrupt_flag(true);
+
+    _state.cycle += nes_cpu_cycle_t(7);
+    _state.registers.PC = peek_word(IRQ_HANDLER);
+}
+
+void nes_cpu::request_dma(uint16_t addr)
+{
+    _state.dma_addr = addr;
+
+    // Happens as soon as the current instruction finishes
+    system->schedule(nes_event::OAM_DMA, _state.cycle);
 }
 
 void nes_cpu::OAMDMA()
 {
-    system->getPpu()->oam_dma(_dma_addr);
+    system->getPpu()->oam_dma(_state.dma_addr);
 
-    // The entire DMA takes 513 or 514 cycles
+    // The entire DMA takes 513 or 514 cycles - CPU is suspended for the whole time
     // http://wiki.nesdev.com/w/index.php/PPU_registers#OAMDMA
-    //if (_cycle % 2 == nes_cpu_cycle_t(0))
-      //  step_cpu(514);
-    //else
-      //  step_cpu(513);
+    if (duration_cast<nes_cpu_cycle_t>(_state.cycle).count() % 2 == 0)
+        _state.cycle += nes_cpu_cycle_t(513);
+    else
+        _state.cycle += nes_cpu_cycle_t(514);
 }
 
 void nes_cpu::init(nes_system* system) {
     this->system = system;
     memory = system->getMem();
-    _nmi_pending = false;
-    _dma_pending = false;
+    flush_code();
+    power_on();
+}
+
+void nes_cpu::flush_code()
+{
+    if (_blocks)
+        _blocks->flush();
+    _idle_block = nullptr;
+    if (_jit)
+        _jit->reset();
+}
+
+void nes_cpu::power_on()
+{
+    _state.nmi_pending = false;
+    _state.irq_lines = 0;
+    _block_abort = false;
+    _idle_block = nullptr;
+    _idle_iterations = 0;
 
     // @TODO - Simulate full power-on state
     // http://wiki.nesdev.com/w/index.php/CPU_power_up_state
-    registers.P = 0x24;          // @TODO - Should be 0x34 - but temporarily set to 0x24 to match nintendulator baseline
-    registers.A = registers.X = registers.Y = 0;
-    registers.SP = 0xfd;
-    registers.PC = 0;
-    _cycle = nes_cycle_t(0);
+    set_status(0x24);            // @TODO - Should be 0x34 - but temporarily set to 0x24 to match nintendulator baseline
+    _state.registers.A = _state.registers.X = _state.registers.Y = 0;
+    _state.registers.SP = 0xfd;
+    _state.registers.PC = 0;
+    _state.cycle = nes_cycle_t(0);
+    _deadline = nes_cycle_t(0);
 }
 
 uint8_t nes_cpu::read_byte(uint16_t addr){
@@ -50,977 +89,617 @@ uint16_t nes_cpu::read_word(uint16_t addr){
 }
 
 uint8_t nes_cpu::read_next_byte() {
-    return read_byte(registers.PC++);
+    return read_byte(_state.registers.PC++);
 }
 
 uint16_t nes_cpu::read_next_word() {
-    uint16_t val = read_word(registers.PC);
-    registers.PC += 2;
+    uint16_t val = read_word(_state.registers.PC);
+    _state.registers.PC += 2;
     return val;
 }
 
+//
+// Use computed goto (a GCC/Clang extension) for threaded dispatch where available - every handler ends
+// with its own indirect jump to the next one, which the branch predictor handles much better than a
+// single shared dispatch point. Other compilers (or NES_CPU_NO_COMPUTED_GOTO) fall back to the function
+// pointer table.
+//
+#if defined(__GNUC__) && !defined(NES_CPU_NO_COMPUTED_GOTO)
+#define NES_CPU_COMPUTED_GOTO 1
+#endif
+
+#define NES_OP_HANDLER(code, handler, mode) &nes_cpu::exec_op<&nes_cpu::handler, nes_addr_mode::mode>,
+#define NES_IMP_HANDLER(code, handler) &nes_cpu::exec_imp<&nes_cpu::handler>,
+
+static const nes_op_handler s_op_handlers[0x100] = { NES_CPU_OPCODES(NES_OP_HANDLER, NES_IMP_HANDLER) };
+
+#define NES_DECODED_OP_HANDLER(code, handler, mode) &nes_cpu::exec_decoded_op<&nes_cpu::handler, nes_addr_mode::mode>,
+#define NES_DECODED_IMP_HANDLER(code, handler) &nes_cpu::exec_decoded_imp<&nes_cpu::handler>,
+
+static const nes_decoded_handler s_decoded_handlers[0x100] = { NES_CPU_OPCODES(NES_DECODED_OP_HANDLER, NES_DECODED_IMP_HANDLER) };
+
+// Instruction length in bytes, opcode included
+#define NES_OP_SIZE(code, handler, mode) 1 + nes_operand_size(nes_addr_mode::mode),
+#define NES_IMP_SIZE(code, handler) 1,
+
+static const uint8_t s_op_sizes[0x100] = { NES_CPU_OPCODES(NES_OP_SIZE, NES_IMP_SIZE) };
+
+//
+// Instructions that (may) change PC - a block ends with them
+// So do the ones that can clear I, so a pending IRQ is taken right after them in native code too
+//
+template <void (nes_cpu::*op)(operand_t), nes_addr_mode mode>
+static constexpr bool ends_block()
+{
+    return mode == nes_addr_mode::REL || op == &nes_cpu::JMP || op == &nes_cpu::JSR;
+}
+
+template <void (nes_cpu::*op)()>
+static constexpr bool ends_block()
+{
+    return op == &nes_cpu::BRK || op == &nes_cpu::RTS || op == &nes_cpu::RTI || op == &nes_cpu::UNKNOWN ||
+           op == &nes_cpu::CLI || op == &nes_cpu::PLP;
+}
+
+#define NES_OP_ENDS_BLOCK(code, handler, mode) ends_block<&nes_cpu::handler, nes_addr_mode::mode>(),
+#define NES_IMP_ENDS_BLOCK(code, handler) ends_block<&nes_cpu::handler>(),
+
+static const bool s_op_ends_block[0x100] = { NES_CPU_OPCODES(NES_OP_ENDS_BLOCK, NES_IMP_ENDS_BLOCK) };
+
+//
+// Instructions an idle loop can be made of - they only read memory and overwrite registers/flags in a way
+// that gives the same result when run again (loads, compares, BIT, AND/ORA), plus the jump back
+//
+template <void (nes_cpu::*op)(operand_t), nes_addr_mode mode>
+static constexpr bool idle_safe()
+{
+    if (mode == nes_addr_mode::REL)
+        return true;
+    if (mode != nes_addr_mode::IMD && mode != nes_addr_mode::ZP && mode != nes_addr_mode::ABS)
+        return false;
+
+    return op == &nes_cpu::LDA || op == &nes_cpu::LDA_ABS || op == &nes_cpu::LDX || op == &nes_cpu::LDX_ABS ||
+           op == &nes_cpu::LDY || op == &nes_cpu::LDY_ABS || op == &nes_cpu::BIT || op == &nes_cpu::CMP ||
+           op == &nes_cpu::CMP_IND || op == &nes_cpu::CPX || op == &nes_cpu::CPX_IMD || op == &nes_cpu::CPY ||
+           op == &nes_cpu::CPY_IMD || op == &nes_cpu::AND || op == &nes_cpu::AND_IND || op == &nes_cpu::ORA ||
+           op == &nes_cpu::ORA_IND || op == &nes_cpu::JMP;
+}
+
+template <void (nes_cpu::*op)()>
+static constexpr bool idle_safe()
+{
+    return op == &nes_cpu::NOP;
+}
+
+#define NES_OP_IDLE_SAFE(code, handler, mode) idle_safe<&nes_cpu::handler, nes_addr_mode::mode>(),
+#define NES_IMP_IDLE_SAFE(code, handler) idle_safe<&nes_cpu::handler>(),
+
+static const bool s_op_idle_safe[0x100] = { NES_CPU_OPCODES(NES_OP_IDLE_SAFE, NES_IMP_IDLE_SAFE) };
+
+template <void (nes_cpu::*op)(operand_t), nes_addr_mode mode>
+void nes_cpu::exec_op(nes_cpu &cpu)
+{
+    (cpu.*op)(cpu.decode_operand<mode>(cpu.fetch_operand<mode>()));
+}
+
+template <void (nes_cpu::*op)()>
+void nes_cpu::exec_imp(nes_cpu &cpu)
+{
+    (cpu.*op)();
+}
+
+template <void (nes_cpu::*op)(operand_t), nes_addr_mode mode>
+void nes_cpu::exec_decoded_op(nes_cpu &cpu, uint16_t raw)
+{
+    (cpu.*op)(cpu.decode_operand<mode>(raw));
+}
+
+template <void (nes_cpu::*op)()>
+void nes_cpu::exec_decoded_imp(nes_cpu &cpu, uint16_t raw)
+{
+    (cpu.*op)();
+}
+
+//
+// Runs until new_count, or until preempt() cuts it short - an NMI, an event scheduled before new_count
+// or a stop request. Nothing but the deadline is checked between instructions.
+//
 void nes_cpu::step_to(nes_cycle_t new_count)
 {
-    while (_cycle < new_count && !system->stop_requested())
-        exec_one_instruction();
+    if (system->stop_requested())
+        return;
+
+    _deadline = new_count;
+    _block_abort = false;
+    _idle_block = nullptr;
+
+    // A pending NMI/IRQ is serviced before the first instruction
+    if (interrupt_pending())
+        preempt(_state.cycle);
+
+#ifdef NES_TRACE
+    if (_trace)
+    {
+        run_traced(new_count);
+        return;
+    }
+#endif
+
+    if (_engine != nes_cpu_engine::INTERPRETER)
+        run_blocks(new_count);
+    else
+        run_interpreter(new_count);
 }
 
-void nes_cpu::nes_log(uint8_t op, opEntry* opEntry, uint16_t count){
-    //C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:  0
-    printf("%-4X %-2X %-2X %-2X %-3s %-28X                      A:%X X:%X Y:%X P:%X SP:%X CYC: %d\n", count, op, operand.value & 0xFF, (operand.value & 0xFF00) >> 8, opEntry->name, operand.value, registers.A, registers.X, registers.Y, registers.P, registers.SP, _cycle);
-    fflush(stdout); // flushes the stdout buffer
+void nes_cpu::set_engine(nes_cpu_engine engine)
+{
+    if (engine == nes_cpu_engine::JIT)
+    {
+        if (!_jit)
+            _jit = std::make_unique<nes_jit>();
+        if (!_jit->available())
+            engine = nes_cpu_engine::BLOCK_CACHE;
+    }
+
+    // The interpreter has no use for the block cache - it is most of the CPU's memory
+    if (engine == nes_cpu_engine::INTERPRETER)
+    {
+        _blocks = nullptr;
+        _idle_block = nullptr;
+    }
+    else if (!_blocks)
+    {
+        _blocks = std::make_unique<nes_block_cache>();
+    }
+
+    _engine = engine;
+}
+
+//
+// Called whenever _deadline is reached - services a pending NMI/IRQ or recovers from an aborted block
+// Returns false if step_to is done
+//
+bool nes_cpu::on_deadline(nes_cycle_t new_count)
+{
+    if (system->stop_requested())
+        return false;
+
+    if (interrupt_pending())
+        exec_interrupt();
+    else if (!_block_abort)
+        return false;
+
+    _block_abort = false;
+    _idle_block = nullptr;
+    _deadline = std::min(new_count, system->next_event_deadline());
+    return true;
 }
 
-void nes_cpu::exec_one_instruction(){
-    uint16_t originalCount = registers.PC;
-    if (_nmi_pending)
+void nes_cpu::run_interpreter(nes_cycle_t new_count)
+{
+#ifdef NES_CPU_COMPUTED_GOTO
+#define NES_OP_LABEL(code, ...) &&op_##code,
+    static const void *s_op_labels[0x100] = { NES_CPU_OPCODES(NES_OP_LABEL, NES_OP_LABEL) };
+
+#define NES_CPU_DISPATCH()                                  \
+    if (_state.cycle >= _deadline)                                \
+        goto deadline;                                      \
+    op_code = read_next_byte();                             \
+    goto *s_op_labels[op_code];
+
+#define NES_OP_CASE(code, handler, mode)                                \
+    op_##code:                                                          \
+        exec_op<&nes_cpu::handler, nes_addr_mode::mode>(*this);         \
+        _state.cycle += nes_cpu_cycle_t(opsTable[code].cycles);               \
+        NES_CPU_DISPATCH()
+
+#define NES_IMP_CASE(code, handler)                                     \
+    op_##code:                                                          \
+        exec_imp<&nes_cpu::handler>(*this);                             \
+        _state.cycle += nes_cpu_cycle_t(opsTable[code].cycles);               \
+        NES_CPU_DISPATCH()
+
+    uint8_t op_code;
+    NES_CPU_DISPATCH()
+
+deadline:
+    if (!on_deadline(new_count))
+        return;
+    NES_CPU_DISPATCH()
+
+    NES_CPU_OPCODES(NES_OP_CASE, NES_IMP_CASE)
+#else
+    for (;;)
     {
-        // generate NMI
-        NMI();
+        while (_state.cycle < _deadline)
+            exec_one_instruction();
 
-        _nmi_pending = false;
+        if (!on_deadline(new_count))
+            return;
     }
-    else if (_dma_pending)
+#endif
+}
+
+//
+// Same as run_interpreter, one basic block at a time
+// The deadline is still checked after every instruction so NMI, events and register writes land at
+// exactly the same instruction boundary as in the interpreter
+//
+void nes_cpu::run_blocks(nes_cycle_t new_count)
+{
+    for (;;)
     {
-        OAMDMA();
+        while (_state.cycle < _deadline)
+        {
+            nes_block *block = find_block(_state.registers.PC);
+            if (!block)
+            {
+                // Not from plain memory, or straddling a page - nothing to cache
+                _idle_block = nullptr;
+                exec_one_instruction();
+                continue;
+            }
+
+            // Coming back to the start of an idle loop right after running it means it went around in full
+            if (!block->idle_loop)
+            {
+                _idle_block = nullptr;
+            }
+            else if (block != _idle_block)
+            {
+                _idle_block = block;
+                _idle_iterations = 0;
+            }
+            else if (++_idle_iterations >= 2 && skip_idle_loop(*block))
+            {
+                continue;                   // could have landed on the deadline
+            }
+
+            // Idle loops stay decoded - skipping them beats spinning in native code
+            if (_engine == nes_cpu_engine::JIT && !block->idle_loop)
+            {
+                if (!block->native && ++block->hits >= NES_JIT_HOT_THRESHOLD)
+                    block->native = compile_block(*block);
+
+                // Native code runs the whole block - only enter it if all but the last instruction finish
+                // before the deadline, the interpreter would have done the same
+                if (block->native && _deadline - _state.cycle > nes_cycle_t(block->lead_cycles))
+                {
+                    // Native code keeps the whole P byte in a host register
+                    _state.registers.P = get_status();
+                    block->native(this);
+                    set_status(_state.registers.P);
+                    continue;
+                }
+            }
+
+            const nes_decoded_op *op = block->ops;
+            const nes_decoded_op *end = op + block->count;
+            do
+            {
+                _state.registers.PC = op->next_pc;
+                op->handler(*this, op->raw);
+                _state.cycle += nes_cpu_cycle_t(op->cycles);
+            } while (++op != end && _state.cycle < _deadline);
+        }
 
-        _dma_pending = false;
+        if (!on_deadline(new_count))
+            return;
     }
-    else {
-        auto op_code = read_next_byte();
-
-        struct opEntry *opStruct = &opsTable[op_code];
-
-        switch (op_code) {
-            //ADC
-            case 0x69:
-                ADC_IMD(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x65:
-                ADC(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x75:
-                ADC(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x6D:
-                ADC(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x7D:
-                ADC(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x79:
-                ADC(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x61:
-                ADC(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x71:
-                ADC(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //AND
-            case 0x29:
-                AND(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x25:
-                AND_IND(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x35:
-                AND_IND(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x2D:
-                AND_IND(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x3D:
-                AND_IND(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x39:
-                AND_IND(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x21:
-                AND_IND(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x31:
-                AND_IND(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //ASL
-            case 0x0A:
-                ASL_ACC(get_operand(nes_addr_mode::ACC));
-                break;
-            case 0x06:
-                ASL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x16:
-                ASL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x0E:
-                ASL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x1E:
-                ASL(get_operand(nes_addr_mode::ABSX));
-                break;
-
-                //BCC
-            case 0x90:
-                BCC();
-                break;
-
-                //BCS
-            case 0xB0:
-                BCS();
-                break;
-
-                //BEQ
-            case 0xF0:
-                BEQ();
-                break;
-
-                //BIT
-            case 0x24:
-                BIT(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x2C:
-                BIT(get_operand(nes_addr_mode::ABS));
-                break;
-
-                //BMI
-            case 0x30:
-                BMI();
-                break;
-
-                //BNE
-            case 0xD0:
-                BNE();
-                break;
-
-                //BPL
-            case 0x10:
-                BPL();
-                break;
-
-                //BVC
-            case 0x50:
-                BVC();
-                break;
-
-                //BVS
-            case 0x70:
-                BVS();
-                break;
-
-                //CMP
-            case 0xC9:
-                CMP(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xC5:
-                CMP_IND(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xD5:
-                CMP_IND(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xCD:
-                CMP_IND(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xDD:
-                CMP_IND(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0xD9:
-                CMP_IND(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xC1:
-                CMP_IND(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0xD1:
-                CMP_IND(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //CPX
-            case 0xE0:
-                CPX_IMD(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xE4:
-                CPX(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xEC:
-                CPX(get_operand(nes_addr_mode::ABS));
-                break;
-
-                //CPY
-            case 0xC0:
-                CPY_IMD(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xC4:
-                CPY(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xCC:
-                CPY(get_operand(nes_addr_mode::ABS));
-                break;
-
-                //DEC
-            case 0xC6:
-                DEC(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xD6:
-                DEC(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xCE:
-                DEC(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xDE:
-                DEC(get_operand(nes_addr_mode::ABSX));
-                break;
-
-                //EOR
-            case 0x49:
-                EOR(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x45:
-                EOR_IND(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x55:
-                EOR_IND(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x4D:
-                EOR_IND(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x5D:
-                EOR_IND(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x59:
-                EOR_IND(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x41:
-                EOR_IND(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x51:
-                EOR_IND(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //INC
-            case 0xE6:
-                INC(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xF6:
-                INC(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xEE:
-                INC(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xFE:
-                INC(get_operand(nes_addr_mode::ABSX));
-                break;
-
-                //JMP
-            case 0x4C:
-                JMP(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x6C:
-                JMP(get_operand(nes_addr_mode::IND_JMP));
-                break;
-
-                //JSR
-            case 0x20:
-                JSR(get_operand(nes_addr_mode::ABS));
-                break;
-
-                //LDA
-            case 0xA9:
-                LDA(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xA5:
-                LDA_ABS(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xB5:
-                LDA_ABS(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xAD:
-                LDA_ABS(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xBD:
-                LDA_ABS(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0xB9:
-                LDA_ABS(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xA1:
-                LDA_ABS(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0xB1:
-                LDA_ABS(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //LDX
-            case 0xA2:
-                LDX(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xA6:
-                LDX_ABS(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xB6:
-                LDX_ABS(get_operand(nes_addr_mode::ZPY));
-                break;
-            case 0xAE:
-                LDX_ABS(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xBE:
-                LDX_ABS(get_operand(nes_addr_mode::ABSY));
-                break;
-
-                //LDY
-            case 0xA0:
-                LDY(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xA4:
-                LDY_ABS(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xB4:
-                LDY_ABS(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xAC:
-                LDY_ABS(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xBC:
-                LDY_ABS(get_operand(nes_addr_mode::ABSX));
-                break;
-
-                //LSR
-            case 0x4A:
-                LSR_ACC(get_operand(nes_addr_mode::ACC));
-                break;
-            case 0x46:
-                LSR(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x56:
-                LSR(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x4E:
-                LSR(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x5E:
-                LSR(get_operand(nes_addr_mode::ABSX));
-                break;
-
-                //ORA
-            case 0x09:
-                ORA(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x05:
-                ORA_IND(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x15:
-                ORA_IND(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x0D:
-                ORA_IND(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x1D:
-                ORA_IND(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x19:
-                ORA_IND(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x01:
-                ORA_IND(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x11:
-                ORA_IND(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //ROL
-            case 0x2A:
-                ROL_ACC(get_operand(nes_addr_mode::ACC));
-                break;
-            case 0x26:
-                ROL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x36:
-                ROL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x2E:
-                ROL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x3E:
-                ROL(get_operand(nes_addr_mode::ABSX));
-                break;
-
-                //ROR
-            case 0x6A:
-                ROR_ACC(get_operand(nes_addr_mode::ACC));
-                break;
-            case 0x66:
-                ROR(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x76:
-                ROR(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x6E:
-                ROR(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x7E:
-                ROR(get_operand(nes_addr_mode::ABSX));
-                break;
-
-                //SBC
-            case 0xE9:
-                SBC_IMD(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xE5:
-                SBC(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xF5:
-                SBC(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xED:
-                SBC(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xFD:
-                SBC(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0xF9:
-                SBC(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xE1:
-                SBC(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0xF1:
-                SBC(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //STA
-            case 0x85:
-                STA(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x95:
-                STA(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x8D:
-                STA(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x9D:
-                STA(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x99:
-                STA(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x81:
-                STA(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x91:
-                STA(get_operand(nes_addr_mode::INDY));
-                break;
-
-                //STX
-            case 0x86:
-                STX(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x96:
-                STX(get_operand(nes_addr_mode::ZPY));
-                break;
-            case 0x8E:
-                STX(get_operand(nes_addr_mode::ABS));
-                break;
-
-                //STY
-            case 0x84:
-                STY(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x94:
-                STY(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x8C:
-                STY(get_operand(nes_addr_mode::ABS));
-                break;
-
-                //IMPLIED ONES
-            case 0x00:
-                BRK();
-                break;
-            case 0x18:
-                CLC();
-                break;
-            case 0xD8:
-                CLD();
-                break;
-            case 0x58:
-                CLI();
-                break;
-            case 0xB8:
-                CLV();
-                break;
-            case 0xCA:
-                DEX();
-                break;
-            case 0x88:
-                DEY();
-                break;
-            case 0xE8:
-                INX();
-                break;
-            case 0xC8:
-                INY();
-                break;
-            case 0xEA:
-                NOP();
-                break;
-            case 0x48:
-                PHA();
-                break;
-            case 0x08:
-                PHP();
-                break;
-            case 0x68:
-                PLA();
-                break;
-            case 0x28:
-                PLP();
-                break;
-            case 0x40:
-                RTI();
-                break;
-            case 0x60:
-                RTS();
-                break;
-            case 0x38:
-                SEC();
-                break;
-            case 0xF8:
-                SED();
-                break;
-            case 0x78:
-                SEI();
-                break;
-            case 0xAA:
-                TAX();
-                break;
-            case 0xA8:
-                TAY();
-                break;
-            case 0xBA:
-                TSX();
-                break;
-            case 0x8A:
-                TXA();
-                break;
-            case 0x9A:
-                TXS();
-                break;
-            case 0x98:
-                TYA();
-                break;
-
-                //===============================================================================
-                // Unofficial instructions
-                //===============================================================================
-            case 0x80:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x04:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x44:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x64:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x0c:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x14:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x34:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x54:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x74:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xd4:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xf4:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x1c:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x3c:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x5c:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x7c:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0xdc:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0xfc:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x89:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x82:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xc2:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xe2:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x1a:
-                UNOFFICIAL();
-                break;
-            case 0x3a:
-                UNOFFICIAL();
-                break;
-            case 0x5a:
-                UNOFFICIAL();
-                break;
-            case 0x7a:
-                UNOFFICIAL();
-                break;
-            case 0xda:
-                UNOFFICIAL();
-                break;
-            case 0xfa:
-                UNOFFICIAL();
-                break;
-            case 0x03:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x07:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x0b:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x0f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x13:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDY));
-                break;
-            case 0x17:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x1b:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x1f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x23:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x27:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x2b:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x2f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x33:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDY));
-                break;
-            case 0x37:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x3b:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x3f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x43:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x47:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x4b:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x4f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x53:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDY));
-                break;
-            case 0x57:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x5b:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x5f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x63:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x67:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x6b:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x6f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x73:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDY));
-                break;
-            case 0x77:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0x7b:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x7f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0x83:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0x87:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0x8b:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0x8f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0x93:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDY));
-                break;
-            case 0x97:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPY));
-                break;
-            case 0x9b:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0x9f:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xa3:
-                LAX(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0xa7:
-                LAX(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xab:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xaf:
-                LAX(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xb3:
-                LAX(get_operand(nes_addr_mode::INDY));
-                break;
-            case 0xb7:
-                LAX(get_operand(nes_addr_mode::ZPY));
-                break;
-            case 0xbb:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPY));
-                break;
-            case 0xbf:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xc3:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0xc7:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xcb:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xcf:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xd3:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xd7:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xdb:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xdf:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-            case 0xe3:
-                ISC(get_operand(nes_addr_mode::INDX));
-                break;
-            case 0xe7:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZP));
-                break;
-            case 0xeb:
-                UNOFFICIAL(get_operand(nes_addr_mode::IMD));
-                break;
-            case 0xef:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABS));
-                break;
-            case 0xf3:
-                UNOFFICIAL(get_operand(nes_addr_mode::INDY));
-                break;
-            case 0xf7:
-                UNOFFICIAL(get_operand(nes_addr_mode::ZPX));
-                break;
-            case 0xfb:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSY));
-                break;
-            case 0xff:
-                UNOFFICIAL(get_operand(nes_addr_mode::ABSX));
-                break;
-
-            default:
-                std::cout << "Unknown instruction: " << op_code << std::endl;
-                assert(false);
+}
+
+#ifdef NES_TRACE
+//
+// One instruction at a time, recording the state before each into _trace
+//
+void nes_cpu::run_traced(nes_cycle_t new_count)
+{
+    // Code bytes without going through I/O handlers - code never runs from I/O anyway
+    auto peek = [this](uint16_t addr) -> uint8_t {
+        const uint8_t *host = memory->get_code_ptr(addr);
+        return host ? *host : 0;
+    };
+
+    for (;;)
+    {
+        while (_state.cycle < _deadline)
+        {
+            if (!interrupt_pending())
+            {
+                nes_trace_record rec;
+                rec.pc = _state.registers.PC;
+                rec.op_code = peek(_state.registers.PC);
+                rec.operand[0] = peek(_state.registers.PC + 1);
+                rec.operand[1] = peek(_state.registers.PC + 2);
+                rec.a = _state.registers.A;
+                rec.x = _state.registers.X;
+                rec.y = _state.registers.Y;
+                rec.p = get_status();
+                rec.sp = _state.registers.SP;
+                rec.cycle = uint32_t(duration_cast<nes_cpu_cycle_t>(_state.cycle).count());
+                _trace->record(rec);
+            }
+
+            exec_one_instruction();
         }
 
-        //nes_log(op_code, opStruct, originalCount);
-        _cycle += nes_cycle_t(opStruct->cycles);
-        operand = {};
+        if (!on_deadline(new_count))
+            return;
     }
 }
+#endif
 
-void nes_cpu::calc_alu_flag(uint8_t value)
+nes_block *nes_cpu::find_block(uint16_t pc)
 {
-    set_zero_flag(value == 0);
-    set_negative_flag(value & 0x80);
+    const uint8_t *host = memory->get_code_ptr(pc);
+    if (!host)
+        return nullptr;
+
+    nes_block &block = _blocks->slot(pc);
+    if (block.host == host && block.pc == pc)
+        return &block;
+
+    if (!decode_block(block, pc, host))
+        return nullptr;
+
+    return &block;
 }
 
-void nes_cpu::ADC(operand_t operand) {
-    uint8_t value = read_byte(operand.value);
+//
+// The block is a loop that has gone around twice in a row. The first time around may have changed
+// registers or cleared the VBlank flag - after the second one nothing can change until memory it reads
+// does, and only events (NMI, DMA) and the PPU updating PPUSTATUS do that while the loop spins.
+// Skips every iteration the interpreter would have run in full before the deadline / next PPUSTATUS change.
+// Returns false if nothing was skipped
+//
+bool nes_cpu::skip_idle_loop(const nes_block &block)
+{
+    bool reads_ppu_status = false;
+    for (int i = 0; i < block.count - 1; ++i)
+    {
+        auto mode = opsTable[block.ops[i].op_code].mode;
+        if (mode != nes_addr_mode::ZP && mode != nes_addr_mode::ABS)
+            continue;
+
+        // $2002 and its mirrors
+        uint16_t addr = block.ops[i].raw;
+        if ((addr & 0xe007) == 0x2002)
+            reads_ppu_status = true;
+        else if (!memory->get_code_ptr(addr))
+            return false;               // other I/O reads have side effects
+    }
 
-    uint8_t oldValue = registers.A;
-    uint8_t newValue = oldValue + value;
+    int64_t lead = block.lead_cycles;
+    int64_t length = lead + nes_cycle_t(nes_cpu_cycle_t(block.ops[block.count - 1].cycles)).count();
+    int64_t left = (_deadline - _state.cycle).count();
+    if (left <= lead)
+        return false;
 
-    bool bit7_overflow = false;
-    if (newValue < oldValue) bit7_overflow = true;
+    // An iteration runs in full if its last-but-one instruction ends before the deadline
+    int64_t iterations = (left - lead - 1) / length + 1;
+    if (reads_ppu_status)
+    {
+        // ... and if all its PPUSTATUS reads happen before the PPU changes it
+        int64_t until_change = (system->getPpu()->next_status_change(_state.cycle) - _state.cycle).count();
+        iterations = std::min(iterations, until_change / length);
+    }
 
-    uint8_t old_val2 = newValue;
-    newValue += get_carry();
-    if (newValue < old_val2) bit7_overflow = true;
+    _state.cycle += nes_cycle_t(iterations * length);
+    return iterations > 0;
+}
 
-    registers.A = newValue;
+nes_native_code nes_cpu::compile_block(nes_block &block)
+{
+    nes_native_code native = _jit->compile(*this, block);
+    if (!native)
+    {
+        // Code buffer is full - start over, whatever is still hot gets compiled again
+        _jit->reset();
+        _blocks->drop_native_code();
+        native = _jit->compile(*this, block);
+    }
 
-    set_overflow_flag(is_sign_overflow(oldValue, value, newValue));
-    set_carry_flag(bit7_overflow);
-    calc_alu_flag(registers.A);
+    return native;
 }
 
-void nes_cpu::ADC_IMD(operand_t operand) {
-    uint8_t value = operand.value;
+bool nes_cpu::decode_block(nes_block &block, uint16_t pc, const uint8_t *host)
+{
+    uint16_t start_pc = pc;
+    const uint8_t *code = host;
+    int page_left = NES_PAGE_SIZE - (pc & (NES_PAGE_SIZE - 1));
+    int count = 0;
+
+    while (count < NES_BLOCK_MAX_OPS)
+    {
+        uint8_t op_code = code[0];
+        int size = s_op_sizes[op_code];
+        if (size > page_left)
+            break;
+
+        nes_decoded_op &op = block.ops[count++];
+        op.handler = s_decoded_handlers[op_code];
+        op.raw = (size == 1) ? 0 : (size == 2) ? code[1] : code[1] + (uint16_t(code[2]) << 8);
+        op.cycles = opsTable[op_code].cycles;
+        op.op_code = op_code;
+
+        pc += size;
+        op.next_pc = pc;
+        code += size;
+        page_left -= size;
+
+        if (s_op_ends_block[op_code])
+            break;
+    }
+
+    if (count == 0)
+    {
+        _blocks->set_host(block, nullptr);
+        return false;
+    }
+
+    _blocks->set_host(block, host);
+    block.pc = start_pc;
+    block.count = count;
+    block.hits = 0;
+    block.native = nullptr;
+
+    block.lead_cycles = 0;
+    for (int i = 0; i < count - 1; ++i)
+        block.lead_cycles += nes_cycle_t(nes_cpu_cycle_t(block.ops[i].cycles)).count();
+
+    // Spin loop - jumps back to itself and only reads (see skip_idle_loop)
+    const nes_decoded_op &last = block.ops[count - 1];
+    uint16_t target = (opsTable[last.op_code].mode == nes_addr_mode::REL) ? last.next_pc + uint16_t(int8_t(last.raw)) : last.raw;
+    block.idle_loop = s_op_ends_block[last.op_code] && target == start_pc;
+    for (int i = 0; i < count && block.idle_loop; ++i)
+        block.idle_loop = s_op_idle_safe[block.ops[i].op_code];
+
+    // Code in RAM can be overwritten - have writes to it come back to invalidate_code
+    memory->protect_code(start_pc >> NES_PAGE_SHIFT);
+
+    return true;
+}
+
+void nes_cpu::exec_interrupt()
+{
+    if (_state.nmi_pending)
+    {
+        // generate NMI
+        NMI();
+
+        _state.nmi_pending = false;
+    }
+    else if (irq_pending())
+    {
+        IRQ();
+    }
+}
 
-    uint8_t oldValue = registers.A;
-    uint8_t newValue = oldValue + value;
+void nes_cpu::exec_one_instruction()
+{
+    if (interrupt_pending())
+    {
+        exec_interrupt();
+        return;
+    }
 
-    bool bit7_overflow = false;
-    if (newValue < oldValue) bit7_overflow = true;
+    auto op_code = read_next_byte();
+    s_op_handlers[op_code](*this);
+
+    _state.cycle += nes_cpu_cycle_t(opsTable[op_code].cycles);
+}
+
+void nes_cpu::ADC(operand_t operand) {
+    uint8_t value = read_byte(operand.value);
 
-    uint8_t old_val2 = newValue;
-    newValue += get_carry();
-    if (newValue < old_val2) bit7_overflow = true;
+    uint16_t sum = _state.registers.A + value + get_carry();
 
-    registers.A = newValue;
+    // V when both inputs have the same sign and the result doesn't
+    _state.flag_v = (~(_state.registers.A ^ value) & (_state.registers.A ^ sum) & 0x80) >> 1;
+    _state.flag_c = sum >> 8;
 
-    set_overflow_flag(is_sign_overflow(oldValue, value, newValue));
-    set_carry_flag(bit7_overflow);
-    calc_alu_flag(registers.A);
+    _state.registers.A = uint8_t(sum);
+    calc_alu_flag(_state.registers.A);
+}
+
+void nes_cpu::ADC_IMD(operand_t operand) {
+    uint8_t value = operand.value;
+
+    uint16_t sum = _state.registers.A + value + get_carry();
+
+    // V when both inputs have the same sign and the result doesn't
+    _state.flag_v = (~(_state.registers.A ^ value) & (_state.registers.A ^ sum) & 0x80) >> 1;
+    _state.flag_c = sum >> 8;
+
+    _state.registers.A = uint8_t(sum);
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::AND(operand_t operand) {
     uint8_t value = operand.value;
-    registers.A &= value;
-    calc_alu_flag(registers.A);
+    _state.registers.A &= value;
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::AND_IND(operand_t operand) {
     uint8_t value = read_byte(operand.value);
-    registers.A &= value;
-    calc_alu_flag(registers.A);
+    _state.registers.A &= value;
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::BRK() {
     system->stop();
 }
 
-operand_t nes_cpu::get_operand(nes_addr_mode mode) {
-    if (mode == nes_addr_mode::ACC){
-        return {registers.A, operand_kind::ACCUMULATOR, false};
-    }
-    if (mode == nes_addr_mode::IMD){
-        return {read_next_byte(), operand_kind::IMMEDIATE, false};
-    }
+template <nes_addr_mode mode>
+uint16_t nes_cpu::fetch_operand()
+{
+    if constexpr (nes_operand_size(mode) == 0)
+        return 0;
+    else if constexpr (nes_operand_size(mode) == 2)
+        return read_next_word();
+    else
+        return read_next_byte();
+}
 
-    uint16_t value = 0;
-    bool page_crossed = false;
-    if (mode == nes_addr_mode::ZP){
-        value = read_next_byte();
-    } else if (mode == nes_addr_mode::ZPX){
-        value = (read_next_byte() + registers.X) & 0xFF;
-    } else if (mode == nes_addr_mode::ZPY) {
-        value = (read_next_byte() + registers.Y) & 0xFF;
-    } else if (mode == nes_addr_mode::IND_JMP) {
-        // Indirect
-        uint16_t addr = read_next_word();
-        if ((addr & 0xff) == 0xff)
-        {
-            // Account for JMP hardware bug
-            // http://wiki.nesdev.com/w/index.php/Errata
-            value = read_byte(addr) + (uint16_t(read_byte(addr & 0xff00)) << 8);
-        }
-        else
-        {
-            value = read_word(addr);
-        }
-    } else if (mode == nes_addr_mode::IND){
-        uint16_t addr = read_next_word();
-        if ((value & 0xFF) == 0xFF){
-            value = peek(addr) + (uint16_t(peek(addr & 0xff00)) << 8);
+template <nes_addr_mode mode>
+operand_t nes_cpu::decode_operand(uint16_t raw) {
+    if constexpr (mode == nes_addr_mode::ACC){
+        return {_state.registers.A, operand_kind::ACCUMULATOR, false};
+    } else if constexpr (mode == nes_addr_mode::IMD){
+        return {raw, operand_kind::IMMEDIATE, false};
+    } else {
+        uint16_t value = 0;
+        bool page_crossed = false;
+        if constexpr (mode == nes_addr_mode::REL){
+            // sign extend - the 16-bit wrap around takes care of negative offsets
+            value = uint16_t(int8_t(raw));
+        } else if constexpr (mode == nes_addr_mode::ZP){
+            value = raw;
+        } else if constexpr (mode == nes_addr_mode::ZPX){
+            value = (raw + _state.registers.X) & 0xFF;
+        } else if constexpr (mode == nes_addr_mode::ZPY) {
+            value = (raw + _state.registers.Y) & 0xFF;
+        } else if constexpr (mode == nes_addr_mode::IND_JMP) {
+            // Indirect
+            uint16_t addr = raw;
+            if ((addr & 0xff) == 0xff)
+            {
+                // Account for JMP hardware bug
+                // http://wiki.nesdev.com/w/index.php/Errata
+                value = read_byte(addr) + (uint16_t(read_byte(addr & 0xff00)) << 8);
+            }
+            else
+            {
+                value = read_word(addr);
+            }
+        } else if constexpr (mode == nes_addr_mode::ABS){
+            value = raw;
+        } else if constexpr (mode == nes_addr_mode::ABSX){
+            uint16_t addr = raw;
+            uint16_t new_addr = addr + _state.registers.X;
+            page_crossed = ((addr & 0xff00) != (new_addr & 0xff00));
+            value = new_addr;
+        } else if constexpr (mode == nes_addr_mode::ABSY){
+            uint16_t addr = raw;
+            uint16_t new_addr = addr + _state.registers.Y;
+            page_crossed = ((addr & 0xff00) != (new_addr & 0xff00));
+            value = new_addr;
+        } else if constexpr (mode == nes_addr_mode::INDX) {
+            uint8_t addr = raw;
+            value = peek((addr + _state.registers.X) & 0xff) + (uint16_t(peek((addr + _state.registers.X + 1) & 0xff)) << 8);
+        } else if constexpr (mode == nes_addr_mode::INDY){
+            uint8_t arg_addr = raw;
+            uint16_t addr = peek(arg_addr) + (uint16_t(peek((arg_addr + 1) & 0xff)) << 8);
+            uint16_t new_addr = addr + _state.registers.Y;
+            page_crossed = ((addr & 0xff00) != (new_addr & 0xff00));
+            value = new_addr;
         } else {
-            value = peek_word(addr);
+            static_assert(mode == nes_addr_mode::INDY, "Unsupported addressing mode");
         }
-    } else if (mode == nes_addr_mode::ABS){
-        value = read_next_word();
-    } else if (mode == nes_addr_mode::ABSX){
-        uint16_t addr = read_next_word();
-        uint16_t new_addr = addr + registers.X;
-        page_crossed = ((addr & 0xff00) != (new_addr & 0xff00));
-        value = new_addr;
-    } else if (mode == nes_addr_mode::ABSY){
-        uint16_t addr = read_next_word();
-        uint16_t new_addr = addr + registers.Y;
-        page_crossed = ((addr & 0xff00) != (new_addr & 0xff00));
-        value = new_addr;
-    } else if (mode == nes_addr_mode::INDX) {
-        uint8_t addr = read_next_byte();
-        value = peek((addr + registers.X) & 0xff) + (uint16_t(peek((addr + registers.X + 1) & 0xff)) << 8);
-    } else if (mode == nes_addr_mode::INDY){
-        uint8_t arg_addr = read_next_byte();
-        uint16_t addr = peek(arg_addr) + (uint16_t(peek((arg_addr + 1) & 0xff)) << 8);
-        uint16_t new_addr = addr + registers.Y;
-        page_crossed = ((addr & 0xff00) != (new_addr & 0xff00));
-        value = new_addr;
-    } else {
-        assert(false);
+        operand = {value, operand_kind::ADDRESS, page_crossed};
+        return operand;
     }
-    operand = {value, operand_kind::ADDRESS, page_crossed};
-    return operand;
 }
 
 void nes_cpu::INC(operand_t operand) {
@@ -1041,8 +720,7 @@ void nes_cpu::ASL_ACC(operand_t operand) {
 
     // @DOCBUG:
     // http://obelisk.me.uk/6502/reference.html#ASL incorrectly states ASL detects A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
 void nes_cpu::ASL(operand_t operand) {
@@ -1055,17 +733,14 @@ void nes_cpu::ASL(operand_t operand) {
 
     // @DOCBUG:
     // http://obelisk.me.uk/6502/reference.html#ASL incorrectly states ASL detects A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
-void nes_cpu::branch(bool cond)
+void nes_cpu::branch(bool cond, operand_t operand)
 {
-    int8_t rel = (int8_t) read_next_byte();
-    operand = {rel, operand_kind::ADDRESS, false};
     if (cond)
     {
-        registers.PC += rel;
+        _state.registers.PC += operand.value;
         /*if (rel == -2 && _stop_at_infinite_loop)
         {
             _system->stop();
@@ -1074,46 +749,45 @@ void nes_cpu::branch(bool cond)
     }
 }
 
-void nes_cpu::BCC() {
-    branch(!get_carry());
+void nes_cpu::BCC(operand_t operand) {
+    branch(!get_carry(), operand);
 }
 
-void nes_cpu::BCS() {
-    branch(get_carry());
+void nes_cpu::BCS(operand_t operand) {
+    branch(get_carry(), operand);
 }
 
-void nes_cpu::BEQ() {
-    branch(is_zero());
+void nes_cpu::BEQ(operand_t operand) {
+    branch(is_zero(), operand);
 }
 
 void nes_cpu::BIT(operand_t operand) {
     uint8_t val = read_byte(operand.value);
-    uint8_t new_val = val & registers.A;
 
-    // flags
-    set_zero_flag(new_val == 0);
-    set_overflow_flag(val & 0x40);
-    set_negative_flag(val & 0x80);
+    // flags - N/V come from the operand, Z from the AND
+    _state.flag_z = val & _state.registers.A;
+    _state.flag_n = val;
+    _state.flag_v = val;
 }
 
-void nes_cpu::BMI() {
-    branch(is_negative());
+void nes_cpu::BMI(operand_t operand) {
+    branch(is_negative(), operand);
 }
 
-void nes_cpu::BNE() {
-    branch(!is_zero());
+void nes_cpu::BNE(operand_t operand) {
+    branch(!is_zero(), operand);
 }
 
-void nes_cpu::BPL() {
-    branch(!is_negative());
+void nes_cpu::BPL(operand_t operand) {
+    branch(!is_negative(), operand);
 }
 
-void nes_cpu::BVC() {
-    branch(!is_overflow());
+void nes_cpu::BVC(operand_t operand) {
+    branch(!is_overflow(), operand);
 }
 
-void nes_cpu::BVS() {
-    branch(is_overflow());
+void nes_cpu::BVS(operand_t operand) {
+    branch(is_overflow(), operand);
 }
 
 void nes_cpu::CLC() {
@@ -1136,64 +810,58 @@ void nes_cpu::CMP(operand_t operand) {
     uint8_t val = operand.value;
 
     // flags
-    uint8_t diff = registers.A - val;
+    uint8_t diff = _state.registers.A - val;
 
-    set_carry_flag(registers.A >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    set_carry_flag(_state.registers.A >= val);
+    calc_alu_flag(diff);
 }
 
 void nes_cpu::CMP_IND(operand_t operand) {
     uint8_t val = read_byte(operand.value);
 
     // flags
-    uint8_t diff = registers.A - val;
+    uint8_t diff = _state.registers.A - val;
 
-    set_carry_flag(registers.A >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    set_carry_flag(_state.registers.A >= val);
+    calc_alu_flag(diff);
 }
 
 void nes_cpu::CPX_IMD(operand_t operand) {
     uint8_t val = operand.value;
 
     // flags
-    uint8_t diff = registers.X - val;
+    uint8_t diff = _state.registers.X - val;
 
-    set_carry_flag(registers.X >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    set_carry_flag(_state.registers.X >= val);
+    calc_alu_flag(diff);
 }
 
 void nes_cpu::CPX(operand_t operand) {
     uint8_t val = read_byte(operand.value);
 
     // flags
-    uint8_t diff = registers.X - val;
+    uint8_t diff = _state.registers.X - val;
 
-    set_carry_flag(registers.X >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    set_carry_flag(_state.registers.X >= val);
+    calc_alu_flag(diff);
 }
 
 void nes_cpu::CPY_IMD(operand_t operand) {
     uint8_t val = operand.value;
 
-    uint8_t diff = (registers.Y - val);
+    uint8_t diff = (_state.registers.Y - val);
 
-    set_carry_flag(registers.Y >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    set_carry_flag(_state.registers.Y >= val);
+    calc_alu_flag(diff);
 }
 
 void nes_cpu::CPY(operand_t operand) {
     uint8_t val = read_byte(operand.value);
 
-    uint8_t diff = (registers.Y - val);
+    uint8_t diff = (_state.registers.Y - val);
 
-    set_carry_flag(registers.Y >= val);
-    set_zero_flag(diff == 0);
-    set_negative_flag(diff & 0x80);
+    set_carry_flag(_state.registers.Y >= val);
+    calc_alu_flag(diff);
 }
 
 void nes_cpu::DEC(operand_t operand) {
@@ -1205,81 +873,81 @@ void nes_cpu::DEC(operand_t operand) {
 }
 
 void nes_cpu::DEX() {
-    registers.X--;
-    calc_alu_flag(registers.X);
+    _state.registers.X--;
+    calc_alu_flag(_state.registers.X);
 }
 
 void nes_cpu::DEY() {
-    registers.Y--;
-    calc_alu_flag(registers.Y);
+    _state.registers.Y--;
+    calc_alu_flag(_state.registers.Y);
 }
 
 void nes_cpu::EOR(operand_t operand) {
     uint8_t val = operand.value;
 
-    registers.A ^= val;
+    _state.registers.A ^= val;
 
     // flags
-    calc_alu_flag(registers.A);
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::EOR_IND(operand_t operand) {
     uint8_t val = read_byte(operand.value);
 
-    registers.A ^= val;
+    _state.registers.A ^= val;
 
     // flags
-    calc_alu_flag(registers.A);
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::INX() {
-    registers.X++;
-    calc_alu_flag(registers.X);
+    _state.registers.X++;
+    calc_alu_flag(_state.registers.X);
 }
 
 void nes_cpu::INY() {
-    registers.Y++;
-    calc_alu_flag(registers.Y);
+    _state.registers.Y++;
+    calc_alu_flag(_state.registers.Y);
 }
 
 void nes_cpu::JMP(operand_t operand) {
-    registers.PC = operand.value;;
+    _state.registers.PC = operand.value;;
 }
 
 void nes_cpu::JSR(operand_t operand) {
-    push_word(registers.PC - 1);
-    registers.PC = operand.value;
+    push_word(_state.registers.PC - 1);
+    _state.registers.PC = operand.value;
 }
 
 void nes_cpu::LDA(operand_t operand){
-    registers.A = operand.value;
-    calc_alu_flag(registers.A);
+    _state.registers.A = operand.value;
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::LDA_ABS(operand_t operand){
-    registers.A = read_byte(operand.value);
+    _state.registers.A = read_byte(operand.value);
 
-    calc_alu_flag(registers.A);
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::LDX(operand_t operand) {
-    registers.X = operand.value;
-    calc_alu_flag(registers.X);
+    _state.registers.X = operand.value;
+    calc_alu_flag(_state.registers.X);
 }
 
 void nes_cpu::LDX_ABS(operand_t operand) {
-    registers.X = read_byte(operand.value);
-    calc_alu_flag(registers.X);
+    _state.registers.X = read_byte(operand.value);
+    calc_alu_flag(_state.registers.X);
 }
 
 void nes_cpu::LDY(operand_t operand) {
-    registers.Y = operand.value;
-    calc_alu_flag(registers.Y);
+    _state.registers.Y = operand.value;
+    calc_alu_flag(_state.registers.Y);
 }
 
 void nes_cpu::LDY_ABS(operand_t operand) {
-    registers.Y = read_byte(operand.value);
-    calc_alu_flag(registers.Y);
+    _state.registers.Y = read_byte(operand.value);
+    calc_alu_flag(_state.registers.Y);
 }
 
 void nes_cpu::LSR_ACC(operand_t operand) {
@@ -1292,8 +960,7 @@ void nes_cpu::LSR_ACC(operand_t operand) {
 
     // @DOCBUG:
     // http://obelisk.me.uk/6502/reference.html#LSR incorrectly states ASL detects A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
 void nes_cpu::LSR(operand_t operand) {
@@ -1306,8 +973,7 @@ void nes_cpu::LSR(operand_t operand) {
 
     // @DOCBUG:
     // http://obelisk.me.uk/6502/reference.html#LSR incorrectly states ASL detects A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
 void nes_cpu::NOP() {
@@ -1327,32 +993,32 @@ void nes_cpu::NOP() {
 void nes_cpu::ORA(operand_t operand) {
     uint8_t val = operand.value;
 
-    registers.A |= val;
+    _state.registers.A |= val;
 
-    calc_alu_flag(registers.A);
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::ORA_IND(operand_t operand) {
     uint8_t val = read_byte(operand.value);
 
-    registers.A |= val;
+    _state.registers.A |= val;
 
-    calc_alu_flag(registers.A);
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::PHA() {
-    push_byte(registers.A);
+    push_byte(_state.registers.A);
 }
 
 void nes_cpu::PHP() {
     // http://wiki.nesdev.com/w/index.php/CPU_status_flag_behavior
     // Set bit 5 and 4 to 1 when copy status into from PHP
-    push_byte(registers.P | 0x30);
+    push_byte(get_status() | 0x30);
 }
 
 void nes_cpu::PLA() {
-    registers.A = pop_byte();
-    calc_alu_flag(registers.A);
+    _state.registers.A = pop_byte();
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::PLP() {
@@ -1360,7 +1026,7 @@ void nes_cpu::PLP() {
     // Bit 5 and 4 are ignored when pulled from stack - which means they are preserved
     // @TODO - Nintendulator actually always sets bit 5, not sure which one is correct
     // I'm setting bit 5 to make testing easier
-    registers.P = (pop_byte() & 0xef) | (registers.P & 0x10) | 0x20;
+    set_status((pop_byte() & 0xef) | (_state.registers.P & 0x10) | 0x20);
 }
 
 void nes_cpu::ROL_ACC(operand_t operand) {
@@ -1372,8 +1038,7 @@ void nes_cpu::ROL_ACC(operand_t operand) {
     set_carry_flag(val & 0x80);
     // @DOCBUG
     // http://obelisk.me.uk/6502/reference.html#ROL incorrectly states zero is set if A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
 void nes_cpu::ROL(operand_t operand) {
@@ -1385,8 +1050,7 @@ void nes_cpu::ROL(operand_t operand) {
     set_carry_flag(val & 0x80);
     // @DOCBUG
     // http://obelisk.me.uk/6502/reference.html#ROL incorrectly states zero is set if A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
 void nes_cpu::ROR_ACC(operand_t operand) {
@@ -1399,8 +1063,7 @@ void nes_cpu::ROR_ACC(operand_t operand) {
 
     // @DOCBUG
     // http://obelisk.me.uk/6502/reference.html#ROR incorrectly states zero is set if A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
 void nes_cpu::ROR(operand_t operand) {
@@ -1413,20 +1076,19 @@ void nes_cpu::ROR(operand_t operand) {
 
     // @DOCBUG
     // http://obelisk.me.uk/6502/reference.html#ROR incorrectly states zero is set if A == 0
-    set_zero_flag(new_val == 0);
-    set_negative_flag(new_val & 0x80);
+    calc_alu_flag(new_val);
 }
 
 void nes_cpu::RTI() {
     PLP();
 
     uint16_t addr = pop_word();
-    registers.PC = addr;
+    _state.registers.PC = addr;
 }
 
 void nes_cpu::RTS() {
     uint16_t addr = pop_word() + 1;
-    registers.PC = addr;
+    _state.registers.PC = addr;
 }
 
 void nes_cpu::SBC(operand_t operand) {
@@ -1452,44 +1114,44 @@ void nes_cpu::SEI() {
 }
 
 void nes_cpu::STA(operand_t operand) {
-    set_byte(operand.value, registers.A);
+    set_byte(operand.value, _state.registers.A);
 }
 
 void nes_cpu::STX(operand_t operand) {
-    set_byte(operand.value, registers.X);
+    set_byte(operand.value, _state.registers.X);
 }
 
 void nes_cpu::STY(operand_t operand) {
-    set_byte(operand.value, registers.Y);
+    set_byte(operand.value, _state.registers.Y);
 }
 
 void nes_cpu::TAX() {
-    registers.X = registers.A;
-    calc_alu_flag(registers.X);
+    _state.registers.X = _state.registers.A;
+    calc_alu_flag(_state.registers.X);
 }
 
 void nes_cpu::TAY() {
-    registers.Y = registers.A;
-    calc_alu_flag(registers.Y);
+    _state.registers.Y = _state.registers.A;
+    calc_alu_flag(_state.registers.Y);
 }
 
 void nes_cpu::TSX() {
-    registers.X = registers.SP;
-    calc_alu_flag(registers.X);
+    _state.registers.X = _state.registers.SP;
+    calc_alu_flag(_state.registers.X);
 }
 
 void nes_cpu::TXA() {
-    registers.A = registers.X;
-    calc_alu_flag(registers.A);
+    _state.registers.A = _state.registers.X;
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::TXS() {
-    registers.SP = registers.X;
+    _state.registers.SP = _state.registers.X;
 }
 
 void nes_cpu::TYA() {
-    registers.A = registers.Y;
-    calc_alu_flag(registers.A);
+    _state.registers.A = _state.registers.Y;
+    calc_alu_flag(_state.registers.A);
 }
 
 void nes_cpu::UNOFFICIAL(operand_t operand) {
@@ -1503,10 +1165,10 @@ void nes_cpu::UNOFFICIAL() {
 void nes_cpu::LAX(operand_t operand) {
     // LDA + TAX
     uint8_t val = read_byte(operand.value);
-    registers.X = registers.A = val;
+    _state.registers.X = _state.registers.A = val;
 
     // flags
-    calc_alu_flag(registers.X);
+    calc_alu_flag(_state.registers.X);
 }
 
 // ISC - INC value then SBC value
@@ -1516,3 +1178,9 @@ void nes_cpu::ISC(operand_t operand)
     // SBC
     SBC(operand);
 }
+
+void nes_cpu::UNKNOWN()
+{
+    std::cout << "Unknown instruction: " << std::hex << int(peek(_state.registers.PC - 1)) << std::endl;
+    assert(false);
+}
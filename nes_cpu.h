@@ -3,6 +3,10 @@
 #include "nes_memory.h"
 #include "nes_mapper.h"
 #include "nes_cycle.h"
+#include "nes_state.h"
+#include "nes_block_cache.h"
+#include "nes_jit.h"
+#include "nes_trace.h"
 
 //Carry: 1 if last addition or shift resulted in a carry, or if last subtraction resulted in no borrow
 #define PROCESSOR_STATUS_CARRY_MASK 0x1
@@ -28,6 +32,9 @@ class nes_system;
 //Negative: Set to bit 7 of the last operation
 #define PROCESSOR_STATUS_NEGATIVE_MASK 0x80
 
+// Flags nes_cpu evaluates lazily
+#define LAZY_FLAGS_MASK (PROCESSOR_STATUS_NEGATIVE_MASK | PROCESSOR_STATUS_OVERFLOW_MASK | PROCESSOR_STATUS_ZERO_MASK | PROCESSOR_STATUS_CARRY_MASK)
+
 // Vertical blanking interrupt handler
 #define NMI_HANDLER     0xfffa
 
@@ -54,6 +61,24 @@ enum class nes_addr_mode {
     ZPY,
 };
 
+// Number of operand bytes following the opcode
+constexpr int nes_operand_size(nes_addr_mode mode)
+{
+    switch (mode)
+    {
+        case nes_addr_mode::ACC:
+        case nes_addr_mode::IMP:
+            return 0;
+        case nes_addr_mode::ABS:
+        case nes_addr_mode::ABSX:
+        case nes_addr_mode::ABSY:
+        case nes_addr_mode::IND_JMP:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
 struct opEntry {
     const char *name;
     nes_addr_mode mode;
@@ -62,15 +87,6 @@ struct opEntry {
     int cycles;
 };
 
-struct cpu_registers {
-    uint16_t PC; // program counter
-    uint8_t SP; // stack pointer
-    uint8_t A; // accumulator
-    uint8_t X; // x register
-    uint8_t Y; // y register
-    uint8_t P; // processor status
-};
-
 enum class operand_kind{
     ACCUMULATOR,
     IMMEDIATE,
@@ -83,32 +99,137 @@ struct operand_t{
     bool page_crossed;
 };
 
+class nes_cpu;
+
+//
+// Devices that can pull the /IRQ line low - it stays asserted until the device is acknowledged, so each
+// source is a bit and the CPU sees the OR of them
+//
+enum nes_irq_source : uint8_t
+{
+    nes_irq_source_mapper = 0x1,
+};
+
+// Executes one instruction whose opcode byte has already been fetched
+typedef void (*nes_op_handler)(nes_cpu &cpu);
+
+// How step_to executes code
+enum class nes_cpu_engine
+{
+    INTERPRETER,        // fetch and decode every instruction
+    BLOCK_CACHE,        // run pre-decoded basic blocks (see nes_block_cache.h)
+    JIT,                // same as BLOCK_CACHE, with hot blocks compiled to native code (see nes_jit.h)
+};
+
 class nes_cpu {
 private:
-    cpu_registers registers;
+    friend class nes_jit_compiler;
+
+    nes_cpu_state &_state;                  // registers, flags and cycle count live in the console state
 
     operand_t operand;
     nes_system* system;
     nes_memory* memory;
-    nes_cycle_t _cycle;
-    bool            _nmi_pending;           // NMI interrupt pending from PPU vertical blanking
-    bool            _dma_pending;           // OAMDMA is requested from writing $4014
-    uint16_t        _dma_addr;              // starting address
+
+    nes_cycle_t     _deadline;              // step_to runs until here - lowered when something needs attention
+    nes_cpu_engine  _engine;
+    bool            _block_abort;           // memory changed under the running block - stop it and carry on
+    std::unique_ptr<nes_block_cache> _blocks;   // only while an engine other than the interpreter is selected
+    std::unique_ptr<nes_jit> _jit;          // only created once the JIT engine is selected
+    const nes_block *_idle_block;           // idle loop that just went around - see skip_idle_loop
+    int             _idle_iterations;
+#ifdef NES_TRACE
+    std::unique_ptr<nes_trace> _trace;      // only while tracing - see set_trace
+    void run_traced(nes_cycle_t new_count);
+#endif
     void NMI();
-    void OAMDMA();
+    void IRQ();
+    void exec_interrupt();
+    bool on_deadline(nes_cycle_t new_count);
+    void run_interpreter(nes_cycle_t new_count);
+    void run_blocks(nes_cycle_t new_count);
+    nes_block *find_block(uint16_t pc);
+    nes_native_code compile_block(nes_block &block);
+    bool skip_idle_loop(const nes_block &block);
+    bool decode_block(nes_block &block, uint16_t pc, const uint8_t *host);
 
 public:
 #define STACK_OFFSET 0x100
-    void nes_log(uint8_t op, opEntry* opEntry, uint16_t pc);
-    void request_nmi() { _nmi_pending = true; };
-    void request_dma(uint16_t addr) { _dma_pending = true; _dma_addr = addr; }
+    explicit nes_cpu(nes_cpu_state &state)
+            : _state(state), _engine(nes_cpu_engine::BLOCK_CACHE), _block_abort(false),
+              _blocks(std::make_unique<nes_block_cache>()), _idle_block(nullptr), _idle_iterations(0) {}
+
+    void request_nmi() { _state.nmi_pending = true; preempt(_state.cycle); };
+
+    // /IRQ is level triggered - it is taken between instructions for as long as a source asserts it and
+    // the I flag is clear
+    void set_irq_line(nes_irq_source source, bool asserted)
+    {
+        if (asserted)
+            _state.irq_lines |= source;
+        else
+            _state.irq_lines &= ~source;
+        check_irq();
+    }
+
+    bool irq_pending() { return _state.irq_lines && !(_state.registers.P & PROCESSOR_STATUS_INTERRUPT_MASK); }
+
+    // Something needs servicing before the next instruction
+    bool interrupt_pending() { return _state.nmi_pending || irq_pending(); }
+    void request_dma(uint16_t addr);
+    void OAMDMA();
+
+    nes_cycle_t cycle() { return _state.cycle; }
+
+    // Makes step_to return after the current instruction if it is running past the given time
+    void preempt(nes_cycle_t when)
+    {
+        if (when < _deadline)
+            _deadline = when;
+    }
+
+    // IRQ may have just got through - /IRQ asserted or I cleared - take it after the current instruction
+    void check_irq()
+    {
+        if (irq_pending())
+            preempt(_state.cycle);
+    }
+
+    // Falls back to BLOCK_CACHE if there is no JIT for this host
+    void set_engine(nes_cpu_engine engine);
+    nes_cpu_engine engine() { return _engine; }
+
+    // Records the last `records` instructions (rounded up to a power of 2) from now on - 0 stops tracing
+    // While tracing, instructions run one at a time whatever the engine - see nes_trace.h
+#ifdef NES_TRACE
+    void set_trace(size_t records) { _trace = records ? std::make_unique<nes_trace>(records) : nullptr; }
+    nes_trace *get_trace() { return _trace.get(); }
+#else
+    void set_trace(size_t records) {}
+    nes_trace *get_trace() { return nullptr; }
+#endif
+
+    // Code in RAM at [host, host + size) was written or remapped - drop the blocks decoded from it
+    void invalidate_code(const uint8_t *host, size_t size)
+    {
+        if (_blocks)
+            _blocks->invalidate(host, size);
+        abort_block();
+    }
+
+    // The memory map changed - the running block (if any) stops after the current instruction
+    void abort_block()
+    {
+        _block_abort = true;
+        preempt(_state.cycle);
+    }
 
     void push_byte(uint8_t val)
     {
         // stack grow top->down
         // no underflow/overflow detection
-        memory->set_byte(registers.SP + STACK_OFFSET, val);
-        registers.SP--;
+        memory->set_byte(_state.registers.SP + STACK_OFFSET, val);
+        _state.registers.SP--;
     }
 
     void push_word(uint16_t val)
@@ -122,8 +243,8 @@ public:
     {
         // stack grow top->down
         // no underflow/overflow detection
-        registers.SP++;
-        return memory->get_byte(registers.SP + STACK_OFFSET);
+        _state.registers.SP++;
+        return memory->get_byte(_state.registers.SP + STACK_OFFSET);
     }
 
     int16_t pop_word()
@@ -134,47 +255,68 @@ public:
         return uint16_t(hi << 8) + lo;
     }
 
-    void set_carry_flag(bool set) { set_flag(PROCESSOR_STATUS_CARRY_MASK, set); }
-    uint8_t get_carry() { return (registers.P & PROCESSOR_STATUS_CARRY_MASK); }
+    void set_carry_flag(bool set) { _state.flag_c = set; }
+    uint8_t get_carry() { return _state.flag_c; }
 
-    void set_zero_flag(bool set) { set_flag(PROCESSOR_STATUS_ZERO_MASK, set); }
-    bool is_zero() { return registers.P & PROCESSOR_STATUS_ZERO_MASK; }
+    void set_zero_flag(bool set) { _state.flag_z = !set; }
+    bool is_zero() { return _state.flag_z == 0; }
 
-    void set_interrupt_flag(bool set) { set_flag(PROCESSOR_STATUS_INTERRUPT_MASK, set); }
-    bool is_interrupt() { return registers.P & PROCESSOR_STATUS_INTERRUPT_MASK; }
+    void set_interrupt_flag(bool set) { set_flag(PROCESSOR_STATUS_INTERRUPT_MASK, set); check_irq(); }
+    bool is_interrupt() { return _state.registers.P & PROCESSOR_STATUS_INTERRUPT_MASK; }
 
     void set_decimal_flag(bool set) { set_flag(PROCESSOR_STATUS_ADC_MASK, set); }
 
     void set_I_flag(bool set) { set_flag(PROCESSOR_STATUS_A_MASK, set); }
     void set_B_flag(bool set) { set_flag(PROCESSOR_STATUS_B_MASK, set); }
 
-    void set_overflow_flag(bool set) { set_flag(PROCESSOR_STATUS_OVERFLOW_MASK, set); }
-    bool is_overflow() { return registers.P & PROCESSOR_STATUS_OVERFLOW_MASK; }
+    void set_overflow_flag(bool set) { _state.flag_v = set ? PROCESSOR_STATUS_OVERFLOW_MASK : 0; }
+    bool is_overflow() { return _state.flag_v & PROCESSOR_STATUS_OVERFLOW_MASK; }
 
-    void set_negative_flag(bool set) { set_flag(PROCESSOR_STATUS_NEGATIVE_MASK, set); }
-    bool is_negative() { return registers.P & PROCESSOR_STATUS_NEGATIVE_MASK; }
+    void set_negative_flag(bool set) { _state.flag_n = set ? PROCESSOR_STATUS_NEGATIVE_MASK : 0; }
+    bool is_negative() { return _state.flag_n & PROCESSOR_STATUS_NEGATIVE_MASK; }
 
     void init(nes_system* system);
+
+    //
+    // Registers back to their power-on values. Decoded blocks and native code stay - blocks decoded from RAM
+    // are dropped anyway as memory maps the RAM again, and the ones decoded from ROM are still good as long
+    // as the ROM is the same. Call flush_code when it isn't
+    //
+    void power_on();
+
+    // Forgets every decoded block and all native code
+    void flush_code();
+
     uint8_t peek(uint16_t addr) { return memory->get_byte(addr); }
     uint16_t peek_word(uint16_t addr){ return  memory->get_word(addr);}
     void step_to(nes_cycle_t count);
     void exec_one_instruction();
-    cpu_registers& reg(){return registers;}
 
-    void calc_flags(uint8_t val){
-        if (val == 0){
-            set_flag(PROCESSOR_STATUS_ZERO_MASK, true);
-        }
-        if (val < 0){
-            set_flag(PROCESSOR_STATUS_NEGATIVE_MASK, true);
-        }
+    // P is brought up to date first - writing it through here has no effect, use set_status
+    cpu_registers& reg() { _state.registers.P = get_status(); return _state.registers; }
+
+    uint8_t get_status()
+    {
+        return (_state.registers.P & ~LAZY_FLAGS_MASK) | (_state.flag_n & PROCESSOR_STATUS_NEGATIVE_MASK) |
+               (_state.flag_v & PROCESSOR_STATUS_OVERFLOW_MASK) | (_state.flag_z ? 0 : PROCESSOR_STATUS_ZERO_MASK) | _state.flag_c;
+    }
+
+    void set_status(uint8_t val)
+    {
+        _state.registers.P = val;
+        _state.flag_n = val;
+        _state.flag_z = ~val & PROCESSOR_STATUS_ZERO_MASK;
+        _state.flag_c = val & PROCESSOR_STATUS_CARRY_MASK;
+        _state.flag_v = val;
+        check_irq();
     }
 
+    // Only for the flags kept in registers.P - I/D/B/bit 5
     void set_flag(uint8_t mask, bool set){
         if (set){
-            registers.P |= mask;
+            _state.registers.P |= mask;
         } else {
-            registers.P &= ~mask;
+            _state.registers.P &= ~mask;
         }
     }
 
@@ -189,13 +331,26 @@ public:
     uint16_t read_word(uint16_t addr);
     uint16_t read_next_word();
 
-    operand_t get_operand(nes_addr_mode mode);
+    // Reads the operand bytes following the opcode - how many depends on the addressing mode
+    template <nes_addr_mode mode> uint16_t fetch_operand();
+
+    // Resolves the operand bytes into an immediate value, accumulator or effective address
+    template <nes_addr_mode mode> operand_t decode_operand(uint16_t raw);
+
+    // Opcode handlers - one instantiation per opcode, see NES_CPU_OPCODES in opcodes.h
+    template <void (nes_cpu::*op)(operand_t), nes_addr_mode mode> static void exec_op(nes_cpu &cpu);
+    template <void (nes_cpu::*op)()> static void exec_imp(nes_cpu &cpu);
+
+    // Same for instructions whose operand bytes were fetched when the block was decoded
+    template <void (nes_cpu::*op)(operand_t), nes_addr_mode mode> static void exec_decoded_op(nes_cpu &cpu, uint16_t raw);
+    template <void (nes_cpu::*op)()> static void exec_decoded_imp(nes_cpu &cpu, uint16_t raw);
+
     void write_operand(operand_t op, int8_t value)
     {
         switch (op.kind)
         {
             case operand_kind::ACCUMULATOR:
-                registers.A = value;
+                _state.registers.A = value;
                 break;
             case operand_kind::ADDRESS:
                 set_byte(op.value, value);
@@ -205,14 +360,15 @@ public:
         }
     }
 
-    void calc_alu_flag(uint8_t value);
+    // N/Z from the result - no need to look at it until a branch or PHP does
+    void calc_alu_flag(uint8_t value) { _state.flag_n = _state.flag_z = value; }
     bool is_sign_overflow(uint8_t val1, int8_t val2, uint8_t new_value)
     {
         return (((val1 & 0x80) == (val2 & 0x80)) &&
                 ((val1 & 0x80) != (new_value & 0x80)));
     }
 
-    void branch(bool cond);
+    void branch(bool cond, operand_t operand);
 
     void ADC(operand_t operand);
     void ADC_IMD(operand_t operand);
@@ -233,23 +389,23 @@ public:
     void INY();
     void BRK();
 
-    void BCC();
+    void BCC(operand_t operand);
 
-    void BCS();
+    void BCS(operand_t operand);
 
-    void BEQ();
+    void BEQ(operand_t operand);
 
     void BIT(operand_t operand);
 
-    void BMI();
+    void BMI(operand_t operand);
 
-    void BNE();
+    void BNE(operand_t operand);
 
-    void BPL();
+    void BPL(operand_t operand);
 
-    void BVC();
+    void BVC(operand_t operand);
 
-    void BVS();
+    void BVS(operand_t operand);
 
     void CLC();
 
@@ -345,4 +501,6 @@ public:
     void UNOFFICIAL();
 
     void ISC(operand_t operand);
+
+    void UNKNOWN();
 };
\ No newline at end of file
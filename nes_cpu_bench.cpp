@@ -0,0 +1,408 @@
+//
+// CPU micro-benchmark suite
+// Times every implemented opcode on its own - in each addressing mode and, for instructions that access
+// memory, against each memory region (RAM, ROM, I/O) - with every CPU engine, and writes the results as JSON
+//   nesemu2_cpu_bench [runs] [--out file.json]
+//
+// Each case is a loop of NES_BENCH_COPIES copies of the instruction, run from PRG ROM like game code.
+// ns/instruction is the best of the runs, with the loop's own DEC/BNE amortized in (~6% of instructions).
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "nes_system.h"
+#include "opcodes.h"
+
+#define NES_BENCH_COPIES 32
+#define NES_BENCH_OUTER 16             // times around the 256 iteration inner loop
+
+#define BENCH_CODE_ADDR 0x8000
+
+// Operands each memory region is accessed through - the zero page pointers at $40 point to the same place
+#define BENCH_RAM_ADDR 0x0300
+#define BENCH_ROM_ADDR 0xC000
+#define BENCH_IO_ADDR  0x2003           // OAMADDR - no side effects worth mentioning either way
+#define BENCH_ZP_ADDR  0x20
+#define BENCH_PTR_ADDR 0x40
+
+// Loop counters - away from everything the instructions under test touch
+#define BENCH_INNER_COUNTER 0x07f0
+#define BENCH_OUTER_COUNTER 0x07f1
+
+enum class bench_region
+{
+    NONE,                               // no memory operand
+    RAM,
+    ROM,
+    IO,
+};
+
+struct bench_case
+{
+    uint8_t op_code;
+    bench_region region;
+};
+
+struct bench_result
+{
+    bench_case test;
+    const char *engine;
+    int64_t instructions;
+    double ns_per_instruction;
+};
+
+static const char *mode_name(nes_addr_mode mode)
+{
+    switch (mode)
+    {
+        case nes_addr_mode::ABS:     return "ABS";
+        case nes_addr_mode::ABSX:    return "ABSX";
+        case nes_addr_mode::ABSY:    return "ABSY";
+        case nes_addr_mode::ACC:     return "ACC";
+        case nes_addr_mode::IMD:     return "IMD";
+        case nes_addr_mode::IMP:     return "IMP";
+        case nes_addr_mode::IND:     return "IND";
+        case nes_addr_mode::IND_JMP: return "IND_JMP";
+        case nes_addr_mode::INDX:    return "INDX";
+        case nes_addr_mode::INDY:    return "INDY";
+        case nes_addr_mode::REL:     return "REL";
+        case nes_addr_mode::ZP:      return "ZP";
+        case nes_addr_mode::ZPX:     return "ZPX";
+        case nes_addr_mode::ZPY:     return "ZPY";
+        default:                     return "UNKNOWN";
+    }
+}
+
+static const char *region_name(bench_region region)
+{
+    switch (region)
+    {
+        case bench_region::RAM: return "RAM";
+        case bench_region::ROM: return "ROM";
+        case bench_region::IO:  return "IO";
+        default:                return "none";
+    }
+}
+
+// Handler behind each opcode - UNOFFICIAL/UNKNOWN have nothing worth timing
+#define BENCH_HANDLER_NAME(code, handler, ...) #handler,
+static const char *s_handler_names[0x100] = { NES_CPU_OPCODES(BENCH_HANDLER_NAME, BENCH_HANDLER_NAME) };
+
+static bool is_implemented(int op_code)
+{
+    return strcmp(s_handler_names[op_code], "UNOFFICIAL") != 0 && strcmp(s_handler_names[op_code], "UNKNOWN") != 0;
+}
+
+static bool is_control_flow(const char *name)
+{
+    static const char *s_names[] = { "BRK", "JSR", "RTS", "RTI" };
+    for (auto control : s_names)
+    {
+        if (strcmp(name, control) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+//
+// Every opcode the CPU implements, except those that leave the loop for good (BRK/JSR/RTS/RTI, JMP
+// indirect). Branches and JMP go to the next instruction, taken or not.
+//
+static std::vector<bench_case> make_cases()
+{
+    std::vector<bench_case> cases;
+    for (int op_code = 0; op_code < 0x100; ++op_code)
+    {
+        const opEntry &entry = opsTable[op_code];
+        if (entry.mode == nes_addr_mode::UNKNOWN || entry.mode == nes_addr_mode::IND || entry.mode == nes_addr_mode::IND_JMP ||
+            !is_implemented(op_code) || is_control_flow(entry.name))
+            continue;
+
+        switch (entry.mode)
+        {
+            case nes_addr_mode::ABS:
+                if (strcmp(entry.name, "JMP") == 0)
+                {
+                    cases.push_back({ uint8_t(op_code), bench_region::NONE });
+                    break;
+                }
+                // fall through
+            case nes_addr_mode::ABSX:
+            case nes_addr_mode::ABSY:
+            case nes_addr_mode::INDX:
+            case nes_addr_mode::INDY:
+                cases.push_back({ uint8_t(op_code), bench_region::RAM });
+                cases.push_back({ uint8_t(op_code), bench_region::ROM });
+                cases.push_back({ uint8_t(op_code), bench_region::IO });
+                break;
+            case nes_addr_mode::ZP:
+            case nes_addr_mode::ZPX:
+            case nes_addr_mode::ZPY:
+                cases.push_back({ uint8_t(op_code), bench_region::RAM });
+                break;
+            default:
+                cases.push_back({ uint8_t(op_code), bench_region::NONE });
+                break;
+        }
+    }
+
+    return cases;
+}
+
+static uint16_t region_addr(bench_region region)
+{
+    switch (region)
+    {
+        case bench_region::ROM: return BENCH_ROM_ADDR;
+        case bench_region::IO:  return BENCH_IO_ADDR;
+        default:                return BENCH_RAM_ADDR;
+    }
+}
+
+//
+// LDX #0, LDY #0
+// loop: NES_BENCH_COPIES x instruction
+//       DEC inner, BNE loop, DEC outer, BNE loop
+//       BRK
+//
+static void build_program(const bench_case &test, std::vector<uint8_t> &prg)
+{
+    const opEntry &entry = opsTable[test.op_code];
+    uint16_t target = region_addr(test.region);
+
+    std::vector<uint8_t> code = { 0xA2, 0x00, 0xA0, 0x00 };
+    uint16_t loop = BENCH_CODE_ADDR + code.size();
+    for (int i = 0; i < NES_BENCH_COPIES; ++i)
+    {
+        uint16_t pc = BENCH_CODE_ADDR + code.size();
+        code.push_back(test.op_code);
+        switch (entry.mode)
+        {
+            case nes_addr_mode::IMD:  code.push_back(0x01); break;
+            case nes_addr_mode::REL:  code.push_back(0x00); break;
+            case nes_addr_mode::ZP:
+            case nes_addr_mode::ZPX:
+            case nes_addr_mode::ZPY:  code.push_back(BENCH_ZP_ADDR); break;
+            case nes_addr_mode::INDX:
+            case nes_addr_mode::INDY: code.push_back(BENCH_PTR_ADDR); break;
+            case nes_addr_mode::ABS:
+            case nes_addr_mode::ABSX:
+            case nes_addr_mode::ABSY:
+            {
+                // JMP goes to the next instruction
+                uint16_t addr = (test.region == bench_region::NONE) ? uint16_t(pc + 3) : target;
+                code.push_back(uint8_t(addr));
+                code.push_back(uint8_t(addr >> 8));
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    // NES_BENCH_COPIES 3-byte instructions still leave the loop start within branch range
+    auto dec_bne = [&](uint16_t counter) {
+        code.insert(code.end(), { 0xCE, uint8_t(counter), uint8_t(counter >> 8) });
+        int offset = int(loop) - int(BENCH_CODE_ADDR + code.size() + 2);
+        code.insert(code.end(), { 0xD0, uint8_t(int8_t(offset)) });
+    };
+
+    dec_bne(BENCH_INNER_COUNTER);
+    dec_bne(BENCH_OUTER_COUNTER);
+    code.push_back(0x00);
+
+    prg.assign(0x8000, 0);
+    std::copy(code.begin(), code.end(), prg.begin());
+}
+
+static void load_case(nes_system &system, const bench_case &test)
+{
+    std::vector<uint8_t> prg;
+    build_program(test, prg);
+
+    system.init();
+    system.attach_rom(nes_rom_image::from_memory(std::move(prg), std::vector<uint8_t>(0x2000), 0, false));
+
+    // Zero page pointers for (ind,X)/(ind),Y - X and Y stay 0 unless the instruction itself changes them
+    uint16_t target = region_addr(test.region);
+    uint8_t ptr[] = { uint8_t(target), uint8_t(target >> 8) };
+    system.getMem()->set_bytes(BENCH_PTR_ADDR, ptr, sizeof(ptr));
+
+    // PPU register accesses let the PPU catch up - it must not raise NMIs while it does
+    system.getMem()->set_byte(0x2000, 0);
+
+    uint8_t counters[] = { 0, NES_BENCH_OUTER };
+    system.getMem()->set_bytes(BENCH_INNER_COUNTER, counters, sizeof(counters));
+
+    system.getCpu()->reg().PC = BENCH_CODE_ADDR;
+}
+
+static void run_to_brk(nes_system &system)
+{
+    // PPU register accesses can schedule events that cut step_to short - just carry on
+    while (!system.stop_requested())
+        system.getCpu()->step_to(nes_cycle_t::max());
+}
+
+static int64_t count_instructions(nes_system &system, const bench_case &test)
+{
+    load_case(system, test);
+
+    int64_t count = 0;
+    while (!system.stop_requested())
+    {
+        system.getCpu()->exec_one_instruction();
+        count++;
+    }
+
+    return count;
+}
+
+static double time_case(nes_system &system, const bench_case &test, nes_cpu_engine engine, int64_t instructions, int runs)
+{
+    double best_ns = 0;
+    for (int i = 0; i < runs; ++i)
+    {
+        load_case(system, test);
+        system.getCpu()->set_engine(engine);
+
+        auto start = std::chrono::steady_clock::now();
+        run_to_brk(system);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        if (i == 0 || ns < best_ns)
+            best_ns = ns;
+    }
+
+    return best_ns / double(instructions);
+}
+
+// Mean ns/instruction per key - for the summary
+struct bench_mean
+{
+    double total = 0;
+    int count = 0;
+};
+
+static void write_means(FILE *out, const char *name, const std::map<std::string, bench_mean> &means, bool last)
+{
+    fprintf(out, "      \"%s\": {", name);
+    bool first = true;
+    for (auto &it : means)
+    {
+        fprintf(out, "%s\"%s\": %.3f", first ? "" : ", ", it.first.c_str(), it.second.total / it.second.count);
+        first = false;
+    }
+    fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+static void write_json(FILE *out, const std::vector<bench_result> &results, const std::vector<const char *> &engines, int runs)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"nesemu2_cpu_bench\",\n");
+    fprintf(out, "  \"runs\": %d,\n", runs);
+    fprintf(out, "  \"copies_per_loop\": %d,\n", NES_BENCH_COPIES);
+
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const bench_result &result = results[i];
+        const opEntry &entry = opsTable[result.test.op_code];
+        fprintf(out, "    {\"engine\": \"%s\", \"opcode\": \"%02X\", \"mnemonic\": \"%s\", \"mode\": \"%s\", \"region\": \"%s\", "
+                     "\"instructions\": %lld, \"ns_per_instruction\": %.3f}%s\n",
+                result.engine, result.test.op_code, entry.name, mode_name(entry.mode), region_name(result.test.region),
+                (long long)result.instructions, result.ns_per_instruction, (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+
+    // Per engine means by mnemonic, addressing mode and memory region
+    fprintf(out, "  \"summary\": {\n");
+    for (size_t e = 0; e < engines.size(); ++e)
+    {
+        std::map<std::string, bench_mean> by_mnemonic, by_mode, by_region;
+        bench_mean overall;
+        for (auto &result : results)
+        {
+            if (strcmp(result.engine, engines[e]) != 0)
+                continue;
+
+            const opEntry &entry = opsTable[result.test.op_code];
+            for (auto *mean : { &by_mnemonic[entry.name], &by_mode[mode_name(entry.mode)],
+                                &by_region[region_name(result.test.region)], &overall })
+            {
+                mean->total += result.ns_per_instruction;
+                mean->count++;
+            }
+        }
+
+        fprintf(out, "    \"%s\": {\n", engines[e]);
+        fprintf(out, "      \"mean\": %.3f,\n", overall.count ? overall.total / overall.count : 0.0);
+        write_means(out, "mnemonic", by_mnemonic, false);
+        write_means(out, "mode", by_mode, false);
+        write_means(out, "region", by_region, true);
+        fprintf(out, "    }%s\n", (e + 1 < engines.size()) ? "," : "");
+    }
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 3;
+    const char *out_path = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            out_path = argv[++i];
+        else
+            runs = std::max(1, atoi(argv[i]));
+    }
+
+    auto system = std::make_unique<nes_system>();
+
+    struct { nes_cpu_engine engine; const char *name; } engines[] = {
+        { nes_cpu_engine::INTERPRETER, "interpreter" },
+        { nes_cpu_engine::BLOCK_CACHE, "block_cache" },
+        { nes_cpu_engine::JIT, "jit" },
+    };
+
+    // No JIT on this host - set_engine falls back
+    std::vector<const char *> engine_names;
+    for (auto &engine : engines)
+    {
+        system->getCpu()->set_engine(engine.engine);
+        if (system->getCpu()->engine() == engine.engine)
+            engine_names.push_back(engine.name);
+    }
+
+    std::vector<bench_result> results;
+    for (auto &test : make_cases())
+    {
+        int64_t instructions = count_instructions(*system, test);
+        for (auto &engine : engines)
+        {
+            if (std::find(engine_names.begin(), engine_names.end(), engine.name) == engine_names.end())
+                continue;
+            results.push_back({ test, engine.name, instructions, time_case(*system, test, engine.engine, instructions, runs) });
+        }
+    }
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "Cannot write %s\n", out_path);
+        return 1;
+    }
+
+    write_json(out, results, engine_names, runs);
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
@@ -26,4 +26,15 @@ static nes_cycle_t ms_to_nes_cycle(double ms)
     return nes_cycle_t(int64_t(NES_CLOCK_HZ / 1000 * ms));
 }
 
-#define PPU_SCANLINE_CYCLE nes_ppu_cycle_t(341)  
\ No newline at end of file
+#define PPU_SCANLINE_CYCLE nes_ppu_cycle_t(341)
+
+//
+// Where the PPU is in its frame at some master cycle
+//
+struct nes_ppu_position
+{
+    nes_cycle_t cycle;
+    int scanline;
+    int dot;
+    uint32_t frame;
+};  
\ No newline at end of file
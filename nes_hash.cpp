@@ -0,0 +1,171 @@
+#include <cstdio>
+#include <cstring>
+#include "nes_hash.h"
+
+//
+// CRC-32 (IEEE 802.3, reflected) - the one zip and every NES ROM database use
+//
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static uint32_t s_table[0x100];
+    static bool s_table_ready = false;
+    if (!s_table_ready)
+    {
+        for (uint32_t i = 0; i < 0x100; ++i)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+            s_table[i] = crc;
+        }
+        s_table_ready = true;
+    }
+
+    for (size_t i = 0; i < size; ++i)
+        crc = s_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+static uint32_t crc32(const uint8_t *data, size_t size)
+{
+    return ~crc32_update(0xffffffff, data, size);
+}
+
+//
+// SHA-1 (FIPS 180-4)
+//
+static inline uint32_t rotl(uint32_t val, int count)
+{
+    return (val << count) | (val >> (32 - count));
+}
+
+static void sha1_block(uint32_t (&h)[5], const uint8_t *block)
+{
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i)
+        w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16) | (uint32_t(block[i * 4 + 2]) << 8) | block[i * 4 + 3];
+    for (int i = 16; i < 80; ++i)
+        w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; ++i)
+    {
+        uint32_t f, k;
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotl(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+static void sha1(const uint8_t *data, size_t size, uint8_t (&digest)[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+    size_t done = 0;
+    for (; size - done >= 64; done += 64)
+        sha1_block(h, data + done);
+
+    // Last partial block, 0x80, zero padding and the length in bits - one or two blocks
+    uint8_t tail[128] = {};
+    size_t left = size - done;
+    memcpy(tail, data + done, left);
+    tail[left] = 0x80;
+    size_t tail_size = (left < 56) ? 64 : 128;
+    uint64_t bits = uint64_t(size) * 8;
+    for (int i = 0; i < 8; ++i)
+        tail[tail_size - 1 - i] = uint8_t(bits >> (i * 8));
+
+    for (size_t i = 0; i < tail_size; i += 64)
+        sha1_block(h, tail + i);
+
+    for (int i = 0; i < 5; ++i)
+    {
+        digest[i * 4] = uint8_t(h[i] >> 24);
+        digest[i * 4 + 1] = uint8_t(h[i] >> 16);
+        digest[i * 4 + 2] = uint8_t(h[i] >> 8);
+        digest[i * 4 + 3] = uint8_t(h[i]);
+    }
+}
+
+nes_rom_hash nes_hash_rom(const uint8_t *data, size_t size)
+{
+    nes_rom_hash hash;
+    hash.crc32 = crc32(data, size);
+    sha1(data, size, hash.sha1);
+    return hash;
+}
+
+#define NES_SAMPLE_COUNT 64
+#define NES_SAMPLE_SIZE 64
+
+uint32_t nes_hash_samples(const uint8_t *data, size_t size)
+{
+    if (size <= NES_SAMPLE_COUNT * NES_SAMPLE_SIZE)
+        return crc32(data, size);
+
+    // The first sample is at the start and the last one ends at the end
+    uint32_t crc = 0xffffffff;
+    size_t stride = (size - NES_SAMPLE_SIZE) / (NES_SAMPLE_COUNT - 1);
+    for (int i = 0; i < NES_SAMPLE_COUNT - 1; ++i)
+        crc = crc32_update(crc, data + i * stride, NES_SAMPLE_SIZE);
+    crc = crc32_update(crc, data + size - NES_SAMPLE_SIZE, NES_SAMPLE_SIZE);
+    return ~crc;
+}
+
+std::string nes_rom_hash::sha1_hex() const
+{
+    char hex[sizeof(sha1) * 2 + 1];
+    for (size_t i = 0; i < sizeof(sha1); ++i)
+        snprintf(hex + i * 2, 3, "%02x", sha1[i]);
+
+    return hex;
+}
+
+bool nes_rom_hash::operator==(const nes_rom_hash &other) const
+{
+    return crc32 == other.crc32 && memcmp(sha1, other.sha1, sizeof(sha1)) == 0;
+}
+
+bool nes_parse_sha1_hex(const char *hex, uint8_t (&sha1)[20])
+{
+    for (size_t i = 0; i < sizeof(sha1); ++i)
+    {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1)
+            return false;
+        sha1[i] = uint8_t(byte);
+    }
+
+    return true;
+}
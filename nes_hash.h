@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+//
+// Content hashes identifying a ROM - CRC32 is what header databases are keyed by, SHA-1 is what the
+// registry (see nes_rom_registry.h) trusts not to collide
+//
+struct nes_rom_hash
+{
+    uint32_t crc32;
+    uint8_t sha1[20];
+
+    // 40 lowercase hex digits
+    std::string sha1_hex() const;
+
+    bool operator==(const nes_rom_hash &other) const;
+};
+
+// Computes both hashes over [data, data + size)
+nes_rom_hash nes_hash_rom(const uint8_t *data, size_t size);
+
+//
+// CRC32 of 64 bytes at 64 evenly spaced places in [data, data + size) - all of it when it is smaller. Cheap
+// enough to check on every open that a file is still what was hashed before, rather than rewritten since
+//
+uint32_t nes_hash_samples(const uint8_t *data, size_t size);
+
+// Parses nes_rom_hash::sha1_hex() output back - false if it isn't one
+bool nes_parse_sha1_hex(const char *hex, uint8_t (&sha1)[20]);
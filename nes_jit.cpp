@@ -0,0 +1,1001 @@
+#include <cassert>
+#include <cstring>
+#include <vector>
+#include "nes_jit.h"
+#include "nes_cpu.h"
+#include "opcodes.h"
+
+#ifdef NES_JIT_X64
+#include <algorithm>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+enum x64_reg { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+enum x64_cond { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_GE = 0xd, CC_LE = 0xe };
+
+// The /digit of the immediate form - the register form opcode is op * 8 + 1
+enum x64_alu { ALU_ADD = 0, ALU_OR = 1, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7 };
+
+//
+// Just enough of an x86-64 assembler for the JIT
+// Register operations are 32-bit unless they say otherwise
+//
+class x64_emitter
+{
+public :
+    x64_emitter(uint8_t *start, size_t size) : _start(start), _cur(start), _end(start + size), _overflow(false) {}
+
+    uint8_t *cur() const { return _cur; }
+    size_t size() const { return _cur - _start; }
+    bool overflow() const { return _overflow; }
+
+    void mov(x64_reg dst, x64_reg src) { rex(false, src, 0, dst); byte(0x89); modrm(src, dst); }
+    void mov(x64_reg dst, uint32_t imm) { rex(false, 0, 0, dst); byte(0xb8 + (dst & 7)); dword(imm); }
+    void mov64(x64_reg dst, x64_reg src) { rex(true, src, 0, dst); byte(0x89); modrm(src, dst); }
+    void mov64(x64_reg dst, uint64_t imm) { rex(true, 0, 0, dst); byte(0xb8 + (dst & 7)); qword(imm); }
+
+    void alu(x64_alu op, x64_reg dst, x64_reg src) { rex(false, src, 0, dst); byte(op * 8 + 1); modrm(src, dst); }
+    void alu(x64_alu op, x64_reg dst, int32_t imm) { rex(false, 0, 0, dst); alu_imm(op, dst, imm); }
+    void alu64(x64_alu op, x64_reg dst, int32_t imm) { rex(true, 0, 0, dst); alu_imm(op, dst, imm); }
+    void test64(x64_reg a, x64_reg b) { rex(true, b, 0, a); byte(0x85); modrm(b, a); }
+    void shl(x64_reg dst, uint8_t count) { rex(false, 0, 0, dst); byte(0xc1); modrm(4, dst); byte(count); }
+    void shr(x64_reg dst, uint8_t count) { rex(false, 0, 0, dst); byte(0xc1); modrm(5, dst); byte(count); }
+    void bt(x64_reg src, uint8_t bit) { rex(false, 0, 0, src); byte(0x0f); byte(0xba); modrm(4, src); byte(bit); }
+    void setcc(x64_cond cc, x64_reg dst) { rex(false, 0, 0, dst, true); byte(0x0f); byte(0x90 + cc); modrm(0, dst); }
+    void movzx8(x64_reg dst, x64_reg src) { rex(false, dst, 0, src, true); byte(0x0f); byte(0xb6); modrm(dst, src); }
+
+    // [base + disp]
+    void load8(x64_reg dst, x64_reg base, int32_t disp) { rex(false, dst, 0, base); byte(0x0f); byte(0xb6); mem(dst, base, disp); }
+    void store8(x64_reg base, int32_t disp, x64_reg src) { rex(false, src, 0, base, true); byte(0x88); mem(src, base, disp); }
+    void store8(x64_reg base, int32_t disp, uint8_t imm) { rex(false, 0, 0, base); byte(0xc6); mem(0, base, disp); byte(imm); }
+    void or8(x64_reg base, int32_t disp, x64_reg src) { rex(false, src, 0, base, true); byte(0x08); mem(src, base, disp); }
+    void cmp8(x64_reg base, int32_t disp, uint8_t imm) { rex(false, 0, 0, base); byte(0x80); mem(7, base, disp); byte(imm); }
+    void store16(x64_reg base, int32_t disp, x64_reg src) { byte(0x66); rex(false, src, 0, base); byte(0x89); mem(src, base, disp); }
+    void store16(x64_reg base, int32_t disp, uint16_t imm) { byte(0x66); rex(false, 0, 0, base); byte(0xc7); mem(0, base, disp); word(imm); }
+    void load32(x64_reg dst, x64_reg base, int32_t disp) { rex(false, dst, 0, base); byte(0x8b); mem(dst, base, disp); }
+    void store32(x64_reg base, int32_t disp, x64_reg src) { rex(false, src, 0, base); byte(0x89); mem(src, base, disp); }
+    void or32(x64_reg dst, x64_reg base, int32_t disp) { rex(false, dst, 0, base); byte(0x0b); mem(dst, base, disp); }
+    void load64(x64_reg dst, x64_reg base, int32_t disp) { rex(true, dst, 0, base); byte(0x8b); mem(dst, base, disp); }
+    void sub64(x64_reg dst, x64_reg base, int32_t disp) { rex(true, dst, 0, base); byte(0x2b); mem(dst, base, disp); }
+    void cmp64(x64_reg reg, x64_reg base, int32_t disp) { rex(true, reg, 0, base); byte(0x3b); mem(reg, base, disp); }
+    void add64(x64_reg base, int32_t disp, int32_t imm) { rex(true, 0, 0, base); byte(0x81); mem(ALU_ADD, base, disp); dword(imm); }
+    void sub64(x64_reg base, int32_t disp, int32_t imm) { rex(true, 0, 0, base); byte(0x81); mem(ALU_SUB, base, disp); dword(imm); }
+
+    // [base + index * 1] and [base + index * 8]
+    void load8(x64_reg dst, x64_reg base, x64_reg index) { rex(false, dst, index, base); byte(0x0f); byte(0xb6); sib(dst, base, index, 0); }
+    void store8(x64_reg base, x64_reg index, x64_reg src) { rex(false, src, index, base, true); byte(0x88); sib(src, base, index, 0); }
+    void load64(x64_reg dst, x64_reg base, x64_reg index) { rex(true, dst, index, base); byte(0x8b); sib(dst, base, index, 3); }
+
+    void push(x64_reg reg) { rex(false, 0, 0, reg); byte(0x50 + (reg & 7)); }
+    void pop(x64_reg reg) { rex(false, 0, 0, reg); byte(0x58 + (reg & 7)); }
+    void ret() { byte(0xc3); }
+    void call(const void *target) { mov64(RAX, uint64_t(target)); byte(0xff); modrm(2, RAX); }
+
+    // Forward jumps return the location of their displacement for bind()
+    uint8_t *jcc(x64_cond cc) { byte(0x0f); byte(0x80 + cc); return rel32(); }
+    uint8_t *jmp() { byte(0xe9); return rel32(); }
+    void jmp(uint8_t *target) { byte(0xe9); dword(uint32_t(target - (_cur + 4))); }
+
+    // Points the jump at the current position
+    void bind(uint8_t *site) { bind(site, _cur); }
+    void bind(uint8_t *site, uint8_t *target)
+    {
+        if (_overflow)
+            return;
+
+        int32_t rel = int32_t(target - (site + 4));
+        memcpy(site, &rel, sizeof(rel));
+    }
+
+private :
+    void byte(uint8_t val)
+    {
+        if (_cur < _end)
+            *_cur++ = val;
+        else
+            _overflow = true;
+    }
+    void word(uint16_t val) { byte(val); byte(val >> 8); }
+    void dword(uint32_t val) { word(val); word(val >> 16); }
+    void qword(uint64_t val) { dword(val); dword(val >> 32); }
+
+    uint8_t *rel32()
+    {
+        uint8_t *site = _cur;
+        dword(0);
+        return site;
+    }
+
+    void rex(bool w, int reg, int index, int base, bool force = false)
+    {
+        uint8_t prefix = 0x40 | (w ? 0x8 : 0) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+        if (prefix != 0x40 || force)
+            byte(prefix);
+    }
+
+    void modrm(int reg, int rm) { byte(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+
+    void mem(int reg, int base, int32_t disp)
+    {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP)
+            byte(0x24);
+        dword(uint32_t(disp));
+    }
+
+    void sib(int reg, int base, int index, int scale)
+    {
+        assert((base & 7) != RBP);
+        byte(0x04 | ((reg & 7) << 3));
+        byte((scale << 6) | ((index & 7) << 3) | (base & 7));
+    }
+
+    void alu_imm(x64_alu op, x64_reg dst, int32_t imm)
+    {
+        if (imm >= -128 && imm <= 127)
+        {
+            byte(0x83);
+            modrm(op, dst);
+            byte(uint8_t(imm));
+        }
+        else
+        {
+            byte(0x81);
+            modrm(op, dst);
+            dword(uint32_t(imm));
+        }
+    }
+
+private :
+    uint8_t *_start;
+    uint8_t *_cur;
+    uint8_t *_end;
+    bool _overflow;
+};
+
+//
+// What the interpreter handler of each opcode does - mirrors the handler names in NES_CPU_OPCODES
+//
+enum class jit_op
+{
+    ADC, ADC_IMD, AND, AND_IND, ASL, ASL_ACC, BCC, BCS, BEQ, BIT, BMI, BNE, BPL, BRK, BVC, BVS, CLC, CLD, CLI,
+    CLV, CMP, CMP_IND, CPX, CPX_IMD, CPY, CPY_IMD, DEC, DEX, DEY, EOR, EOR_IND, INC, INX, INY, ISC, JMP, JSR,
+    LAX, LDA, LDA_ABS, LDX, LDX_ABS, LDY, LDY_ABS, LSR, LSR_ACC, NOP, ORA, ORA_IND, PHA, PHP, PLA, PLP, ROL,
+    ROL_ACC, ROR, ROR_ACC, RTI, RTS, SBC, SBC_IMD, SEC, SED, SEI, STA, STX, STY, TAX, TAY, TSX, TXA, TXS, TYA,
+    UNKNOWN, UNOFFICIAL,
+};
+
+#define JIT_OP(code, handler, mode) jit_op::handler,
+#define JIT_IMP(code, handler) jit_op::handler,
+
+const jit_op s_jit_ops[0x100] = { NES_CPU_OPCODES(JIT_OP, JIT_IMP) };
+
+#define JIT_OP_MODE(code, handler, mode) nes_addr_mode::mode,
+#define JIT_IMP_MODE(code, handler) nes_addr_mode::IMP,
+
+const nes_addr_mode s_jit_modes[0x100] = { NES_CPU_OPCODES(JIT_OP_MODE, JIT_IMP_MODE) };
+
+// Instructions that change PC - always the last one of a block
+bool ends_block(jit_op kind)
+{
+    switch (kind)
+    {
+        case jit_op::BCC: case jit_op::BCS: case jit_op::BEQ: case jit_op::BMI:
+        case jit_op::BNE: case jit_op::BPL: case jit_op::BVC: case jit_op::BVS:
+        case jit_op::JMP: case jit_op::JSR: case jit_op::RTS: case jit_op::RTI:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Where the 6502 lives while native code runs - all callee-saved so calls back into C++ keep them
+const x64_reg REG_CPU = RBX;
+const x64_reg REG_A = R12;
+const x64_reg REG_X = R13;
+const x64_reg REG_Y = R14;
+const x64_reg REG_P = R15;
+const x64_reg REG_SP = RBP;
+
+// Stack frame - keeps rsp 16-byte aligned for calls after the 6 pushes
+const int32_t FRAME_EXIT = 0;       // byte - a call back lowered the deadline, stop after this instruction
+const int32_t FRAME_ADDR = 8;       // address saved across slow path calls
+const int32_t FRAME_TEMP = 16;      // low byte of 16-bit pointers
+const int32_t FRAME_SIZE = 24;
+
+uint32_t jit_read(nes_cpu *cpu, uint32_t addr)
+{
+    return cpu->read_byte(addr);
+}
+
+void jit_write(nes_cpu *cpu, uint32_t addr, uint32_t val)
+{
+    cpu->set_byte(addr, val);
+}
+
+} // namespace
+
+//
+// Compiles one block - all code generation lives here
+// Cycles are tracked at compile time: the main path only updates the cycle count when calling back into C++,
+// which needs it to be exact (PPU catch-up, DMA scheduling)
+//
+class nes_jit_compiler
+{
+public :
+    nes_jit_compiler(x64_emitter &e, nes_cpu &cpu, const nes_block &block)
+        : e(e), _cpu(cpu), _block(block), _before(0), _committed(0), _op_cycles(0), _called_out(false)
+    {
+    }
+
+    void compile();
+
+private :
+    // Handlers work on nes_cpu's lazy flags, native code on registers.P
+    static void call_handler(nes_cpu *cpu, nes_decoded_handler handler, uint32_t raw)
+    {
+        cpu->set_status(cpu->_state.registers.P);
+        handler(*cpu, raw);
+        cpu->_state.registers.P = cpu->get_status();
+    }
+
+    enum class pc_mode { IMM, RAX, KEEP };
+
+    struct slow_path
+    {
+        uint8_t *site;
+        uint8_t *resume;
+        int32_t delta;              // cycles to commit before calling back
+        int32_t op_cycles;          // cycles of the instruction making the call
+        bool write;
+    };
+
+    struct exit_path
+    {
+        uint8_t *site;
+        uint16_t pc;
+        int32_t cycles;             // cycles not committed yet
+    };
+
+    int32_t disp(const void *field) { return int32_t((const uint8_t *)field - (const uint8_t *)&_cpu); }
+    int32_t disp_cycle() { return disp(&_cpu._state.cycle); }
+    int32_t disp_deadline() { return disp(&_cpu._deadline); }
+
+    void prologue();
+    void epilogue();
+    void store_registers();
+    void load_registers();
+    void emit_exit(pc_mode mode, uint16_t pc, int32_t cycles);
+
+    void compile_op(const nes_decoded_op &op, bool last, int32_t cycles);
+    bool compile_native(jit_op kind, nes_addr_mode mode, const nes_decoded_op &op, int32_t cycles);
+    void compile_fallback(const nes_decoded_op &op, bool last, int32_t cycles);
+    void compile_branch(const nes_decoded_op &op, int bit, bool taken_if_set, int32_t cycles);
+
+    void read();
+    void write();
+    void address(nes_addr_mode mode, uint16_t raw);
+    void load_operand(nes_addr_mode mode, uint16_t raw);
+    void read_zp_pointer();
+    void push();
+    void pop();
+    void set_nz(x64_reg reg);
+    void set_nz(uint8_t val);
+    void set_carry(x64_reg bit);
+    void adc();
+    void compare(x64_reg reg);
+    void shift(jit_op kind);
+
+private :
+    x64_emitter &e;
+    nes_cpu &_cpu;
+    const nes_block &_block;
+    uint8_t *_body;
+    int32_t _before;                // master cycles of the instructions before the current one
+    int32_t _committed;             // master cycles already added to the cycle count on the main path
+    int32_t _op_cycles;             // master cycles of the current instruction
+    bool _called_out;               // current instruction called back into C++
+    std::vector<slow_path> _slow_paths;
+    std::vector<exit_path> _exit_paths;
+};
+
+void nes_jit_compiler::compile()
+{
+    prologue();
+    _body = e.cur();
+
+    for (int i = 0; i < _block.count; ++i)
+    {
+        const nes_decoded_op &op = _block.ops[i];
+        int32_t cycles = int32_t(nes_cycle_t(nes_cpu_cycle_t(op.cycles)).count());
+        bool last = (i == _block.count - 1);
+
+        _called_out = false;
+        _op_cycles = cycles;
+        compile_op(op, last, cycles);
+        _before += cycles;
+
+        if (last)
+            break;
+
+        // Something lowered the deadline - stop right after this instruction just like the interpreter
+        if (_called_out)
+        {
+            e.cmp8(RSP, FRAME_EXIT, 0);
+            _exit_paths.push_back({ e.jcc(CC_NE), op.next_pc, _before - _committed });
+        }
+    }
+
+    // Out of line code - slow paths of the inlined memory accesses and early exits
+    for (auto &slow : _slow_paths)
+    {
+        e.bind(slow.site);
+        e.store32(RSP, FRAME_ADDR, RSI);
+        if (slow.delta)
+            e.add64(REG_CPU, disp_cycle(), slow.delta);
+        e.mov64(RDI, REG_CPU);
+        if (slow.write)
+        {
+            e.mov(RDX, RCX);
+            e.call((const void *)&jit_write);
+        }
+        else
+        {
+            e.call((const void *)&jit_read);
+        }
+        e.load32(RSI, RSP, FRAME_ADDR);
+
+        // The cycle count is exact right now - see if the interpreter would stop after this instruction
+        e.load64(RCX, REG_CPU, disp_cycle());
+        e.alu64(ALU_ADD, RCX, slow.op_cycles);
+        e.cmp64(RCX, REG_CPU, disp_deadline());
+        e.setcc(CC_GE, RCX);
+        e.or8(RSP, FRAME_EXIT, RCX);
+
+        if (slow.delta)
+            e.sub64(REG_CPU, disp_cycle(), slow.delta);
+        e.jmp(slow.resume);
+    }
+
+    for (auto &exit : _exit_paths)
+    {
+        e.bind(exit.site);
+        emit_exit(pc_mode::IMM, exit.pc, exit.cycles);
+    }
+}
+
+void nes_jit_compiler::prologue()
+{
+    e.push(RBX);
+    e.push(RBP);
+    e.push(R12);
+    e.push(R13);
+    e.push(R14);
+    e.push(R15);
+    e.alu64(ALU_SUB, RSP, FRAME_SIZE);
+    e.mov64(REG_CPU, RDI);
+    load_registers();
+    e.store8(RSP, FRAME_EXIT, uint8_t(0));
+}
+
+void nes_jit_compiler::epilogue()
+{
+    e.alu64(ALU_ADD, RSP, FRAME_SIZE);
+    e.pop(R15);
+    e.pop(R14);
+    e.pop(R13);
+    e.pop(R12);
+    e.pop(RBP);
+    e.pop(RBX);
+    e.ret();
+}
+
+void nes_jit_compiler::store_registers()
+{
+    auto &regs = _cpu._state.registers;
+    e.store8(REG_CPU, disp(&regs.A), REG_A);
+    e.store8(REG_CPU, disp(&regs.X), REG_X);
+    e.store8(REG_CPU, disp(&regs.Y), REG_Y);
+    e.store8(REG_CPU, disp(&regs.P), REG_P);
+    e.store8(REG_CPU, disp(&regs.SP), REG_SP);
+}
+
+void nes_jit_compiler::load_registers()
+{
+    auto &regs = _cpu._state.registers;
+    e.load8(REG_A, REG_CPU, disp(&regs.A));
+    e.load8(REG_X, REG_CPU, disp(&regs.X));
+    e.load8(REG_Y, REG_CPU, disp(&regs.Y));
+    e.load8(REG_P, REG_CPU, disp(&regs.P));
+    e.load8(REG_SP, REG_CPU, disp(&regs.SP));
+}
+
+void nes_jit_compiler::emit_exit(pc_mode mode, uint16_t pc, int32_t cycles)
+{
+    store_registers();
+    if (mode == pc_mode::IMM)
+        e.store16(REG_CPU, disp(&_cpu._state.registers.PC), pc);
+    else if (mode == pc_mode::RAX)
+        e.store16(REG_CPU, disp(&_cpu._state.registers.PC), RAX);
+    if (cycles)
+        e.add64(REG_CPU, disp_cycle(), cycles);
+    epilogue();
+}
+
+void nes_jit_compiler::compile_op(const nes_decoded_op &op, bool last, int32_t cycles)
+{
+    jit_op kind = s_jit_ops[op.op_code];
+    nes_addr_mode mode = s_jit_modes[op.op_code];
+
+    if (!compile_native(kind, mode, op, cycles))
+        compile_fallback(op, last, cycles);
+    else if (last && !ends_block(kind))
+        emit_exit(pc_mode::IMM, op.next_pc, _before + cycles - _committed);
+}
+
+//
+// Calls the interpreter handler with the registers written back and PC/cycles up to date
+//
+void nes_jit_compiler::compile_fallback(const nes_decoded_op &op, bool last, int32_t cycles)
+{
+    store_registers();
+    e.store16(REG_CPU, disp(&_cpu._state.registers.PC), op.next_pc);
+    if (_before != _committed)
+        e.add64(REG_CPU, disp_cycle(), _before - _committed);
+    _committed = _before;
+
+    e.mov64(RDI, REG_CPU);
+    e.mov64(RSI, uint64_t(op.handler));
+    e.mov(RDX, uint32_t(op.raw));
+    e.call((const void *)&call_handler);
+    load_registers();
+
+    if (last)
+    {
+        // The handler may have jumped - PC is already where it should be
+        emit_exit(pc_mode::KEEP, 0, _before + cycles - _committed);
+        return;
+    }
+
+    e.load64(RAX, REG_CPU, disp_cycle());
+    e.alu64(ALU_ADD, RAX, cycles);
+    e.cmp64(RAX, REG_CPU, disp_deadline());
+    _exit_paths.push_back({ e.jcc(CC_GE), op.next_pc, _before + cycles - _committed });
+}
+
+//
+// Returns false if the instruction has to go through its interpreter handler
+//
+bool nes_jit_compiler::compile_native(jit_op kind, nes_addr_mode mode, const nes_decoded_op &op, int32_t cycles)
+{
+    switch (kind)
+    {
+        case jit_op::LDA: case jit_op::LDX: case jit_op::LDY:
+        {
+            x64_reg reg = (kind == jit_op::LDA) ? REG_A : (kind == jit_op::LDX) ? REG_X : REG_Y;
+            e.mov(reg, uint32_t(op.raw & 0xff));
+            set_nz(uint8_t(op.raw));
+            return true;
+        }
+        case jit_op::LDA_ABS: case jit_op::LDX_ABS: case jit_op::LDY_ABS:
+        {
+            x64_reg reg = (kind == jit_op::LDA_ABS) ? REG_A : (kind == jit_op::LDX_ABS) ? REG_X : REG_Y;
+            load_operand(mode, op.raw);
+            e.mov(reg, RAX);
+            set_nz(reg);
+            return true;
+        }
+        case jit_op::STA: case jit_op::STX: case jit_op::STY:
+        {
+            x64_reg reg = (kind == jit_op::STA) ? REG_A : (kind == jit_op::STX) ? REG_X : REG_Y;
+            address(mode, op.raw);
+            e.mov(RCX, reg);
+            write();
+            return true;
+        }
+        case jit_op::ORA: case jit_op::ORA_IND:
+        case jit_op::AND: case jit_op::AND_IND:
+        case jit_op::EOR: case jit_op::EOR_IND:
+        {
+            x64_alu alu = (kind == jit_op::ORA || kind == jit_op::ORA_IND) ? ALU_OR :
+                          (kind == jit_op::AND || kind == jit_op::AND_IND) ? ALU_AND : ALU_XOR;
+            load_operand(mode, op.raw);
+            e.alu(alu, REG_A, RAX);
+            set_nz(REG_A);
+            return true;
+        }
+        case jit_op::ADC: case jit_op::ADC_IMD:
+            load_operand(mode, op.raw);
+            e.mov(RSI, RAX);
+            adc();
+            return true;
+        case jit_op::SBC: case jit_op::SBC_IMD:
+            load_operand(mode, op.raw);
+            e.mov(RSI, RAX);
+            e.alu(ALU_XOR, RSI, 0xff);
+            adc();
+            return true;
+        case jit_op::CMP: case jit_op::CMP_IND:
+            load_operand(mode, op.raw);
+            compare(REG_A);
+            return true;
+        case jit_op::CPX: case jit_op::CPX_IMD:
+            load_operand(mode, op.raw);
+            compare(REG_X);
+            return true;
+        case jit_op::CPY: case jit_op::CPY_IMD:
+            load_operand(mode, op.raw);
+            compare(REG_Y);
+            return true;
+        case jit_op::BIT:
+            load_operand(mode, op.raw);
+            e.alu(ALU_AND, REG_P, 0x3d);
+            e.mov(RCX, RAX);
+            e.alu(ALU_AND, RCX, 0xc0);
+            e.alu(ALU_OR, REG_P, RCX);
+            e.alu(ALU_AND, RAX, REG_A);
+            e.setcc(CC_E, RCX);
+            e.movzx8(RCX, RCX);
+            e.alu(ALU_ADD, RCX, RCX);
+            e.alu(ALU_OR, REG_P, RCX);
+            return true;
+        case jit_op::INC: case jit_op::DEC:
+            address(mode, op.raw);
+            read();
+            e.alu(kind == jit_op::INC ? ALU_ADD : ALU_SUB, RAX, 1);
+            e.alu(ALU_AND, RAX, 0xff);
+            set_nz(RAX);
+            e.mov(RCX, RAX);
+            write();
+            return true;
+        case jit_op::ASL: case jit_op::LSR: case jit_op::ROL: case jit_op::ROR:
+            address(mode, op.raw);
+            read();
+            shift(kind);
+            set_nz(RAX);
+            e.mov(RCX, RAX);
+            write();
+            return true;
+        case jit_op::ASL_ACC: case jit_op::LSR_ACC: case jit_op::ROL_ACC: case jit_op::ROR_ACC:
+            e.mov(RAX, REG_A);
+            shift(kind == jit_op::ASL_ACC ? jit_op::ASL : kind == jit_op::LSR_ACC ? jit_op::LSR :
+                  kind == jit_op::ROL_ACC ? jit_op::ROL : jit_op::ROR);
+            set_nz(RAX);
+            e.mov(REG_A, RAX);
+            return true;
+        case jit_op::INX: case jit_op::INY: case jit_op::DEX: case jit_op::DEY:
+        {
+            x64_reg reg = (kind == jit_op::INX || kind == jit_op::DEX) ? REG_X : REG_Y;
+            e.alu((kind == jit_op::INX || kind == jit_op::INY) ? ALU_ADD : ALU_SUB, reg, 1);
+            e.alu(ALU_AND, reg, 0xff);
+            set_nz(reg);
+            return true;
+        }
+        case jit_op::TAX: e.mov(REG_X, REG_A); set_nz(REG_X); return true;
+        case jit_op::TAY: e.mov(REG_Y, REG_A); set_nz(REG_Y); return true;
+        case jit_op::TXA: e.mov(REG_A, REG_X); set_nz(REG_A); return true;
+        case jit_op::TYA: e.mov(REG_A, REG_Y); set_nz(REG_A); return true;
+        case jit_op::TSX: e.mov(REG_X, REG_SP); set_nz(REG_X); return true;
+        case jit_op::TXS: e.mov(REG_SP, REG_X); return true;
+        case jit_op::CLC: e.alu(ALU_AND, REG_P, ~PROCESSOR_STATUS_CARRY_MASK); return true;
+        case jit_op::SEC: e.alu(ALU_OR, REG_P, PROCESSOR_STATUS_CARRY_MASK); return true;
+        case jit_op::CLI: e.alu(ALU_AND, REG_P, ~PROCESSOR_STATUS_INTERRUPT_MASK); return true;
+        case jit_op::SEI: e.alu(ALU_OR, REG_P, PROCESSOR_STATUS_INTERRUPT_MASK); return true;
+        case jit_op::CLD: e.alu(ALU_AND, REG_P, ~PROCESSOR_STATUS_ADC_MASK); return true;
+        case jit_op::SED: e.alu(ALU_OR, REG_P, PROCESSOR_STATUS_ADC_MASK); return true;
+        case jit_op::CLV: e.alu(ALU_AND, REG_P, ~PROCESSOR_STATUS_OVERFLOW_MASK); return true;
+        case jit_op::NOP:
+        case jit_op::UNOFFICIAL:
+            // Only decodes its operand, which has no side effects
+            return true;
+        case jit_op::PHA:
+            e.mov(RCX, REG_A);
+            push();
+            return true;
+        case jit_op::PHP:
+            e.mov(RCX, REG_P);
+            e.alu(ALU_OR, RCX, 0x30);
+            push();
+            return true;
+        case jit_op::PLA:
+            pop();
+            e.mov(REG_A, RAX);
+            set_nz(REG_A);
+            return true;
+        case jit_op::PLP:
+            // See nes_cpu::PLP - B is preserved and bit 5 always set
+            pop();
+            e.alu(ALU_AND, RAX, 0xef);
+            e.alu(ALU_AND, REG_P, 0x10);
+            e.alu(ALU_OR, REG_P, RAX);
+            e.alu(ALU_OR, REG_P, 0x20);
+            return true;
+        case jit_op::BCC: compile_branch(op, 0, false, cycles); return true;
+        case jit_op::BCS: compile_branch(op, 0, true, cycles); return true;
+        case jit_op::BNE: compile_branch(op, 1, false, cycles); return true;
+        case jit_op::BEQ: compile_branch(op, 1, true, cycles); return true;
+        case jit_op::BVC: compile_branch(op, 6, false, cycles); return true;
+        case jit_op::BVS: compile_branch(op, 6, true, cycles); return true;
+        case jit_op::BPL: compile_branch(op, 7, false, cycles); return true;
+        case jit_op::BMI: compile_branch(op, 7, true, cycles); return true;
+        case jit_op::JMP:
+            if (mode != nes_addr_mode::ABS)
+                return false;
+            emit_exit(pc_mode::IMM, op.raw, _before + cycles - _committed);
+            return true;
+        case jit_op::JSR:
+        {
+            uint16_t ret_addr = op.next_pc - 1;
+            e.mov(RCX, uint32_t(ret_addr >> 8));
+            push();
+            e.mov(RCX, uint32_t(ret_addr & 0xff));
+            push();
+            emit_exit(pc_mode::IMM, op.raw, _before + cycles - _committed);
+            return true;
+        }
+        case jit_op::RTI:
+            pop();
+            e.alu(ALU_AND, RAX, 0xef);
+            e.alu(ALU_AND, REG_P, 0x10);
+            e.alu(ALU_OR, REG_P, RAX);
+            e.alu(ALU_OR, REG_P, 0x20);
+            [[fallthrough]];
+        case jit_op::RTS:
+            pop();
+            e.store32(RSP, FRAME_TEMP, RAX);
+            pop();
+            e.shl(RAX, 8);
+            e.or32(RAX, RSP, FRAME_TEMP);
+            if (kind == jit_op::RTS)
+                e.alu(ALU_ADD, RAX, 1);
+            e.alu(ALU_AND, RAX, 0xffff);
+            emit_exit(pc_mode::RAX, 0, _before + cycles - _committed);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void nes_jit_compiler::compile_branch(const nes_decoded_op &op, int bit, bool taken_if_set, int32_t cycles)
+{
+    uint16_t target = op.next_pc + uint16_t(int8_t(op.raw));
+    int32_t remaining = _before + cycles - _committed;
+
+    e.bt(REG_P, bit);
+    uint8_t *taken = e.jcc(taken_if_set ? CC_B : CC_AE);
+    emit_exit(pc_mode::IMM, op.next_pc, remaining);
+
+    e.bind(taken);
+    if (target == _block.pc && _committed == 0)
+    {
+        // Loops back to itself - keep going while the whole block still fits before the deadline, without
+        // leaving native code
+        e.add64(REG_CPU, disp_cycle(), remaining);
+        e.load64(RAX, REG_CPU, disp_deadline());
+        e.sub64(RAX, REG_CPU, disp_cycle());
+        e.alu64(ALU_CMP, RAX, _block.lead_cycles);
+        uint8_t *done = e.jcc(CC_LE);
+        e.jmp(_body);
+        e.bind(done);
+        emit_exit(pc_mode::IMM, target, 0);
+    }
+    else
+    {
+        emit_exit(pc_mode::IMM, target, remaining);
+    }
+}
+
+//
+// Memory - the inlined fast path is nes_memory::get_byte/set_byte, pages without a host pointer go to the
+// slow path which calls back into nes_cpu
+//
+
+// [ESI] -> EAX, keeps ESI
+void nes_jit_compiler::read()
+{
+    e.mov(RAX, RSI);
+    e.shr(RAX, NES_PAGE_SHIFT);
+    e.mov64(RDX, uint64_t(_cpu.memory->_read_pages));
+    e.load64(RDX, RDX, RAX);
+    e.test64(RDX, RDX);
+    uint8_t *slow = e.jcc(CC_E);
+    e.movzx8(RCX, RSI);
+    e.load8(RAX, RDX, RCX);
+    _slow_paths.push_back({ slow, e.cur(), _before - _committed, _op_cycles, false });
+    _called_out = true;
+}
+
+// ECX -> [ESI]
+void nes_jit_compiler::write()
+{
+    e.mov(RAX, RSI);
+    e.shr(RAX, NES_PAGE_SHIFT);
+    e.mov64(RDX, uint64_t(_cpu.memory->_write_pages));
+    e.load64(RDX, RDX, RAX);
+    e.test64(RDX, RDX);
+    uint8_t *slow = e.jcc(CC_E);
+    e.movzx8(RAX, RSI);
+    e.store8(RDX, RAX, RCX);
+    _slow_paths.push_back({ slow, e.cur(), _before - _committed, _op_cycles, true });
+    _called_out = true;
+}
+
+// Effective address -> ESI, same as nes_cpu::decode_operand
+void nes_jit_compiler::address(nes_addr_mode mode, uint16_t raw)
+{
+    switch (mode)
+    {
+        case nes_addr_mode::ZP:
+        case nes_addr_mode::ABS:
+            e.mov(RSI, uint32_t(raw));
+            break;
+        case nes_addr_mode::ZPX:
+        case nes_addr_mode::ZPY:
+            e.mov(RSI, mode == nes_addr_mode::ZPX ? REG_X : REG_Y);
+            e.alu(ALU_ADD, RSI, raw);
+            e.alu(ALU_AND, RSI, 0xff);
+            break;
+        case nes_addr_mode::ABSX:
+        case nes_addr_mode::ABSY:
+            e.mov(RSI, mode == nes_addr_mode::ABSX ? REG_X : REG_Y);
+            e.alu(ALU_ADD, RSI, raw);
+            e.alu(ALU_AND, RSI, 0xffff);
+            break;
+        case nes_addr_mode::INDX:
+            e.mov(RSI, REG_X);
+            e.alu(ALU_ADD, RSI, raw & 0xff);
+            e.alu(ALU_AND, RSI, 0xff);
+            read_zp_pointer();
+            break;
+        case nes_addr_mode::INDY:
+            e.mov(RSI, uint32_t(raw & 0xff));
+            read_zp_pointer();
+            e.alu(ALU_ADD, RSI, REG_Y);
+            e.alu(ALU_AND, RSI, 0xffff);
+            break;
+        default:
+            assert(!"Unsupported addressing mode");
+    }
+}
+
+// 16-bit pointer at zero page [ESI] -> ESI, wrapping around within zero page
+void nes_jit_compiler::read_zp_pointer()
+{
+    read();
+    e.store32(RSP, FRAME_TEMP, RAX);
+    e.alu(ALU_ADD, RSI, 1);
+    e.alu(ALU_AND, RSI, 0xff);
+    read();
+    e.shl(RAX, 8);
+    e.or32(RAX, RSP, FRAME_TEMP);
+    e.mov(RSI, RAX);
+}
+
+// Operand value -> EAX
+void nes_jit_compiler::load_operand(nes_addr_mode mode, uint16_t raw)
+{
+    if (mode == nes_addr_mode::IMD)
+    {
+        e.mov(RAX, uint32_t(raw & 0xff));
+        return;
+    }
+
+    address(mode, raw);
+    read();
+}
+
+// ECX -> stack
+void nes_jit_compiler::push()
+{
+    e.mov(RSI, REG_SP);
+    e.alu(ALU_ADD, RSI, STACK_OFFSET);
+    write();
+    e.alu(ALU_SUB, REG_SP, 1);
+    e.alu(ALU_AND, REG_SP, 0xff);
+}
+
+// stack -> EAX
+void nes_jit_compiler::pop()
+{
+    e.alu(ALU_ADD, REG_SP, 1);
+    e.alu(ALU_AND, REG_SP, 0xff);
+    e.mov(RSI, REG_SP);
+    e.alu(ALU_ADD, RSI, STACK_OFFSET);
+    read();
+}
+
+// N/Z from a value in 0~255 - uses ECX/EDX
+void nes_jit_compiler::set_nz(x64_reg reg)
+{
+    assert(reg != RCX && reg != RDX);
+    e.alu(ALU_AND, REG_P, ~(PROCESSOR_STATUS_NEGATIVE_MASK | PROCESSOR_STATUS_ZERO_MASK) & 0xff);
+    e.mov(RCX, reg);
+    e.alu(ALU_AND, RCX, PROCESSOR_STATUS_NEGATIVE_MASK);
+    e.alu(ALU_OR, REG_P, RCX);
+    e.test64(reg, reg);
+    e.setcc(CC_E, RCX);
+    e.movzx8(RCX, RCX);
+    e.alu(ALU_ADD, RCX, RCX);
+    e.alu(ALU_OR, REG_P, RCX);
+}
+
+void nes_jit_compiler::set_nz(uint8_t val)
+{
+    e.alu(ALU_AND, REG_P, ~(PROCESSOR_STATUS_NEGATIVE_MASK | PROCESSOR_STATUS_ZERO_MASK) & 0xff);
+    uint8_t flags = (val & PROCESSOR_STATUS_NEGATIVE_MASK) | (val ? 0 : PROCESSOR_STATUS_ZERO_MASK);
+    if (flags)
+        e.alu(ALU_OR, REG_P, flags);
+}
+
+// Bit 0 of the register -> C
+void nes_jit_compiler::set_carry(x64_reg bit)
+{
+    e.alu(ALU_AND, REG_P, ~PROCESSOR_STATUS_CARRY_MASK & 0xff);
+    e.alu(ALU_OR, REG_P, bit);
+}
+
+// A + ESI + C -> A, with C/V/N/Z - see nes_cpu::ADC_IMD
+void nes_jit_compiler::adc()
+{
+    e.mov(RAX, REG_A);
+    e.alu(ALU_ADD, RAX, RSI);
+    e.mov(RCX, REG_P);
+    e.alu(ALU_AND, RCX, PROCESSOR_STATUS_CARRY_MASK);
+    e.alu(ALU_ADD, RAX, RCX);
+
+    // V: operands have the same sign and the result doesn't - (~(A ^ M) & (A ^ R)) & 0x80
+    e.mov(RCX, REG_A);
+    e.alu(ALU_XOR, RCX, RSI);
+    e.alu(ALU_XOR, RCX, 0xff);
+    e.mov(RDX, REG_A);
+    e.alu(ALU_XOR, RDX, RAX);
+    e.alu(ALU_AND, RCX, RDX);
+    e.alu(ALU_AND, RCX, 0x80);
+    e.shr(RCX, 1);
+    e.alu(ALU_AND, REG_P, ~PROCESSOR_STATUS_OVERFLOW_MASK & 0xff);
+    e.alu(ALU_OR, REG_P, RCX);
+
+    // C: carry out of bit 7
+    e.mov(RCX, RAX);
+    e.shr(RCX, 8);
+    set_carry(RCX);
+
+    e.alu(ALU_AND, RAX, 0xff);
+    e.mov(REG_A, RAX);
+    set_nz(REG_A);
+}
+
+// reg - EAX, with C/N/Z - see nes_cpu::CMP
+void nes_jit_compiler::compare(x64_reg reg)
+{
+    e.mov(RSI, RAX);
+    e.mov(RAX, reg);
+    e.alu(ALU_CMP, RAX, RSI);
+    e.setcc(CC_AE, RCX);
+    e.movzx8(RCX, RCX);
+    set_carry(RCX);
+    e.alu(ALU_SUB, RAX, RSI);
+    e.alu(ALU_AND, RAX, 0xff);
+    set_nz(RAX);
+}
+
+// Shifts/rotates EAX in place and sets C - N/Z are up to the caller
+void nes_jit_compiler::shift(jit_op kind)
+{
+    e.mov(RCX, RAX);
+    if (kind == jit_op::ASL || kind == jit_op::ROL)
+    {
+        e.shr(RCX, 7);
+        e.shl(RAX, 1);
+        if (kind == jit_op::ROL)
+        {
+            e.mov(RDX, REG_P);
+            e.alu(ALU_AND, RDX, PROCESSOR_STATUS_CARRY_MASK);
+            e.alu(ALU_OR, RAX, RDX);
+        }
+        e.alu(ALU_AND, RAX, 0xff);
+    }
+    else
+    {
+        e.alu(ALU_AND, RCX, 1);
+        e.shr(RAX, 1);
+        if (kind == jit_op::ROR)
+        {
+            e.mov(RDX, REG_P);
+            e.alu(ALU_AND, RDX, PROCESSOR_STATUS_CARRY_MASK);
+            e.shl(RDX, 7);
+            e.alu(ALU_OR, RAX, RDX);
+        }
+    }
+    set_carry(RCX);
+}
+
+nes_jit::nes_jit()
+    : _used(0), _page_size(size_t(sysconf(_SC_PAGESIZE)))
+{
+    // Only address space - see protect
+    void *code = mmap(nullptr, NES_JIT_CODE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    _code = (code == MAP_FAILED) ? nullptr : (uint8_t *)code;
+}
+
+nes_jit::~nes_jit()
+{
+    if (_code)
+        munmap(_code, NES_JIT_CODE_SIZE);
+}
+
+void nes_jit::protect(size_t begin, size_t end, int prot)
+{
+    begin &= ~(_page_size - 1);
+    end = (end + _page_size - 1) & ~(_page_size - 1);
+    if (begin < end)
+        mprotect(_code + begin, end - begin, prot);
+}
+
+void nes_jit::reset()
+{
+    if (!_code)
+        return;
+
+    // Hand the pages back too - the next code written there faults in fresh ones
+    protect(0, _used, PROT_NONE);
+    madvise(_code, NES_JIT_CODE_SIZE, MADV_DONTNEED);
+    _used = 0;
+}
+
+nes_native_code nes_jit::compile(nes_cpu &cpu, const nes_block &block)
+{
+    if (!_code)
+        return nullptr;
+
+    // Code already in the page _used is in stays where it is, only not executable while this block is emitted
+    size_t end = std::min(_used + NES_JIT_BLOCK_CODE_SIZE, size_t(NES_JIT_CODE_SIZE));
+    protect(_used, end, PROT_READ | PROT_WRITE);
+
+    x64_emitter e(_code + _used, end - _used);
+    nes_jit_compiler compiler(e, cpu, block);
+    compiler.compile();
+    if (e.overflow())
+    {
+        protect(_used, end, PROT_NONE);
+        protect(0, _used, PROT_READ | PROT_EXEC);
+        return nullptr;
+    }
+
+    auto native = (nes_native_code)(_code + _used);
+
+    // keep entry points 16-byte aligned
+    size_t used = _used + ((e.size() + 15) & ~size_t(15));
+    size_t used_pages = (used + _page_size - 1) & ~(_page_size - 1);
+    protect(_used, used, PROT_READ | PROT_EXEC);
+    protect(used_pages, end, PROT_NONE);
+    _used = used;
+
+    return native;
+}
+
+#else
+
+nes_jit::nes_jit()
+    : _code(nullptr), _used(0), _page_size(0)
+{
+}
+
+nes_jit::~nes_jit()
+{
+}
+
+void nes_jit::reset()
+{
+    _used = 0;
+}
+
+nes_native_code nes_jit::compile(nes_cpu &cpu, const nes_block &block)
+{
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "nes_block_cache.h"
+
+class nes_cpu;
+
+//
+// The JIT only knows how to generate x86-64 code for the System V calling convention
+//
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(NES_NO_JIT)
+#define NES_JIT_X64 1
+#endif
+
+// Executions before a block is worth compiling
+#define NES_JIT_HOT_THRESHOLD 8
+
+// Address space native code is bump-allocated from - pages are only committed as code reaches them
+#define NES_JIT_CODE_SIZE (4 * 1024 * 1024)
+
+// Room made writable for one block's code - far more than NES_BLOCK_MAX_OPS instructions ever take
+#define NES_JIT_BLOCK_CODE_SIZE (64 * 1024)
+
+//
+// Translates hot decoded blocks (see nes_block_cache.h) into x86-64 code
+//
+// A/X/Y/P/SP live in host registers for the whole block. Memory goes through the same page table as
+// nes_memory::get_byte/set_byte, inlined - only pages without a host pointer (I/O, mapper registers, code
+// in RAM) call back into nes_memory. Instructions the JIT doesn't know are executed by calling their
+// interpreter handler with the registers written back.
+//
+// Native code runs the whole block and only stops early when a call back into nes_cpu/nes_memory lowered
+// the deadline (NMI, DMA, stop, code invalidation) - nes_cpu only enters it when the block is known to
+// finish before the deadline, so timing is exactly that of the interpreter.
+//
+// The buffer is never writable and executable at once (W^X): everything below the page _used is in is
+// read/execute, the page(s) a block is being emitted to are read/write only while compile runs, and the rest
+// is inaccessible until code gets there.
+//
+class nes_jit
+{
+public :
+    nes_jit();
+    ~nes_jit();
+
+    // false if there is no JIT for this host, or executable memory could not be allocated
+    bool available() const { return _code != nullptr; }
+
+    // Compiles the block - returns nullptr if the code buffer is full (see reset)
+    nes_native_code compile(nes_cpu &cpu, const nes_block &block);
+
+    // Recycles the whole code buffer - every nes_native_code handed out before is gone
+    void reset();
+
+private :
+    // Sets the protection of the whole pages covering [begin, end) of the buffer
+    void protect(size_t begin, size_t end, int prot);
+
+private :
+    uint8_t *_code;                     // code buffer, see above
+    size_t _used;
+    size_t _page_size;
+};
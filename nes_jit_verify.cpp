@@ -0,0 +1,366 @@
+//
+// Lockstep verification of the JIT against the interpreter
+// Runs the same code on two systems - one with nes_cpu_engine::INTERPRETER, one with nes_cpu_engine::JIT -
+// in identical randomly sized steps and compares registers, cycle count and RAM after every step.
+// Stops at the first divergence.
+//
+// nesemu2_jit_verify [programs]        random generated programs (default 200)
+// nesemu2_jit_verify <rom> [frames]    a ROM (default 600 frames)
+// Returns 77 (skipped, for ctest) on hosts without a JIT.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "nes_system.h"
+#include "nes_ppu.h"
+
+#define VERIFY_CODE_ADDR        0x8000
+#define VERIFY_NMI_ADDR         0x9f00
+#define VERIFY_RAM_CODE_ADDR    0x0600      // LDA #imm / RTS - rewritten by the program itself
+#define VERIFY_LOOP_COUNTER     0xf0
+#define VERIFY_POINTERS         0xe0        // 8 pointers into RAM for (zp),Y
+#define VERIFY_ZP_END           0xe0        // random zero page accesses stay below the pointers/counter
+#define VERIFY_CYCLES_PER_PROGRAM (PPU_SCANLINE_CYCLE * PPU_SCANLINE_COUNT * 30)
+
+//
+// Random 6502 program built from loops so that blocks get hot - every instruction form the JIT compiles
+// (and a few it doesn't) with operands that can't corrupt the program, plus PPU register I/O, OAM DMA,
+// NMIs and self-modifying code in RAM
+//
+class program_generator
+{
+public :
+    program_generator(unsigned seed) : _rng(seed) {}
+
+    void generate(std::vector<uint8_t> &code)
+    {
+        _code = &code;
+        code.clear();
+
+        int sub_count = rand(1, 4);
+        int loop_count = rand(3, 10);
+
+        // main - subroutines are placed after it, JSR targets are patched in once they are known
+        size_t main_start = code.size();
+        std::vector<size_t> jsr_sites;
+        for (int i = 0; i < loop_count; ++i)
+        {
+            emit(0xa9, rand(1, 60));                            // LDA #count
+            emit(0x85, VERIFY_LOOP_COUNTER);                    // STA counter
+            size_t body = code.size();
+            gen_body(rand(1, 20));
+            if (rand(0, 2) == 0)
+            {
+                emit(0x20, 0, 0);                               // JSR sub
+                jsr_sites.push_back(code.size() - 2);
+            }
+            if (rand(0, 3) == 0)
+            {
+                emit(0x20, VERIFY_RAM_CODE_ADDR & 0xff, VERIFY_RAM_CODE_ADDR >> 8);
+                emit(rand(0, 1) ? 0x8d : 0xee, (VERIFY_RAM_CODE_ADDR + 1) & 0xff, (VERIFY_RAM_CODE_ADDR + 1) >> 8);
+            }
+            emit(0xc6, VERIFY_LOOP_COUNTER);                    // DEC counter
+            emit(0xd0, uint8_t(body - (code.size() + 2)));      // BNE body
+        }
+        emit(0x4c, (VERIFY_CODE_ADDR + main_start) & 0xff, (VERIFY_CODE_ADDR + main_start) >> 8);
+
+        std::vector<uint16_t> subs;
+        for (int i = 0; i < sub_count; ++i)
+        {
+            subs.push_back(uint16_t(VERIFY_CODE_ADDR + code.size()));
+            gen_body(rand(1, 24));
+            emit(0x60);                                         // RTS
+        }
+
+        for (auto site : jsr_sites)
+        {
+            uint16_t target = subs[rand(0, sub_count - 1)];
+            code[site] = target & 0xff;
+            code[site + 1] = target >> 8;
+        }
+    }
+
+private :
+    int rand(int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(_rng); }
+
+    void emit(uint8_t op) { _code->push_back(op); }
+    void emit(uint8_t op, uint8_t lo) { emit(op); _code->push_back(lo); }
+    void emit(uint8_t op, uint8_t lo, uint8_t hi) { emit(op, lo); _code->push_back(hi); }
+
+    uint8_t zp() { return rand(0, VERIFY_ZP_END - 1); }
+    uint16_t ram(int span) { return rand(0x200, VERIFY_RAM_CODE_ADDR - 1 - span); }
+    void emit_abs(uint8_t op, uint16_t addr) { emit(op, addr & 0xff, addr >> 8); }
+
+    void gen_body(int count)
+    {
+        // read-only forms of ORA/AND/EOR/ADC/CMP/SBC/LDA: (zp,X), zp, #, abs, (zp),Y, zp,X, abs,Y, abs,X
+        static const uint8_t alu_groups[] = { 0x00, 0x20, 0x40, 0x60, 0xa0, 0xc0, 0xe0 };
+        static const uint8_t implied[] = { 0xe8, 0xc8, 0xca, 0x88, 0xaa, 0xa8, 0x8a, 0x98, 0xba, 0x18, 0x38,
+                                           0xb8, 0xea, 0x0a, 0x4a, 0x2a, 0x6a, 0xd8 };
+        static const uint8_t rmw[] = { 0x06, 0x46, 0x26, 0x66, 0xe6, 0xc6 };
+
+        for (int i = 0; i < count; ++i)
+        {
+            switch (rand(0, 13))
+            {
+                case 0: case 1: case 2:
+                {
+                    uint8_t base = alu_groups[rand(0, 6)] + 1;
+                    switch (rand(0, 7))
+                    {
+                        case 0: emit(base + 0x00, zp()); break;                         // (zp,X)
+                        case 1: emit(base + 0x04, zp()); break;                         // zp
+                        case 2: emit(base + 0x08, rand(0, 255)); break;                 // #
+                        case 3: emit_abs(base + 0x0c, ram(0)); break;                   // abs
+                        case 4: emit(base + 0x10, VERIFY_POINTERS + 2 * rand(0, 7)); break;  // (zp),Y
+                        case 5: emit(base + 0x14, zp()); break;                         // zp,X
+                        case 6: emit_abs(base + 0x18, ram(255)); break;                 // abs,Y
+                        case 7: emit_abs(base + 0x1c, ram(255)); break;                 // abs,X
+                    }
+                    break;
+                }
+                case 3: case 4:
+                    emit(implied[rand(0, sizeof(implied) - 1)]);
+                    break;
+                case 5:
+                {
+                    uint8_t op = rmw[rand(0, sizeof(rmw) - 1)];
+                    switch (rand(0, 2))
+                    {
+                        case 0: emit(op, zp()); break;
+                        case 1: emit_abs(op + 0x08, ram(0)); break;
+                        case 2: emit_abs(op + 0x18, ram(255)); break;
+                    }
+                    break;
+                }
+                case 6:
+                    // STA zp / abs / abs,X / abs,Y / (zp),Y, STX/STY zp / abs
+                    switch (rand(0, 6))
+                    {
+                        case 0: emit(0x85, zp()); break;
+                        case 1: emit_abs(0x8d, ram(0)); break;
+                        case 2: emit_abs(0x9d, ram(255)); break;
+                        case 3: emit_abs(0x99, ram(255)); break;
+                        case 4: emit(0x91, VERIFY_POINTERS + 2 * rand(0, 7)); break;
+                        case 5: emit(rand(0, 1) ? 0x86 : 0x84, zp()); break;
+                        case 6: emit_abs(rand(0, 1) ? 0x8e : 0x8c, ram(0)); break;
+                    }
+                    break;
+                case 7:
+                    // LDX/LDY/CPX/CPY/BIT
+                    switch (rand(0, 5))
+                    {
+                        case 0: emit(rand(0, 1) ? 0xa2 : 0xa0, rand(0, 255)); break;
+                        case 1: emit(rand(0, 1) ? 0xa6 : 0xa4, zp()); break;
+                        case 2: emit_abs(rand(0, 1) ? 0xbe : 0xbc, ram(255)); break;
+                        case 3: emit(rand(0, 1) ? 0xe0 : 0xc0, rand(0, 255)); break;
+                        case 4: emit(rand(0, 1) ? 0xe4 : 0xc4, zp()); break;
+                        case 5: emit(0x24, zp()); break;
+                    }
+                    break;
+                case 8:
+                    // balanced stack use
+                    if (rand(0, 1))
+                    {
+                        emit(0x48);                     // PHA
+                        emit(0xa9, rand(0, 255));       // LDA #
+                        emit(0x68);                     // PLA
+                    }
+                    else
+                    {
+                        emit(0x08);                     // PHP
+                        emit(0x38);                     // SEC
+                        emit(0x28);                     // PLP
+                    }
+                    break;
+                case 9:
+                    // instructions the JIT hands back to the interpreter - LAX zp / abs
+                    if (rand(0, 1))
+                        emit(0xa7, zp());
+                    else
+                        emit_abs(0xaf, ram(0));
+                    break;
+                case 10:
+                    // PPU registers - $2000 may turn NMI on
+                    switch (rand(0, 4))
+                    {
+                        case 0: emit_abs(0xad, 0x2002); break;
+                        case 1: emit_abs(0x8d, 0x2006); break;
+                        case 2: emit_abs(0x8d, 0x2007); break;
+                        case 3: emit_abs(0xad, 0x2007); break;
+                        case 4: emit_abs(0x8d, 0x2000); break;
+                    }
+                    break;
+                case 11:
+                    if (rand(0, 7) == 0)
+                        emit_abs(0x8d, 0x4014);         // OAM DMA from page A
+                    else
+                        emit_abs(0xee, 0x2007);         // INC $2007 - read and write I/O in one instruction
+                    break;
+                case 12:
+                    // forward branch over one instruction - splits the loop into several blocks
+                    emit(0x10 + 0x20 * rand(0, 7), 1);
+                    emit(0xe8);
+                    break;
+                case 13:
+                    emit(0x10 + 0x20 * rand(0, 7), 2);
+                    emit(0xa9, rand(0, 255));
+                    break;
+            }
+        }
+    }
+
+private :
+    std::mt19937 _rng;
+    std::vector<uint8_t> *_code;
+};
+
+static void load_program(nes_system &system, const std::vector<uint8_t> &code, unsigned seed)
+{
+    system.init();
+    auto mem = system.getMem();
+    mem->map_flat_ram();
+
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> ram(VERIFY_RAM_CODE_ADDR);
+    for (auto &b : ram)
+        b = rng() & 0xff;
+    for (int i = 0; i < 8; ++i)
+    {
+        // (zp),Y pointers stay clear of the code in RAM
+        uint16_t ptr = 0x200 + rng() % (VERIFY_RAM_CODE_ADDR - 0x200 - 0x100);
+        ram[VERIFY_POINTERS + 2 * i] = ptr & 0xff;
+        ram[VERIFY_POINTERS + 2 * i + 1] = ptr >> 8;
+    }
+    mem->set_bytes(0, ram.data(), ram.size());
+
+    uint8_t ram_code[] = { 0xa9, 0x00, 0x60 };                  // LDA #0 / RTS
+    mem->set_bytes(VERIFY_RAM_CODE_ADDR, ram_code, sizeof(ram_code));
+
+    uint8_t nmi[] = { 0x48, 0xe6, 0xd0, 0x68, 0x40 };           // PHA / INC $D0 / PLA / RTI
+    mem->set_bytes(VERIFY_NMI_ADDR, nmi, sizeof(nmi));
+    uint8_t vector[] = { VERIFY_NMI_ADDR & 0xff, VERIFY_NMI_ADDR >> 8 };
+    mem->set_bytes(NMI_HANDLER, vector, sizeof(vector));
+
+    mem->set_bytes(VERIFY_CODE_ADDR, (uint8_t *)code.data(), code.size());
+    system.getCpu()->reg().PC = VERIFY_CODE_ADDR;
+}
+
+static void dump(const char *name, nes_system &system)
+{
+    auto cpu = system.getCpu();
+    auto &r = cpu->reg();
+    printf("  %-12s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%lld\n", name, r.PC, r.A, r.X, r.Y, r.P,
+           r.SP, (long long)cpu->cycle().count());
+}
+
+// Returns false and reports the first difference between the two systems
+static bool compare(nes_system &ref, nes_system &jit, int64_t step)
+{
+    auto &a = ref.getCpu()->reg();
+    auto &b = jit.getCpu()->reg();
+    bool same = a.PC == b.PC && a.A == b.A && a.X == b.X && a.Y == b.Y && a.P == b.P && a.SP == b.SP &&
+                ref.getCpu()->cycle() == jit.getCpu()->cycle();
+
+    int ram_diff = -1;
+    for (int addr = 0; addr < 0x800 && ram_diff < 0; ++addr)
+    {
+        if (ref.getMem()->get_byte(addr) != jit.getMem()->get_byte(addr))
+            ram_diff = addr;
+    }
+
+    if (same && ram_diff < 0)
+        return true;
+
+    printf("Divergence after step %lld:\n", (long long)step);
+    dump("interpreter", ref);
+    dump("jit", jit);
+    if (ram_diff >= 0)
+        printf("  RAM $%04X: %02X vs %02X\n", ram_diff, ref.getMem()->get_byte(ram_diff), jit.getMem()->get_byte(ram_diff));
+
+    return false;
+}
+
+// Steps both systems in the same random increments until total cycles have passed
+static bool run_lockstep(nes_system &ref, nes_system &jit, nes_cycle_t total, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    int64_t step = 0;
+    while (ref._master_cycle < total && !ref.stop_requested())
+    {
+        // mostly small steps so that divergences are caught close to where they happen
+        nes_cycle_t count = nes_cycle_t((rng() % 8) ? 1 + rng() % 600 : 1 + rng() % 30000);
+        ref.step(count);
+        jit.step(count);
+        ++step;
+
+        if (!compare(ref, jit, step))
+            return false;
+    }
+
+    return true;
+}
+
+static int verify_programs(int programs)
+{
+    std::vector<uint8_t> code;
+    auto ref = std::make_unique<nes_system>();
+    auto jit = std::make_unique<nes_system>();
+
+    for (int i = 0; i < programs; ++i)
+    {
+        program_generator(i).generate(code);
+
+        load_program(*ref, code, i);
+        ref->getCpu()->set_engine(nes_cpu_engine::INTERPRETER);
+        load_program(*jit, code, i);
+        jit->getCpu()->set_engine(nes_cpu_engine::JIT);
+
+        if (!run_lockstep(*ref, *jit, nes_cycle_t(VERIFY_CYCLES_PER_PROGRAM), i))
+        {
+            printf("Program %d failed\n", i);
+            return 1;
+        }
+    }
+
+    printf("%d programs match\n", programs);
+    return 0;
+}
+
+static int verify_rom(const char *rom_path, int frames)
+{
+    auto ref = std::make_unique<nes_system>();
+    auto jit = std::make_unique<nes_system>();
+
+    ref->init();
+    ref->load_rom(rom_path);
+    ref->getCpu()->set_engine(nes_cpu_engine::INTERPRETER);
+    jit->init();
+    jit->load_rom(rom_path);
+    jit->getCpu()->set_engine(nes_cpu_engine::JIT);
+
+    if (!run_lockstep(*ref, *jit, PPU_SCANLINE_CYCLE * PPU_SCANLINE_COUNT * frames, 0))
+        return 1;
+
+    printf("%d frames match\n", frames);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    auto probe = std::make_unique<nes_system>();
+    probe->getCpu()->set_engine(nes_cpu_engine::JIT);
+    if (probe->getCpu()->engine() != nes_cpu_engine::JIT)
+    {
+        printf("No JIT on this host\n");
+        return 77;
+    }
+
+    if (argc > 1 && atoi(argv[1]) == 0 && strcmp(argv[1], "0") != 0)
+        return verify_rom(argv[1], (argc > 2) ? atoi(argv[2]) : 600);
+
+    return verify_programs((argc > 1) ? atoi(argv[1]) : 200);
+}
@@ -0,0 +1,171 @@
+#include <cstdio>
+#include "nes_mapped_file.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool nes_mapped_file::open(const char *path, bool sequential)
+{
+    close();
+
+#if !defined(_WIN32)
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    _size = size_t(st.st_size);
+    if (_size > 0)
+    {
+        void *data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ::close(fd);
+            _size = 0;
+            return false;
+        }
+
+        if (sequential)
+            madvise(data, _size, MADV_SEQUENTIAL);
+        _data = (uint8_t *)data;
+        _mapped = true;
+    }
+
+    // The mapping stays valid without the descriptor
+    ::close(fd);
+    return true;
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    _size = size_t(ftell(file));
+    fseek(file, 0, SEEK_SET);
+
+    _data = new uint8_t[_size ? _size : 1];
+    bool ok = fread(_data, 1, _size, file) == _size;
+    fclose(file);
+
+    if (!ok)
+        close();
+    return ok;
+#endif
+}
+
+void nes_mapped_file::close()
+{
+    if (_data)
+    {
+#if !defined(_WIN32)
+        if (_mapped)
+            munmap(_data, _size);
+        else
+#endif
+            delete[] _data;
+    }
+
+    _data = nullptr;
+    _size = 0;
+    _mapped = false;
+}
+
+bool nes_mapped_save_file::open(const char *path, size_t size)
+{
+    close();
+    if (size == 0)
+        return false;
+
+#if !defined(_WIN32)
+    int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    // flock() locks belong to the open file, so a second open in this same process is turned away too
+    struct stat st;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 ||
+        (size_t(st.st_size) < size && ftruncate(fd, off_t(size)) != 0))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    _data = (uint8_t *)data;
+    _size = size;
+    _mapped = true;
+    _fd = fd;
+    return true;
+#else
+    _data = new uint8_t[size]();
+    _size = size;
+    _path = path;
+
+    // A missing or short file just leaves zeros
+    FILE *file = fopen(path, "rb");
+    if (file)
+    {
+        fread(_data, 1, size, file);
+        fclose(file);
+    }
+
+    return true;
+#endif
+}
+
+void nes_mapped_save_file::flush()
+{
+#if !defined(_WIN32)
+    if (_mapped)
+        msync(_data, _size, MS_ASYNC);
+#endif
+}
+
+void nes_mapped_save_file::close()
+{
+    if (_data)
+    {
+#if !defined(_WIN32)
+        if (_mapped)
+        {
+            msync(_data, _size, MS_ASYNC);
+            munmap(_data, _size);
+            ::close(_fd);
+        }
+        else
+#endif
+        {
+            FILE *file = fopen(_path.c_str(), "wb");
+            if (file)
+            {
+                fwrite(_data, 1, _size, file);
+                fclose(file);
+            }
+
+            delete[] _data;
+        }
+    }
+
+    _data = nullptr;
+    _size = 0;
+    _mapped = false;
+    _fd = -1;
+    _path.clear();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+//
+// Read-only view of a whole file. Memory-mapped where the host supports it, so the OS only reads the pages
+// that are touched and multi-GB files cost nothing up front - otherwise the file is read into memory.
+//
+class nes_mapped_file
+{
+public :
+    nes_mapped_file() : _data(nullptr), _size(0), _mapped(false) {}
+    ~nes_mapped_file() { close(); }
+
+    nes_mapped_file(const nes_mapped_file &) = delete;
+    nes_mapped_file &operator=(const nes_mapped_file &) = delete;
+
+    // false if the file can't be opened - an empty file opens fine with size() == 0
+    // sequential tells the OS the file is read front to back so it can read ahead aggressively
+    bool open(const char *path, bool sequential = false);
+    void close();
+
+    const uint8_t *data() const { return _data; }
+    size_t size() const { return _size; }
+
+private :
+    uint8_t *_data;
+    size_t _size;
+    bool _mapped;                   // _data came from mmap rather than new[]
+};
+
+//
+// Read-write file mapped into memory - writes to data() are writes to the file, with no I/O on the caller's
+// side: the OS writes dirty pages back on its own, and flush() only asks it to start doing so now.
+// Everything written is in the OS page cache the moment it's written, so it survives the process crashing.
+// The file is locked for as long as it is open - a second open of the same file, by this process or another,
+// fails rather than have two consoles write over each other's RAM.
+// Without mmap the file is read in on open and written back by close - nothing survives a crash then, and
+// nothing is locked either.
+//
+class nes_mapped_save_file
+{
+public :
+    nes_mapped_save_file() : _data(nullptr), _size(0), _mapped(false), _fd(-1) {}
+    ~nes_mapped_save_file() { close(); }
+
+    nes_mapped_save_file(const nes_mapped_save_file &) = delete;
+    nes_mapped_save_file &operator=(const nes_mapped_save_file &) = delete;
+
+    // Maps the first size bytes of the file - the file is created, or zero-extended to size, as needed
+    // false if it can't be, or someone else has it open
+    bool open(const char *path, size_t size);
+    void close();
+
+    // Starts writing back what changed since the last flush - never waits for the disk
+    void flush();
+
+    uint8_t *data() const { return _data; }
+    size_t size() const { return _size; }
+
+private :
+    uint8_t *_data;
+    size_t _size;
+    bool _mapped;                   // _data came from mmap rather than new[]
+    int _fd;                        // kept open while mapped - it holds the lock
+    std::string _path;              // where close() writes _data back to when it isn't mapped
+};
@@ -0,0 +1,79 @@
+#include "nes_mapper.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+
+// Smallest CHR RAM of cartridges without CHR ROM - the pattern tables are 8KB whatever the header says
+#define CHR_RAM_SIZE 0x2000
+
+#define PRG_RAM_ADDR 0x6000
+
+nes_mapper::nes_mapper(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram)
+        : _rom(std::move(rom)), _chr_ram(chr_ram), _mem(nullptr), _ppu(nullptr)
+{
+    // assign/clear keep the capacity - the storage of the previous cartridge is reused
+    if (_rom->chr_size() == 0)
+        _chr_ram.assign(std::max(_rom->chr_ram_size(), size_t(CHR_RAM_SIZE)), 0);
+    else
+        _chr_ram.clear();
+
+    // Boards with a battery don't have any other PRG RAM worth mapping
+    _prg_ram_size = _rom->has_battery() ? _rom->prg_nvram_size() : _rom->prg_ram_size();
+    if (_prg_ram_size)
+        _prg_ram_size = std::max(_prg_ram_size, size_t(NES_PAGE_SIZE));
+}
+
+bool nes_mapper::open_save(const char *path)
+{
+    assert(!_mem);
+    return _rom->has_battery() && _save.open(path, _prg_ram_size);
+}
+
+void nes_mapper::map_prg_ram()
+{
+    assert(_mem);
+    if (!_prg_ram_size)
+        return;
+
+    // Anything bigger than the window needs a mapper that banks it - only the first 8KB is reachable here
+    uint8_t *data = _save.data() ? _save.data() : _mem->state().prg_ram;
+    size_t size = std::min(_prg_ram_size, size_t(NES_PRG_RAM_SIZE));
+    for (size_t filled = 0; filled < NES_PRG_RAM_SIZE; filled += size)
+        _mem->map_ram(uint8_t((PRG_RAM_ADDR + filled) >> NES_PAGE_SHIFT), int(size >> NES_PAGE_SHIFT), data);
+}
+
+void nes_mapper::map_prg(uint16_t addr, int size, int bank)
+{
+    assert(_mem);
+    int prg_size = int(_rom->prg_size());
+    const uint8_t *data = _rom->prg() + size_t(bank % prg_bank_count(size)) * size;
+
+    // ROMs smaller than the bank (16KB NROM in a 32KB window) repeat
+    for (int filled = 0; filled < size; filled += prg_size)
+    {
+        int chunk = std::min(size - filled, prg_size);
+        _mem->map_rom(uint8_t((addr + filled) >> 8), chunk >> 8, data);
+        if (prg_size >= size)
+            break;
+    }
+}
+
+void nes_mapper::map_chr(uint16_t addr, int size, int bank)
+{
+    assert(_ppu);
+    if (_chr_ram.empty())
+    {
+        int bank_count = std::max(1, int(_rom->chr_size()) / size);
+        _ppu->map_chr(addr >> PPU_CHR_PAGE_SHIFT, size >> PPU_CHR_PAGE_SHIFT, _rom->chr() + size_t(bank % bank_count) * size);
+    }
+    else
+    {
+        int bank_count = std::max(1, int(_chr_ram.size()) / size);
+        _ppu->map_chr_ram(addr >> PPU_CHR_PAGE_SHIFT, size >> PPU_CHR_PAGE_SHIFT, _chr_ram.data() + size_t(bank % bank_count) * size);
+    }
+}
+
+void nes_mapper::set_mirroring(nes_mapper_flags flags)
+{
+    assert(_ppu);
+    _ppu->set_mirroring(flags);
+}
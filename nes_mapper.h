@@ -1,13 +1,21 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <vector>
-#include <fstream>
+#include <stdexcept>
+#include <string>
 #include <assert.h>
+#include "nes_cycle.h"
+#include "nes_mapped_file.h"
+#include "nes_rom_image.h"
 
 class nes_memory;
 class nes_ppu;
+class nes_system;
 
 enum nes_mapper_flags : uint16_t
 {
@@ -31,6 +39,10 @@ enum nes_mapper_flags : uint16_t
 
     // Has registers
             nes_mapper_flags_has_registers = 0x4,
+
+    // A, B
+    // C, D - the cartridge has VRAM for C and D, the mirroring bits are ignored
+            nes_mapper_flags_four_screen = 0x8,
 };
 
 struct nes_mapper_info
@@ -41,34 +53,29 @@ struct nes_mapper_info
     nes_mapper_flags flags;        // whatever flags you might need
 };
 
-struct ines_header
-{
-    uint8_t magic[4];       // 0x4E, 0x45, 0x53, 0x1A
-    uint8_t prg_size;       // PRG ROM in 16K
-    uint8_t chr_size;       // CHR ROM in 8K, 0 -> using CHR RAM
-    uint8_t flag6;
-    uint8_t flag7;
-    uint8_t prg_ram_size;   // PRG RAM in 8K
-    uint8_t flag9;
-    uint8_t flag10;         // unofficial
-    uint8_t reserved[5];    // reserved
-};
-
+//
+// A cartridge - owns the PRG/CHR ROM and maps banks of it into the CPU and PPU page tables
+// Bank switching only repoints pages at other parts of the ROM buffers (see map_prg/map_chr) - nothing is
+// ever copied, so switching every frame (or every scanline) costs a few pointer stores.
+//
 class nes_mapper
 {
 public :
-    nes_mapper(){};
+    // The image may have no CHR ROM - the cartridge has (at least) 8KB of CHR RAM instead, kept in chr_ram
+    // chr_ram belongs to whoever creates the mapper (see nes_mapper_slot) and must outlive it
+    nes_mapper(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram);
+
     //
     // Called when mapper is loaded into memory
-    // Useful when all you need is a one-time memcpy
+    // Maps the power-on PRG banks
     //
     virtual void on_load_ram(nes_memory &mem) = 0;
 
     //
     // Called when mapper is loaded into PPU
-    // Useful when all you need is a one-time memcpy
+    // Maps the power-on CHR banks
     //
-    virtual void on_load_ppu(nes_ppu &ppu) {}
+    virtual void on_load_ppu(nes_ppu &ppu) = 0;
 
     //
     // Returns various mapper related information
@@ -77,18 +84,103 @@ public :
 
     //
     // Write mapper register in the given address
-    // Caller should check if addr is in range of register first
+    // Only called for addresses in [reg_start, reg_end] of nes_mapper_info
+    //
+    virtual void write_reg(uint16_t addr, uint8_t val) {};
+
+    //
+    // The nes_event::MAPPER_IRQ the mapper scheduled is due
+    //
+    virtual void on_irq_event() {};
+
+    //
+    // PPU settings that decide when PPU A12 rises (rendering on/off, pattern table addresses, sprite size)
+    // just changed - until now it rose at old_rise_dot. See nes_ppu::count_a12_rises
+    //
+    virtual void on_a12_timing_change(int old_rise_dot) {};
+
     //
-    //virtual void write_reg(uint16_t addr, uint8_t val) {};
+    // Keeps battery-backed PRG RAM in the file at path (created if needed) so it outlives the process
+    // Call before loading the mapper into memory. Only one instance at a time gets the file
+    // false if the cartridge has no battery, or the file can't be mapped or is in use by another instance -
+    // PRG RAM stays plain memory then
+    //
+    bool open_save(const char *path);
+
+    // Called at frame boundaries - starts writing battery-backed RAM back to the save file, without waiting
+    void flush_save() { _save.flush(); }
+
+    // CHR RAM back to its power-on contents - battery-backed PRG RAM is left alone, that's what it is for
+    void clear_chr_ram() { std::fill(_chr_ram.begin(), _chr_ram.end(), 0); }
+
+    const std::shared_ptr<const nes_rom_image> &rom() const { return _rom; }
+
+    // Empty unless there is no CHR ROM
+    const std::vector<uint8_t> &chr_ram() const { return _chr_ram; }
 
     virtual ~nes_mapper(){};
+
+protected :
+    // Maps PRG bank number `bank` (banks are `size` bytes, numbers wrap around the ROM) at CPU address addr
+    void map_prg(uint16_t addr, int size, int bank);
+
+    // Maps CHR bank number `bank` (banks are `size` bytes, numbers wrap around) at PPU address addr
+    void map_chr(uint16_t addr, int size, int bank);
+
+    // Maps PRG RAM at $6000~$7fff if the cartridge has any - repeated if it is smaller than that
+    void map_prg_ram();
+
+    // Nametable mirroring can be switched at runtime by some mappers
+    void set_mirroring(nes_mapper_flags flags);
+
+    int prg_bank_count(int size) const { return std::max(1, int(_rom->prg_size()) / size); }
+
+    // Reset vector of the PRG bank ending at bank_end (byte offset) when it is mapped at $ffff - for code_addr
+    uint16_t reset_vector(size_t bank_end) const
+    {
+        return uint16_t(_rom->prg()[bank_end - 4] | (_rom->prg()[bank_end - 3] << 8));
+    }
+
+    // Mirroring flags from the header
+    nes_mapper_flags header_mirroring() const
+    {
+        if (_rom->four_screen())
+            return nes_mapper_flags_four_screen;
+        return _rom->vertical_mirroring() ? nes_mapper_flags_vertical_mirroring : nes_mapper_flags_horizontal_mirroring;
+    }
+
+    std::shared_ptr<const nes_rom_image> _rom;  // shared with every other instance running the same ROM
+    std::vector<uint8_t> &_chr_ram;             // empty unless there is no CHR ROM
+    size_t _prg_ram_size;                       // in nes_state::prg_ram - or in _save if it has a battery
+    nes_mapped_save_file _save;
+
+    nes_memory *_mem;                           // set by on_load_ram / on_load_ppu
+    nes_ppu *_ppu;
+};
+
+class nes_mapper_nrom final : public nes_mapper
+{
+public :
+    nes_mapper_nrom(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram)
+            : nes_mapper(std::move(rom), chr_ram)
+    {
+
+    }
+
+    void on_load_ram(nes_memory &mem);
+    void on_load_ppu(nes_ppu &ppu);
+    void get_info(nes_mapper_info &info);
 };
 
-class nes_mapper_nrom : public nes_mapper
+//
+// MMC1 (mapper 1) - 5-bit serial shift register feeding control/CHR/PRG bank registers
+// http://wiki.nesdev.com/w/index.php/MMC1
+//
+class nes_mapper_mmc1 final : public nes_mapper
 {
 public :
-    nes_mapper_nrom(std::shared_ptr<std::vector<uint8_t>> &prg_rom, std::shared_ptr<std::vector<uint8_t>> &chr_rom, bool vertical_mirroring)
-            :_prg_rom(prg_rom), _chr_rom(chr_rom), _vertical_mirroring(vertical_mirroring)
+    nes_mapper_mmc1(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram)
+            : nes_mapper(std::move(rom), chr_ram)
     {
 
     }
@@ -96,87 +188,199 @@ public :
     void on_load_ram(nes_memory &mem);
     void on_load_ppu(nes_ppu &ppu);
     void get_info(nes_mapper_info &info);
+    void write_reg(uint16_t addr, uint8_t val);
 
 private :
-    std::shared_ptr<std::vector<uint8_t>> _prg_rom;
-    std::shared_ptr<std::vector<uint8_t>> _chr_rom;
-    bool _vertical_mirroring;
+    void update_prg_banks();
+    void update_chr_banks();
+
+    uint8_t _shift_reg;                 // bits written so far, LSB first
+    int _shift_count;
+    uint8_t _control;                   // mirroring, PRG bank mode, CHR bank mode
+    uint8_t _chr_bank_0;
+    uint8_t _chr_bank_1;
+    uint8_t _prg_bank;
 };
 
-#define FLAG_6_USE_VERTICAL_MIRRORING_MASK 0x1
-#define FLAG_6_HAS_BATTERY_BACKED_PRG_RAM_MASK 0x2
-#define FLAG_6_HAS_TRAINER_MASK  0x4
-#define FLAG_6_USE_FOUR_SCREEN_VRAM_MASK 0x8
-#define FLAG_6_LO_MAPPER_NUMBER_MASK 0xf0
-#define FLAG_7_HI_MAPPER_NUMBER_MASK 0xf0
+//
+// UxROM (mapper 2) - switchable 16KB PRG bank at $8000, last bank fixed at $C000, CHR RAM
+// http://wiki.nesdev.com/w/index.php/UxROM
+//
+class nes_mapper_uxrom final : public nes_mapper
+{
+public :
+    nes_mapper_uxrom(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram)
+            : nes_mapper(std::move(rom), chr_ram)
+    {
 
-class nes_rom_loader
+    }
+
+    void on_load_ram(nes_memory &mem);
+    void on_load_ppu(nes_ppu &ppu);
+    void get_info(nes_mapper_info &info);
+    void write_reg(uint16_t addr, uint8_t val);
+};
+
+//
+// CNROM (mapper 3) - fixed PRG like NROM, switchable 8KB CHR ROM bank
+// http://wiki.nesdev.com/w/index.php/CNROM
+//
+class nes_mapper_cnrom final : public nes_mapper
 {
 public :
-    struct ines_header
+    nes_mapper_cnrom(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram)
+            : nes_mapper(std::move(rom), chr_ram)
     {
-        uint8_t magic[4];       // 0x4E, 0x45, 0x53, 0x1A
-        uint8_t prg_size;       // PRG ROM in 16K
-        uint8_t chr_size;       // CHR ROM in 8K, 0 -> using CHR RAM
-        uint8_t flag6;
-        uint8_t flag7;
-        uint8_t prg_ram_size;   // PRG RAM in 8K
-        uint8_t flag9;
-        uint8_t flag10;         // unofficial
-        uint8_t reserved[5];    // reserved
-    };
-
-    // Loads a NES ROM file
-    // Automatically detects format according to extension and header
-    // Returns a nes_mapper instance which has all necessary memory mapped
-    static std::shared_ptr<nes_mapper> load_from(const char *path)
 
+    }
+
+    void on_load_ram(nes_memory &mem);
+    void on_load_ppu(nes_ppu &ppu);
+    void get_info(nes_mapper_info &info);
+    void write_reg(uint16_t addr, uint8_t val);
+};
+
+//
+// MMC3 (mapper 4) - 8KB PRG / 1KB CHR banks and a scanline counter clocked by PPU A12 that raises IRQ
+// The counter isn't clocked as the PPU runs: it is brought up to date from the PPU frame timing whenever
+// it is touched, and the IRQ is scheduled as a nes_event::MAPPER_IRQ at the exact A12 rise that fires it
+// http://wiki.nesdev.com/w/index.php/MMC3
+//
+class nes_mapper_mmc3 final : public nes_mapper
+{
+public :
+    nes_mapper_mmc3(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram)
+            : nes_mapper(std::move(rom), chr_ram)
     {
-        std::ifstream file;
-        file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-        file.open(path, std::ifstream::in | std::ifstream::binary);
 
-        // Parse header
-        ines_header header;
-        file.read((char *)&header, sizeof(header));
+    }
 
-        if (header.flag6 & FLAG_6_HAS_TRAINER_MASK)
-        {
-            // skip the 512-byte trainer
-            file.seekg(0x200, std::ios_base::cur);
-        }
+    void on_load_ram(nes_memory &mem);
+    void on_load_ppu(nes_ppu &ppu);
+    void get_info(nes_mapper_info &info);
+    void write_reg(uint16_t addr, uint8_t val);
+    void on_irq_event();
+    void on_a12_timing_change(int old_rise_dot);
+
+private :
+    void update_prg_banks();
+    void update_chr_banks();
 
-        bool vertical_mirroring = header.flag6 & FLAG_6_USE_VERTICAL_MIRRORING_MASK;
+    // Brings _irq_counter up to the PPU's current position - A12 rose at rise_dot until now
+    void sync_irq_counter(int rise_dot);
+    void clock_irq_counter(int clocks);
 
-        if (header.flag7 == 0x44)
-        {
-            // This might be one of the earlier dumps with bad iNes header (D stands for diskdude)
-            header.flag7 = 0;
-        }
+    // Schedules nes_event::MAPPER_IRQ at the A12 rise that takes the counter to 0 - if that fires IRQ
+    void schedule_irq();
 
-        int mapper_id = ((header.flag6 & FLAG_6_LO_MAPPER_NUMBER_MASK) >> 4) + ((header.flag7 & FLAG_7_HI_MAPPER_NUMBER_MASK));
+    nes_system *_system;
 
-        int prg_rom_size = header.prg_size * 0x4000;    // 16KB
-        int chr_rom_size = header.chr_size * 0x2000;    // 8KB
+    uint8_t _bank_select;               // register written by the next $8001 write + PRG/CHR modes
+    uint8_t _banks[8];                  // R0~R7
 
-        auto prg_rom = std::make_shared<std::vector<uint8_t>>(prg_rom_size);
-        auto chr_rom = std::make_shared<std::vector<uint8_t>>(chr_rom_size);
+    uint8_t _irq_latch;
+    uint8_t _irq_counter;
+    bool _irq_reload;                   // counter is reloaded from the latch on the next clock
+    bool _irq_enabled;
+    nes_ppu_position _irq_sync;         // PPU position _irq_counter is up to date with
+};
+
+//
+// AxROM (mapper 7) - switchable 32KB PRG bank, one-screen mirroring selected by the same register, CHR RAM
+// http://wiki.nesdev.com/w/index.php/AxROM
+//
+class nes_mapper_axrom final : public nes_mapper
+{
+public :
+    nes_mapper_axrom(std::shared_ptr<const nes_rom_image> rom, std::vector<uint8_t> &chr_ram)
+            : nes_mapper(std::move(rom), chr_ram)
+    {
 
-        file.read((char *)prg_rom->data(), prg_rom->size());
-        file.read((char *)chr_rom->data(), chr_rom->size());
+    }
 
-        std::shared_ptr<nes_mapper> mapper;
+    void on_load_ram(nes_memory &mem);
+    void on_load_ppu(nes_ppu &ppu);
+    void get_info(nes_mapper_info &info);
+    void write_reg(uint16_t addr, uint8_t val);
+};
 
-        // @TODO - Change this into a mapper factory class
-        switch (mapper_id)
+//
+// Room for any one of the mappers above, constructed in place - plugging in another cartridge doesn't touch
+// the heap. CHR RAM lives here too and is only reallocated when a cartridge needs more than any before it
+//
+class nes_mapper_slot
+{
+public :
+    nes_mapper_slot() : _mapper(nullptr) {}
+    ~nes_mapper_slot() { clear(); }
+
+    nes_mapper_slot(const nes_mapper_slot &) = delete;
+    nes_mapper_slot &operator=(const nes_mapper_slot &) = delete;
+
+    nes_mapper *get() { return _mapper; }
+
+    // Destroys the current mapper (if any) and creates a mapper_t for rom in its place
+    template <class mapper_t>
+    mapper_t *emplace(std::shared_ptr<const nes_rom_image> rom)
+    {
+        static_assert(sizeof(mapper_t) <= sizeof(storage_t) && alignof(mapper_t) <= alignof(storage_t), "mapper_t is missing from storage_t");
+
+        clear();
+        mapper_t *mapper = new (&_storage) mapper_t(std::move(rom), _chr_ram);
+        _mapper = mapper;
+        return mapper;
+    }
+
+    void clear()
+    {
+        if (_mapper)
         {
-            case 0: mapper = std::make_shared<nes_mapper_nrom>(prg_rom, chr_rom, vertical_mirroring); break;
-            default:
-                assert(!"Unsupported mapper id");
+            _mapper->~nes_mapper();
+            _mapper = nullptr;
         }
+    }
 
-        file.close();
+private :
+    typedef std::aligned_union<0, nes_mapper_nrom, nes_mapper_mmc1, nes_mapper_uxrom, nes_mapper_cnrom, nes_mapper_mmc3,
+            nes_mapper_axrom>::type storage_t;
 
-        return mapper;
+    storage_t _storage;
+    nes_mapper *_mapper;                        // in _storage - nullptr if there is no cartridge
+    std::vector<uint8_t> _chr_ram;
+};
+
+class nes_rom_loader
+{
+public :
+    // Creates the mapper for the ROM in the slot - replacing whatever was there
+    // Calls before_replace while the previous mapper is still alive, for whatever points into it to let go,
+    // then on_load with a reference to the concrete mapper class (they are all final) - this is the one
+    // place the mapper number picks a type, so whatever on_load sets up is compiled against that class and
+    // calls into it directly rather than through the nes_mapper vtable
+    // Throws for unsupported mappers, leaving the slot alone - before_replace isn't called then
+    template <typename before_fn_t, typename fn_t>
+    static void load_into(nes_mapper_slot &slot, std::shared_ptr<const nes_rom_image> rom, before_fn_t &&before_replace,
+                          fn_t &&on_load)
+    {
+        switch (rom->mapper_id())
+        {
+            case 0: create<nes_mapper_nrom>(slot, std::move(rom), before_replace, on_load); break;
+            case 1: create<nes_mapper_mmc1>(slot, std::move(rom), before_replace, on_load); break;
+            case 2: create<nes_mapper_uxrom>(slot, std::move(rom), before_replace, on_load); break;
+            case 3: create<nes_mapper_cnrom>(slot, std::move(rom), before_replace, on_load); break;
+            case 4: create<nes_mapper_mmc3>(slot, std::move(rom), before_replace, on_load); break;
+            case 7: create<nes_mapper_axrom>(slot, std::move(rom), before_replace, on_load); break;
+            default:
+                throw std::runtime_error("Unsupported mapper " + std::to_string(rom->mapper_id()));
+        }
+    }
+
+private :
+    template <class mapper_t, typename before_fn_t, typename fn_t>
+    static void create(nes_mapper_slot &slot, std::shared_ptr<const nes_rom_image> rom, before_fn_t &before_replace,
+                       fn_t &on_load)
+    {
+        before_replace();
+        on_load(*slot.emplace<mapper_t>(std::move(rom)));
     }
 };
@@ -0,0 +1,38 @@
+#include <cstring>
+#include "nes_mapper.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+
+#define AXROM_PRG_BANK_MASK 0x7
+#define AXROM_UPPER_NAME_TABLE 0x10         // 0: one-screen $2000; 1: one-screen $2400
+
+void nes_mapper_axrom::on_load_ram(nes_memory &mem)
+{
+    _mem = &mem;
+    map_prg_ram();
+    map_prg(0x8000, 0x8000, 0);
+}
+
+void nes_mapper_axrom::on_load_ppu(nes_ppu &ppu)
+{
+    _ppu = &ppu;
+    set_mirroring(nes_mapper_flags_one_screen_lower_bank);
+    map_chr(0x0000, 0x2000, 0);
+}
+
+void nes_mapper_axrom::get_info(nes_mapper_info &info)
+{
+    memset(&info, 0, sizeof(info));
+
+    // Bank 0 on power on
+    info.code_addr = reset_vector(std::min(_rom->prg_size(), size_t(0x8000)));
+    info.reg_start = 0x8000;
+    info.reg_end = 0xffff;
+    info.flags = nes_mapper_flags(nes_mapper_flags_has_registers | nes_mapper_flags_one_screen_lower_bank);
+}
+
+void nes_mapper_axrom::write_reg(uint16_t addr, uint8_t val)
+{
+    map_prg(0x8000, 0x8000, val & AXROM_PRG_BANK_MASK);
+    set_mirroring((val & AXROM_UPPER_NAME_TABLE) ? nes_mapper_flags_one_screen_upper_bank : nes_mapper_flags_one_screen_lower_bank);
+}
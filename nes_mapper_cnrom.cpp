@@ -0,0 +1,35 @@
+#include <cstring>
+#include "nes_mapper.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+
+void nes_mapper_cnrom::on_load_ram(nes_memory &mem)
+{
+    _mem = &mem;
+    map_prg_ram();
+
+    // 16KB PRG ROM is "mapped" to 0xC000 as well
+    map_prg(0x8000, 0x8000, 0);
+}
+
+void nes_mapper_cnrom::on_load_ppu(nes_ppu &ppu)
+{
+    _ppu = &ppu;
+    map_chr(0x0000, 0x2000, 0);
+}
+
+void nes_mapper_cnrom::get_info(nes_mapper_info &info)
+{
+    memset(&info, 0, sizeof(info));
+
+    info.code_addr = (_rom->prg_size() == 0x4000) ? 0xc000 : 0x8000;
+    info.reg_start = 0x8000;
+    info.reg_end = 0xffff;
+    info.flags = nes_mapper_flags(nes_mapper_flags_has_registers | header_mirroring());
+}
+
+void nes_mapper_cnrom::write_reg(uint16_t addr, uint8_t val)
+{
+    // Bank numbers wrap around the CHR ROM
+    map_chr(0x0000, 0x2000, val);
+}
@@ -0,0 +1,131 @@
+#include <cstring>
+#include "nes_mapper.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+
+// Control register ($8000~$9fff)
+#define MMC1_CONTROL_MIRRORING_MASK 0x3     // same encoding as nes_mapper_flags mirroring
+#define MMC1_CONTROL_PRG_MODE_MASK 0xc      // 0/1: 32KB at $8000; 2: first bank at $8000; 3: last bank at $c000
+#define MMC1_CONTROL_PRG_MODE_SHIFT 2
+#define MMC1_CONTROL_CHR_4KB 0x10           // 0: one 8KB CHR bank; 1: two 4KB CHR banks
+
+// Writing a byte with bit 7 set resets the shift register
+#define MMC1_RESET_MASK 0x80
+
+#define MMC1_PRG_BANK_MASK 0xf
+
+void nes_mapper_mmc1::on_load_ram(nes_memory &mem)
+{
+    _mem = &mem;
+    map_prg_ram();
+
+    _shift_reg = 0;
+    _shift_count = 0;
+    _control = MMC1_CONTROL_PRG_MODE_MASK;      // power on with the last bank fixed at $c000
+    _chr_bank_0 = 0;
+    _chr_bank_1 = 0;
+    _prg_bank = 0;
+
+    update_prg_banks();
+}
+
+void nes_mapper_mmc1::on_load_ppu(nes_ppu &ppu)
+{
+    _ppu = &ppu;
+
+    set_mirroring(nes_mapper_flags(_control & MMC1_CONTROL_MIRRORING_MASK));
+    update_chr_banks();
+}
+
+void nes_mapper_mmc1::get_info(nes_mapper_info &info)
+{
+    memset(&info, 0, sizeof(info));
+
+    // Last bank is fixed at $c000 on power on
+    info.code_addr = reset_vector(_rom->prg_size());
+    info.reg_start = 0x8000;
+    info.reg_end = 0xffff;
+    info.flags = nes_mapper_flags(nes_mapper_flags_has_registers | header_mirroring());
+}
+
+//
+// Registers are loaded one bit at a time - the 5th write picks the register by its address
+//
+void nes_mapper_mmc1::write_reg(uint16_t addr, uint8_t val)
+{
+    if (val & MMC1_RESET_MASK)
+    {
+        _shift_reg = 0;
+        _shift_count = 0;
+        _control |= MMC1_CONTROL_PRG_MODE_MASK;
+        update_prg_banks();
+        return;
+    }
+
+    _shift_reg |= (val & 0x1) << _shift_count;
+    if (++_shift_count < 5)
+        return;
+
+    uint8_t reg = _shift_reg;
+    _shift_reg = 0;
+    _shift_count = 0;
+
+    switch (addr & 0xe000)
+    {
+        case 0x8000:
+            _control = reg;
+            set_mirroring(nes_mapper_flags(_control & MMC1_CONTROL_MIRRORING_MASK));
+            update_prg_banks();
+            update_chr_banks();
+            break;
+        case 0xa000:
+            _chr_bank_0 = reg;
+            update_chr_banks();
+            break;
+        case 0xc000:
+            _chr_bank_1 = reg;
+            update_chr_banks();
+            break;
+        case 0xe000:
+            _prg_bank = reg & MMC1_PRG_BANK_MASK;
+            update_prg_banks();
+            break;
+    }
+}
+
+void nes_mapper_mmc1::update_prg_banks()
+{
+    switch ((_control & MMC1_CONTROL_PRG_MODE_MASK) >> MMC1_CONTROL_PRG_MODE_SHIFT)
+    {
+        case 0:
+        case 1:
+            // 32KB - low bit of the bank number is ignored
+            map_prg(0x8000, 0x8000, _prg_bank >> 1);
+            break;
+        case 2:
+            map_prg(0x8000, 0x4000, 0);
+            map_prg(0xc000, 0x4000, _prg_bank);
+            break;
+        case 3:
+            map_prg(0x8000, 0x4000, _prg_bank);
+            map_prg(0xc000, 0x4000, prg_bank_count(0x4000) - 1);
+            break;
+    }
+}
+
+void nes_mapper_mmc1::update_chr_banks()
+{
+    if (!_ppu)
+        return;
+
+    if (_control & MMC1_CONTROL_CHR_4KB)
+    {
+        map_chr(0x0000, 0x1000, _chr_bank_0);
+        map_chr(0x1000, 0x1000, _chr_bank_1);
+    }
+    else
+    {
+        // 8KB - low bit of the bank number is ignored
+        map_chr(0x0000, 0x2000, _chr_bank_0 >> 1);
+    }
+}
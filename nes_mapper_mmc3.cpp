@@ -0,0 +1,201 @@
+#include <climits>
+#include <cstring>
+#include "nes_mapper.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+#include "nes_system.h"
+
+// Bank select ($8000~$9ffe, even)
+#define MMC3_BANK_SELECT_REG_MASK 0x7       // which of R0~R7 the next bank data write goes to
+#define MMC3_BANK_SELECT_PRG_MODE 0x40      // 0: R6 at $8000, second last bank at $c000; 1: swapped
+#define MMC3_BANK_SELECT_CHR_A12 0x80       // 0: 2KB banks at $0000; 1: 2KB banks at $1000
+
+// Mirroring ($a000~$bffe, even)
+#define MMC3_MIRRORING_HORIZONTAL 0x1
+
+void nes_mapper_mmc3::on_load_ram(nes_memory &mem)
+{
+    _mem = &mem;
+    _system = mem._system;
+    map_prg_ram();
+
+    _bank_select = 0;
+    memset(_banks, 0, sizeof(_banks));
+    _banks[1] = 2;                      // R0/R1 are 2KB banks - power on with the first 8KB of CHR in order
+    _banks[2] = 4;
+    _banks[3] = 5;
+    _banks[4] = 6;
+    _banks[5] = 7;
+    _banks[7] = 1;
+
+    _irq_latch = 0;
+    _irq_counter = 0;
+    _irq_reload = false;
+    _irq_enabled = false;
+
+    update_prg_banks();
+}
+
+void nes_mapper_mmc3::on_load_ppu(nes_ppu &ppu)
+{
+    _ppu = &ppu;
+    _irq_sync = ppu.position();
+
+    update_chr_banks();
+}
+
+void nes_mapper_mmc3::get_info(nes_mapper_info &info)
+{
+    memset(&info, 0, sizeof(info));
+
+    // Last bank is always at $e000
+    info.code_addr = reset_vector(_rom->prg_size());
+    info.reg_start = 0x8000;
+    info.reg_end = 0xffff;
+    info.flags = nes_mapper_flags(nes_mapper_flags_has_registers | header_mirroring());
+}
+
+//
+// 4 pairs of registers - A14/A13 pick the pair, A0 the register within it
+//
+void nes_mapper_mmc3::write_reg(uint16_t addr, uint8_t val)
+{
+    switch (addr & 0xe001)
+    {
+        case 0x8000:
+            _bank_select = val;
+            update_prg_banks();
+            update_chr_banks();
+            break;
+        case 0x8001:
+            _banks[_bank_select & MMC3_BANK_SELECT_REG_MASK] = val;
+            if ((_bank_select & MMC3_BANK_SELECT_REG_MASK) >= 6)
+                update_prg_banks();
+            else
+                update_chr_banks();
+            break;
+        case 0xa000:
+            set_mirroring((val & MMC3_MIRRORING_HORIZONTAL) ? nes_mapper_flags_horizontal_mirroring : nes_mapper_flags_vertical_mirroring);
+            break;
+        case 0xa001:
+            // PRG RAM protect - PRG RAM is always writable
+            break;
+        case 0xc000:
+            sync_irq_counter(_ppu->a12_rise_dot());
+            _irq_latch = val;
+            schedule_irq();
+            break;
+        case 0xc001:
+            sync_irq_counter(_ppu->a12_rise_dot());
+            _irq_counter = 0;
+            _irq_reload = true;
+            schedule_irq();
+            break;
+        case 0xe000:
+            // Disabling also acknowledges a pending IRQ
+            sync_irq_counter(_ppu->a12_rise_dot());
+            _irq_enabled = false;
+            _system->getCpu()->set_irq_line(nes_irq_source_mapper, false);
+            schedule_irq();
+            break;
+        case 0xe001:
+            sync_irq_counter(_ppu->a12_rise_dot());
+            _irq_enabled = true;
+            schedule_irq();
+            break;
+    }
+}
+
+void nes_mapper_mmc3::on_irq_event()
+{
+    sync_irq_counter(_ppu->a12_rise_dot());
+    schedule_irq();
+}
+
+void nes_mapper_mmc3::on_a12_timing_change(int old_rise_dot)
+{
+    sync_irq_counter(old_rise_dot);
+    schedule_irq();
+}
+
+void nes_mapper_mmc3::sync_irq_counter(int rise_dot)
+{
+    _ppu->step_to(_system->getCpu()->cycle());
+    nes_ppu_position now = _ppu->position();
+
+    nes_cycle_t last_rise;
+    int clocks = _ppu->count_a12_rises(_irq_sync, now.cycle, INT_MAX, rise_dot, last_rise);
+    _irq_sync = now;
+
+    clock_irq_counter(clocks);
+}
+
+void nes_mapper_mmc3::clock_irq_counter(int clocks)
+{
+    while (clocks > 0)
+    {
+        if (_irq_counter == 0 || _irq_reload)
+        {
+            _irq_counter = _irq_latch;
+            _irq_reload = false;
+            clocks--;
+        }
+        else
+        {
+            int count = std::min(clocks, int(_irq_counter));
+            _irq_counter -= count;
+            clocks -= count;
+        }
+
+        if (_irq_counter == 0 && _irq_enabled)
+            _system->getCpu()->set_irq_line(nes_irq_source_mapper, true);
+    }
+}
+
+void nes_mapper_mmc3::schedule_irq()
+{
+    nes_cycle_t when = NES_EVENT_NEVER;
+    if (_irq_enabled)
+    {
+        // Clocks until the counter is 0 again - a reload takes one clock of its own
+        int clocks = (_irq_counter == 0 || _irq_reload) ? _irq_latch + 1 : _irq_counter;
+
+        nes_cycle_t last_rise;
+        if (_ppu->count_a12_rises(_irq_sync, NES_EVENT_NEVER, clocks, _ppu->a12_rise_dot(), last_rise) == clocks)
+            when = last_rise;
+    }
+
+    _system->schedule(nes_event::MAPPER_IRQ, when);
+}
+
+void nes_mapper_mmc3::update_prg_banks()
+{
+    int second_last = prg_bank_count(0x2000) - 2;
+    if (_bank_select & MMC3_BANK_SELECT_PRG_MODE)
+    {
+        map_prg(0x8000, 0x2000, second_last);
+        map_prg(0xc000, 0x2000, _banks[6]);
+    }
+    else
+    {
+        map_prg(0x8000, 0x2000, _banks[6]);
+        map_prg(0xc000, 0x2000, second_last);
+    }
+
+    map_prg(0xa000, 0x2000, _banks[7]);
+    map_prg(0xe000, 0x2000, second_last + 1);
+}
+
+void nes_mapper_mmc3::update_chr_banks()
+{
+    if (!_ppu)
+        return;
+
+    // 2KB banks ignore the low bit
+    uint16_t banks_2k = (_bank_select & MMC3_BANK_SELECT_CHR_A12) ? 0x1000 : 0x0000;
+    uint16_t banks_1k = banks_2k ^ 0x1000;
+    map_chr(banks_2k, 0x800, _banks[0] >> 1);
+    map_chr(banks_2k + 0x800, 0x800, _banks[1] >> 1);
+    for (int i = 0; i < 4; ++i)
+        map_chr(banks_1k + i * 0x400, 0x400, _banks[2 + i]);
+}
@@ -5,28 +5,25 @@
 
 //
 // Called when mapper is loaded into memory
-// Useful when all you need is a one-time memcpy
+// PRG ROM is mapped straight into the CPU page table - no copy
 //
 void nes_mapper_nrom::on_load_ram(nes_memory &mem)
 {
-    // memcpy
-    mem.set_bytes(0x8000, _prg_rom->data(), _prg_rom->size());
+    _mem = &mem;
+    map_prg_ram();
 
-    if (_prg_rom->size() == 0x4000)
-    {
-        // "map" 0xC000 to 0x8000
-        mem.set_bytes(0xc000, _prg_rom->data(), _prg_rom->size());
-    }
+    // 16KB PRG ROM is "mapped" to 0xC000 as well
+    map_prg(0x8000, 0x8000, 0);
 }
 
 //
 // Called when mapper is loaded into PPU
-// Useful when all you need is a one-time memcpy
+// CHR ROM is mapped straight into the PPU pattern tables - no copy
 //
 void nes_mapper_nrom::on_load_ppu(nes_ppu &ppu)
 {
-    // memcpy
-    ppu.write_bytes(0x0000, _chr_rom->data(), _chr_rom->size());
+    _ppu = &ppu;
+    map_chr(0x0000, 0x2000, 0);
 }
 
 //
@@ -36,14 +33,10 @@ void nes_mapper_nrom::get_info(nes_mapper_info &info)
 {
     memset(&info, 0, sizeof(info));
 
-    if (_prg_rom->size() == 0x4000)
+    if (_rom->prg_size() == 0x4000)
         info.code_addr = 0xc000;
     else
         info.code_addr = 0x8000;
 
-    info.flags = nes_mapper_flags_none;
-    if (_vertical_mirroring)
-        info.flags = nes_mapper_flags(info.flags | nes_mapper_flags_vertical_mirroring);
-    else
-        info.flags = nes_mapper_flags(info.flags | nes_mapper_flags_horizontal_mirroring);
+    info.flags = header_mirroring();
 }
@@ -1,26 +1,268 @@
+#include <algorithm>
 #include "nes_memory.h"
 #include "nes_system.h"
 
 void nes_memory::init(nes_system *system) {
-    memset(&memory[0], 0, RAM_SIZE);
+    memset(_state.ram, 0, sizeof(_state.ram));
+    memset(_state.prg_ram, 0, sizeof(_state.prg_ram));
+    _system = system;
     _ppu = system->getPpu();
+    _cpu = system->getCpu();
     _input = system->getInput();
+
+    reset_pages();
+}
+
+//
+// Power-on memory map without any cartridge
+//
+void nes_memory::reset_pages()
+{
+    // $0000~$07ff internal RAM, mirrored 4 times until $1fff
+    for (int mirror = 0; mirror < 0x2000; mirror += NES_INTERNAL_RAM_SIZE)
+        map_ram(mirror >> NES_PAGE_SHIFT, NES_INTERNAL_RAM_SIZE / NES_PAGE_SIZE, _state.ram);
+
+    // $2000~$2007 PPU registers, mirrored every 8 bytes until $3fff
+    map_io(0x20, 0x20, read_ppu_reg, write_ppu_reg);
+
+    // $4000~$401f APU and I/O registers - the rest of the page is cartridge space
+    map_io(0x40, 1, read_apu_io_reg, write_apu_io_reg);
+
+    // $4100~$ffff cartridge space - nothing there until a mapper maps its PRG ROM/RAM
+    map_io(0x41, NES_PAGE_COUNT - 0x41, read_open_bus, write_rom);
+}
+
+void nes_memory::map_flat_ram()
+{
+    _flat_ram.assign(RAM_SIZE - 0x4100, 0);
+    map_ram(0x41, NES_PAGE_COUNT - 0x41, _flat_ram.data());
+}
+
+void nes_memory::map_ram(uint8_t page, int count, uint8_t *data)
+{
+    assert(page + count <= NES_PAGE_COUNT);
+    for (int i = 0; i < count; ++i)
+    {
+        _read_pages[page + i] = _write_pages[page + i] = data + i * NES_PAGE_SIZE;
+        _read_handlers[page + i] = nullptr;
+        _write_handlers[page + i] = nullptr;
+        set_code_page(page + i, nullptr);
+        overlay_patches(page + i);
+    }
+
+    // The RAM becomes writable through these pages without protect_code knowing
+    _cpu->invalidate_code(data, count * NES_PAGE_SIZE);
+}
+
+void nes_memory::map_rom(uint8_t page, int count, const uint8_t *data)
+{
+    assert(page + count <= NES_PAGE_COUNT);
+    for (int i = 0; i < count; ++i)
+    {
+        // Never written through - _write_pages stays null, so the (possibly read-only) mapping is safe
+        _read_pages[page + i] = const_cast<uint8_t *>(data) + i * NES_PAGE_SIZE;
+        _write_pages[page + i] = nullptr;
+        _read_handlers[page + i] = nullptr;
+        _write_handlers[page + i] = is_mapper_reg_page(page + i) ? _mapper_reg_handler : write_rom;
+        set_code_page(page + i, nullptr);
+        overlay_patches(page + i);
+    }
+
+    _cpu->abort_block();
+}
+
+void nes_memory::map_io(uint8_t page, int count, nes_read_handler read_handler, nes_write_handler write_handler)
+{
+    assert(page + count <= NES_PAGE_COUNT);
+    for (int i = 0; i < count; ++i)
+    {
+        _read_pages[page + i] = _write_pages[page + i] = nullptr;
+        _read_handlers[page + i] = read_handler;
+        _write_handlers[page + i] = write_handler;
+        set_code_page(page + i, nullptr);
+        overlay_patches(page + i);
+    }
+
+    _cpu->abort_block();
+}
+
+void nes_memory::add_patch(const nes_patch &patch)
+{
+    remove_patch(patch.addr);
+
+    int page = patch.addr >> NES_PAGE_SHIFT;
+    _patches.push_back(patch);
+    if (_patch_counts[page]++ == 0)
+        overlay_patches(page);
+
+    // The running block may have been decoded from the page
+    _cpu->abort_block();
+}
+
+void nes_memory::remove_patch(uint16_t addr)
+{
+    auto found = std::find_if(_patches.begin(), _patches.end(), [addr](const nes_patch &patch) { return patch.addr == addr; });
+    if (found == _patches.end())
+        return;
+
+    _patches.erase(found);
+    int page = addr >> NES_PAGE_SHIFT;
+    if (--_patch_counts[page] == 0)
+        remove_overlay(page);
+}
+
+void nes_memory::clear_patches()
+{
+    while (!_patches.empty())
+        remove_patch(_patches.back().addr);
+}
+
+void nes_memory::remove_overlay(int page)
+{
+    // Blocks decoded from the page before the patches went in hold the unpatched bytes - which is what it
+    // reads again now
+    _read_pages[page] = _patched_pages[page];
+    _read_handlers[page] = _patched_handlers[page];
+}
+
+uint8_t nes_memory::read_patched_page(nes_memory &mem, uint16_t addr)
+{
+    int page = addr >> NES_PAGE_SHIFT;
+    uint8_t *host = mem._patched_pages[page];
+    uint8_t val = host ? host[addr & 0xff] : mem._patched_handlers[page](mem, addr);
+
+    for (const nes_patch &patch : mem._patches)
+    {
+        if (patch.addr == addr && (patch.compare < 0 || patch.compare == val))
+            return patch.value;
+    }
+
+    return val;
+}
+
+void nes_memory::protect_code(uint8_t page)
+{
+    uint8_t *host = _write_pages[page];
+    if (!host || host != _read_pages[page])
+        return;
+
+    for (int i = 0; i < NES_PAGE_COUNT; ++i)
+    {
+        if (_write_pages[i] == host)
+        {
+            set_code_page(i, host);
+            _write_pages[i] = nullptr;
+            _write_handlers[i] = write_code_page;
+        }
+    }
 }
 
-void nes_memory::load_mapper(std::shared_ptr<nes_mapper> &mapper)
+void nes_memory::unload_mapper()
 {
-    // unset previous mapper
+    // Nothing the previous cartridge (or map_flat_ram) mapped stays around
     _mapper = nullptr;
+    map_io(0x41, NES_PAGE_COUNT - 0x41, read_open_bus, write_rom);
+    _flat_ram = std::vector<uint8_t>();
+}
 
-    // Give mapper a chance to copy all the bytes needed
-    mapper->on_load_ram(*this);
+void nes_memory::load_mapper(nes_mapper &mapper, nes_write_handler reg_handler)
+{
+    unload_mapper();
 
-    _mapper = mapper;
+    // Info first - map_rom needs to know where the mapper registers are
+    _mapper = &mapper;
     _mapper->get_info(_mapper_info);
+    _mapper_reg_handler = reg_handler;
+
+    // Mapper maps its power-on PRG banks
+    _mapper->on_load_ram(*this);
+
+    // Mapper registers sit on top of ROM - writes to them go to the mapper
+    if (_mapper_info.flags & nes_mapper_flags_has_registers)
+    {
+        for (int page = _mapper_info.reg_start >> NES_PAGE_SHIFT; page <= _mapper_info.reg_end >> NES_PAGE_SHIFT; ++page)
+        {
+            _write_pages[page] = nullptr;
+            _write_handlers[page] = _mapper_reg_handler;
+            set_code_page(page, nullptr);
+        }
+    }
+}
+
+bool nes_memory::is_mapper_reg_page(int page)
+{
+    return _mapper && (_mapper_info.flags & nes_mapper_flags_has_registers) &&
+           page >= (_mapper_info.reg_start >> NES_PAGE_SHIFT) && page <= (_mapper_info.reg_end >> NES_PAGE_SHIFT);
+}
+
+uint8_t nes_memory::read_ppu_reg(nes_memory &mem, uint16_t addr)
+{
+    // map 0x2000~0x2008 every 8 bytes until 0x3fff
+    return mem.read_io_reg(addr & 0x2007);
+}
+
+void nes_memory::write_ppu_reg(nes_memory &mem, uint16_t addr, uint8_t val)
+{
+    mem.write_io_reg(addr & 0x2007, val);
+}
+
+uint8_t nes_memory::read_apu_io_reg(nes_memory &mem, uint16_t addr)
+{
+    // $4000~401f
+    if (addr < 0x4020)
+        return mem.read_io_reg(addr);
+
+    return read_open_bus(mem, addr);
+}
+
+void nes_memory::write_apu_io_reg(nes_memory &mem, uint16_t addr, uint8_t val)
+{
+    // $4000~401f
+    if (addr < 0x4020)
+        mem.write_io_reg(addr, val);
+}
+
+uint8_t nes_memory::read_open_bus(nes_memory &mem, uint16_t addr)
+{
+    // Nothing drives the data bus - it still holds the last byte fetched, which for absolute addressing
+    // is the high byte of the address
+    return uint8_t(addr >> 8);
+}
+
+void nes_memory::write_rom(nes_memory &mem, uint16_t addr, uint8_t val)
+{
+    // ROM is read-only
+}
+
+void nes_memory::write_code_page(nes_memory &mem, uint16_t addr, uint8_t val)
+{
+    // Unprotect the page and all its mirrors - until code gets decoded from it again, writes go straight through
+    // Only the protected pages are looked at, 64 at a time
+    uint8_t *host = mem._code_pages[addr >> NES_PAGE_SHIFT];
+    for (int word = 0; word < NES_PAGE_COUNT / 64; ++word)
+    {
+        uint64_t mask = mem._code_page_mask[word];
+        for (int i = word * 64; mask; ++i, mask >>= 1)
+        {
+            if ((mask & 1) && mem._code_pages[i] == host)
+            {
+                mem.set_code_page(i, nullptr);
+                mem._write_pages[i] = host;
+                mem._write_handlers[i] = nullptr;
+            }
+        }
+    }
+
+    host[addr & 0xff] = val;
+    mem._cpu->invalidate_code(host, NES_PAGE_SIZE);
 }
 
 uint8_t nes_memory::read_io_reg(uint16_t addr)
 {
+    // PPU runs behind the CPU and only catches up when it has to - which includes right now
+    if (addr < 0x4000)
+        _ppu->step_to(_cpu->cycle());
+
     switch (addr)
     {
         case 0x2002: return _ppu->read_PPUSTATUS();
@@ -35,6 +277,9 @@ uint8_t nes_memory::read_io_reg(uint16_t addr)
 
 void nes_memory::write_io_reg(uint16_t addr, uint8_t val)
 {
+    if (addr < 0x4000)
+        _ppu->step_to(_cpu->cycle());
+
     switch (addr)
     {
         case 0x2000: _ppu->write_PPUCTRL(val); return;
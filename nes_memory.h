@@ -5,26 +5,52 @@
 #include <assert.h>
 #include <cstring>
 #include <cerrno>
+#include "nes_cheat.h"
 #include "nes_mapper.h"
 #include "nes_input.h"
+#include "nes_state.h"
 
+// CPU address space
 #define RAM_SIZE 0x10000
 
+//
+// CPU address space is described with a page table of 256 pages x 256 bytes
+// Plain memory (RAM, PRG ROM/RAM) is read/written straight through a host pointer. Mirroring and bank
+// switching are done by pointing several pages at the same host memory. Everything else - PPU/APU/controller
+// registers, mapper registers, writes to ROM - has no host pointer and goes through the page handler.
+//
+#define NES_PAGE_SHIFT 8
+#define NES_PAGE_SIZE 0x100
+#define NES_PAGE_COUNT 0x100
+
 class nes_system;
+class nes_cpu;
+class nes_memory;
+
+typedef uint8_t (*nes_read_handler)(nes_memory &mem, uint16_t addr);
+typedef void (*nes_write_handler)(nes_memory &mem, uint16_t addr, uint8_t val);
 
 class nes_memory {
 public:
-    std::vector<uint8_t> memory;
-    std::shared_ptr<nes_mapper> _mapper;
+    nes_mapper *_mapper;                        // owned by nes_system - nullptr without a cartridge
+    nes_system *_system;
     nes_ppu *_ppu;
+    nes_cpu *_cpu;
     nes_input *_input;
     nes_mapper_info _mapper_info;
-    nes_memory(){
-        memory.reserve(RAM_SIZE);
-    }
+    explicit nes_memory(nes_state &state) : _mapper(nullptr), _state(state), _code_page_mask(), _patch_counts() {}
 
     void init(nes_system* system);
 
+    // Internal RAM and PRG RAM live in the console state
+    nes_state &state() { return _state; }
+
+    //
+    // Plain RAM all over cartridge space ($4100~$ffff) instead of a cartridge - for test programs and
+    // benchmarks that poke code and vectors anywhere. Until a mapper is loaded.
+    //
+    void map_flat_ram();
+
     static error_t memcpy_s(void *dest, size_t dest_size, const void *src, size_t count)
     {
         if (dest_size < count)
@@ -35,83 +61,166 @@ public:
         return 0;
     }
 
-    void redirect_addr(uint16_t &addr)
-    {
-        if ((addr & 0xE000) == 0)
-        {
-            // map 0x0000~0x07ff 4 times until 0x1fff
-            addr &= 0x7ff;
-        }
-        else if ((addr & 0xE000) == 0x2000)
-        {
-            // map 0x2000~0x2008 every 8 bytes until 0x3fff
-            addr &= 0x2007;
-        }
-    }
-
     uint16_t get_word(uint16_t addr)
     {
-        redirect_addr(addr);
         return get_byte(addr) + (uint16_t(get_byte(addr + 1)) << 8);
     }
 
+    // Copies into memory without triggering any I/O - for loading programs
+    // Pages without writable host memory (ROM, registers) are left alone
     void set_bytes(uint16_t addr, uint8_t* data, std::size_t size){
         assert(size + addr <= RAM_SIZE);
-        redirect_addr(addr);
-        memcpy_s(&memory[0] + addr, RAM_SIZE - addr, data, size);
+        for (std::size_t i = 0; i < size; ++i, ++addr)
+        {
+            uint8_t *page = _write_pages[addr >> NES_PAGE_SHIFT];
+            if (page)
+                page[addr & 0xff] = data[i];
+            else if (_code_pages[addr >> NES_PAGE_SHIFT])
+                write_code_page(*this, addr, data[i]);
+        }
     }
 
     uint8_t read_io_reg(uint16_t addr);
     void write_io_reg(uint16_t addr, uint8_t val);
 
-    bool is_io_reg(uint16_t addr)
-    {
-        // $2000~$2007
-        if ((addr & 0xfff8) == 0x2000)
-            return true;
-        // $4000~401f
-        if ((addr & 0xffe0) == 0x4000)
-            return true;
-        return false;
-    }
-
     uint8_t get_byte(uint16_t addr)
     {
-        redirect_addr(addr);
-        if (is_io_reg(addr))
-            return read_io_reg(addr);
+        uint8_t *page = _read_pages[addr >> NES_PAGE_SHIFT];
+        if (page)
+            return page[addr & 0xff];
 
-        return memory[addr];
+        return _read_handlers[addr >> NES_PAGE_SHIFT](*this, addr);
     }
 
     void get_bytes(uint8_t *dest, uint16_t dest_size, uint16_t src_addr, size_t src_size)
     {
         assert(src_addr + src_size <= RAM_SIZE);
-        redirect_addr(src_addr);
-        memcpy_s(dest, dest_size, & memory[0] + src_addr, src_size);
+        assert(src_size <= dest_size);
+        for (size_t i = 0; i < src_size; ++i)
+            dest[i] = get_byte(src_addr + i);
     }
 
     void set_byte(uint16_t addr, uint8_t val)
     {
-        redirect_addr(addr);
-        if (is_io_reg(addr))
+        uint8_t *page = _write_pages[addr >> NES_PAGE_SHIFT];
+        if (page)
         {
-            write_io_reg(addr, val);
+            page[addr & 0xff] = val;
             return;
         }
 
-        if (_mapper && (_mapper_info.flags & nes_mapper_flags_has_registers))
-        {
-            if (addr >= _mapper_info.reg_start && addr <= _mapper_info.reg_end)
-            {
-                //_mapper->write_reg(addr, val);
-                return;
-            }
-        }
+        _write_handlers[addr >> NES_PAGE_SHIFT](*this, addr, val);
+    }
 
-        memory[addr] = val;
+    // Mapper register writes call mapper_t::write_reg directly - mapper_t is final, so the page handler is
+    // an ordinary function call instead of a virtual one (nes_mapper itself goes through the vtable)
+    // The mapper must stay alive until unload_mapper or the next load_mapper
+    template <class mapper_t>
+    void load_mapper(mapper_t &mapper)
+    {
+        load_mapper(mapper, write_mapper_reg<mapper_t>);
     }
 
-    void load_mapper(std::shared_ptr<nes_mapper> &mapper);
-};
+    // Cartridge space goes back to open bus
+    void unload_mapper();
+
+    // Host memory behind addr if it is plain memory (RAM/ROM) that code can be decoded from, nullptr otherwise
+    const uint8_t *get_code_ptr(uint16_t addr)
+    {
+        uint8_t *page = _read_pages[addr >> NES_PAGE_SHIFT];
+        if (page)
+            return page + (addr & 0xff);
+
+        return nullptr;
+    }
 
+    // CPU has decoded code from this page - if it is RAM, route writes to it (through any mirror) to
+    // write_code_page so the decoded blocks get thrown away
+    void protect_code(uint8_t page);
+
+    //
+    // Page table setup - page is the high byte of the address, data must cover count * NES_PAGE_SIZE bytes
+    //
+    void map_ram(uint8_t page, int count, uint8_t *data);
+    void map_rom(uint8_t page, int count, const uint8_t *data);
+    void map_io(uint8_t page, int count, nes_read_handler read_handler, nes_write_handler write_handler);
+
+    //
+    // Cheats, overlaid on the page table - a page holding a patch hands its read pointer over to
+    // read_patched_page, so reads anywhere else (everywhere, without patches) cost what they always did.
+    // Code on a patched page runs in the interpreter. Patches stay through bank switches, reset and
+    // attach_rom until removed. Replaces any patch at the same address
+    //
+    void add_patch(const nes_patch &patch);
+    void remove_patch(uint16_t addr);
+    void clear_patches();
+    const std::vector<nes_patch> &patches() const { return _patches; }
+
+private :
+    friend class nes_jit_compiler;         // inlines get_byte/set_byte into native code
+
+    void reset_pages();
+
+    void load_mapper(nes_mapper &mapper, nes_write_handler reg_handler);
+
+    // Writes to this page go to the mapper rather than being dropped like other ROM writes
+    bool is_mapper_reg_page(int page);
+
+    static uint8_t read_ppu_reg(nes_memory &mem, uint16_t addr);
+    static void write_ppu_reg(nes_memory &mem, uint16_t addr, uint8_t val);
+    static uint8_t read_apu_io_reg(nes_memory &mem, uint16_t addr);
+    static void write_apu_io_reg(nes_memory &mem, uint16_t addr, uint8_t val);
+    static uint8_t read_open_bus(nes_memory &mem, uint16_t addr);
+    static void write_rom(nes_memory &mem, uint16_t addr, uint8_t val);
+    static void write_code_page(nes_memory &mem, uint16_t addr, uint8_t val);
+    static uint8_t read_patched_page(nes_memory &mem, uint16_t addr);
+
+    // The page was just (re)mapped - if it holds patches, they take its read pointer over again
+    void overlay_patches(int page)
+    {
+        if (!_patch_counts[page])
+            return;
+
+        _patched_pages[page] = _read_pages[page];
+        _patched_handlers[page] = _read_handlers[page];
+        _read_pages[page] = nullptr;
+        _read_handlers[page] = read_patched_page;
+    }
+
+    void remove_overlay(int page);
+
+    // _code_pages and _code_page_mask go together
+    void set_code_page(int page, uint8_t *host)
+    {
+        uint64_t bit = uint64_t(1) << (page & 63);
+        _code_pages[page] = host;
+        if (host)
+            _code_page_mask[page >> 6] |= bit;
+        else
+            _code_page_mask[page >> 6] &= ~bit;
+    }
+
+    template <class mapper_t>
+    static void write_mapper_reg(nes_memory &mem, uint16_t addr, uint8_t val)
+    {
+        if (addr >= mem._mapper_info.reg_start && addr <= mem._mapper_info.reg_end)
+            static_cast<mapper_t *>(mem._mapper)->write_reg(addr, val);
+    }
+
+private :
+    nes_state &_state;
+    std::vector<uint8_t> _flat_ram;             // see map_flat_ram - empty otherwise
+
+    uint8_t *_read_pages[NES_PAGE_COUNT];
+    uint8_t *_write_pages[NES_PAGE_COUNT];
+    nes_read_handler _read_handlers[NES_PAGE_COUNT];
+    nes_write_handler _write_handlers[NES_PAGE_COUNT];
+    uint8_t *_code_pages[NES_PAGE_COUNT];       // write pointer of RAM pages taken away by protect_code
+    uint64_t _code_page_mask[NES_PAGE_COUNT / 64];  // pages with a _code_pages entry
+    nes_write_handler _mapper_reg_handler;      // write_mapper_reg for the loaded mapper's class
+
+    std::vector<nes_patch> _patches;
+    uint16_t _patch_counts[NES_PAGE_COUNT];     // patches per page - every byte of a page may have one
+    uint8_t *_patched_pages[NES_PAGE_COUNT];    // read pointer/handler the page would have without patches
+    nes_read_handler _patched_handlers[NES_PAGE_COUNT];
+};
@@ -0,0 +1,165 @@
+#include "nes_pixels.h"
+#include "nes_ppu.h"
+
+//
+// The vector kernels are picked at run time, so they are compiled for their instruction sets function by
+// function - which takes GCC/Clang
+//
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(NES_NO_SIMD)
+#define NES_PIXELS_X86 1
+#include <immintrin.h>
+#endif
+
+static void compose_scalar(const nes_pixel_line &line, int x, int end, uint8_t *out)
+{
+    if (!line.sprites)
+    {
+        for (; x < end; ++x)
+            out[x] = line.palette[(x >= 8 || line.bg_left) ? line.bg[x] : 0] & line.color_mask;
+
+        return;
+    }
+
+    for (; x < end; ++x)
+    {
+        int entry = (x >= 8 || line.bg_left) ? line.bg[x] : 0;
+        uint8_t sprite = (line.sprites && (x >= 8 || line.sprites_left)) ? line.sprites[x] : 0;
+        if (sprite && !(entry && (sprite & PPU_SPRITE_ATTR_BEHIND_BG)))
+            entry = sprite & 0x1f;
+
+        out[x] = line.palette[entry] & line.color_mask;
+    }
+}
+
+#ifdef NES_PIXELS_X86
+
+// Loaded from x (< 8) - keeps the pixels from 8 on
+static const uint8_t s_left_clip[8 + 32] = {
+        0, 0, 0, 0, 0, 0, 0, 0,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+//
+// 16 pixels at a time from x while there are that many left - returns where it stopped. Inlined into the AVX2
+// kernel as well, so it gets VEX encoded there: legacy SSE code right after AVX2 code pays for the switch
+//
+__attribute__((target("ssse3"), always_inline))
+static inline int compose_16(const nes_pixel_line &line, int x, int end, uint8_t *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i behind_bg = _mm_set1_epi8(PPU_SPRITE_ATTR_BEHIND_BG);
+    const __m128i entry_bits = _mm_set1_epi8(0x1f);
+    const __m128i upper_half = _mm_set1_epi8(0x10);
+    const __m128i color_mask = _mm_set1_epi8(char(line.color_mask));
+    const __m128i palette_lo = _mm_loadu_si128((const __m128i *)line.palette);
+    const __m128i palette_hi = _mm_loadu_si128((const __m128i *)(line.palette + 16));
+
+    for (; x + 16 <= end; x += 16)
+    {
+        __m128i bg = _mm_loadu_si128((const __m128i *)(line.bg + x));
+        __m128i sprite = line.sprites ? _mm_loadu_si128((const __m128i *)(line.sprites + x)) : zero;
+        if (x < 8)
+        {
+            __m128i clip = _mm_loadu_si128((const __m128i *)(s_left_clip + x));
+            if (!line.bg_left)
+                bg = _mm_and_si128(bg, clip);
+            if (!line.sprites_left)
+                sprite = _mm_and_si128(sprite, clip);
+        }
+
+        // The background shows where there is no sprite, or the sprite is behind an opaque background
+        __m128i behind = _mm_andnot_si128(_mm_cmpeq_epi8(bg, zero),
+                                          _mm_cmpeq_epi8(_mm_and_si128(sprite, behind_bg), behind_bg));
+        __m128i use_bg = _mm_or_si128(_mm_cmpeq_epi8(sprite, zero), behind);
+        __m128i entry = _mm_or_si128(_mm_and_si128(use_bg, bg),
+                                     _mm_andnot_si128(use_bg, _mm_and_si128(sprite, entry_bits)));
+
+        // PSHUFB looks up 16 entries by the low 4 bits - bit 4 picks the half of the palette
+        __m128i upper = _mm_cmpeq_epi8(_mm_and_si128(entry, upper_half), upper_half);
+        __m128i color = _mm_or_si128(_mm_andnot_si128(upper, _mm_shuffle_epi8(palette_lo, entry)),
+                                     _mm_and_si128(upper, _mm_shuffle_epi8(palette_hi, entry)));
+        _mm_storeu_si128((__m128i *)(out + x), _mm_and_si128(color, color_mask));
+    }
+
+    return x;
+}
+
+__attribute__((target("ssse3")))
+static void compose_ssse3(const nes_pixel_line &line, int x, int end, uint8_t *out)
+{
+    compose_scalar(line, compose_16(line, x, end, out), end, out);
+}
+
+__attribute__((target("avx2")))
+static void compose_avx2(const nes_pixel_line &line, int x, int end, uint8_t *out)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i behind_bg = _mm256_set1_epi8(PPU_SPRITE_ATTR_BEHIND_BG);
+    const __m256i entry_bits = _mm256_set1_epi8(0x1f);
+    const __m256i upper_half = _mm256_set1_epi8(0x10);
+    const __m256i color_mask = _mm256_set1_epi8(char(line.color_mask));
+
+    // VPSHUFB looks up within each 128-bit lane - both lanes get the same table
+    const __m256i palette_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)line.palette));
+    const __m256i palette_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(line.palette + 16)));
+
+    for (; x + 32 <= end; x += 32)
+    {
+        __m256i bg = _mm256_loadu_si256((const __m256i *)(line.bg + x));
+        __m256i sprite = line.sprites ? _mm256_loadu_si256((const __m256i *)(line.sprites + x)) : zero;
+        if (x < 8)
+        {
+            __m256i clip = _mm256_loadu_si256((const __m256i *)(s_left_clip + x));
+            if (!line.bg_left)
+                bg = _mm256_and_si256(bg, clip);
+            if (!line.sprites_left)
+                sprite = _mm256_and_si256(sprite, clip);
+        }
+
+        __m256i behind = _mm256_andnot_si256(_mm256_cmpeq_epi8(bg, zero),
+                                             _mm256_cmpeq_epi8(_mm256_and_si256(sprite, behind_bg), behind_bg));
+        __m256i use_bg = _mm256_or_si256(_mm256_cmpeq_epi8(sprite, zero), behind);
+        __m256i entry = _mm256_blendv_epi8(_mm256_and_si256(sprite, entry_bits), bg, use_bg);
+
+        __m256i upper = _mm256_cmpeq_epi8(_mm256_and_si256(entry, upper_half), upper_half);
+        __m256i color = _mm256_blendv_epi8(_mm256_shuffle_epi8(palette_lo, entry),
+                                           _mm256_shuffle_epi8(palette_hi, entry), upper);
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_and_si256(color, color_mask));
+    }
+
+    compose_scalar(line, compose_16(line, x, end, out), end, out);
+}
+
+#endif
+
+nes_pixel_kernel nes_pixel_kernel_supported(nes_pixel_kernel kernel)
+{
+#ifdef NES_PIXELS_X86
+    __builtin_cpu_init();
+    if (kernel == nes_pixel_kernel::AVX2 && !__builtin_cpu_supports("avx2"))
+        kernel = nes_pixel_kernel::SSSE3;
+    if (kernel == nes_pixel_kernel::SSSE3 && !__builtin_cpu_supports("ssse3"))
+        kernel = nes_pixel_kernel::SCALAR;
+
+    return kernel;
+#else
+    (void)kernel;
+    return nes_pixel_kernel::SCALAR;
+#endif
+}
+
+nes_compose_pixels_fn nes_compose_pixels(nes_pixel_kernel kernel)
+{
+    switch (nes_pixel_kernel_supported(kernel))
+    {
+#ifdef NES_PIXELS_X86
+    case nes_pixel_kernel::AVX2:
+        return compose_avx2;
+    case nes_pixel_kernel::SSSE3:
+        return compose_ssse3;
+#endif
+    default:
+        return compose_scalar;
+    }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+//
+// The last stage of the PPU's pixel pipeline - what comes out of a scanline, given the background and sprite
+// pixels over it:
+// * the leftmost 8 pixels of the background and/or sprites are hidden unless bg_left/sprites_left
+// * a sprite pixel wins over the background one, unless it is behind the background and that is opaque
+// * the palette entry of the winner is looked up and masked with color_mask
+// Everything is indexed by screen x
+//
+struct nes_pixel_line
+{
+    const uint8_t *bg;              // palette entry (0x00~0x0f) of every background pixel - 0 where transparent
+    const uint8_t *sprites;         // palette entry (0x10~0x1f) of every sprite pixel with PPU_SPRITE_ATTR_BEHIND_BG,
+                                    // 0 where there is none (bits 6~7 are ignored) - nullptr for no sprites at all
+    const uint8_t *palette;         // the 32 palette entries
+    uint8_t color_mask;             // 0x3f, or 0x30 for grayscale
+    bool bg_left;
+    bool sprites_left;
+};
+
+// Pixels [x, end) of line into out
+typedef void (*nes_compose_pixels_fn)(const nes_pixel_line &line, int x, int end, uint8_t *out);
+
+//
+// How pixels are composed - every kernel has the exact same output, only the speed differs
+//
+enum class nes_pixel_kernel
+{
+    SCALAR,             // a pixel at a time
+    SSSE3,              // 16 pixels at a time - palette lookups need PSHUFB, so plain SSE2 isn't enough
+    AVX2,               // 32 pixels at a time
+};
+
+// kernel if the host runs it, otherwise the best one below it that it does
+nes_pixel_kernel nes_pixel_kernel_supported(nes_pixel_kernel kernel);
+
+nes_compose_pixels_fn nes_compose_pixels(nes_pixel_kernel kernel);
@@ -0,0 +1,80 @@
+//
+// Randomized check of the pixel compose kernels against each other
+// Composes random scanlines - random background and sprite pixels (priority bits included), palette,
+// grayscale and left column clipping, at random alignments and spans - with every kernel and stops at the
+// first one whose pixels differ from the scalar kernel's. Kernels the host can't run fall back to a lower one
+// (see nes_pixel_kernel_supported), so they are only checked where they are supported.
+//   nesemu2_pixels_test [lines]        default 50000
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include "nes_pixels.h"
+#include "nes_state.h"
+
+#define PIXELS_TEST_WIDTH 256
+
+static const char *s_kernel_names[] = { "scalar", "ssse3", "avx2" };
+
+int main(int argc, char *argv[])
+{
+    long lines = argc > 1 ? atol(argv[1]) : 50000;
+
+    std::mt19937 rng(1);
+    auto rand = [&rng](int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); };
+
+    // Slack in front of bg and sprites so that the lines start at every alignment
+    uint8_t bg[PIXELS_TEST_WIDTH + 32];
+    uint8_t sprites[PIXELS_TEST_WIDTH + 32];
+    uint8_t palette[PPU_PALETTE_SIZE];
+    uint8_t out[3][PIXELS_TEST_WIDTH];
+
+    for (long i = 0; i < lines; ++i)
+    {
+        for (auto &pixel : bg)
+            pixel = rand(0, 1) ? uint8_t(rand(0, 0x0f)) : 0;
+        for (auto &pixel : sprites)
+            pixel = rand(0, 1) ? uint8_t(0x10 | rand(0, 0x0f) | (rand(0, 7) << 5)) : 0;
+        for (auto &entry : palette)
+            entry = uint8_t(rand(0, 0x3f));
+
+        nes_pixel_line line;
+        line.bg = bg + rand(0, 31);
+        line.sprites = rand(0, 3) ? sprites + rand(0, 31) : nullptr;
+        line.palette = palette;
+        line.color_mask = rand(0, 1) ? 0x30 : 0x3f;
+        line.bg_left = rand(0, 1);
+        line.sprites_left = rand(0, 1);
+
+        // Half of the lines run to the end of the scanline from somewhere around the clipped column
+        int x = (i & 1) ? rand(0, 11) : rand(0, PIXELS_TEST_WIDTH);
+        int end = (i & 1) ? PIXELS_TEST_WIDTH : rand(x, PIXELS_TEST_WIDTH);
+
+        memset(out, 0xee, sizeof(out));
+        for (int kernel = 0; kernel < 3; ++kernel)
+            nes_compose_pixels(nes_pixel_kernel(kernel))(line, x, end, out[kernel]);
+
+        for (int kernel = 1; kernel < 3; ++kernel)
+        {
+            if (memcmp(out[0], out[kernel], sizeof(out[0])) != 0)
+            {
+                for (int pixel = 0; pixel < PIXELS_TEST_WIDTH; ++pixel)
+                {
+                    if (out[0][pixel] != out[kernel][pixel])
+                    {
+                        printf("line %ld [%d, %d): %s has %02X at x = %d, scalar has %02X\n", i, x, end,
+                               s_kernel_names[kernel], out[kernel][pixel], pixel, out[0][pixel]);
+                        break;
+                    }
+                }
+                return 1;
+            }
+        }
+    }
+
+    nes_pixel_kernel best = nes_pixel_kernel_supported(nes_pixel_kernel::AVX2);
+    printf("%ld lines match - kernels up to %s checked\n", lines, s_kernel_names[int(best)]);
+    return 0;
+}
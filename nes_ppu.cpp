@@ -1,73 +1,234 @@
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include "nes_ppu.h"
 #include "nes_system.h"
 #include "nes_cycle.h"
 
-// fetching tile for current line
-void nes_ppu::fetch_tile()
+// Pattern tables without a cartridge - reads as 0, ignores writes
+static const uint8_t s_no_chr[0x2000] = {};
+
+// What any page that isn't in the cartridge's CHR decodes to
+static const uint8_t s_no_tiles[PPU_PAGE_TILE_COUNT * NES_TILE_PIXELS] = {};
+
+// The background of a line with the background hidden
+static const uint8_t s_no_bg[PPU_SCREEN_X] = {};
+
+nes_ppu::nes_ppu(nes_ppu_state &state)
+        : _state(state), _mapper(nullptr), _pages(), _page_writable(), _tiles(), _flipped_tiles(), _tile_dirty(),
+          _chr_rom(nullptr), _chr_rom_size(0), _chr_rom_tiles(nullptr), _chr_rom_flipped_tiles(nullptr),
+          _chr_ram(nullptr), _chr_ram_size(0),
+          _system(nullptr), _frame_buffers(std::make_unique<uint8_t[][PPU_SCREEN_X * PPU_SCREEN_Y]>(2)),
+          _front_buffer(0), _frame_ready(false),
+          _line_tile_count(0), _line_v(0), _line_v_tile(0), _line_x(0), _line_sprite_count(0),
+          _bg_layers(std::make_unique<uint8_t[][PPU_BG_LAYER_SIZE * PPU_BG_LAYER_SIZE]>(PPU_NAMETABLE_COUNT))
 {
+    // Everything map_chr uses (it may split the scanline) is set up before it
+    set_pixel_kernel(nes_pixel_kernel::AVX2);
+    invalidate_bg_layers();
+    map_chr(0, PPU_CHR_PAGE_COUNT, s_no_chr);
+
+    _state.mirroring = nes_mapper_flags_horizontal_mirroring;
+    map_nametables();
+}
 
+void nes_ppu::set_pixel_kernel(nes_pixel_kernel kernel)
+{
+    _pixel_kernel = nes_pixel_kernel_supported(kernel);
+    _compose_pixels = nes_compose_pixels(_pixel_kernel);
 }
 
 void nes_ppu::init(nes_system* system)
 {
     _system = system;
+    _state.mirroring = nes_mapper_flags_horizontal_mirroring;
+    map_nametables();
+    memset(_state.oam, 0, sizeof(_state.oam));
+    memset(_state.palette, 0, sizeof(_state.palette));
+    memset(_state.nametables, 0, sizeof(_state.nametables));
+    invalidate_bg_layers();
+
     // PPUCTRL data
-    _name_tbl_addr = 0;
-    _bg_pattern_tbl_addr = 0;
-    _sprite_pattern_tbl_addr = 0;
-    _ppu_addr_inc = 1;
-    _vblank_nmi = true;
-    _use_8x16_sprite = false;
-    _sprite_height = 8;
+    _state.name_tbl_addr = 0;
+    _state.bg_pattern_tbl_addr = 0;
+    _state.sprite_pattern_tbl_addr = 0;
+    _state.ppu_addr_inc = 1;
+    _state.vblank_nmi = true;
+    _state.use_8x16_sprite = false;
+    _state.sprite_height = 8;
 
     // PPUMASK
-    _show_bg = false;
-    _show_sprites = false;
-    _gray_scale_mode = false;
+    _state.show_bg = false;
+    _state.show_sprites = false;
+    _state.gray_scale_mode = false;
+    _state.show_bg_left = false;
+    _state.show_sprites_left = false;
 
     // PPUSTATUS
-    _latch = 0;
-    _sprite_overflow = false;
-    _vblank_started = false;
-    _sprite_0_hit = false;
+    _state.latch = 0;
+    _state.sprite_overflow = false;
+    _state.vblank_started = false;
+    _state.sprite_0_hit = false;
+    _state.sprite_0_hit_dot = -1;
+    _state.status_after_read = 0;
 
     // OAMADDR, OAMDATA
-    _oam_addr = 0;
+    _state.oam_addr = 0;
 
     // PPUSCROLL
-    _addr_toggle = false;
+    _state.addr_toggle = false;
 
     // PPUADDR
-    _ppu_addr = 0;
-    _temp_ppu_addr = 0;
+    _state.ppu_addr = 0;
+    _state.temp_ppu_addr = 0;
 
-    _coarse_x_scroll = 0;
-    _fine_x_scroll = 0;
-    _scroll_y = 0;
+    _state.coarse_x_scroll = 0;
+    _state.fine_x_scroll = 0;
+    _state.scroll_y = 0;
 
     // PPUDATA
-    _vram_read_buf = 0;
+    _state.vram_read_buf = 0;
+
+    _state.master_cycle = nes_cycle_t(0);
+    _state.scanline_cycle = nes_cycle_t(0);
+    _state.cur_scanline = 0;
+    _state.frame_count = 0;
+    _frame_ready = false;
 
-    _master_cycle = nes_cycle_t(0);
-    _scanline_cycle = nes_cycle_t(0);
-    _cur_scanline = 0;
-    _frame_count = 0;
+    schedule_frame_events();
 }
 
-void nes_ppu::load_mapper(std::shared_ptr<nes_mapper> &mapper)
+void nes_ppu::load_mapper(nes_mapper &mapper)
 {
     // unset previous mapper
     _mapper = nullptr;
 
-    // Give mapper a chance to copy all the bytes needed
-    mapper->on_load_ppu(*this);
-
+    // Header mirroring first - mappers that control mirroring themselves override it in on_load_ppu
     nes_mapper_info info;
-    mapper->get_info(info);
-    set_mirroring(info.flags);
+    mapper.get_info(info);
+    _state.mirroring = info.flags & (nes_mapper_flags_mirroring_mask | nes_mapper_flags_four_screen);
+    map_nametables();
+
+    // Where the decoded tiles of whatever the mapper maps come from. CHR ROM was decoded along with the ROM, CHR
+    // RAM is decoded as it is used - and starts out all dirty (capacity is kept, so this allocates only for
+    // more CHR RAM than any cartridge before)
+    const nes_rom_image &rom = *mapper.rom();
+    _chr_rom = rom.chr();
+    _chr_rom_size = rom.chr_size();
+    _chr_rom_tiles = _chr_rom_size ? rom.assets().chr_tiles.data() : nullptr;
+    _chr_rom_flipped_tiles = _chr_rom_size ? rom.assets().chr_tiles_flipped.data() : nullptr;
+
+    const std::vector<uint8_t> &chr_ram = mapper.chr_ram();
+    _chr_ram = chr_ram.data();
+    _chr_ram_size = chr_ram.size();
+    _chr_ram_tiles.resize(_chr_ram_size / PPU_TILE_SIZE * NES_TILE_PIXELS * 2);
+    _chr_ram_dirty.assign(_chr_ram_size / PPU_TILE_SIZE, 1);
+    invalidate_bg_layers();
+
+    // Mapper maps its power-on CHR banks
+    mapper.on_load_ppu(*this);
 
-    _mapper = mapper;
+    _mapper = &mapper;
+}
+
+void nes_ppu::unload_mapper()
+{
+    // Catches up first - with the mapper and its CHR still in place
+    map_chr(0, PPU_CHR_PAGE_COUNT, s_no_chr);
+    _mapper = nullptr;
+    _chr_rom = _chr_ram = nullptr;
+    _chr_rom_size = _chr_ram_size = 0;
+}
+
+void nes_ppu::map_chr_pages(int page, int count, uint8_t *data, bool writable)
+{
+    assert(page + count <= PPU_CHR_PAGE_COUNT);
+
+    // Scanlines so far (and the current one up to here) are rendered with the old banks
+    catch_up();
+    split_scanline();
+
+    int bg_page = _state.bg_pattern_tbl_addr >> PPU_PAGE_SHIFT;
+    for (int i = 0; i < count; ++i)
+    {
+        const uint8_t *old_tiles = _tiles[page + i];
+        const uint8_t *page_data = data + i * PPU_PAGE_SIZE;
+        _pages[page + i] = const_cast<uint8_t *>(page_data);
+        _page_writable[page + i] = writable;
+
+        // Decoded tiles at the same offset as the CHR data
+        if (page_data >= _chr_ram && page_data < _chr_ram + _chr_ram_size)
+        {
+            size_t tile = size_t(page_data - _chr_ram) / PPU_TILE_SIZE;
+            size_t tile_count = _chr_ram_size / PPU_TILE_SIZE;
+            _tiles[page + i] = _chr_ram_tiles.data() + tile * NES_TILE_PIXELS;
+            _flipped_tiles[page + i] = _chr_ram_tiles.data() + (tile_count + tile) * NES_TILE_PIXELS;
+            _tile_dirty[page + i] = _chr_ram_dirty.data() + tile;
+        }
+        else if (page_data >= _chr_rom && page_data < _chr_rom + _chr_rom_size)
+        {
+            size_t offset = size_t(page_data - _chr_rom) / PPU_TILE_SIZE * NES_TILE_PIXELS;
+            _tiles[page + i] = _chr_rom_tiles + offset;
+            _flipped_tiles[page + i] = _chr_rom_flipped_tiles + offset;
+            _tile_dirty[page + i] = nullptr;
+        }
+        else
+        {
+            _tiles[page + i] = _flipped_tiles[page + i] = s_no_tiles;
+            _tile_dirty[page + i] = nullptr;
+        }
+
+        // Switching a bank in for itself changes nothing
+        if (_tiles[page + i] != old_tiles && page + i >= bg_page && page + i < bg_page + 4)
+            dirty_bg_patterns((page + i - bg_page) * PPU_PAGE_TILE_COUNT, PPU_PAGE_TILE_COUNT);
+    }
+}
+
+void nes_ppu::decode_chr_ram_tile(int page, int tile)
+{
+    nes_decode_chr_tile(_pages[page] + tile * PPU_TILE_SIZE,
+                        const_cast<uint8_t *>(_tiles[page]) + tile * NES_TILE_PIXELS,
+                        const_cast<uint8_t *>(_flipped_tiles[page]) + tile * NES_TILE_PIXELS);
+    _tile_dirty[page][tile] = 0;
+}
+
+void nes_ppu::invalidate_bg_layers()
+{
+    memset(_bg_dirty, 0xff, sizeof(_bg_dirty));
+    memset(_bg_pattern_dirty, 0, sizeof(_bg_pattern_dirty));
+}
+
+void nes_ppu::dirty_bg_nametable(int page, int offset)
+{
+    uint32_t *dirty = _bg_dirty[(_pages[page] - _state.nametables) / PPU_NAMETABLE_SIZE];
+    dirty[offset / 32] |= 1u << (offset % 32);
+
+    // An attribute byte colors 4x4 tiles
+    if (offset >= PPU_ATTRIBUTE_TABLE_OFFSET)
+    {
+        int attr = offset - PPU_ATTRIBUTE_TABLE_OFFSET;
+        for (int row = attr / 8 * 4; row < attr / 8 * 4 + 4; ++row)
+            dirty[row] |= 0xfu << (attr % 8 * 4);
+    }
+}
+
+void nes_ppu::dirty_bg_patterns(int first, int count)
+{
+    for (int table = 0; table < PPU_NAMETABLE_COUNT; ++table)
+    {
+        for (int tile = first; tile < first + count; ++tile)
+            _bg_pattern_dirty[table][tile / 64] |= 1ull << (tile % 64);
+    }
+}
+
+void nes_ppu::dirty_bg_chr_ram(const uint8_t *page_data, int tile)
+{
+    int bg_page = _state.bg_pattern_tbl_addr >> PPU_PAGE_SHIFT;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (_pages[bg_page + i] == page_data)
+            dirty_bg_patterns(i * PPU_PAGE_TILE_COUNT + tile, 1);
+    }
 }
 
 void nes_ppu::write_OAMDMA(uint8_t val)
@@ -78,105 +239,575 @@ void nes_ppu::write_OAMDMA(uint8_t val)
 
 void nes_ppu::oam_dma(uint16_t addr)
 {
-    if (_oam_addr == 0)
+    catch_up();
+
+    if (_state.oam_addr == 0)
     {
         // simple case - copy the 0x100 bytes directly
-        _system->getMem()->get_bytes(_oam.get(), PPU_OAM_SIZE, addr, PPU_OAM_SIZE);
+        _system->getMem()->get_bytes(_state.oam, PPU_OAM_SIZE, addr, PPU_OAM_SIZE);
     }
     else
     {
         // the copy starts at _oam_addr and wraps around
-        int copy_before_wrap = 0x100 - _oam_addr;
-        _system->getMem()->get_bytes(_oam.get() + _oam_addr, copy_before_wrap, addr, copy_before_wrap);
-        _system->getMem()->get_bytes(_oam.get(), PPU_OAM_SIZE - copy_before_wrap, addr + copy_before_wrap, PPU_OAM_SIZE - copy_before_wrap);
+        int copy_before_wrap = 0x100 - _state.oam_addr;
+        _system->getMem()->get_bytes(_state.oam + _state.oam_addr, copy_before_wrap, addr, copy_before_wrap);
+        _system->getMem()->get_bytes(_state.oam, PPU_OAM_SIZE - copy_before_wrap, addr + copy_before_wrap, PPU_OAM_SIZE - copy_before_wrap);
     }
 }
 
 void nes_ppu::set_mirroring(nes_mapper_flags flags)
 {
-    _mirroring_flags = nes_mapper_flags(flags & nes_mapper_flags_mirroring_mask);
+    catch_up();
+    split_scanline();
+
+    // The mirroring registers of four-screen boards aren't wired to anything
+    if (_state.mirroring & nes_mapper_flags_four_screen)
+        return;
+
+    _state.mirroring = flags & (nes_mapper_flags_mirroring_mask | nes_mapper_flags_four_screen);
+    map_nametables();
 }
 
-void nes_ppu::step_to(nes_cycle_t count)
+//
+// Which 1KB of nametable RAM each of the 4 nametables is, by nes_mapper_flags mirroring bits
+//
+static const uint8_t s_nametable_banks[][PPU_NAMETABLE_COUNT] = {
+        { 0, 0, 0, 0 },                     // one screen, lower bank
+        { 1, 1, 1, 1 },                     // one screen, upper bank
+        { 0, 1, 0, 1 },                     // vertical - $2000=$2800, $2400=$2c00
+        { 0, 0, 1, 1 },                     // horizontal - $2000=$2400, $2800=$2c00
+};
+
+static const uint8_t s_four_screen_banks[PPU_NAMETABLE_COUNT] = { 0, 1, 2, 3 };
+
+void nes_ppu::map_nametables()
 {
-    while (_master_cycle < count && !_system->stop_requested())
+    const uint8_t *banks = (_state.mirroring & nes_mapper_flags_four_screen) ?
+                           s_four_screen_banks : s_nametable_banks[_state.mirroring & nes_mapper_flags_mirroring_mask];
+    for (int table = 0; table < PPU_NAMETABLE_COUNT; ++table)
     {
-        step_ppu(nes_ppu_cycle_t(1));
-
-        if (_cur_scanline <= 239)
+        uint8_t *data = _state.nametables + banks[table] * PPU_NAMETABLE_SIZE;
+        for (uint16_t addr : { PPU_NAMETABLE_ADDR, PPU_NAMETABLE_MIRROR_ADDR })
         {
-            //fetch_tile_pipeline();
-            //fetch_sprite_pipeline();
+            int page = (addr >> PPU_PAGE_SHIFT) + table;
+            _pages[page] = data;
+            _page_writable[page] = true;
         }
-        else if (_cur_scanline == 240)
+    }
+}
+
+//
+// Dots within a frame where the PPU has something to do, in order - see on_event_dot
+// Everything in between is skipped over in one go
+//
+#define PPU_DOT(scanline, dot) ((scanline) * PPU_SCANLINE_CYCLE.count() + (dot))
+
+static const int s_event_dots[] = {
+        PPU_DOT(241, 1),                    // VBlank begins
+        PPU_DOT(260, 341 - 12 + 1),         // early VBlank end - see the @HACK in on_event_dot
+        PPU_DOT(261, 0),                    // VBlank ends
+        PPU_DOT(261, 1),                    // sprite 0 hit and sprite overflow cleared
+        PPU_DOT(261, 339),                  // odd frame skip
+        PPU_DOT(PPU_SCANLINE_COUNT, 0),     // frame end
+};
+
+static int next_event_dot(int frame_dot)
+{
+    for (int event_dot : s_event_dots)
+    {
+        if (event_dot > frame_dot)
+            return event_dot;
+    }
+
+    return PPU_DOT(PPU_SCANLINE_COUNT, 0);
+}
+
+void nes_ppu::step_to(nes_cycle_t count)
+{
+    while (_state.master_cycle < count)
+    {
+        int frame_dot = PPU_DOT(_state.cur_scanline, _state.scanline_cycle.count());
+
+        auto dots = nes_ppu_cycle_t(next_event_dot(frame_dot) - frame_dot);
+        if (_state.master_cycle + dots > count)
         {
+            dots = count - _state.master_cycle;
+            render_dots(frame_dot, frame_dot + int(dots.count()));
+            step_ppu(dots);
+            break;
         }
-        else if (_cur_scanline < 261)
+
+        render_dots(frame_dot, frame_dot + int(dots.count()));
+        step_ppu(dots);
+        on_event_dot();
+    }
+}
+
+void nes_ppu::catch_up()
+{
+    if (_system)
+        step_to(_system->getCpu()->cycle());
+}
+
+nes_cycle_t nes_ppu::next_status_change(nes_cycle_t now)
+{
+    // Changes since the last read count too - they can happen as the PPU catches up after it, in here or for
+    // an event, with nobody reading PPUSTATUS to see them yet
+    step_to(now);
+    if (status_flags() != _state.status_after_read)
+        return now;
+
+    // PPUSTATUS changes at event dots...
+    int frame_dot = PPU_DOT(_state.cur_scanline, _state.scanline_cycle.count());
+    int change_dot = next_event_dot(frame_dot);
+
+    // ... and while rendering, right after sprite 0 hits and right after visible scanlines start (which is
+    // when sprite 0 hits and sprite overflow are found) - see render_dots
+    if (rendering() && !(_state.sprite_0_hit && _state.sprite_overflow))
+    {
+        int line = _state.cur_scanline;
+        int dot = int(_state.scanline_cycle.count());
+        if (line < PPU_SCREEN_Y && _state.sprite_0_hit_dot >= dot)
+            change_dot = std::min<int>(change_dot, PPU_DOT(line, _state.sprite_0_hit_dot) + 1);
+
+        if (line < PPU_SCREEN_Y && dot == 0)
+            change_dot = std::min<int>(change_dot, frame_dot + 1);
+        else if (line + 1 < PPU_SCREEN_Y)
+            change_dot = std::min<int>(change_dot, PPU_DOT(line + 1, 0) + 1);
+        else if (line == PPU_SCANLINE_COUNT - 1)
+            change_dot = std::min<int>(change_dot, PPU_DOT(PPU_SCANLINE_COUNT, 0) + 1);
+    }
+
+    return _state.master_cycle + nes_ppu_cycle_t(change_dot - frame_dot);
+}
+
+void nes_ppu::render_dots(int from, int to)
+{
+    for (int line = from / PPU_SCANLINE_CYCLE.count(); line < PPU_SCANLINE_COUNT && PPU_DOT(line, 0) < to; ++line)
+    {
+        // Dots of this line in [from, to)
+        int first = from - PPU_DOT(line, 0);
+        int last = to - PPU_DOT(line, 0);
+        auto due = [first, last](int dot) { return dot >= first && dot < last; };
+
+        if (line < PPU_SCREEN_Y)
         {
-            if (_cur_scanline == 241 && _scanline_cycle == nes_ppu_cycle_t(1))
+            if (due(0))
+                start_scanline(line);
+            if (_state.sprite_0_hit_dot >= 0 && due(_state.sprite_0_hit_dot))
             {
-                //NES_TRACE4("[NES_PPU] SCANLINE = 241, VBlank BEGIN");
-                _vblank_started = true;
-                if (_vblank_nmi)
-                {
-                    // Request NMI so that games can do their rendering
-                    _system->getCpu()->request_nmi();
-                }
+                _state.sprite_0_hit = true;
+                _state.sprite_0_hit_dot = -1;
             }
+            if (due(256))
+                finish_scanline(line);
+        }
+        else if (line != PPU_SCANLINE_COUNT - 1)
+        {
+            continue;
+        }
 
-            // @HACK - account for a race where you have LDA $2002_PPUSTATUS and end of VBLANK at the same time
-            // This moves end of NMI a bit earlier to compensate for that
-            if (_cur_scanline == 260 && _scanline_cycle > nes_ppu_cycle_t(341 - 12))
-                _vblank_started = false;
+        // v follows the tile fetches of visible and pre-render scanlines
+        if (rendering())
+        {
+            if (due(256))
+                increment_y();
+            if (due(257))
+                _state.ppu_addr = (_state.ppu_addr & ~0x041f) | (_state.temp_ppu_addr & 0x041f);
+            if (line == PPU_SCANLINE_COUNT - 1 && due(280))
+                _state.ppu_addr = (_state.ppu_addr & 0x041f) | (_state.temp_ppu_addr & 0x7be0);
         }
-        else
+    }
+}
+
+// Moves v down a pixel - into the next row of tiles, and from the bottom of a nametable to the one below
+void nes_ppu::increment_y()
+{
+    uint16_t v = _state.ppu_addr;
+    if ((v & 0x7000) != 0x7000)
+    {
+        _state.ppu_addr = v + 0x1000;
+        return;
+    }
+
+    v &= ~0x7000;
+    int coarse_y = (v >> 5) & 0x1f;
+    if (coarse_y == 29)
+    {
+        coarse_y = 0;
+        v ^= 0x0800;
+    }
+    else if (coarse_y == 31)
+    {
+        // Rows 30 and 31 are the attribute table - games scrolled into it wrap without switching nametables
+        coarse_y = 0;
+    }
+    else
+    {
+        coarse_y++;
+    }
+
+    _state.ppu_addr = (v & ~0x03e0) | (coarse_y << 5);
+}
+
+// v moved right by tiles (no more than a nametable's width) - into the nametable to the right past the edge
+static uint16_t advance_coarse_x(uint16_t v, int tiles)
+{
+    int coarse_x = (v & 0x1f) + tiles;
+    if (coarse_x >= 32)
+        v ^= 0x0400;
+
+    return (v & ~0x1f) | (coarse_x & 0x1f);
+}
+
+const uint8_t *nes_ppu::fetch_bg_tile(uint16_t v, uint8_t &palette)
+{
+    // http://wiki.nesdev.com/w/index.php/PPU_scrolling#Tile_and_attribute_fetching
+    uint8_t tile = read_byte(uint16_t(PPU_NAMETABLE_ADDR | (v & 0x0fff)));
+    uint8_t attr = read_byte(uint16_t(0x23c0 | (v & 0x0c00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07)));
+    palette = (attr >> (((v >> 4) & 4) | (v & 2))) & 3;
+
+    return tile_row(uint16_t(_state.bg_pattern_tbl_addr | (tile << 4)), (v >> 12) & 7, false);
+}
+
+int nes_ppu::evaluate_sprites(int line, uint8_t *sprites, bool &overflow)
+{
+    int count = 0;
+    overflow = false;
+    for (int i = 0; i < PPU_SPRITE_MAX; ++i)
+    {
+        // Sprites are evaluated the line before - they show up a line below their Y
+        int row = line - 1 - _state.oam[i * 4];
+        if (row < 0 || row >= _state.sprite_height)
+            continue;
+
+        // The hardware's buggy overflow check isn't emulated
+        if (count == PPU_ACTIVE_SPRITE_MAX)
         {
-            if (_cur_scanline == 261)
-            {
-                if (_scanline_cycle == nes_ppu_cycle_t(0))
-                {
-                    //NES_TRACE4("[NES_PPU] SCANLINE = 261, VBlank END");
-                    _vblank_started = false;
-
-                    // Reset _ppu_addr to top-left of the screen
-                    // But only do so when rendering is on (otherwise it will interfer with PPUDATA writes)
-                    if (_show_bg || _show_sprites)
-                    {
-                        _ppu_addr = _temp_ppu_addr;
-                    }
-                }
-                else if (_scanline_cycle == nes_ppu_cycle_t(1))
-                {
-                    _sprite_0_hit = false;
-                }
-            }
+            overflow = true;
+            break;
+        }
+
+        sprites[count++] = uint8_t(i);
+    }
+
+    return count;
+}
+
+const uint8_t *nes_ppu::fetch_sprite_row(int line, const uint8_t *sprite)
+{
+    int row = line - 1 - sprite[0];
+    uint8_t attr = sprite[2];
+    if (attr & PPU_SPRITE_ATTR_VERTICAL_FLIP)
+        row = _state.sprite_height - 1 - row;
+
+    uint16_t addr;
+    if (_state.use_8x16_sprite)
+    {
+        // Bit 0 of the tile picks the pattern table - the top half is the even tile, the bottom one the odd
+        addr = uint16_t(((sprite[1] & 1) << 12) | ((sprite[1] & 0xfe) << 4));
+        if (row >= 8)
+        {
+            addr += 16;
+            row -= 8;
+        }
+    }
+    else
+    {
+        addr = uint16_t(_state.sprite_pattern_tbl_addr | (sprite[1] << 4));
+    }
+
+    return tile_row(addr, row, attr & PPU_SPRITE_ATTR_HORIZONTAL_FLIP);
+}
+
+void nes_ppu::start_scanline(int line)
+{
+    _line_x = 0;
+    _line_tile_count = 0;
+    _line_v = _state.ppu_addr;
+    _line_v_tile = 0;
+    _line_sprite_count = 0;
+    _state.sprite_0_hit_dot = -1;
+    if (!rendering())
+        return;
+
+    uint8_t sprites[PPU_ACTIVE_SPRITE_MAX];
+    bool overflow;
+    _line_sprite_count = evaluate_sprites(line, sprites, overflow);
+    if (overflow)
+        _state.sprite_overflow = true;
+    if (_line_sprite_count == 0)
+        return;
+
+    // Sprite pixels of the whole line - their patterns are fetched before the line starts. Where sprites overlap
+    // the lowest OAM index wins, even when it is behind the background
+    memset(_sprite_line, 0, sizeof(_sprite_line));
+    for (int i = 0; i < _line_sprite_count; ++i)
+    {
+        const uint8_t *sprite = _state.oam + sprites[i] * 4;
+        const uint8_t *pixels = fetch_sprite_row(line, sprite);
+        uint8_t flags = (sprite[2] & PPU_SPRITE_ATTR_BEHIND_BG) | (sprites[i] == 0 ? PPU_SPRITE_LINE_SPRITE_0 : 0);
+        for (int column = 0; column < 8; ++column)
+        {
+            int x = sprite[3] + column;
+            if (x >= PPU_SCREEN_X)
+                break;
+
+            int value = pixels[column];
+            if (value && !_sprite_line[x])
+                _sprite_line[x] = uint8_t(0x10 | ((sprite[2] & PPU_SPRITE_ATTR_BIT32_MASK) << 2) | value | flags);
+        }
+    }
+
+    if (_state.sprite_0_hit || !_state.show_bg || !_state.show_sprites || sprites[0] != 0)
+        return;
+
+    // Sprite 0 is on this line - look for its first opaque pixel over an opaque background one
+    bool clip_left = !_state.show_bg_left || !_state.show_sprites_left;
+    for (int x = clip_left ? 8 : 0; x < PPU_SCREEN_X - 1; ++x)      // never at the rightmost pixel
+    {
+        if (!(_sprite_line[x] & PPU_SPRITE_LINE_SPRITE_0))
+            continue;
+
+        int bg_x = _state.fine_x_scroll + x;
+        uint8_t palette;
+        if (fetch_bg_tile(advance_coarse_x(_state.ppu_addr, bg_x >> 3), palette)[bg_x & 7])
+        {
+            // Pixel x comes out at dot x + 1
+            _state.sprite_0_hit_dot = int16_t(x + 1);
+            break;
+        }
+    }
+}
+
+void nes_ppu::split_scanline()
+{
+    int dot = int(_state.scanline_cycle.count());
+    if (_state.cur_scanline >= PPU_SCREEN_Y || dot == 0 || dot > PPU_SCREEN_X)
+        return;
+
+    // Pixel x comes out at dot x + 1 from a tile fetched at least 8 dots earlier - the first 2 tiles of the line
+    // are fetched at the end of the line before
+    fetch_line_tiles(std::min((dot - 1) / 8 + 2, PPU_LINE_TILE_COUNT));
+    render_pixels(_state.cur_scanline, dot - 1);
+}
+
+void nes_ppu::finish_scanline(int line)
+{
+    render_pixels(line, PPU_SCREEN_X);
+}
+
+// Palette entries of a decoded background tile row - 0 where transparent. All 8 pixels at once as the bytes of
+// a 64-bit word, none of it carries across bytes
+static uint64_t bg_tile_row(const uint8_t *pixels, uint8_t palette)
+{
+    uint64_t values;
+    memcpy(&values, pixels, 8);
+
+    uint64_t opaque = (values | (values >> 1)) & 0x0101010101010101ull;
+    return values | (opaque * (palette << 2));
+}
+
+const uint8_t *nes_ppu::bg_layer_row(uint16_t v)
+{
+    // Mirrors of a nametable share its layer
+    const uint8_t *page = _pages[(PPU_NAMETABLE_ADDR >> PPU_PAGE_SHIFT) + ((v >> 10) & 3)];
+    int table = int(page - _state.nametables) / PPU_NAMETABLE_SIZE;
+    const uint8_t *nametable = _state.nametables + table * PPU_NAMETABLE_SIZE;
+    uint32_t *dirty = _bg_dirty[table];
+
+    uint64_t *patterns = _bg_pattern_dirty[table];
+    if (patterns[0] | patterns[1] | patterns[2] | patterns[3])
+    {
+        // Tiles of the whole layer showing a pattern that changed
+        for (int i = 0; i < PPU_NAMETABLE_SIZE; ++i)
+        {
+            if ((patterns[nametable[i] / 64] >> (nametable[i] % 64)) & 1)
+                dirty[i / 32] |= 1u << (i % 32);
+        }
+
+        memset(patterns, 0, sizeof(_bg_pattern_dirty[table]));
+    }
 
+    // The row of tiles v is in - http://wiki.nesdev.com/w/index.php/PPU_scrolling#Tile_and_attribute_fetching
+    int coarse_y = (v >> 5) & 0x1f;
+    uint8_t *tiles = _bg_layers[table] + coarse_y * 8 * PPU_BG_LAYER_SIZE;
+    for (int coarse_x = 0; dirty[coarse_y]; ++coarse_x)
+    {
+        uint32_t bit = 1u << coarse_x;
+        if (!(dirty[coarse_y] & bit))
+            continue;
+
+        dirty[coarse_y] &= ~bit;
+        uint8_t attr = nametable[PPU_ATTRIBUTE_TABLE_OFFSET + coarse_y / 4 * 8 + coarse_x / 4];
+        uint8_t palette = (attr >> (((coarse_y & 2) << 1) | (coarse_x & 2))) & 3;
+        uint16_t tile_addr = uint16_t(_state.bg_pattern_tbl_addr | (nametable[coarse_y * 32 + coarse_x] << 4));
+        for (int row = 0; row < 8; ++row)
+        {
+            uint64_t pixels = bg_tile_row(tile_row(tile_addr, row, false), palette);
+            memcpy(tiles + row * PPU_BG_LAYER_SIZE + coarse_x * 8, &pixels, 8);
+        }
+    }
+
+    return tiles + ((v >> 12) & 7) * PPU_BG_LAYER_SIZE + (v & 0x1f) * 8;
+}
+
+void nes_ppu::fetch_line_tiles(int count)
+{
+    // Tiles up to the right edge of a nametable are next to each other in its layer
+    for (int tile = _line_tile_count; tile < count;)
+    {
+        uint16_t v = advance_coarse_x(_line_v, tile - _line_v_tile);
+        int run = std::min(count - tile, 32 - (v & 0x1f));
+        memcpy(_line_bg + tile * 8, bg_layer_row(v), run * 8);
+        tile += run;
+    }
+
+    _line_tile_count = std::max(_line_tile_count, count);
+}
+
+void nes_ppu::render_pixels(int line, int end)
+{
+    if (_line_x >= end)
+        return;
+
+    nes_pixel_line pixels;
+    pixels.bg = s_no_bg;
+    if (_state.show_bg)
+    {
+        // Pixel x is pixel fine x + x of the tiles
+        fetch_line_tiles((_state.fine_x_scroll + end - 1) / 8 + 1);
+        pixels.bg = _line_bg + _state.fine_x_scroll;
+    }
+
+    pixels.sprites = (_state.show_sprites && _line_sprite_count) ? _sprite_line : nullptr;
+    pixels.palette = _state.palette;
+    pixels.color_mask = _state.gray_scale_mode ? 0x30 : 0x3f;
+    pixels.bg_left = _state.show_bg_left;
+    pixels.sprites_left = _state.show_sprites_left;
+    _compose_pixels(pixels, _line_x, end, _frame_buffers[_front_buffer ^ 1] + line * PPU_SCREEN_X);
+
+    _line_x = end;
+}
+
+int nes_ppu::count_a12_rises(const nes_ppu_position &from, nes_cycle_t until, int max_rises, int rise_dot, nes_cycle_t &last_rise)
+{
+    last_rise = NES_EVENT_NEVER;
+    if (rise_dot < 0)
+        return 0;
+
+    int count = 0;
+    int scanline = from.scanline;
+    int dot = from.dot;
+    bool odd_frame = from.frame % 2 == 1;
+    nes_cycle_t line_start = from.cycle - nes_ppu_cycle_t(dot);
+    while (count < max_rises)
+    {
+        // Visible scanlines and the pre-render scanline fetch tiles
+        if ((scanline < PPU_SCREEN_Y || scanline == PPU_SCANLINE_COUNT - 1) && dot < rise_dot)
+        {
+            nes_cycle_t rise = line_start + nes_ppu_cycle_t(rise_dot);
+            if (rise > until)
+                break;
+
+            last_rise = rise;
+            count++;
+        }
+
+        // Pre-render scanline of odd frames is a dot short while rendering - see on_event_dot
+        int length = PPU_SCANLINE_CYCLE.count();
+        if (scanline == PPU_SCANLINE_COUNT - 1 && odd_frame)
+            length--;
+
+        line_start += nes_ppu_cycle_t(length);
+        if (line_start > until)
+            break;
+
+        dot = 0;
+        if (++scanline == PPU_SCANLINE_COUNT)
+        {
+            scanline = 0;
+            odd_frame = !odd_frame;
+        }
+    }
+
+    return count;
+}
+
+void nes_ppu::on_event_dot()
+{
+    if (_state.cur_scanline == 241 && _state.scanline_cycle == nes_ppu_cycle_t(1))
+    {
+        //NES_TRACE4("[NES_PPU] SCANLINE = 241, VBlank BEGIN");
+        _state.vblank_started = true;
+
+        // All visible scanlines are done
+        _front_buffer ^= 1;
+        _frame_ready = true;
+
+        if (_state.vblank_nmi)
+        {
+            // Request NMI so that games can do their rendering
+            _system->getCpu()->request_nmi();
+        }
+    }
+    else if (_state.cur_scanline == 260)
+    {
+        // @HACK - account for a race where you have LDA $2002_PPUSTATUS and end of VBLANK at the same time
+        // This moves end of NMI a bit earlier to compensate for that
+        _state.vblank_started = false;
+    }
+    else if (_state.cur_scanline == 261)
+    {
+        if (_state.scanline_cycle == nes_ppu_cycle_t(0))
+        {
+            //NES_TRACE4("[NES_PPU] SCANLINE = 261, VBlank END");
+            _state.vblank_started = false;
+        }
+        else if (_state.scanline_cycle == nes_ppu_cycle_t(1))
+        {
+            _state.sprite_0_hit = false;
+            _state.sprite_overflow = false;
+        }
+        else if (_state.frame_count % 2 == 1 && (_state.show_bg || _state.show_sprites))
+        {
             // pre-render scanline
-            if (_scanline_cycle == nes_ppu_cycle_t(340) && _frame_count % 2 == 1)
-            {
-                // odd frame skip the last cycle
-                step_ppu(nes_ppu_cycle_t(1));
-            }
+            // odd frame skip the last cycle when rendering is on
+            _state.scanline_cycle = nes_ppu_cycle_t(340);
         }
     }
+    else if (_state.cur_scanline == 0)
+    {
+        // step_ppu already wrapped around into the next frame
+        schedule_frame_events();
+    }
 }
 
-void nes_ppu::step_ppu(nes_ppu_cycle_t count)
+//
+// Lets the system know when it needs to bring the PPU up to date
+// Called at the start of every frame
+//
+void nes_ppu::schedule_frame_events()
 {
-    assert(count < PPU_SCANLINE_CYCLE);
+    nes_cycle_t frame_start = _state.master_cycle - _state.scanline_cycle;
+    _system->schedule(nes_event::VBLANK_NMI, frame_start + nes_ppu_cycle_t(PPU_DOT(241, 1)));
+    _system->schedule(nes_event::FRAME_END, frame_start + nes_ppu_cycle_t(PPU_DOT(PPU_SCANLINE_COUNT, 0)));
+}
 
-    _master_cycle += nes_ppu_cycle_t(count);
-    _scanline_cycle += nes_ppu_cycle_t(count);
+void nes_ppu::step_ppu(nes_ppu_cycle_t count)
+{
+    _state.master_cycle += nes_ppu_cycle_t(count);
+    _state.scanline_cycle += nes_ppu_cycle_t(count);
 
-    if (_scanline_cycle >= PPU_SCANLINE_CYCLE)
+    if (_state.scanline_cycle >= PPU_SCANLINE_CYCLE)
     {
-        _scanline_cycle %= PPU_SCANLINE_CYCLE;
-        _cur_scanline++;
-        if (_cur_scanline >= PPU_SCANLINE_COUNT)
+        _state.cur_scanline += _state.scanline_cycle / PPU_SCANLINE_CYCLE;
+        _state.scanline_cycle %= PPU_SCANLINE_CYCLE;
+        if (_state.cur_scanline >= PPU_SCANLINE_COUNT)
         {
-            _cur_scanline %= PPU_SCANLINE_COUNT;
+            _state.cur_scanline %= PPU_SCANLINE_COUNT;
             //swap_buffer();
-            _frame_count++;
+            _state.frame_count++;
             //NES_TRACE4("[NES_PPU] FRAME " << std::dec << _frame_count << " ------ ");
 
             //if (_auto_stop && _frame_count > _stop_after_frame)
@@ -187,4 +818,4 @@ void nes_ppu::step_ppu(nes_ppu_cycle_t count)
         }
         //NES_TRACE4("[NES_PPU] SCANLINE " << std::dec << (uint32_t) _cur_scanline << " ------ ");
     }
-}
\ No newline at end of file
+}
@@ -3,18 +3,43 @@
 #include "common.h"
 #include <cstdint>
 #include <memory>
+#include <vector>
 #include "nes_mapper.h"
-#include "nes_system.h"
+#include "nes_pixels.h"
+#include "nes_rom_registry.h"
 #include "nes_cycle.h"
+#include "nes_state.h"
+
+class nes_system;
 
 // PPU has its own separate 16KB memory address space
 // http://wiki.nesdev.com/w/index.php/PPU_memory_map
 
 #define PPU_VRAM_SIZE 0x4000
 
-// OAM (Object Attribute Memory) - internal memory inside PPU for 64 sprites of 4 bytes each
-// wiki.nesdev.com/w/index.php/PPU_OAM
-#define PPU_OAM_SIZE 0x100
+//
+// PPU address space is described with a page table of 16 pages x 1KB - 1KB being both the smallest CHR bank
+// any supported mapper switches and the size of a nametable
+// * $0000~$1fff pattern tables - pages point into CHR ROM/RAM banks
+// * $2000~$2fff the 4 nametables - pages point into nametable RAM as the mirroring says
+// * $3000~$3fff the same 4 pages again. The palette at $3f00~$3fff hides the end of the last one and is
+//   never looked up in the table (see palette_index)
+//
+#define PPU_PAGE_SHIFT 10
+#define PPU_PAGE_SIZE (1 << PPU_PAGE_SHIFT)
+#define PPU_PAGE_COUNT (PPU_VRAM_SIZE >> PPU_PAGE_SHIFT)
+
+#define PPU_CHR_PAGE_SHIFT PPU_PAGE_SHIFT
+#define PPU_CHR_PAGE_SIZE PPU_PAGE_SIZE
+#define PPU_CHR_PAGE_COUNT (0x2000 >> PPU_PAGE_SHIFT)
+
+// Pattern table tiles are 16 bytes, decoded into NES_TILE_PIXELS (see nes_rom_assets::chr_tiles)
+#define PPU_TILE_SIZE 16
+#define PPU_PAGE_TILE_COUNT (PPU_PAGE_SIZE / PPU_TILE_SIZE)
+
+#define PPU_NAMETABLE_ADDR 0x2000
+#define PPU_NAMETABLE_MIRROR_ADDR 0x3000
+#define PPU_PALETTE_ADDR 0x3f00
 
 //
 // All register masks
@@ -94,75 +119,134 @@
 #define PPU_SPRITE_ATTR_HORIZONTAL_FLIP 0x40
 #define PPU_SPRITE_ATTR_VERTICAL_FLIP 0x80
 
+// Background tiles a scanline covers - one more than fits on screen, for the fine x scroll
+#define PPU_LINE_TILE_COUNT (PPU_SCREEN_X / 8 + 1)
+
+// Sprite 0 pixels in the sprite pixels of a scanline
+#define PPU_SPRITE_LINE_SPRITE_0 0x80
+
+// A nametable rendered is 32x32 tiles of 8x8 pixels - the last 2 rows of tiles are the attribute table
+#define PPU_BG_LAYER_SIZE 256
+#define PPU_ATTRIBUTE_TABLE_OFFSET 0x3c0
+
 class nes_ppu {
 private:
-    std::shared_ptr<nes_mapper> _mapper;
-    nes_mapper_flags _mirroring_flags;  // mapper flags masked by mirroring flags
+    nes_ppu_state &_state;              // registers, timing, OAM, palette and nametables live in the console state
 
-    nes_system* _system;
-    uint8_t *_frame_buffer;             // entire frame buffer - only 4 bit is used
-
-    // PPUCTRL data
-    uint16_t _name_tbl_addr;
-    uint16_t _bg_pattern_tbl_addr;
-    uint16_t _sprite_pattern_tbl_addr;
-    uint16_t _ppu_addr_inc;
-    bool _vblank_nmi;
-    bool _use_8x16_sprite;
-    uint8_t _sprite_height;
+    nes_mapper *_mapper;                // owned by nes_system - nullptr without a cartridge
 
-    // PPUMASK
-    bool _show_bg;
-    bool _show_sprites;
-    bool _gray_scale_mode;
+    // Host memory behind each 1KB of the address space - CHR banks are switched and nametables mirrored by
+    // repointing these
+    uint8_t *_pages[PPU_PAGE_COUNT];
+    bool _page_writable[PPU_PAGE_COUNT];    // CHR RAM and nametables - CHR ROM ignores writes
 
-    nes_cycle_t _master_cycle;
-    nes_ppu_cycle_t _scanline_cycle;
-    int _cur_scanline;
-    uint32_t _frame_count;
+    //
+    // Pattern tables decoded to a byte per pixel, to render from - and mirrored left to right for flipped
+    // sprites. Alongside _pages, NES_TILE_PIXELS for every tile of the page
+    // * CHR ROM is decoded once per ROM, in its nes_rom_assets - a bank switch repoints these as well
+    // * CHR RAM is decoded into _chr_ram_tiles (normal ones, then flipped ones) a tile at a time, on the first
+    //   use after a write to it marks it in _tile_dirty - which is nullptr for every other kind of page
+    //
+    const uint8_t *_tiles[PPU_CHR_PAGE_COUNT];
+    const uint8_t *_flipped_tiles[PPU_CHR_PAGE_COUNT];
+    uint8_t *_tile_dirty[PPU_PAGE_COUNT];
+
+    const uint8_t *_chr_rom;                // of the loaded mapper, to tell what map_chr_pages maps
+    size_t _chr_rom_size;
+    const uint8_t *_chr_rom_tiles;
+    const uint8_t *_chr_rom_flipped_tiles;
+    const uint8_t *_chr_ram;
+    size_t _chr_ram_size;
+    std::vector<uint8_t> _chr_ram_tiles;
+    std::vector<uint8_t> _chr_ram_dirty;    // a byte per CHR RAM tile
 
-    // PPUSTATUS
-    uint8_t _latch;
-    bool _sprite_overflow;
-    bool _vblank_started;
-    bool _sprite_0_hit;
+    nes_system* _system;
 
-    // OAMADDR, OAMDATA
-    uint8_t _oam_addr;
+    //
+    // Frames are palette indices - what the palette entry of every pixel holds, with grayscale applied - a
+    // scanline at a time into the back buffer, which becomes the front buffer at VBlank
+    //
+    std::unique_ptr<uint8_t[][PPU_SCREEN_X * PPU_SCREEN_Y]> _frame_buffers;    // 2, out of line like _bg_layers
+    int _front_buffer;
+    bool _frame_ready;
 
-    // PPUSCROLL
-    bool _addr_toggle;                  // the "w" register - see http://wiki.nesdev.com/w/index.php/PPU_scrolling
+    //
+    // The visible scanline being rendered. Lines are normally drawn in one go. A write that changes what they
+    // look like half way through (see split_scanline) draws what is out so far, and the rest of the line is
+    // drawn later from the tiles fetched before and after
+    //
+    uint8_t _line_bg[PPU_LINE_TILE_COUNT * 8];  // palette entry of every pixel of the tiles fetched so far, 0 where
+                                                // transparent - the screen starts fine x pixels in
+    int _line_tile_count;               // fetched so far
+    uint16_t _line_v;                   // v the tiles from _line_v_tile on are fetched from - PPUADDR moves it
+    int _line_v_tile;
+    int _line_x;                        // pixels drawn so far
+
+    // Palette entry (0x10~0x1f) of the sprite pixel over every pixel, with PPU_SPRITE_ATTR_BEHIND_BG and
+    // PPU_SPRITE_LINE_SPRITE_0 - 0 where there is none. Only good when _line_sprite_count isn't 0
+    uint8_t _sprite_line[PPU_SCREEN_X];
+    int _line_sprite_count;
 
-    uint16_t _temp_ppu_addr;            // the "t" register - see http://wiki.nesdev.com/w/index.php/PPU_scrolling
-    uint8_t _scroll_y;                  // cached _scroll_y value
+    //
+    // The background of each 1KB of nametable RAM rendered like _line_bg (mirrors share it), so that lines are
+    // windows into it wherever they are scrolled to. Rows 30 and 31 are the attribute table as tiles, for
+    // games scrolled into it. A tile is rendered again, by the next line that shows it, once marked dirty:
+    // * its nametable byte or its attribute byte was written
+    // * its pattern in the background pattern table changed - CHR RAM written, a bank switched or PPUCTRL
+    //   picking the other table. Those go to _bg_pattern_dirty, to find the tiles that show them only when
+    //   the layer is next used
+    // Palette writes make nothing dirty - the layers hold palette entries, looked up as lines are composed
+    // A quarter of a megabyte - allocated with the PPU rather than part of it, so a console stays small
+    //
+    std::unique_ptr<uint8_t[][PPU_BG_LAYER_SIZE * PPU_BG_LAYER_SIZE]> _bg_layers;      // PPU_NAMETABLE_COUNT
+    uint32_t _bg_dirty[PPU_NAMETABLE_COUNT][PPU_BG_LAYER_SIZE / 8];     // a bit per tile of each row of tiles
+    uint64_t _bg_pattern_dirty[PPU_NAMETABLE_COUNT][4];                 // a bit per background pattern table tile
 
-    // PPUDATA
-    uint8_t _vram_read_buf;             // delayed VRAM reads
+    nes_pixel_kernel _pixel_kernel;
+    nes_compose_pixels_fn _compose_pixels;
 
 public:
-    // PPUADDR
-    // yyy NN YYYYY XXXXX
-    //    ||| || ||||| +++++-- coarse X scroll
-    //    ||| || +++++-------- coarse Y scroll
-    //    ||| ++-------------- nametable select
-    //    +++----------------- fine Y scroll
-    uint16_t _ppu_addr;                 // the "v" register - see http://wiki.nesdev.com/w/index.php/PPU_scrolling
-    uint8_t  _fine_x_scroll;            // the "x" register - see http://wiki.nesdev.com/w/index.php/PPU_scrolling
-    uint8_t  _coarse_x_scroll;
     void step_ppu(nes_ppu_cycle_t cycle);
     void step_to(nes_cycle_t count);
-    std::unique_ptr<uint8_t[]> _vram;
-    std::unique_ptr<uint8_t[]> _oam;
+
+    // Earliest time after now at which PPUSTATUS can change without being written to - catches up first
+    nes_cycle_t next_status_change(nes_cycle_t now);
+
+    nes_ppu_position position() { return { _state.master_cycle, _state.cur_scanline, int(_state.scanline_cycle.count()), _state.frame_count }; }
+
+    //
+    // PPU A12 (what the MMC3 scanline counter counts) isn't simulated fetch by fetch - while rendering it
+    // rises at one fixed dot of every fetching scanline, so rises are counted and predicted from the frame
+    // timing instead. Counts the rises at rise_dot (see a12_rise_dot) after `from` up to and including
+    // `until`, stopping at max_rises, and stores the time of the last one counted in last_rise.
+    //
+    int count_a12_rises(const nes_ppu_position &from, nes_cycle_t until, int max_rises, int rise_dot, nes_cycle_t &last_rise);
+    void on_event_dot();
+    void schedule_frame_events();
     void init(nes_system* system);
-    nes_ppu()
-    {
-        _vram = std::make_unique<uint8_t[]>(PPU_VRAM_SIZE);
-        _oam = std::make_unique<uint8_t[]>(PPU_OAM_SIZE);
-    }
+    explicit nes_ppu(nes_ppu_state &state);
+
+    const nes_ppu_state &state() const { return _state; }
+
+    void load_mapper(nes_mapper &mapper);
+
+    // Pattern tables read as 0 until the next load_mapper
+    void unload_mapper();
 
-    void load_mapper(std::shared_ptr<nes_mapper> &mapper);
+    // Last complete frame - PPU_SCREEN_X x PPU_SCREEN_Y palette indices (0~63), a row after another
+    const uint8_t *frame() const { return _frame_buffers[_front_buffer]; }
 
-    void fetch_tile();
+    // How pixels are composed - the best the host runs up to kernel. The fastest one by default
+    void set_pixel_kernel(nes_pixel_kernel kernel);
+    nes_pixel_kernel pixel_kernel() { return _pixel_kernel; }
+
+    // Whether a frame completed since the last call - frames complete at VBlank
+    bool frame_ready()
+    {
+        bool ready = _frame_ready;
+        _frame_ready = false;
+        return ready;
+    }
 
     struct sprite_info
     {
@@ -172,75 +256,97 @@ public:
         uint8_t pos_x;
     };
 
+    // Nametable mirroring is a matter of repointing 8 pages - four-screen boards ignore it
     void set_mirroring(nes_mapper_flags flags);
 
+    //
+    // Pattern table setup - page is addr >> PPU_CHR_PAGE_SHIFT, data must cover count * PPU_CHR_PAGE_SIZE bytes
+    // CHR ROM is never written through - writes to it are dropped before they get to the (read-only) memory
+    //
+    void map_chr(int page, int count, const uint8_t *rom) { map_chr_pages(page, count, const_cast<uint8_t *>(rom), false); }
+    void map_chr_ram(int page, int count, uint8_t *ram) { map_chr_pages(page, count, ram, true); }
+
     sprite_info *get_sprite(uint8_t sprite_id)
     {
         // sprite info resides in OAM memory and there are 64 sprites x 4 bytes each = 256 bytes
-        //return &((sprite_info *)_oam.get())[sprite_id];
+        //return &((sprite_info *)_state.oam)[sprite_id];
     }
 
     //
-    // PPU internal ram
+    // PPU address space - one page table lookup, except for the palette
     //
     uint8_t read_byte(uint16_t addr)
     {
-        redirect_addr(addr);
+        if (addr >= PPU_PALETTE_ADDR)
+            return (addr < PPU_VRAM_SIZE) ? _state.palette[palette_index(addr)] : 0xff;
 
-        if (addr >= PPU_VRAM_SIZE)
-            return 0xff;
-
-        return _vram[addr];
+        return _pages[addr >> PPU_PAGE_SHIFT][addr & (PPU_PAGE_SIZE - 1)];
     }
 
     void write_byte(uint16_t addr, uint8_t val)
     {
-        redirect_addr(addr);
-
-        if (addr >= PPU_VRAM_SIZE)
+        if (addr >= PPU_PALETTE_ADDR)
+        {
+            if (addr < PPU_VRAM_SIZE)
+                _state.palette[palette_index(addr)] = val;
             return;
+        }
 
-        _vram[addr] = val;
+        int page = addr >> PPU_PAGE_SHIFT;
+        if (_page_writable[page])
+        {
+            int offset = addr & (PPU_PAGE_SIZE - 1);
+            _pages[page][offset] = val;
+            if (page >= PPU_CHR_PAGE_COUNT)
+            {
+                dirty_bg_nametable(page, offset);
+            }
+            else if (_tile_dirty[page])
+            {
+                _tile_dirty[page][offset / PPU_TILE_SIZE] = 1;
+                dirty_bg_chr_ram(_pages[page], offset / PPU_TILE_SIZE);
+            }
+        }
+    }
+
+    // Row of the pattern table tile at tile_addr decoded - 8 pixels of 0~3, leftmost first (rightmost if flip)
+    const uint8_t *tile_row(uint16_t tile_addr, int row, bool flip)
+    {
+        int page = tile_addr >> PPU_PAGE_SHIFT;
+        int tile = (tile_addr & (PPU_PAGE_SIZE - 1)) / PPU_TILE_SIZE;
+        if (_tile_dirty[page] && _tile_dirty[page][tile])
+            decode_chr_ram_tile(page, tile);
+
+        return (flip ? _flipped_tiles : _tiles)[page] + tile * NES_TILE_PIXELS + row * 8;
     }
 
     void write_bytes(uint16_t addr, uint8_t *src, size_t src_size)
     {
-        if (addr + src_size > PPU_VRAM_SIZE)
-            return;
+        for (size_t i = 0; i < src_size; ++i)
+            write_byte(uint16_t(addr + i), src[i]);
+    }
 
-        redirect_addr(addr);
-        memcpy_s(_vram.get() + addr, PPU_VRAM_SIZE - addr, src, src_size);
+    // Host memory behind addr - anywhere in $0000~$3eff. Good until the end of its 1KB page
+    const uint8_t *page_ptr(uint16_t addr) const
+    {
+        assert(addr < PPU_PALETTE_ADDR);
+        return _pages[addr >> PPU_PAGE_SHIFT] + (addr & (PPU_PAGE_SIZE - 1));
     }
 
-    void redirect_addr(uint16_t &addr)
+    void map_chr_pages(int page, int count, uint8_t *data, bool writable);
+
+    // Points the nametable pages (and their mirrors at $3000) at nametable RAM as _state.mirroring says
+    void map_nametables();
+
+    // Palette entry behind $3f00~$3fff - 32 entries mirrored every 0x20 bytes, and the backdrop entries of
+    // the sprite palettes ($3f10/$3f14/$3f18/$3f1c) mirror those of the background ones
+    static int palette_index(uint16_t addr)
     {
-        if ((addr & 0xff00) == 0x3f00)
-        {
-            // mirror of palette table every 0x20 bytes
-            addr &= 0xff1f;
+        addr &= PPU_PALETTE_SIZE - 1;
+        if ((addr & 0x13) == 0x10)
+            addr &= 0x0f;
 
-            // mirror special case 0x3f10 = 0x3f00, 0x3f14 = 0x3f04, ...
-            if ((addr & 0xfff3) == 0x3f10)
-                addr &= 0x3f0f;
-        }
-        else if ((addr & 0xf000) == 0x2000)
-        {
-            // name table mirroring
-            if (_mirroring_flags == nes_mapper_flags_vertical_mirroring)
-                addr &= 0xf7ff;     // $2000=$2800, $2400=$2c00
-            else if (_mirroring_flags == nes_mapper_flags_horizontal_mirroring)
-                addr &= 0xfbff;     // $2000=$2400, $2800=$2c00
-            else if (_mirroring_flags == nes_mapper_flags_one_screen_lower_bank)
-                addr &= 0xf3ff;     // $2000 mapped to all the other 3
-            else if (_mirroring_flags == nes_mapper_flags_one_screen_upper_bank)
-                addr = (addr & 0xf3ff) | 0x400; // $2400 mapped to all the other 3
-            else assert(!"Unsupported mirroring modes");
-        }
-        else if (addr >= 0x3000)
-        {
-            // 0x3000~0x3f00 mirrors to 0x2000~0x2f00
-            addr -= 0x1000;
-        }
+        return addr;
     }
 
     //
@@ -248,61 +354,103 @@ public:
     //
     void write_latch(uint8_t val)
     {
-        _latch = val;
+        _state.latch = val;
     }
 
     uint8_t read_latch()
     {
         // This latch is also subject to decay but it is random so no need to emulate that
-        return _latch;
+        return _state.latch;
+    }
+
+    // Dot of each fetching scanline at which A12 rises with the current settings - -1 if it never does
+    int a12_rise_dot()
+    {
+        if (!_state.show_bg && !_state.show_sprites)
+            return -1;
+
+        // Sprite fetches from $1000 after background fetches from $0000 - 8x16 sprites are assumed to
+        // come from $1000 as that's what MMC3 games do
+        if (_state.sprite_pattern_tbl_addr == 0x1000 || _state.use_8x16_sprite)
+            return 260;
+
+        // Background prefetch for the next scanline from $1000 after sprites from $0000
+        if (_state.bg_pattern_tbl_addr == 0x1000)
+            return 324;
+
+        return -1;
     }
 
     void write_PPUCTRL(uint8_t val)
     {
+        split_scanline();
         write_latch(val);
+        int old_rise_dot = a12_rise_dot();
 
         uint8_t name_table_addr_bit = val & PPUCTRL_BASE_NAME_TABLE_ADDR_MASK;
-        _temp_ppu_addr = (_temp_ppu_addr & 0xf3ff) | ((val & PPUCTRL_BASE_NAME_TABLE_ADDR_MASK) << 10);
-        _name_tbl_addr = 0x2000 + uint16_t(name_table_addr_bit) * 0x400;
-
-        _bg_pattern_tbl_addr = (val & PPUCTRL_BACKGROUND_PATTERN_TABLE_ADDRESS_MASK) << 0x8;
-        _sprite_pattern_tbl_addr = (val & PPUCTRL_SPRITE_PATTERN_TABLE_ADDR_MASK) << 0x8;
-
-        _use_8x16_sprite = val & PPUCTRL_SPRITE_SIZE_MASK;
-        if (_use_8x16_sprite)
-            _sprite_height = 16;
+        _state.temp_ppu_addr = (_state.temp_ppu_addr & 0xf3ff) | ((val & PPUCTRL_BASE_NAME_TABLE_ADDR_MASK) << 10);
+        _state.name_tbl_addr = 0x2000 + uint16_t(name_table_addr_bit) * 0x400;
+
+        uint16_t bg_pattern_tbl_addr = uint16_t((val & PPUCTRL_BACKGROUND_PATTERN_TABLE_ADDRESS_MASK) << 0x8);
+        if (bg_pattern_tbl_addr != _state.bg_pattern_tbl_addr)
+            dirty_bg_patterns(0, PPU_PAGE_TILE_COUNT * 4);
+        _state.bg_pattern_tbl_addr = bg_pattern_tbl_addr;
+        _state.sprite_pattern_tbl_addr = (val & PPUCTRL_SPRITE_PATTERN_TABLE_ADDR_MASK) << 0x9;
+
+        _state.use_8x16_sprite = val & PPUCTRL_SPRITE_SIZE_MASK;
+        if (_state.use_8x16_sprite)
+            _state.sprite_height = 16;
         else
-            _sprite_height = 8;
+            _state.sprite_height = 8;
 
-        _ppu_addr_inc = (val & PPUCTRL_VRAM_ADDR_MASK) ? 0x20 : 1;
+        _state.ppu_addr_inc = (val & PPUCTRL_VRAM_ADDR_MASK) ? 0x20 : 1;
 
-        _vblank_nmi = (val & PPUCTRL_NMI_AT_VBLANK_MASK);
+        _state.vblank_nmi = (val & PPUCTRL_NMI_AT_VBLANK_MASK);
+
+        if (_mapper && a12_rise_dot() != old_rise_dot)
+            _mapper->on_a12_timing_change(old_rise_dot);
     }
 
     void write_PPUMASK(uint8_t val)
     {
+        split_scanline();
         write_latch(val);
+        int old_rise_dot = a12_rise_dot();
+
+        _state.show_bg = val & PPUMASK_SHOW_BACKGROUND;
+        _state.show_sprites = val & PPUMASK_SHOW_SPRITES;
+        _state.gray_scale_mode = val & PPUMASK_GRAYSCALE;
+        _state.show_bg_left = val & PPUMASK_BACKGROUND_IN_LEFTMOST_8;
+        _state.show_sprites_left = val & PPUMASK_SPRITE_IN_LEFTMOST_8;
 
-        _show_bg = val & PPUMASK_SHOW_BACKGROUND;
-        _show_sprites = val & PPUMASK_SHOW_SPRITES;
-        _gray_scale_mode = val & PPUMASK_GRAYSCALE;
+        if (_mapper && a12_rise_dot() != old_rise_dot)
+            _mapper->on_a12_timing_change(old_rise_dot);
     }
 
-    uint8_t read_PPUSTATUS()
+    // PPUSTATUS bits 5~7
+    uint8_t status_flags() const
     {
-        uint8_t status = _latch & PPUSTATUS_LATCH_MASK;
-        if (_sprite_0_hit)
+        uint8_t status = 0;
+        if (_state.sprite_0_hit)
             status |= PPUSTATUS_SPRITE_0_HIT;
-        if (_sprite_overflow)
+        if (_state.sprite_overflow)
             status |= PPUSTATUS_SPRITE_OVERFLOW;
-        if (_vblank_started)
+        if (_state.vblank_started)
             status |= PPUSTATUS_VBLANK_START;
 
+        return status;
+    }
+
+    uint8_t read_PPUSTATUS()
+    {
+        uint8_t status = (_state.latch & PPUSTATUS_LATCH_MASK) | status_flags();
+
 
             // clear various flags after reading
-            _vblank_started = false;
-            _addr_toggle = false;
+            _state.vblank_started = false;
+            _state.addr_toggle = false;
             write_latch(status);
+            _state.status_after_read = status_flags();
 
         return status;
     }
@@ -311,71 +459,76 @@ public:
     {
         write_latch(val);
 
-        _oam_addr = val;
+        _state.oam_addr = val;
     }
 
     void write_OAMDATA(uint8_t val)
     {
         write_latch(val);
 
-        _oam[_oam_addr] = val;
-        _oam_addr++;
+        _state.oam[_state.oam_addr] = val;
+        _state.oam_addr++;
     }
 
     uint8_t read_OAMDATA()
     {
 
-        uint8_t val = _oam[_oam_addr];
+        uint8_t val = _state.oam[_state.oam_addr];
         write_latch(val);
         return val;
     }
 
     void write_PPUSCROLL(uint8_t val)
     {
-
+        split_scanline();
         write_latch(val);
 
-        _addr_toggle = !_addr_toggle;
-        if (_addr_toggle)
+        _state.addr_toggle = !_state.addr_toggle;
+        if (_state.addr_toggle)
         {
             // first write
-            _temp_ppu_addr = (_temp_ppu_addr & 0xffe0) | (val >> 3);
-            _fine_x_scroll = val & 0x7;
-            _coarse_x_scroll = _temp_ppu_addr & 0x1f;
+            _state.temp_ppu_addr = (_state.temp_ppu_addr & 0xffe0) | (val >> 3);
+            _state.fine_x_scroll = val & 0x7;
+            _state.coarse_x_scroll = _state.temp_ppu_addr & 0x1f;
         }
         else
         {
             // second write
-            _temp_ppu_addr = (_temp_ppu_addr & 0xc1f) | (uint16_t(val & 0xf8) << 2) | (uint16_t(val & 0x7) << 12);
-            _scroll_y = val;
+            _state.temp_ppu_addr = (_state.temp_ppu_addr & 0xc1f) | (uint16_t(val & 0xf8) << 2) | (uint16_t(val & 0x7) << 12);
+            _state.scroll_y = val;
         }
     }
 
     void write_PPUADDR(uint8_t val)
     {
+        split_scanline();
         write_latch(val);
 
-        _addr_toggle = !_addr_toggle;
-        if (_addr_toggle)
+        _state.addr_toggle = !_state.addr_toggle;
+        if (_state.addr_toggle)
         {
             // first write
             // note that both PPUADDR(2006) and PPUSCROLL (2005) share the same _temp_ppu_addr
-            _temp_ppu_addr = (_temp_ppu_addr & 0x00ff) | (uint16_t(val & 0x3f) << 8);
+            _state.temp_ppu_addr = (_state.temp_ppu_addr & 0x00ff) | (uint16_t(val & 0x3f) << 8);
         }
         else
         {
             // second write
             // note that both PPUADDR(2006) and PPUSCROLL (2005) share the same _temp_ppu_addr
-            _temp_ppu_addr = (_temp_ppu_addr & 0xff00) | val;
-            _ppu_addr = _temp_ppu_addr;
+            _state.temp_ppu_addr = (_state.temp_ppu_addr & 0xff00) | val;
+            _state.ppu_addr = _state.temp_ppu_addr;
+
+            // The rest of the line fetches from here
+            _line_v = _state.ppu_addr;
+            _line_v_tile = _line_tile_count;
         }
     }
 
     void write_PPUDATA(uint8_t val)
     {
         write_latch(val);
-        write_byte(_ppu_addr, val);
-        _ppu_addr += _ppu_addr_inc;
+        write_byte(_state.ppu_addr, val);
+        _state.ppu_addr += _state.ppu_addr_inc;
     }
 
     uint8_t read_PPUDATA()
@@ -383,16 +536,16 @@ public:
         // use _vram_read_buf to implement VRAM delay reading buffer behavior
         // First time read will read from buffer and then update the buffer
         // This means all the reads are delayed by 1 read
-        uint8_t val = _vram_read_buf;
-        uint8_t new_val = read_byte(_ppu_addr);
+        uint8_t val = _state.vram_read_buf;
+        uint8_t new_val = read_byte(_state.ppu_addr);
 
-        bool is_palette = ((_ppu_addr & 0xff00) == 0x3f00);
+        bool is_palette = ((_state.ppu_addr & 0xff00) == PPU_PALETTE_ADDR);
             // for palette - the read buf is updated with the mirrored nametable address
             if (is_palette)
-                _vram_read_buf = read_byte(_ppu_addr - 0x1000);
+                _state.vram_read_buf = read_byte(_state.ppu_addr - 0x1000);
             else
-                _vram_read_buf = new_val;
-            _ppu_addr += _ppu_addr_inc;
+                _state.vram_read_buf = new_val;
+            _state.ppu_addr += _state.ppu_addr_inc;
 
         write_latch(val);
 
@@ -406,4 +559,64 @@ public:
     void write_OAMDMA(uint8_t val);
 
     void oam_dma(uint16_t addr);
+
+private :
+    friend struct nes_ppu_layer_check;      // nes_ppu_test.cpp - checks the layers against fetch_bg_tile
+
+    // Brings the PPU up to the CPU - before anything that changes what is rendered without going through the
+    // PPU registers (which catch up on their own), such as bank switches
+    void catch_up();
+
+    //
+    // Rendering is done a scanline at a time as the PPU passes these dots - registers don't change between
+    // catch ups, and split_scanline takes care of the CPU changing them mid-line
+    // * dot 0 - sprite evaluation: sprite pixels of the line, sprite overflow and where sprite 0 hits (the flag
+    //   is set at that dot)
+    // * dot 256 - the line is drawn with v/x as they are (or the rest of it, if split), then v moves down a line
+    // * dot 257 - horizontal scroll is reloaded from t
+    // * dot 280 of the pre-render line - vertical scroll is reloaded from t
+    // Every dot in [from, to) of the frame gets done
+    //
+    void render_dots(int from, int to);
+    void start_scanline(int line);
+    void finish_scanline(int line);
+
+    // Draws the current visible scanline up to the current dot - before whatever changes how the rest of it looks
+    void split_scanline();
+
+    // Fetches the tiles of the current line up to count - with the registers and banks as they are now
+    void fetch_line_tiles(int count);
+
+    // The current line from _line_x up to end
+    void render_pixels(int line, int end);
+
+    // OAM index of the sprites on line, in priority order - at most PPU_ACTIVE_SPRITE_MAX, returns how many
+    // and whether there are more in overflow
+    int evaluate_sprites(int line, uint8_t *sprites, bool &overflow);
+
+    // Decoded row of sprite on line, flipped as it says - leftmost pixel first
+    const uint8_t *fetch_sprite_row(int line, const uint8_t *sprite);
+
+    // Decoded row of the background tile at v (see tile_row) and its palette (0~3)
+    const uint8_t *fetch_bg_tile(uint16_t v, uint8_t &palette);
+
+    void decode_chr_ram_tile(int page, int tile);
+
+    // Background layers (see _bg_layers) - every tile of every one of them dirty
+    void invalidate_bg_layers();
+
+    // The tile at offset of nametable page, and the tiles an attribute byte there colors
+    void dirty_bg_nametable(int page, int offset);
+
+    // Background pattern table tiles [first, first + count) changed
+    void dirty_bg_patterns(int first, int count);
+
+    // CHR RAM tile of page_data written - a background pattern wherever the background pattern table shows it
+    void dirty_bg_chr_ram(const uint8_t *page_data, int tile);
+
+    // The pixel row of the background at v, on - the rest of its row of tiles follows. Renders dirty tiles first
+    const uint8_t *bg_layer_row(uint16_t v);
+
+    bool rendering() const { return _state.show_bg || _state.show_sprites; }
+    void increment_y();
 };
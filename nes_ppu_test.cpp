@@ -0,0 +1,337 @@
+//
+// Randomized checks of the PPU
+// * pages - random reads and writes all over $0000~$3fff (and past it) through nes_ppu::read_byte/write_byte,
+//   with mirroring switched at random in between, against a model that looks every address up the plain
+//   way: nametable mirroring picks a physical nametable per access, the palette folds its backdrop mirrors.
+//   Covers all five layouts - one screen lower/upper, vertical and horizontal on NROM boards with CHR RAM
+//   and CHR ROM, and a four-screen board
+// * layers - a console rendering while nametables, attributes, CHR RAM, CHR banks, mirroring and the
+//   background pattern table are changed at random through the CPU bus. Every so often each row of every
+//   background layer (see nes_ppu::_bg_layers) is checked against the tiles fetch_bg_tile finds there
+// Stops at the first difference.
+//   nesemu2_ppu_test [operations]      per board, default 200000 - a twentieth of that for layers
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include "nes_system.h"
+#include "nes_memory.h"
+#include "nes_ppu.h"
+
+//
+// The PPU address space as it was before the page table - everything found by address
+//
+struct ppu_model
+{
+    std::vector<uint8_t> chr;
+    bool chr_ram;
+    int mirroring;                  // nes_mapper_flags mirroring bits, or nes_mapper_flags_four_screen
+    uint8_t nametables[PPU_NAMETABLE_COUNT * PPU_NAMETABLE_SIZE];
+    uint8_t palette[PPU_PALETTE_SIZE];
+
+    uint8_t *ptr(uint16_t addr)
+    {
+        if (addr < PPU_NAMETABLE_ADDR)
+            return &chr[addr];
+
+        if ((addr & 0xff00) == 0x3f00)
+        {
+            // 0x3f10 = 0x3f00, 0x3f14 = 0x3f04, ...
+            addr &= 0x1f;
+            if ((addr & 0x13) == 0x10)
+                addr &= 0x0f;
+            return &palette[addr];
+        }
+
+        // 0x3000~0x3eff mirrors 0x2000~0x2eff
+        int table = (addr >> 10) & 0x3;
+        int bank;
+        if (mirroring == nes_mapper_flags_four_screen)
+            bank = table;
+        else if (mirroring == nes_mapper_flags_vertical_mirroring)
+            bank = table & 1;
+        else if (mirroring == nes_mapper_flags_horizontal_mirroring)
+            bank = table >> 1;
+        else if (mirroring == nes_mapper_flags_one_screen_lower_bank)
+            bank = 0;
+        else
+            bank = 1;
+        return &nametables[bank * PPU_NAMETABLE_SIZE + (addr & (PPU_NAMETABLE_SIZE - 1))];
+    }
+
+    uint8_t read(uint16_t addr)
+    {
+        return addr < PPU_VRAM_SIZE ? *ptr(addr) : 0xff;
+    }
+
+    void write(uint16_t addr, uint8_t val)
+    {
+        if (addr >= PPU_VRAM_SIZE || (addr < PPU_NAMETABLE_ADDR && !chr_ram))
+            return;
+
+        *ptr(addr) = val;
+    }
+};
+
+struct ppu_test_board
+{
+    const char *name;
+    uint8_t flag6;
+    int chr_banks;                  // 8KB of CHR ROM each - 0 for 8KB of CHR RAM
+};
+
+static const ppu_test_board s_page_boards[] = {
+    { "chr ram, horizontal",  0x00, 0 },
+    { "chr rom, vertical",    0x01, 1 },
+    { "four screen",          0x08, 0 },
+};
+
+// MMC3 - CHR banks and mirroring switch
+static const ppu_test_board s_layer_boards[] = {
+    { "mmc3 chr rom",         0x40, 16 },
+    { "mmc3 chr ram",         0x40, 0 },
+    { "mmc3 four screen",     0x48, 16 },
+};
+
+static const nes_mapper_flags s_mirrorings[] = {
+    nes_mapper_flags_one_screen_lower_bank,
+    nes_mapper_flags_one_screen_upper_bank,
+    nes_mapper_flags_vertical_mirroring,
+    nes_mapper_flags_horizontal_mirroring,
+};
+
+static std::mt19937 s_rng(1);
+
+static int rand(int lo, int hi)
+{
+    return std::uniform_int_distribution<int>(lo, hi)(s_rng);
+}
+
+//
+// 32KB of PRG with an idle loop in the last 8KB (fixed on MMC3, whatever is switched) and random CHR ROM
+// Powered on with the board's ROM in system
+//
+static std::vector<uint8_t> load_rom(nes_system &system, const ppu_test_board &board)
+{
+    std::vector<uint8_t> rom = { 'N', 'E', 'S', 0x1a, 2, uint8_t(board.chr_banks), board.flag6, 0,
+                                 0, 0, 0, 0, 0, 0, 0, 0 };
+    size_t prg = rom.size();
+    rom.resize(prg + 0x8000, 0xea);
+    rom[prg + 0x6000] = 0x78;           // $e000: SEI
+    rom[prg + 0x6001] = 0x4c;           //        JMP $e001
+    rom[prg + 0x6002] = 0x01;
+    rom[prg + 0x6003] = 0xe0;
+    rom[prg + 0x6100] = 0x40;           // $e100: RTI
+    const uint8_t vectors[] = { 0x00, 0xe1, 0x00, 0xe0, 0x00, 0xe1 };
+    memcpy(&rom[prg + 0x7ffa], vectors, sizeof(vectors));
+
+    for (int i = 0; i < board.chr_banks * 0x2000; ++i)
+        rom.push_back(uint8_t(rand(0, 255)));
+
+    // A file of its own per board - see nes_rom_image::open
+    static int s_rom_count = 0;
+    std::string name = "nesemu2_ppu_test_" + std::to_string(s_rom_count++) + ".nes";
+    std::string path = (std::filesystem::temp_directory_path() / name).string();
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(rom.data()), rom.size());
+    }
+
+    system.init();
+    system.load_rom(path.c_str(), "");
+    std::error_code error;
+    std::filesystem::remove(path, error);
+    return rom;
+}
+
+static bool check_pages(const ppu_test_board &board, long operations)
+{
+    auto system = std::make_unique<nes_system>();
+    std::vector<uint8_t> rom = load_rom(*system, board);
+
+    nes_ppu *ppu = system->getPpu();
+    const nes_ppu_state &state = system->state().ppu;
+
+    ppu_model model;
+    model.chr_ram = !board.chr_banks;
+    model.chr.assign(0x2000, 0);
+    if (board.chr_banks)
+        memcpy(model.chr.data(), rom.data() + 16 + 0x8000, 0x2000);
+    model.mirroring = state.mirroring;
+    memcpy(model.nametables, state.nametables, sizeof(model.nametables));
+    memcpy(model.palette, state.palette, sizeof(model.palette));
+
+    for (long i = 0; i < operations; ++i)
+    {
+        // Mostly the nametables, where mirroring matters
+        uint16_t addr;
+        switch (rand(0, 7))
+        {
+            case 0:  addr = uint16_t(rand(0, 0x1fff)); break;
+            case 1:  addr = uint16_t(rand(0x3f00, 0x3fff)); break;
+            case 2:  addr = uint16_t(rand(0x4000, 0xffff)); break;
+            default: addr = uint16_t(rand(0x2000, 0x3eff)); break;
+        }
+
+        int op = rand(0, 63);
+        if (op == 0)
+        {
+            // Four-screen boards ignore it
+            nes_mapper_flags mirroring = s_mirrorings[rand(0, 3)];
+            ppu->set_mirroring(mirroring);
+            if (model.mirroring != nes_mapper_flags_four_screen)
+                model.mirroring = mirroring;
+        }
+        else if (op < 32)
+        {
+            uint8_t val = uint8_t(rand(0, 255));
+            ppu->write_byte(addr, val);
+            model.write(addr, val);
+        }
+        else
+        {
+            uint8_t actual = ppu->read_byte(addr);
+            uint8_t expected = model.read(addr);
+            if (actual != expected)
+            {
+                printf("%s: operation %ld, mirroring %d - $%04X reads %02X, expected %02X\n", board.name, i,
+                       model.mirroring, addr, actual, expected);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Every row of every background layer against the tiles fetch_bg_tile finds at the same v
+struct nes_ppu_layer_check
+{
+    static bool check(nes_ppu *ppu, const char *name, long operation)
+    {
+        for (int table = 0; table < PPU_NAMETABLE_COUNT; ++table)
+        {
+            for (int coarse_y = 0; coarse_y < 32; ++coarse_y)
+            {
+                for (int fine_y = 0; fine_y < 8; ++fine_y)
+                {
+                    uint16_t v = uint16_t(fine_y << 12 | table << 10 | coarse_y << 5);
+                    const uint8_t *row = ppu->bg_layer_row(v);
+                    for (int coarse_x = 0; coarse_x < 32; ++coarse_x)
+                    {
+                        uint8_t palette;
+                        const uint8_t *pixels = ppu->fetch_bg_tile(uint16_t(v | coarse_x), palette);
+                        for (int x = 0; x < 8; ++x)
+                        {
+                            uint8_t expected = pixels[x] ? uint8_t(pixels[x] | (palette << 2)) : 0;
+                            if (row[coarse_x * 8 + x] != expected)
+                            {
+                                printf("%s: operation %ld - layer of $%04X, tile %d, row %d, pixel %d is %02X, "
+                                       "expected %02X\n", name, operation, PPU_NAMETABLE_ADDR + table * PPU_NAMETABLE_SIZE,
+                                       coarse_y * 32 + coarse_x, fine_y, x, row[coarse_x * 8 + x], expected);
+                                return false;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        return true;
+    }
+};
+
+static bool check_layers(const ppu_test_board &board, long operations)
+{
+    auto system = std::make_unique<nes_system>();
+    load_rom(*system, board);
+
+    nes_memory *mem = system->getMem();
+    nes_ppu *ppu = system->getPpu();
+    auto write = [mem](uint16_t addr, uint8_t val) { mem->set_byte(addr, val); };
+
+    write(0x2001, 0x1e);
+    for (long i = 0; i < operations; ++i)
+    {
+        system->step(nes_cycle_t(rand(1, 4000)));
+
+        int op = rand(0, 99);
+        if (op < 30)
+        {
+            // A run of PPUDATA writes - mostly nametables and attributes, then CHR RAM and the palette
+            int kind = rand(0, 7);
+            int addr = kind < 5 ? rand(0x2000, 0x2fff) : kind < 7 ? rand(0, 0x1fff) : rand(0x3f00, 0x3f1f);
+            write(0x2006, uint8_t(addr >> 8));
+            write(0x2006, uint8_t(addr));
+            for (int count = rand(1, 40); count > 0; --count)
+                write(0x2007, uint8_t(rand(0, 255)));
+        }
+        else if (op < 45)
+        {
+            write(0x2005, uint8_t(rand(0, 255)));
+            write(0x2005, uint8_t(rand(0, 255)));
+        }
+        else if (op < 55)
+        {
+            // Either pattern table for the background - no NMI
+            write(0x2000, uint8_t(rand(0, 0x7f)));
+        }
+        else if (op < 60)
+        {
+            write(0x2001, rand(0, 3) ? 0x1e : uint8_t(rand(0, 255)));
+        }
+        else if (op < 80)
+        {
+            // CHR (and PRG) banks
+            write(0x8000, uint8_t(rand(0, 7)));
+            write(0x8001, uint8_t(rand(0, 255)));
+        }
+        else if (op < 85)
+        {
+            write(0xa000, uint8_t(rand(0, 1)));
+        }
+        else if (op == 85 && rand(0, 9) == 0)
+        {
+            system->reset();
+            write(0x2001, 0x1e);
+        }
+
+        if (i % 100 == 99)
+        {
+            // Whatever the PPU still has to render is rendered with the layers as they are now
+            ppu->step_to(system->_master_cycle);
+            if (!nes_ppu_layer_check::check(ppu, board.name, i))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    long operations = argc > 1 ? atol(argv[1]) : 200000;
+
+    for (const auto &board : s_page_boards)
+    {
+        if (!check_pages(board, operations))
+            return 1;
+    }
+
+    for (const auto &board : s_layer_boards)
+    {
+        if (!check_layers(board, operations / 20))
+            return 1;
+    }
+
+    printf("%ld operations on %zu boards match, %ld on %zu rendering\n", operations,
+           sizeof(s_page_boards) / sizeof(s_page_boards[0]), operations / 20,
+           sizeof(s_layer_boards) / sizeof(s_layer_boards[0]));
+    return 0;
+}
@@ -0,0 +1,234 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include "nes_rom_image.h"
+#include "nes_rom_registry.h"
+
+//
+// Identifies the file itself rather than the path it was opened by - and changes when the file is rewritten,
+// as far as the file system's timestamps go: to the nanosecond where there are those, and the change time
+// as well, which nothing but the file system sets. Rewrites closer together than the timestamps tell apart
+// are caught by nes_rom_image::identify
+//
+static std::string file_key(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return std::string();
+
+    std::string key = std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" +
+                      std::to_string(st.st_size) + ":" + std::to_string(st.st_mtime) + ":" +
+                      std::to_string(st.st_ctime);
+#if defined(_WIN32)
+    // No inode numbers - fall back to the path
+    key += std::string(":") + path;
+#elif defined(__APPLE__)
+    key += "." + std::to_string(st.st_mtimespec.tv_nsec) + "." + std::to_string(st.st_ctimespec.tv_nsec);
+#else
+    key += "." + std::to_string(st.st_mtim.tv_nsec) + "." + std::to_string(st.st_ctim.tv_nsec);
+#endif
+    return key;
+}
+
+std::shared_ptr<const nes_rom_image> nes_rom_image::open(const char *path)
+{
+    // Images still in use by someone - they go away with their last user
+    static std::mutex s_lock;
+    static std::map<std::string, std::weak_ptr<const nes_rom_image>> s_images;
+
+    std::string key = file_key(path);
+    if (key.empty())
+        throw std::runtime_error(std::string("Cannot open ") + path);
+
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto found = s_images.find(key);
+    if (found != s_images.end())
+    {
+        // Unless the file was rewritten under it since - see identify
+        auto image = found->second.lock();
+        if (image && nes_hash_samples(image->_prg, image->_prg_size + image->_chr_size) == image->_samples)
+            return image;
+    }
+
+    std::shared_ptr<nes_rom_image> image(new nes_rom_image());
+    if (!image->_file.open(path))
+        throw std::runtime_error(std::string("Cannot open ") + path);
+    if (!image->parse(image->_file.data(), image->_file.size()))
+        throw std::runtime_error(std::string(path) + " is not an iNES ROM");
+    image->identify(key);
+
+    // Drop entries of images nobody uses anymore while we're here
+    for (auto it = s_images.begin(); it != s_images.end();)
+    {
+        if (it->second.expired())
+            it = s_images.erase(it);
+        else
+            ++it;
+    }
+
+    s_images[key] = image;
+    return image;
+}
+
+std::shared_ptr<const nes_rom_image> nes_rom_image::from_memory(std::vector<uint8_t> prg, std::vector<uint8_t> chr, int mapper_id, bool vertical_mirroring)
+{
+    std::shared_ptr<nes_rom_image> image(new nes_rom_image());
+    image->_memory = std::move(prg);
+    image->_prg_size = image->_memory.size();
+    image->_chr_size = chr.size();
+    image->_memory.insert(image->_memory.end(), chr.begin(), chr.end());
+
+    image->_prg = image->_memory.data();
+    image->_chr = image->_memory.data() + image->_prg_size;
+    image->_mapper_id = mapper_id;
+    image->_vertical_mirroring = vertical_mirroring;
+    image->_prg_ram_size = 0x2000;
+    image->_chr_ram_size = image->_chr_size ? 0 : 0x2000;
+    image->identify(std::string());
+    return image;
+}
+
+bool nes_rom_image::parse(const uint8_t *data, size_t size)
+{
+    ines_header header;
+    if (size < sizeof(header))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "NES\x1a", sizeof(header.magic)) != 0)
+        return false;
+
+    size_t offset = sizeof(header);
+    if (header.flag6 & FLAG_6_HAS_TRAINER_MASK)
+    {
+        // skip the 512-byte trainer
+        offset += 0x200;
+    }
+
+    if ((header.flag7 & FLAG_7_NES_2_MASK) == FLAG_7_NES_2)
+        parse_nes_2(header);
+    else
+        parse_ines(header);
+
+    // One at a time - the sum of sizes straight from the header may wrap around
+    if (offset > size || _prg_size == 0 || _prg_size > size - offset || _chr_size > size - offset - _prg_size)
+        return false;
+
+    _prg = data + offset;
+    _chr = _prg + _prg_size;
+    _vertical_mirroring = header.flag6 & FLAG_6_USE_VERTICAL_MIRRORING_MASK;
+    _four_screen = header.flag6 & FLAG_6_USE_FOUR_SCREEN_VRAM_MASK;
+    return true;
+}
+
+void nes_rom_image::parse_ines(const ines_header &header)
+{
+    uint8_t flag7 = header.flag7;
+    uint8_t prg_ram_size = header.prg_ram_size;
+    if (flag7 == 0x44)
+    {
+        // This might be one of the earlier dumps with bad iNes header (D stands for diskdude)
+        flag7 = 0;
+        prg_ram_size = 0;
+    }
+    else if (header.reserved[1] || header.reserved[2] || header.reserved[3] || header.reserved[4])
+    {
+        // Bytes 12~15 are always zero in a clean iNES header - anything there is a ripper's signature that
+        // usually spills into flag 7 and byte 8 as well, so they can't be trusted either
+        flag7 = 0;
+        prg_ram_size = 0;
+    }
+
+    _prg_size = header.prg_size * 0x4000;     // 16KB
+    _chr_size = header.chr_size * 0x2000;     // 8KB
+    _mapper_id = ((header.flag6 & FLAG_6_LO_MAPPER_NUMBER_MASK) >> 4) + ((flag7 & FLAG_7_HI_MAPPER_NUMBER_MASK));
+
+    // 0 means 8KB for compatibility - boards without any PRG RAM don't care if there is some
+    _prg_ram_size = (prg_ram_size ? prg_ram_size : 1) * 0x2000;
+    if (header.flag6 & FLAG_6_HAS_BATTERY_BACKED_PRG_RAM_MASK)
+    {
+        _prg_nvram_size = _prg_ram_size;
+        _prg_ram_size = 0;
+    }
+
+    _chr_ram_size = _chr_size ? 0 : 0x2000;
+}
+
+//
+// ROM sizes are either 12 bits of banks, or 2^E * (MM * 2 + 1) bytes when the high 4 bits are all set
+// E goes up to 63 - a size that doesn't fit in size_t comes back as SIZE_MAX, which no file is big enough for
+//
+static size_t nes_2_rom_size(uint8_t lsb, uint8_t msb, size_t bank_size)
+{
+    if (msb == NES_2_SIZE_EXPONENT)
+    {
+        // The multiplier takes up to 3 bits
+        int exponent = lsb >> 2;
+        if (exponent > int(sizeof(size_t) * 8) - 4)
+            return SIZE_MAX;
+
+        return (size_t(1) << exponent) * ((lsb & 0x3) * 2 + 1);
+    }
+
+    return ((size_t(msb) << 8) | lsb) * bank_size;
+}
+
+// RAM sizes are 64 << shift bytes, 0 meaning none
+static size_t nes_2_ram_size(uint8_t shift)
+{
+    return shift ? size_t(64) << shift : 0;
+}
+
+void nes_rom_image::parse_nes_2(const ines_header &header)
+{
+    _nes_2 = true;
+    _prg_size = nes_2_rom_size(header.prg_size, header.flag9 & NES_2_PRG_SIZE_MSB_MASK, 0x4000);
+    _chr_size = nes_2_rom_size(header.chr_size, header.flag9 >> NES_2_CHR_SIZE_MSB_SHIFT, 0x2000);
+    _mapper_id = ((header.flag6 & FLAG_6_LO_MAPPER_NUMBER_MASK) >> 4) | (header.flag7 & FLAG_7_HI_MAPPER_NUMBER_MASK) |
+                 ((header.prg_ram_size & NES_2_MAPPER_MSB_MASK) << 8);
+    _submapper_id = header.prg_ram_size >> NES_2_SUBMAPPER_SHIFT;
+
+    _prg_ram_size = nes_2_ram_size(header.flag10 & NES_2_RAM_SHIFT_MASK);
+    _prg_nvram_size = nes_2_ram_size(header.flag10 >> NES_2_NVRAM_SHIFT_SHIFT);
+
+    // CHR NVRAM is only found on boards we don't support - it is just more CHR RAM here
+    _chr_ram_size = nes_2_ram_size(header.reserved[0] & NES_2_RAM_SHIFT_MASK) +
+                    nes_2_ram_size(header.reserved[0] >> NES_2_NVRAM_SHIFT_SHIFT);
+}
+
+void nes_rom_image::identify(const std::string &file_key)
+{
+    // A file rewritten with the same size within a timestamp tick has the same file key - samples of its
+    // contents tell it from the one hashed before
+    _samples = nes_hash_samples(_prg, _prg_size + _chr_size);
+    std::string key = file_key;
+    if (!key.empty())
+    {
+        char samples[16];
+        snprintf(samples, sizeof(samples), ":%08x", _samples);
+        key += samples;
+    }
+
+    auto &registry = nes_rom_registry::instance();
+    _hash = registry.identify(key, _prg, _prg_size + _chr_size);
+
+    nes_header_fix fix;
+    if (registry.header_fix(_hash, fix))
+    {
+        if (fix.mapper_id >= 0)
+            _mapper_id = fix.mapper_id;
+        if (fix.vertical_mirroring >= 0)
+            _vertical_mirroring = fix.vertical_mirroring != 0;
+    }
+}
+
+const nes_rom_assets &nes_rom_image::assets() const
+{
+    std::call_once(_assets_once, [this] { _assets = nes_rom_registry::instance().assets(*this); });
+    return *_assets;
+}
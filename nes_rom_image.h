@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "nes_mapped_file.h"
+#include "nes_hash.h"
+
+//
+// iNES file format
+// http://wiki.nesdev.com/w/index.php/INES
+// NES 2.0 reuses bytes 8~15 - see the NES_2_ macros
+// http://wiki.nesdev.com/w/index.php/NES_2.0
+//
+struct ines_header
+{
+    uint8_t magic[4];       // 0x4E, 0x45, 0x53, 0x1A
+    uint8_t prg_size;       // PRG ROM in 16K
+    uint8_t chr_size;       // CHR ROM in 8K, 0 -> using CHR RAM
+    uint8_t flag6;
+    uint8_t flag7;
+    uint8_t prg_ram_size;   // PRG RAM in 8K                    NES 2.0: mapper MSB / submapper
+    uint8_t flag9;          //                                  NES 2.0: PRG/CHR ROM size MSB
+    uint8_t flag10;         // unofficial                       NES 2.0: PRG RAM / NVRAM size
+    uint8_t reserved[5];    // reserved                         NES 2.0: CHR RAM / NVRAM size, timing, ...
+};
+
+#define FLAG_6_USE_VERTICAL_MIRRORING_MASK 0x1
+#define FLAG_6_HAS_BATTERY_BACKED_PRG_RAM_MASK 0x2
+#define FLAG_6_HAS_TRAINER_MASK  0x4
+#define FLAG_6_USE_FOUR_SCREEN_VRAM_MASK 0x8
+#define FLAG_6_LO_MAPPER_NUMBER_MASK 0xf0
+#define FLAG_7_HI_MAPPER_NUMBER_MASK 0xf0
+#define FLAG_7_NES_2_MASK 0x0c
+#define FLAG_7_NES_2 0x08
+
+#define NES_2_MAPPER_MSB_MASK 0x0f          // prg_ram_size - mapper number bits 8~11
+#define NES_2_SUBMAPPER_SHIFT 4
+#define NES_2_PRG_SIZE_MSB_MASK 0x0f        // flag9 - bits 8~11 of prg_size
+#define NES_2_CHR_SIZE_MSB_SHIFT 4          // flag9 - bits 8~11 of chr_size
+#define NES_2_SIZE_EXPONENT 0xf             // size MSB meaning prg_size/chr_size is 2^E * (MM * 2 + 1) instead
+#define NES_2_RAM_SHIFT_MASK 0x0f           // flag10 (PRG) / reserved[0] (CHR) - volatile RAM is 64 << shift
+#define NES_2_NVRAM_SHIFT_SHIFT 4           // flag10 (PRG) / reserved[0] (CHR) - battery-backed RAM is 64 << shift
+
+//
+// Immutable cartridge contents - PRG/CHR ROM plus what the header says about the board
+// Images opened from a file point straight into a read-only mapping of it, and every open of the same file
+// in the process gets the same image: a hundred instances of one game share a single copy of the ROM, paged
+// in by the OS on first touch, and only the first one pays for the open.
+// Mappers (and through them the CPU/PPU page tables) point into the image - it has to outlive them, which
+// holding the std::shared_ptr takes care of.
+// Every image is identified by the hash of its PRG+CHR through nes_rom_registry, which also corrects the
+// header of known bad dumps and holds what is derived from the contents (nes_rom_registry::assets).
+//
+struct nes_rom_assets;
+
+class nes_rom_image
+{
+public :
+    // Throws std::runtime_error if the file can't be read or isn't an iNES ROM
+    static std::shared_ptr<const nes_rom_image> open(const char *path);
+
+    // ROM built in memory rather than read from a file
+    static std::shared_ptr<const nes_rom_image> from_memory(std::vector<uint8_t> prg, std::vector<uint8_t> chr, int mapper_id, bool vertical_mirroring);
+
+    const uint8_t *prg() const { return _prg; }
+    size_t prg_size() const { return _prg_size; }
+
+    // chr_size() is 0 if the board has CHR RAM instead
+    const uint8_t *chr() const { return _chr; }
+    size_t chr_size() const { return _chr_size; }
+
+    int mapper_id() const { return _mapper_id; }
+    int submapper_id() const { return _submapper_id; }
+    bool vertical_mirroring() const { return _vertical_mirroring; }
+
+    // The board has VRAM for all 4 nametables - mirroring doesn't apply
+    bool four_screen() const { return _four_screen; }
+    bool nes_2() const { return _nes_2; }
+
+    // PRG RAM at $6000~$7fff - battery-backed RAM (NVRAM) is kept in a save file, see nes_mapper::open_save
+    // An iNES header only says whether the PRG RAM has a battery - it is 8KB (or what byte 8 says) either way
+    size_t prg_ram_size() const { return _prg_ram_size; }
+    size_t prg_nvram_size() const { return _prg_nvram_size; }
+    bool has_battery() const { return _prg_nvram_size != 0; }
+
+    // CHR RAM - only used when there is no CHR ROM
+    size_t chr_ram_size() const { return _chr_ram_size; }
+
+    // Hash of PRG followed by CHR
+    const nes_rom_hash &hash() const { return _hash; }
+
+    // What the registry derives from the contents - asked for on first use, and kept from then on
+    const nes_rom_assets &assets() const;
+
+    nes_rom_image(const nes_rom_image &) = delete;
+    nes_rom_image &operator=(const nes_rom_image &) = delete;
+
+private :
+    nes_rom_image()
+            : _prg(nullptr), _prg_size(0), _chr(nullptr), _chr_size(0), _mapper_id(0), _submapper_id(0),
+              _vertical_mirroring(false), _four_screen(false), _nes_2(false), _prg_ram_size(0), _prg_nvram_size(0), _chr_ram_size(0),
+              _samples(0)
+    {}
+
+    // Finds PRG/CHR inside an iNES or NES 2.0 file image - false if it isn't one
+    bool parse(const uint8_t *data, size_t size);
+    void parse_ines(const ines_header &header);
+    void parse_nes_2(const ines_header &header);
+
+    // Hashes the contents and applies the registry's header fix for them, if any
+    void identify(const std::string &file_key);
+
+    nes_mapped_file _file;
+    std::vector<uint8_t> _memory;       // from_memory - PRG followed by CHR
+
+    const uint8_t *_prg;
+    size_t _prg_size;
+    const uint8_t *_chr;
+    size_t _chr_size;
+    int _mapper_id;
+    int _submapper_id;
+    bool _vertical_mirroring;
+    bool _four_screen;
+    bool _nes_2;
+    size_t _prg_ram_size;
+    size_t _prg_nvram_size;
+    size_t _chr_ram_size;
+    nes_rom_hash _hash;
+    uint32_t _samples;                  // nes_hash_samples of PRG and CHR when they were hashed
+
+    mutable std::once_flag _assets_once;
+    mutable std::shared_ptr<const nes_rom_assets> _assets;
+};
@@ -0,0 +1,166 @@
+//
+// iNES / NES 2.0 header parsing checks
+// Every case is written out as a file and opened through nes_rom_image::open, which either takes it with the
+// expected sizes or throws - and a file rewritten in place has to be told from what it held before.
+// Returns non-zero if any case comes out wrong.
+//   nesemu2_rom_image_test
+//
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "nes_rom_image.h"
+#include "nes_rom_registry.h"
+
+struct rom_image_case
+{
+    const char *name;
+    uint8_t header[16];
+    size_t body_size;               // bytes after the header
+    bool valid;
+    size_t prg_size;                // expected when valid
+    size_t chr_size;
+    int mapper_id;
+};
+
+static const rom_image_case s_cases[] = {
+    { "ines",               { 'N', 'E', 'S', 0x1a, 2, 1, 0x10, 0x00 },                          0x8000 + 0x2000, true, 0x8000, 0x2000, 1 },
+    { "ines chr ram",       { 'N', 'E', 'S', 0x1a, 1, 0, 0x00, 0x00 },                          0x4000,          true, 0x4000, 0,      0 },
+    { "ines trainer",       { 'N', 'E', 'S', 0x1a, 1, 1, 0x04, 0x00 },                          0x200 + 0x6000,  true, 0x4000, 0x2000, 0 },
+    { "ines truncated",     { 'N', 'E', 'S', 0x1a, 2, 1, 0x00, 0x00 },                          0x8000 + 0x1fff, false },
+    { "ines no prg",        { 'N', 'E', 'S', 0x1a, 0, 1, 0x00, 0x00 },                          0x2000,          false },
+    { "bad magic",          { 'N', 'E', 'S', 0x00, 1, 0, 0x00, 0x00 },                          0x4000,          false },
+    { "nes 2.0",            { 'N', 'E', 'S', 0x1a, 2, 1, 0x40, 0x08, 0x01 },                    0x8000 + 0x2000, true, 0x8000, 0x2000, 0x104 },
+    { "nes 2.0 exponent",   { 'N', 'E', 'S', 0x1a, 10 << 2 | 1, 0, 0x00, 0x08, 0, 0x0f },       3 * 1024,        true, 3 * 1024, 0,    0 },
+    { "nes 2.0 truncated",  { 'N', 'E', 'S', 0x1a, 10 << 2 | 1, 0, 0x00, 0x08, 0, 0x0f },       3 * 1024 - 1,    false },
+
+    // Sizes of 2^63 * 7 - their sum wraps around to something small
+    { "nes 2.0 overflow",   { 'N', 'E', 'S', 0x1a, 0xfc, 0xfc, 0x00, 0x08, 0, 0xff },          64,              false },
+    { "nes 2.0 chr overflow", { 'N', 'E', 'S', 0x1a, 1, 0xfc, 0x00, 0x08, 0, 0xf0 },            0x4000 + 64,     false },
+};
+
+static bool check(const rom_image_case &c, const std::string &path)
+{
+    {
+        std::vector<uint8_t> file(c.header, c.header + sizeof(c.header));
+        file.resize(file.size() + c.body_size, 0xea);
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(file.data()), file.size());
+    }
+
+    std::shared_ptr<const nes_rom_image> image;
+    try
+    {
+        image = nes_rom_image::open(path.c_str());
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+
+    if (!image)
+    {
+        if (c.valid)
+            printf("%s: rejected\n", c.name);
+        return !c.valid;
+    }
+
+    if (!c.valid)
+    {
+        printf("%s: accepted with PRG %zu CHR %zu\n", c.name, image->prg_size(), image->chr_size());
+        return false;
+    }
+
+    if (image->prg_size() != c.prg_size || image->chr_size() != c.chr_size || image->mapper_id() != c.mapper_id)
+    {
+        printf("%s: PRG %zu CHR %zu mapper %d, expected PRG %zu CHR %zu mapper %d\n", c.name,
+               image->prg_size(), image->chr_size(), image->mapper_id(), c.prg_size, c.chr_size, c.mapper_id);
+        return false;
+    }
+
+    return true;
+}
+
+static void write_rom(const std::string &path, uint8_t chr_fill)
+{
+    std::vector<uint8_t> file = { 'N', 'E', 'S', 0x1a, 1, 1, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0, 0 };
+    file.resize(file.size() + 0x4000, 0xea);
+    file.resize(file.size() + 0x2000, chr_fill);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(file.data()), file.size());
+}
+
+//
+// A file rewritten in place with the same size - right away, so within the same timestamp tick as often as
+// not - must not come back with the hash and assets of what it held before
+//
+static bool check_rewrite(const std::string &path)
+{
+    nes_rom_hash old_hash;
+    {
+        write_rom(path, 0x00);
+        auto image = nes_rom_image::open(path.c_str());
+        old_hash = image->hash();
+        if (image->assets().chr_tiles[0] != 0)
+        {
+            printf("rewrite: CHR of 0x00 decodes to %d\n", image->assets().chr_tiles[0]);
+            return false;
+        }
+    }
+
+    write_rom(path, 0xff);
+    auto image = nes_rom_image::open(path.c_str());
+    if (image->hash() == old_hash || image->assets().chr_tiles[0] != 3)
+    {
+        printf("rewrite: %s hash, CHR of 0xff decodes to %d\n", image->hash() == old_hash ? "same" : "new",
+               image->assets().chr_tiles[0]);
+        return false;
+    }
+
+    // Same again with the image still in use when the file is rewritten under it
+    write_rom(path, 0x00);
+    auto rewritten = nes_rom_image::open(path.c_str());
+    if (rewritten == image || !(rewritten->hash() == old_hash))
+    {
+        printf("rewrite while open: %s\n", rewritten == image ? "same image" : "wrong hash");
+        return false;
+    }
+
+    return true;
+}
+
+int main()
+{
+    auto dir = std::filesystem::temp_directory_path();
+    int failed = 0;
+    int index = 0;
+    for (const auto &c : s_cases)
+    {
+        // A file of its own per case - open() shares images of the same file
+        std::string path = (dir / ("nesemu2_rom_image_test_" + std::to_string(index++) + ".nes")).string();
+        if (!check(c, path))
+            ++failed;
+
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+
+    std::string path = (dir / "nesemu2_rom_image_test_rewrite.nes").string();
+    if (!check_rewrite(path))
+        ++failed;
+
+    std::error_code error;
+    std::filesystem::remove(path, error);
+
+    if (failed)
+    {
+        printf("%d of %zu cases failed\n", failed, sizeof(s_cases) / sizeof(s_cases[0]) + 1);
+        return 1;
+    }
+
+    printf("%zu cases pass\n", sizeof(s_cases) / sizeof(s_cases[0]) + 1);
+    return 0;
+}
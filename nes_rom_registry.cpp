@@ -0,0 +1,373 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include "nes_rom_registry.h"
+#include "nes_rom_image.h"
+#include "opcodes.h"
+
+//
+// Known bad dumps - CRC32 of PRG+CHR -> what the header should have said
+// Only add dumps that have been verified; users can add their own through headers.txt in the cache directory
+//
+static const std::map<uint32_t, nes_header_fix> s_known_header_fixes = {
+};
+
+#define NES_ASSETS_MAGIC "NESA"
+#define NES_ASSETS_VERSION 1
+
+//
+// <sha1>.nesasset - the header, then chr_tiles, then prg_code
+//
+struct nes_assets_file_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t mapper_id;             // decides which PRG is disassembled - a header fix may change it
+    uint32_t chr_tiles_size;
+    uint32_t prg_code_size;
+};
+
+nes_rom_registry &nes_rom_registry::instance()
+{
+    static nes_rom_registry s_registry;
+    return s_registry;
+}
+
+nes_rom_registry::nes_rom_registry()
+        : _header_fixes(s_known_header_fixes.begin(), s_known_header_fixes.end())
+{
+}
+
+void nes_rom_registry::set_cache_dir(const std::string &dir)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _cache_dir = dir;
+    if (_cache_dir.empty())
+        return;
+
+    std::error_code error;
+    std::filesystem::create_directories(_cache_dir, error);
+
+    load_index();
+    load_header_fixes();
+}
+
+void nes_rom_registry::add_header_fix(uint32_t crc32, const nes_header_fix &fix)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _header_fixes[crc32] = fix;
+}
+
+//
+// index.txt - one "<file key> <crc32 hex> <sha1 hex>" line per file hashed so far
+//
+void nes_rom_registry::load_index()
+{
+    std::ifstream index(_cache_dir + "/index.txt");
+    std::string line;
+    while (std::getline(index, line))
+    {
+        // File keys may contain spaces (see file_key in nes_rom_image.cpp) - the hashes are the last two words
+        size_t sha1_pos = line.rfind(' ');
+        if (sha1_pos == std::string::npos || sha1_pos == 0)
+            continue;
+        size_t crc_pos = line.rfind(' ', sha1_pos - 1);
+        if (crc_pos == std::string::npos)
+            continue;
+
+        nes_rom_hash hash;
+        if (sscanf(line.c_str() + crc_pos + 1, "%8x", &hash.crc32) != 1 ||
+            line.size() - sha1_pos - 1 != sizeof(hash.sha1) * 2 ||
+            !nes_parse_sha1_hex(line.c_str() + sha1_pos + 1, hash.sha1))
+            continue;
+
+        _hashes[line.substr(0, crc_pos)] = hash;
+    }
+}
+
+void nes_rom_registry::load_header_fixes()
+{
+    std::ifstream headers(_cache_dir + "/headers.txt");
+    std::string line;
+    while (std::getline(headers, line))
+    {
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream words(line);
+        std::string crc, mapper, mirroring;
+        if (!(words >> crc >> mapper >> mirroring))
+            continue;
+
+        nes_header_fix fix;
+        fix.mapper_id = (mapper == "-") ? -1 : atoi(mapper.c_str());
+        fix.vertical_mirroring = (mirroring == "v") ? 1 : (mirroring == "h") ? 0 : -1;
+        _header_fixes[uint32_t(strtoul(crc.c_str(), nullptr, 16))] = fix;
+    }
+}
+
+nes_rom_hash nes_rom_registry::identify(const std::string &file_key, const uint8_t *data, size_t size)
+{
+    if (!file_key.empty())
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        auto found = _hashes.find(file_key);
+        if (found != _hashes.end())
+            return found->second;
+    }
+
+    // Hashing multi-MB images takes a while - don't hold everyone else up
+    nes_rom_hash hash = nes_hash_rom(data, size);
+    if (file_key.empty())
+        return hash;
+
+    std::lock_guard<std::mutex> guard(_lock);
+    _hashes[file_key] = hash;
+    if (!_cache_dir.empty())
+    {
+        char crc[9];
+        snprintf(crc, sizeof(crc), "%08x", hash.crc32);
+        std::ofstream index(_cache_dir + "/index.txt", std::ios::app);
+        index << file_key << ' ' << crc << ' ' << hash.sha1_hex() << '\n';
+    }
+
+    return hash;
+}
+
+bool nes_rom_registry::header_fix(const nes_rom_hash &hash, nes_header_fix &fix)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    auto found = _header_fixes.find(hash.crc32);
+    if (found == _header_fixes.end())
+        return false;
+
+    fix = found->second;
+    return true;
+}
+
+//
+// Pattern table tiles are 16 bytes - 8 bytes of low bits, then 8 bytes of high bits, one byte per row
+//
+void nes_decode_chr_tile(const uint8_t *chr, uint8_t *pixels, uint8_t *flipped)
+{
+    for (int row = 0; row < 8; ++row)
+    {
+        uint8_t lo = chr[row];
+        uint8_t hi = chr[row + 8];
+        for (int col = 0; col < 8; ++col)
+        {
+            uint8_t pixel = uint8_t(((lo >> col) & 1) | (((hi >> col) & 1) << 1));
+            pixels[row * 8 + 7 - col] = pixel;
+            flipped[row * 8 + col] = pixel;
+        }
+    }
+}
+
+static void decode_chr(const uint8_t *chr, size_t size, std::vector<uint8_t> &tiles)
+{
+    tiles.resize(size / 16 * NES_TILE_PIXELS);
+    uint8_t flipped[NES_TILE_PIXELS];
+    for (size_t tile = 0; tile < size / 16; ++tile)
+        nes_decode_chr_tile(chr + tile * 16, tiles.data() + tile * NES_TILE_PIXELS, flipped);
+}
+
+static void flip_chr_tiles(const std::vector<uint8_t> &tiles, std::vector<uint8_t> &flipped)
+{
+    flipped.resize(tiles.size());
+    for (size_t row = 0; row < tiles.size(); row += 8)
+        std::reverse_copy(tiles.begin() + row, tiles.begin() + row + 8, flipped.begin() + row);
+}
+
+//
+// PRG mapped at [window_addr, 0x10000) at power-on - window_size bytes from window_offset, repeated if the
+// window is bigger than that
+//
+struct prg_window
+{
+    uint32_t window_addr;
+    size_t window_offset;
+    size_t window_size;
+
+    bool contains(uint32_t addr) const { return addr >= window_addr && addr < 0x10000; }
+    size_t offset(uint32_t addr) const { return window_offset + (addr - window_addr) % window_size; }
+};
+
+static prg_window power_on_prg_window(const nes_rom_image &image)
+{
+    size_t prg_size = image.prg_size();
+    switch (image.mapper_id())
+    {
+        case 0:     // NROM
+        case 3:     // CNROM
+        case 7:     // AxROM - bank 0
+            return { 0x8000, 0, std::min(prg_size, size_t(0x8000)) };
+        case 1:     // MMC1 - last 16KB bank fixed at $C000
+        case 2:     // UxROM
+            return { 0xc000, prg_size - std::min(prg_size, size_t(0x4000)), std::min(prg_size, size_t(0x4000)) };
+        default:    // MMC3 and almost everything else keep the last 8KB at $E000 where the vectors are
+            return { 0xe000, prg_size - std::min(prg_size, size_t(0x2000)), std::min(prg_size, size_t(0x2000)) };
+    }
+}
+
+static void disassemble_prg(const nes_rom_image &image, std::vector<uint8_t> &code)
+{
+    code.assign(image.prg_size(), nes_code_flags_none);
+
+    prg_window window = power_on_prg_window(image);
+    if (window.window_size < 6)
+        return;
+
+    const uint8_t *prg = image.prg();
+    auto read_word = [&](uint32_t addr) {
+        return uint16_t(prg[window.offset(addr)] | (prg[window.offset(addr + 1)] << 8));
+    };
+
+    std::vector<uint32_t> pending;
+    for (uint32_t vector = 0xfffa; vector < 0x10000; vector += 2)
+    {
+        uint16_t target = read_word(vector);
+        if (window.contains(target))
+        {
+            code[window.offset(target)] |= nes_code_flags_vector | nes_code_flags_jump_target;
+            pending.push_back(target);
+        }
+    }
+
+    auto add_target = [&](uint32_t target) {
+        if (!window.contains(target))
+            return;
+        code[window.offset(target)] |= nes_code_flags_jump_target;
+        pending.push_back(target);
+    };
+
+    while (!pending.empty())
+    {
+        uint32_t addr = pending.back();
+        pending.pop_back();
+
+        // Follow straight-line code until it ends or runs into something already visited
+        while (window.contains(addr) && !(code[window.offset(addr)] & nes_code_flags_op_start))
+        {
+            uint8_t op = prg[window.offset(addr)];
+            const opEntry &entry = opsTable[op];
+            if (entry.mode == nes_addr_mode::UNKNOWN)
+                break;
+
+            int operand_size = nes_operand_size(entry.mode);
+            if (addr + operand_size >= 0x10000)
+                break;
+
+            code[window.offset(addr)] |= nes_code_flags_op_start;
+            uint32_t next = addr + 1 + operand_size;
+
+            if (entry.mode == nes_addr_mode::REL)
+            {
+                add_target(uint16_t(next + int8_t(prg[window.offset(addr + 1)])));
+            }
+            else if (op == 0x20 || op == 0x4c)
+            {
+                // JSR / JMP abs
+                add_target(read_word(addr + 1));
+            }
+
+            // JMP abs, JMP ind, RTS, RTI and BRK don't fall through
+            if (op == 0x4c || op == 0x6c || op == 0x60 || op == 0x40 || op == 0x00)
+                break;
+
+            addr = next;
+        }
+    }
+}
+
+std::shared_ptr<nes_rom_assets> nes_rom_registry::load_assets(const std::string &cache_dir, const std::string &sha1_hex,
+                                                              const nes_rom_image &image)
+{
+    if (cache_dir.empty())
+        return nullptr;
+
+    std::ifstream file(cache_dir + "/" + sha1_hex + ".nesasset", std::ios::binary);
+    nes_assets_file_header header;
+    if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        return nullptr;
+
+    // Anything that doesn't look exactly right is recomputed (and overwritten)
+    if (memcmp(header.magic, NES_ASSETS_MAGIC, sizeof(header.magic)) != 0 || header.version != NES_ASSETS_VERSION ||
+        header.mapper_id != uint32_t(image.mapper_id()) || header.chr_tiles_size != image.chr_size() / 16 * NES_TILE_PIXELS || header.prg_code_size != image.prg_size())
+        return nullptr;
+
+    auto assets = std::make_shared<nes_rom_assets>();
+    assets->chr_tiles.resize(header.chr_tiles_size);
+    assets->prg_code.resize(header.prg_code_size);
+    if (!file.read(reinterpret_cast<char *>(assets->chr_tiles.data()), assets->chr_tiles.size()) ||
+        !file.read(reinterpret_cast<char *>(assets->prg_code.data()), assets->prg_code.size()))
+        return nullptr;
+
+    return assets;
+}
+
+void nes_rom_registry::save_assets(const std::string &cache_dir, const std::string &sha1_hex, const nes_rom_image &image,
+                                   const nes_rom_assets &assets)
+{
+    if (cache_dir.empty())
+        return;
+
+    nes_assets_file_header header;
+    memcpy(header.magic, NES_ASSETS_MAGIC, sizeof(header.magic));
+    header.version = NES_ASSETS_VERSION;
+    header.mapper_id = uint32_t(image.mapper_id());
+    header.chr_tiles_size = uint32_t(assets.chr_tiles.size());
+    header.prg_code_size = uint32_t(assets.prg_code.size());
+
+    //
+    // Written under another name and renamed so that nobody ever reads a half-written file - a name of its own
+    // for every thread, as two of them may be saving the same ROM's assets at once
+    //
+    std::string path = cache_dir + "/" + sha1_hex + ".nesasset";
+    std::string temp_path = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(assets.chr_tiles.data()), assets.chr_tiles.size());
+        file.write(reinterpret_cast<const char *>(assets.prg_code.data()), assets.prg_code.size());
+        if (!file)
+            return;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(temp_path, path, error);
+}
+
+std::shared_ptr<const nes_rom_assets> nes_rom_registry::assets(const nes_rom_image &image)
+{
+    std::string sha1_hex = image.hash().sha1_hex();
+
+    std::string cache_dir;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        auto found = _assets.find(sha1_hex);
+        if (found != _assets.end())
+            return found->second;
+
+        cache_dir = _cache_dir;
+    }
+
+    //
+    // Decoding and the disk are left out of the lock so that other ROMs aren't held up. Each image asks only once
+    // (see nes_rom_image::assets) - two images of the same ROM may race here, and the first one in wins
+    //
+    auto assets = load_assets(cache_dir, sha1_hex, image);
+    if (!assets)
+    {
+        assets = std::make_shared<nes_rom_assets>();
+        decode_chr(image.chr(), image.chr_size(), assets->chr_tiles);
+        disassemble_prg(image, assets->prg_code);
+        save_assets(cache_dir, sha1_hex, image, *assets);
+    }
+    flip_chr_tiles(assets->chr_tiles, assets->chr_tiles_flipped);
+
+    std::lock_guard<std::mutex> guard(_lock);
+    return _assets.emplace(sha1_hex, std::move(assets)).first->second;
+}
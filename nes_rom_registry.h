@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "nes_hash.h"
+
+class nes_rom_image;
+
+//
+// What the disassembly pass found out about a PRG byte - see nes_rom_assets::prg_code
+//
+enum nes_code_flags : uint8_t
+{
+    nes_code_flags_none = 0,
+    nes_code_flags_op_start = 0x1,          // first byte of an instruction reachable from a vector
+    nes_code_flags_jump_target = 0x2,       // something branches, jumps or calls here
+    nes_code_flags_vector = 0x4,            // NMI/RESET/IRQ points here
+};
+
+//
+// Data derived from a ROM's contents - depends on nothing but the contents, so it is computed once per
+// SHA-1 and shared by every image with that hash
+//
+struct nes_rom_assets
+{
+    // CHR ROM decoded to one byte per pixel (0~3), 8x8 tiles of 64 bytes in CHR order - tile n of the
+    // image is at n * NES_TILE_PIXELS. Empty for CHR RAM boards
+    std::vector<uint8_t> chr_tiles;
+
+    // chr_tiles with every tile mirrored left to right - for sprites flipped horizontally. Cheap to derive, so
+    // it isn't kept on disk
+    std::vector<uint8_t> chr_tiles_flipped;
+
+    // nes_code_flags per PRG byte, from a static recursive-descent disassembly that starts at the vectors and
+    // stays within the PRG banks mapped at power-on. Code only reachable through bank switching or
+    // indirect jumps isn't found - treat it as a hint, not a map of all code
+    std::vector<uint8_t> prg_code;
+};
+
+#define NES_TILE_PIXELS 64
+
+// Decodes a 16-byte pattern table tile into NES_TILE_PIXELS bytes - and into flipped mirrored left to right
+void nes_decode_chr_tile(const uint8_t *chr, uint8_t *pixels, uint8_t *flipped);
+
+//
+// Header correction for a known dump, keyed by the CRC32 of PRG+CHR
+//
+struct nes_header_fix
+{
+    int mapper_id;                  // -1 keeps the header's
+    int vertical_mirroring;         // -1 keeps the header's, otherwise 0/1
+};
+
+//
+// Process-wide registry of ROM contents, keyed by hash
+// * identify() hashes an image once - and never again for a file it has seen, in this process or (with a
+//   cache directory) an earlier one
+// * header_fix() corrects headers of known bad dumps
+// * assets() computes nes_rom_assets once per hash and keeps them - in memory, and on disk in the cache
+//   directory so the next process just reads them back
+// Thread-safe.
+//
+class nes_rom_registry
+{
+public :
+    static nes_rom_registry &instance();
+
+    //
+    // Directory for the hash index, assets and user header fixes (headers.txt) - created if needed
+    // Empty (the default) keeps everything in memory
+    // headers.txt has one "<crc32 hex> <mapper id or -> <h, v or ->" line per ROM, # starts a comment
+    //
+    void set_cache_dir(const std::string &dir);
+
+    // Adds a header correction - replaces the built-in one for the same CRC32, if any
+    void add_header_fix(uint32_t crc32, const nes_header_fix &fix);
+
+    //
+    // Hash of [data, data + size), PRG followed by CHR
+    // file_key identifies the file the data came from (see nes_rom_image::open) - files seen before aren't
+    // hashed again. Empty for data that didn't come from a file
+    //
+    nes_rom_hash identify(const std::string &file_key, const uint8_t *data, size_t size);
+
+    // false if there is no correction for the ROM
+    bool header_fix(const nes_rom_hash &hash, nes_header_fix &fix);
+
+    std::shared_ptr<const nes_rom_assets> assets(const nes_rom_image &image);
+
+private :
+    nes_rom_registry();
+
+    void load_index();
+    void load_header_fixes();
+    static std::shared_ptr<nes_rom_assets> load_assets(const std::string &cache_dir, const std::string &sha1_hex,
+                                                       const nes_rom_image &image);
+    static void save_assets(const std::string &cache_dir, const std::string &sha1_hex, const nes_rom_image &image,
+                            const nes_rom_assets &assets);
+
+    std::mutex _lock;
+    std::string _cache_dir;
+    std::map<std::string, nes_rom_hash> _hashes;                            // by file key
+    std::map<uint32_t, nes_header_fix> _header_fixes;                       // by CRC32
+    std::map<std::string, std::shared_ptr<const nes_rom_assets>> _assets;   // by SHA-1 hex
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include "nes_cycle.h"
+
+//
+// Things that have to happen at a known point in time
+//
+enum class nes_event
+{
+    VBLANK_NMI,         // PPU enters vertical blanking (scanline 241, dot 1) and may raise NMI
+    FRAME_END,          // PPU wraps around to scanline 0 of the next frame
+    OAM_DMA,            // $4014 was written - CPU is suspended while OAM is copied
+    MAPPER_IRQ,         // a mapper counter (MMC3 scanline counter) reaches 0 and raises IRQ
+    COUNT
+};
+
+#define NES_EVENT_NEVER nes_cycle_t::max()
+
+//
+// Tiny priority queue of timestamped events, in master cycles
+// Each event type has at most one pending deadline, so a fixed slot per type plus a cached minimum is all
+// we need - nes_system uses next_deadline() to run the CPU straight up to the next event instead of
+// stepping every component one cycle at a time
+//
+class nes_scheduler
+{
+public :
+    void init()
+    {
+        for (auto &deadline : _deadlines)
+            deadline = NES_EVENT_NEVER;
+        _next = NES_EVENT_NEVER;
+    }
+
+    // Schedules the event at the given time, replacing any pending one of the same type
+    void schedule(nes_event event, nes_cycle_t when)
+    {
+        _deadlines[int(event)] = when;
+        if (when < _next)
+            _next = when;
+        else
+            update_next();
+    }
+
+    void cancel(nes_event event)
+    {
+        schedule(event, NES_EVENT_NEVER);
+    }
+
+    nes_cycle_t next_deadline() const { return _next; }
+
+    // Removes the earliest event that is due at or before now
+    // Returns false if nothing is due
+    bool pop_due(nes_cycle_t now, nes_event &event)
+    {
+        if (_next > now)
+            return false;
+
+        for (int i = 0; i < int(nes_event::COUNT); ++i)
+        {
+            if (_deadlines[i] == _next)
+            {
+                event = nes_event(i);
+                _deadlines[i] = NES_EVENT_NEVER;
+                update_next();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private :
+    void update_next()
+    {
+        _next = NES_EVENT_NEVER;
+        for (auto deadline : _deadlines)
+        {
+            if (deadline < _next)
+                _next = deadline;
+        }
+    }
+
+private :
+    nes_cycle_t _deadlines[int(nes_event::COUNT)];
+    nes_cycle_t _next;                  // earliest deadline in _deadlines
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include "nes_cycle.h"
+
+// Internal 2KB RAM, mirrored 4 times up to $1fff
+#define NES_INTERNAL_RAM_SIZE 0x800
+
+// Cartridge PRG RAM at $6000~$7fff - battery-backed PRG RAM lives in the save file instead (see nes_mapper)
+#define NES_PRG_RAM_SIZE 0x2000
+
+// 2KB of nametable RAM (CIRAM) inside the console - the cartridge decides how the 4 nametables map onto it
+// Four-screen boards bring another 2KB so that each nametable has its own
+#define PPU_NAMETABLE_RAM_SIZE 0x800
+#define PPU_NAMETABLE_SIZE 0x400
+#define PPU_NAMETABLE_COUNT 4
+
+#define PPU_PALETTE_SIZE 0x20
+
+// OAM (Object Attribute Memory) - internal memory inside PPU for 64 sprites of 4 bytes each
+// wiki.nesdev.com/w/index.php/PPU_OAM
+#define PPU_OAM_SIZE 0x100
+
+struct cpu_registers {
+    uint16_t PC; // program counter
+    uint8_t SP; // stack pointer
+    uint8_t A; // accumulator
+    uint8_t X; // x register
+    uint8_t Y; // y register
+    uint8_t P; // processor status
+};
+
+//
+// CPU registers and interrupt lines - see nes_cpu for what they mean
+//
+struct nes_cpu_state
+{
+    cpu_registers registers;
+
+    // N/Z/C/V are evaluated lazily - kept the way the last instruction produced them and only assembled
+    // into a P byte when something needs all of it (PHP, NMI, reg()). registers.P holds the other bits.
+    uint8_t flag_n;                 // N is bit 7
+    uint8_t flag_z;                 // Z is set when this is 0
+    uint8_t flag_c;                 // C - 0 or 1
+    uint8_t flag_v;                 // V is bit 6
+    bool nmi_pending;               // NMI interrupt pending from PPU vertical blanking
+    uint8_t irq_lines;              // nes_irq_source bits currently asserting /IRQ
+    uint16_t dma_addr;              // starting address
+    nes_cycle_t cycle;
+};
+
+//
+// PPU registers, timing and internal memory - see nes_ppu for what they mean
+//
+struct nes_ppu_state
+{
+    nes_cycle_t master_cycle;
+    nes_ppu_cycle_t scanline_cycle;
+    int cur_scanline;
+    uint32_t frame_count;
+
+    // PPUCTRL
+    uint16_t name_tbl_addr;
+    uint16_t bg_pattern_tbl_addr;
+    uint16_t sprite_pattern_tbl_addr;
+    uint16_t ppu_addr_inc;
+    bool vblank_nmi;
+    bool use_8x16_sprite;
+    uint8_t sprite_height;
+
+    // PPUMASK
+    bool show_bg;
+    bool show_sprites;
+    bool gray_scale_mode;
+    bool show_bg_left;              // in the leftmost 8 pixels
+    bool show_sprites_left;
+
+    // PPUSTATUS
+    uint8_t latch;
+    bool sprite_overflow;
+    bool vblank_started;
+    bool sprite_0_hit;
+    int16_t sprite_0_hit_dot;       // dot of the current scanline sprite 0 hits at - -1 if it doesn't
+    uint8_t status_after_read;      // PPUSTATUS flags the last read left behind - see next_status_change
+
+    // OAMADDR, OAMDATA
+    uint8_t oam_addr;
+
+    // PPUSCROLL, PPUADDR
+    bool addr_toggle;               // the "w" register - see http://wiki.nesdev.com/w/index.php/PPU_scrolling
+    uint16_t temp_ppu_addr;         // the "t" register
+    uint16_t ppu_addr;              // the "v" register
+    uint8_t fine_x_scroll;          // the "x" register
+    uint8_t coarse_x_scroll;
+    uint8_t scroll_y;               // cached scroll_y value
+
+    // PPUDATA
+    uint8_t vram_read_buf;          // delayed VRAM reads
+
+    uint8_t mirroring;              // nes_mapper_flags mirroring bits, or nes_mapper_flags_four_screen
+
+    uint8_t oam[PPU_OAM_SIZE];
+    uint8_t palette[PPU_PALETTE_SIZE];
+    uint8_t nametables[PPU_NAMETABLE_COUNT * PPU_NAMETABLE_SIZE];   // CIRAM, then the four-screen VRAM
+};
+
+//
+// CPU/PPU registers and console RAM in one block - registers first, then memory by how often it is touched.
+// Nothing in here points anywhere: ROM is referenced by the mapper, and page tables point into this block.
+// It is not the whole console, so a copy can't be loaded back into one: mapper registers (and with them
+// the PRG/CHR banks and nametable mirroring in use), CHR RAM, battery-backed PRG RAM, pending scheduler
+// events and controller state all live elsewhere, and so does what is derived from the block - the PPU's
+// nametable page table and rendered background layers, decoded CHR RAM tiles, blocks decoded from RAM.
+//
+struct alignas(64) nes_state
+{
+    nes_cpu_state cpu;
+    nes_ppu_state ppu;
+    uint8_t ram[NES_INTERNAL_RAM_SIZE];
+    uint8_t prg_ram[NES_PRG_RAM_SIZE];
+};
+
+static_assert(std::is_trivially_copyable<nes_state>::value, "nes_state must be copyable with memcpy");
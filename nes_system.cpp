@@ -1,13 +1,15 @@
+#include <algorithm>
+#include <string>
 #include "nes_system.h"
+#include "nes_logger.h"
 
-nes_system::nes_system() {
-    _mem = std::make_unique<nes_memory>();
-    _cpu = std::make_unique<nes_cpu>();
-    _ppu = std::make_unique<nes_ppu>();
-    _input = std::make_unique<nes_input>();
+nes_system::nes_system()
+        : _state(), _cpu(_state.cpu), _ppu(_state.ppu), _mem(_state), _plug_cartridge(nullptr)
+{
 }
 
 void nes_system::init() {
+    _scheduler.init();
     getCpu()->init(this);
     getPpu()->init(this);
     getMem()->init(this);
@@ -16,11 +18,27 @@ void nes_system::init() {
     _master_cycle = nes_cycle_t(0);
 }
 
+void nes_system::reset()
+{
+    _scheduler.init();
+    _cpu.power_on();
+    _ppu.init(this);
+    _mem.init(this);
+    _input.init();
+    _stop_requested = false;
+    _master_cycle = nes_cycle_t(0);
+
+    if (_plug_cartridge)
+        _plug_cartridge(*this);
+}
+
 void nes_system::run_program(std::vector <uint8_t> program, uint16_t addr) {
-    _mem->set_bytes(addr, program.data(), program.size());
-    _cpu->reg().PC = addr;
+    _mem.map_flat_ram();
+    _mem.set_bytes(addr, program.data(), program.size());
+    _cpu.reg().PC = addr;
 
-    auto tick = nes_cycle_t(1);
+    // one frame at a time
+    auto tick = PPU_SCANLINE_CYCLE * PPU_SCANLINE_COUNT;
     while (!stop_requested())
     {
         step(tick);
@@ -30,20 +48,97 @@ void nes_system::run_program(std::vector <uint8_t> program, uint16_t addr) {
 
 void nes_system::step(nes_cycle_t count)
 {
-    _master_cycle += count;
+    nes_cycle_t target = _master_cycle + count;
 
-    _cpu->step_to(_master_cycle);
-    _ppu->step_to(_master_cycle);
+    while (_master_cycle < target && !stop_requested())
+    {
+        // Run the CPU straight up to the next event (or the end of this step). The PPU catches up lazily
+        // when the CPU touches its registers or when one of its events is due.
+        nes_cycle_t deadline = std::min(target, _scheduler.next_deadline());
+        _cpu.step_to(deadline);
+
+        // The CPU may have been cut short by a newly scheduled event, or overshot by part of an instruction
+        _master_cycle = std::max(_master_cycle, std::min(deadline, _cpu.cycle()));
+        dispatch_events();
+    }
+
+    _ppu.step_to(_master_cycle);
 }
 
-void nes_system::load_rom(const char *rom_path) {
+void nes_system::dispatch_events()
+{
+    nes_event event;
+    while (_scheduler.pop_due(_master_cycle, event))
+    {
+        switch (event)
+        {
+            case nes_event::VBLANK_NMI:
+                // PPU raises NMI as it catches up
+                _ppu.step_to(_master_cycle);
+                break;
+            case nes_event::FRAME_END:
+                // PPU starts the next frame and schedules its next events as it catches up
+                _ppu.step_to(_master_cycle);
 
-    auto mapper = nes_rom_loader::load_from(rom_path);
-    _mem->load_mapper(mapper);
-    _ppu->load_mapper(mapper);
+                // Battery-backed RAM goes back to the save file in the background
+                if (_mem._mapper)
+                    _mem._mapper->flush_save();
+                break;
+            case nes_event::OAM_DMA:
+                _cpu.OAMDMA();
+                break;
+            case nes_event::MAPPER_IRQ:
+                _mem._mapper->on_irq_event();
+                break;
+            default:
+                assert(!"Unknown event");
+        }
+    }
+}
+
+void nes_system::attach_rom(std::shared_ptr<const nes_rom_image> rom, const char *save_path)
+{
+    // Blocks are tagged with the host memory they were decoded from - another image may well reuse the
+    // address of one that is gone
+    if (!_cartridge.get() || _cartridge.get()->rom() != rom)
+        _cpu.flush_code();
+
+    auto unload = [this]() {
+        // Unmapping catches the PPU up - it may still render from the previous mapper's CHR until then
+        _mem.unload_mapper();
+        _ppu.unload_mapper();
+    };
+
+    nes_rom_loader::load_into(_cartridge, std::move(rom), unload, [this, save_path](auto &mapper) {
+        // Before memory maps the PRG RAM
+        if (save_path && *save_path && mapper.rom()->has_battery() && !mapper.open_save(save_path))
+        {
+            std::string message = std::string("Cannot open ") + save_path + " (in use?) - saves are kept in memory";
+            NES_LOG(message.c_str());
+        }
 
-    nes_mapper_info info;
-    mapper->get_info(info);
-    _cpu->reg().PC = info.code_addr;
+        typedef std::decay_t<decltype(mapper)> mapper_t;
+        _plug_cartridge = [](nes_system &system) {
+            system.plug_cartridge(static_cast<mapper_t &>(*system._cartridge.get()));
+        };
+    });
+
+    reset();
 }
 
+void nes_system::load_rom(const char *rom_path, const char *save_path) {
+
+    std::string default_save_path;
+    if (!save_path)
+    {
+        // game.nes -> game.sav
+        default_save_path = rom_path;
+        size_t ext = default_save_path.find_last_of("./\\");
+        if (ext != std::string::npos && default_save_path[ext] == '.')
+            default_save_path.erase(ext);
+        default_save_path += ".sav";
+        save_path = default_save_path.c_str();
+    }
+
+    attach_rom(nes_rom_image::open(rom_path), save_path);
+}
@@ -4,82 +4,100 @@
 #include <vector>
 #include <fstream>
 #include "nes_mapper.h"
+#include "nes_state.h"
 #include "nes_cpu.h"
 #include "nes_ppu.h"
-
-class nes_memory;
-
+#include "nes_memory.h"
+#include "nes_input.h"
+#include "nes_scheduler.h"
+
+//
+// A console - one object, no separate allocations for its parts. What changes as it runs is all in _state
+// (see nes_state); the components around it hold the machinery working on it: page tables, decoded
+// blocks, the mapper.
+//
 class nes_system {
 private:
-    std::unique_ptr<nes_cpu> _cpu;
-    std::unique_ptr<nes_ppu> _ppu;
-    std::unique_ptr<nes_input> _input;
-    std::unique_ptr<nes_memory> _mem;
+    nes_state _state;
+    nes_cpu _cpu;
+    nes_ppu _ppu;
+    nes_input _input;
+    nes_memory _mem;
+    nes_scheduler _scheduler;
+    nes_mapper_slot _cartridge;
+    void (*_plug_cartridge)(nes_system &system);   // plug_cartridge<the mapper class in _cartridge>
     bool _stop_requested;
+
+    void dispatch_events();
+
+    // Powers the cartridge on - PRG/CHR banks, PRG RAM, mapper registers
+    template <class mapper_t>
+    void plug_cartridge(mapper_t &mapper)
+    {
+        mapper.clear_chr_ram();
+
+        // Memory gets the concrete type so register writes don't go through the vtable
+        _mem.load_mapper(mapper);
+        _ppu.load_mapper(mapper);
+
+        nes_mapper_info info;
+        mapper.get_info(info);
+        _cpu.reg().PC = info.code_addr;
+    }
+
 public:
     nes_cycle_t _master_cycle;
 
+    // Wires the components together and powers the console on - without a cartridge
     void init();
+
+    //
+    // Power cycle - everything back to power-on state with the same cartridge. Battery-backed RAM stays,
+    // and so does the code decoded/compiled from the ROM. Doesn't allocate anything
+    //
+    void reset();
+
     nes_system();
-    nes_cpu* getCpu(){ return _cpu.get();}
-    nes_ppu* getPpu(){ return _ppu.get();}
-    nes_input* getInput(){ return _input.get();}
-    nes_memory* getMem(){ return _mem.get();}
+    nes_system(const nes_system &) = delete;
+    nes_system &operator=(const nes_system &) = delete;
+
+    nes_cpu* getCpu(){ return &_cpu;}
+    nes_ppu* getPpu(){ return &_ppu;}
+    nes_input* getInput(){ return &_input;}
+    nes_memory* getMem(){ return &_mem;}
+    // Read-only - see nes_state for what it doesn't cover, and the components for what they derive from it
+    const nes_state &state() const { return _state; }
     void run_program(std::vector<uint8_t> program, uint16_t addr);
     void run_rom(const char *rom_path);
 
     void step(nes_cycle_t count);
     void stop(){
         _stop_requested = true;
+        _cpu.preempt(nes_cycle_t(0));
     }
 
-    bool stop_requested() { return _stop_requested; }
-
-#define FLAG_6_USE_VERTICAL_MIRRORING_MASK 0x1
-#define FLAG_6_HAS_BATTERY_BACKED_PRG_RAM_MASK 0x2
-#define FLAG_6_HAS_TRAINER_MASK  0x4
-#define FLAG_6_USE_FOUR_SCREEN_VRAM_MASK 0x8
-#define FLAG_6_LO_MAPPER_NUMBER_MASK 0xf0
-#define FLAG_7_HI_MAPPER_NUMBER_MASK 0xf0
-
-    void load_rom(const char *rom_path);
-
-    static nes_mapper_nrom load_from(const char *path)
+    // Schedules an event at the given master cycle - the CPU stops early if it is running past that point
+    void schedule(nes_event event, nes_cycle_t when)
     {
-        std::ifstream file;
-        file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-        file.open(path, std::ifstream::in | std::ifstream::binary);
-
-        // Parse header
-        ines_header header;
-        file.read((char *)&header, sizeof(header));
-
-        if (header.flag6 & FLAG_6_HAS_TRAINER_MASK)
-        {
-            // skip the 512-byte trainer
-            file.seekg(0x200, std::ios_base::cur);
-        }
-
-        bool vertical_mirroring = header.flag6 & FLAG_6_USE_VERTICAL_MIRRORING_MASK;
-
-        if (header.flag7 == 0x44)
-        {
-            // This might be one of the earlier dumps with bad iNes header (D stands for diskdude)
-            header.flag7 = 0;
-        }
-
-        int prg_rom_size = header.prg_size * 0x4000;    // 16KB
-        int chr_rom_size = header.chr_size * 0x2000;    // 8KB
-
-        auto prg_rom = std::make_shared<std::vector<uint8_t>>(prg_rom_size);
-        auto chr_rom = std::make_shared<std::vector<uint8_t>>(chr_rom_size);
+        _scheduler.schedule(event, when);
+        _cpu.preempt(when);
+    }
 
-        file.read((char *)prg_rom->data(), prg_rom->size());
-        file.read((char *)chr_rom->data(), chr_rom->size());
+    nes_cycle_t next_event_deadline() { return _scheduler.next_deadline(); }
 
-        file.close();
+    bool stop_requested() { return _stop_requested; }
 
-        return {prg_rom, chr_rom, vertical_mirroring};
-    }
+    //
+    // Plugs in a cartridge for the ROM and powers on (see reset). The mapper is created in place of the
+    // previous one, so nothing is allocated (but CHR RAM for a bigger cartridge than any before), and code
+    // decoded from the ROM is kept when it is the ROM that was already in.
+    // Battery-backed PRG RAM lives in save_path - nullptr or "" keeps it in memory only. Only one instance
+    // at a time gets a save file: the others (and any that can't open it) are logged and keep it in memory
+    // Throws for unsupported mappers - the previous cartridge stays in then
+    //
+    void attach_rom(std::shared_ptr<const nes_rom_image> rom, const char *save_path = nullptr);
+
+    // Same with the ROM file at rom_path - and the save file next to it with a .sav extension by default
+    void load_rom(const char *rom_path, const char *save_path = nullptr);
 };
 
@@ -0,0 +1,72 @@
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <stdexcept>
+#include "nes_system_pool.h"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+nes_system_pool::nes_system_pool(size_t count)
+        : _systems(nullptr), _count(count), _mapped(false), _huge_pages(false)
+{
+    size_t size = std::max(count, size_t(1)) * sizeof(nes_system);
+    _region_size = (size + NES_HUGE_PAGE_SIZE - 1) & ~size_t(NES_HUGE_PAGE_SIZE - 1);
+
+    void *region = nullptr;
+#if !defined(_WIN32)
+#ifdef MAP_HUGETLB
+    // Reserved huge pages - usually there are none unless the administrator set some aside
+    region = mmap(nullptr, _region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED)
+        _huge_pages = true;
+#else
+    region = MAP_FAILED;
+#endif
+
+    if (region == MAP_FAILED)
+    {
+        // Transparent huge pages only back 2MB-aligned ranges - map an extra huge page to align within
+        size_t mapped_size = _region_size + NES_HUGE_PAGE_SIZE;
+        void *mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED)
+            throw std::bad_alloc();
+
+        uintptr_t start = (uintptr_t(mapped) + NES_HUGE_PAGE_SIZE - 1) & ~uintptr_t(NES_HUGE_PAGE_SIZE - 1);
+        size_t head = start - uintptr_t(mapped);
+        if (head)
+            munmap(mapped, head);
+        if (NES_HUGE_PAGE_SIZE - head)
+            munmap((uint8_t *)start + _region_size, NES_HUGE_PAGE_SIZE - head);
+        region = (void *)start;
+
+#ifdef MADV_HUGEPAGE
+        _huge_pages = madvise(region, _region_size, MADV_HUGEPAGE) == 0;
+#endif
+    }
+    _mapped = true;
+#else
+    region = ::operator new(_region_size, std::align_val_t(NES_HUGE_PAGE_SIZE));
+#endif
+
+    _systems = (nes_system *)region;
+    for (size_t i = 0; i < _count; ++i)
+    {
+        new (&_systems[i]) nes_system();
+        _systems[i].init();
+    }
+}
+
+nes_system_pool::~nes_system_pool()
+{
+    for (size_t i = 0; i < _count; ++i)
+        _systems[i].~nes_system();
+
+#if !defined(_WIN32)
+    if (_mapped)
+        munmap(_systems, _region_size);
+#else
+    ::operator delete(_systems, std::align_val_t(NES_HUGE_PAGE_SIZE));
+#endif
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <assert.h>
+#include "nes_system.h"
+
+#define NES_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+//
+// A fixed number of consoles side by side in one contiguous block of memory - backed by huge pages where the
+// host has them, so a farm of consoles costs a handful of TLB entries rather than thousands.
+// Every console is constructed and init()'ed up front; from then on attach_rom() and reset() recycle them
+// without going near the allocator. A console itself is small (about twice its nes_state) - its big
+// buffers live outside the block, allocated once with the console: the PPU's frame buffers and background
+// layers, and the block cache (dropped while the interpreter is selected, allocated again when another
+// engine is). So do the JIT's code buffer (executable memory, created when the JIT engine is selected) and
+// CHR RAM (with its decoded tiles) for a bigger cartridge than any before.
+//
+class nes_system_pool
+{
+public :
+    explicit nes_system_pool(size_t count);
+    ~nes_system_pool();
+
+    nes_system_pool(const nes_system_pool &) = delete;
+    nes_system_pool &operator=(const nes_system_pool &) = delete;
+
+    size_t size() const { return _count; }
+
+    nes_system &operator[](size_t index)
+    {
+        assert(index < _count);
+        return _systems[index];
+    }
+
+    // The block is backed by huge pages - explicitly reserved ones, or transparent ones the OS was asked for
+    bool huge_pages() const { return _huge_pages; }
+
+private :
+    nes_system *_systems;
+    size_t _count;
+    size_t _region_size;            // _systems rounded up to NES_HUGE_PAGE_SIZE
+    bool _mapped;                   // _systems came from mmap rather than operator new
+    bool _huge_pages;
+};
@@ -0,0 +1,103 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "nes_trace.h"
+#include "opcodes.h"
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+nes_trace::nes_trace(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    _records = std::make_unique<nes_trace_record[]>(size);
+    _mask = size - 1;
+    _next = 0;
+}
+
+// write() until all of data is out - it may take less at a time
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const char *pos = (const char *)data;
+    while (size > 0)
+    {
+        auto written = write(fd, pos, (unsigned)std::min(size, size_t(1) << 30));
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        pos += written;
+        size -= size_t(written);
+    }
+
+    return true;
+}
+
+bool nes_trace::save(int fd) const
+{
+    nes_trace_file_header header = {};
+    memcpy(header.magic, NES_TRACE_MAGIC, sizeof(header.magic));
+    header.version = NES_TRACE_VERSION;
+    header.record_size = sizeof(nes_trace_record);
+    header.count = size();
+
+    // The ring wraps at most once - oldest part first
+    size_t first = (_next - size()) & _mask;
+    size_t before_wrap = std::min(size(), capacity() - first);
+    return write_all(fd, &header, sizeof(header)) &&
+           write_all(fd, &_records[first], sizeof(nes_trace_record) * before_wrap) &&
+           write_all(fd, &_records[0], sizeof(nes_trace_record) * (size() - before_wrap));
+}
+
+// Operand as nintendulator disassembles it
+static void format_operand(const nes_trace_record &rec, const opEntry &entry, char *buf, size_t size)
+{
+    uint8_t lo = rec.operand[0];
+    uint16_t word = uint16_t(rec.operand[0] | (rec.operand[1] << 8));
+    switch (entry.mode)
+    {
+        case nes_addr_mode::ACC:     snprintf(buf, size, "A"); break;
+        case nes_addr_mode::IMD:     snprintf(buf, size, "#$%02X", lo); break;
+        case nes_addr_mode::ZP:      snprintf(buf, size, "$%02X", lo); break;
+        case nes_addr_mode::ZPX:     snprintf(buf, size, "$%02X,X", lo); break;
+        case nes_addr_mode::ZPY:     snprintf(buf, size, "$%02X,Y", lo); break;
+        case nes_addr_mode::ABS:     snprintf(buf, size, "$%04X", word); break;
+        case nes_addr_mode::ABSX:    snprintf(buf, size, "$%04X,X", word); break;
+        case nes_addr_mode::ABSY:    snprintf(buf, size, "$%04X,Y", word); break;
+        case nes_addr_mode::IND:
+        case nes_addr_mode::IND_JMP: snprintf(buf, size, "($%04X)", word); break;
+        case nes_addr_mode::INDX:    snprintf(buf, size, "($%02X,X)", lo); break;
+        case nes_addr_mode::INDY:    snprintf(buf, size, "($%02X),Y", lo); break;
+        case nes_addr_mode::REL:     snprintf(buf, size, "$%04X", uint16_t(rec.pc + 2 + int8_t(lo))); break;
+        default:                     buf[0] = 0; break;
+    }
+}
+
+char *nes_trace_format(const nes_trace_record &rec, char *buf, size_t size)
+{
+    const opEntry &entry = opsTable[rec.op_code];
+    int operand_size = (entry.mode == nes_addr_mode::UNKNOWN) ? 0 : nes_operand_size(entry.mode);
+
+    char bytes[16];
+    int len = snprintf(bytes, sizeof(bytes), "%02X", rec.op_code);
+    for (int i = 0; i < operand_size; ++i)
+        len += snprintf(bytes + len, sizeof(bytes) - len, " %02X", rec.operand[i]);
+
+    char operand[16];
+    format_operand(rec, entry, operand, sizeof(operand));
+
+    char disasm[40];
+    snprintf(disasm, sizeof(disasm), "%s %s", entry.name, operand);
+
+    snprintf(buf, size, "%04X  %-9s %-32sA:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%u",
+             rec.pc, bytes, disasm, rec.a, rec.x, rec.y, rec.p, rec.sp, rec.cycle);
+    return buf;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+//
+// Instruction tracing is compiled in unless NES_NO_TRACE is defined - without it nes_cpu has no trace
+// support at all. With it, nothing is traced (and nothing is paid) until nes_cpu::set_trace turns it on.
+//
+#if !defined(NES_NO_TRACE)
+#define NES_TRACE 1
+#endif
+
+//
+// CPU state right before an instruction executes - the same fields as a nintendulator log line
+//
+struct nes_trace_record
+{
+    uint16_t pc;
+    uint8_t op_code;
+    uint8_t operand[2];             // bytes following the opcode - only the first nes_operand_size are meaningful
+    uint8_t a;
+    uint8_t x;
+    uint8_t y;
+    uint8_t p;
+    uint8_t sp;
+    uint32_t cycle;                 // CPU cycles since power on, low 32 bits (wraps after ~40 min of NES time)
+};
+
+static_assert(sizeof(nes_trace_record) == 16, "trace records are written to disk as-is");
+
+//
+// Trace file written by nes_trace::save: the header followed by header.count records, oldest first
+//
+#define NES_TRACE_MAGIC "NESTRACE"
+#define NES_TRACE_VERSION 1
+
+struct nes_trace_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+};
+
+//
+// Ring buffer keeping the last capacity() instructions - allocated once, recording is a single store
+//
+class nes_trace
+{
+public :
+    // capacity is rounded up to a power of 2
+    explicit nes_trace(size_t capacity);
+
+    void record(const nes_trace_record &rec) { _records[_next++ & _mask] = rec; }
+
+    size_t capacity() const { return _mask + 1; }
+
+    // Number of records currently held
+    size_t size() const { return (_next < capacity()) ? size_t(_next) : capacity(); }
+
+    // Number of records ever written - the newest one is record number total() - 1
+    uint64_t total() const { return _next; }
+
+    // index 0 is the oldest record
+    const nes_trace_record &at(size_t index) const { return _records[(_next - size() + index) & _mask]; }
+
+    void clear() { _next = 0; }
+
+    // Writes the records out as a trace file to fd, open for writing - false if that fails. Nothing but
+    // write() is called, so this is safe in a signal handler
+    bool save(int fd) const;
+
+private :
+    std::unique_ptr<nes_trace_record[]> _records;
+    size_t _mask;
+    uint64_t _next;                 // total records ever written
+};
+
+//
+// Renders a record as a nintendulator-style log line (without trailing newline) into buf - returns buf
+//   C000  4C F5 C5  JMP $C5F5                       A:00 X:00 Y:00 P:24 SP:FD CYC:7
+//
+#define NES_TRACE_LINE_SIZE 96
+char *nes_trace_format(const nes_trace_record &rec, char *buf, size_t size);
@@ -0,0 +1,71 @@
+//
+// Renders a binary instruction trace (see nes_trace.h) as a nintendulator-style text log
+//   nesemu2_trace_dump <trace file> [last N instructions]
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "nes_trace.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <trace file> [last N instructions]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        printf("Cannot open %s\n", argv[1]);
+        return 1;
+    }
+
+    nes_trace_file_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, NES_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != NES_TRACE_VERSION || header.record_size != sizeof(nes_trace_record))
+    {
+        printf("%s is not a trace file this version understands\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    uint64_t first = 0;
+    if (argc > 2)
+    {
+        uint64_t last = strtoull(argv[2], nullptr, 10);
+        if (last < header.count)
+            first = header.count - last;
+    }
+
+    if (fseek(file, long(sizeof(header) + first * sizeof(nes_trace_record)), SEEK_SET) != 0)
+    {
+        printf("%s is truncated\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    // Stream in chunks - traces can be millions of records
+    static nes_trace_record records[4096];
+    char line[NES_TRACE_LINE_SIZE];
+    uint64_t left = header.count - first;
+    while (left > 0)
+    {
+        size_t count = fread(records, sizeof(nes_trace_record), (left < 4096) ? size_t(left) : 4096, file);
+        if (count == 0)
+        {
+            fprintf(stderr, "%s is truncated\n", argv[1]);
+            break;
+        }
+
+        for (size_t i = 0; i < count; ++i)
+            puts(nes_trace_format(records[i], line, sizeof(line)));
+        left -= count;
+    }
+
+    fclose(file);
+    return 0;
+}
@@ -1,7 +1,7 @@
 #pragma once
 #include "nes_cpu.h"
 
-opEntry opsTable[] = {
+static const opEntry opsTable[] = {
         {"BRK", nes_addr_mode::IMP, 1, 0, 7}, //0x0, 0
         {"ORA", nes_addr_mode::INDX, 2, 0, 6}, //0x1, 1
         {"STP", nes_addr_mode::UNKNOWN, 0, 0, 0}, //0x2, 2
@@ -258,4 +258,267 @@ opEntry opsTable[] = {
         {"SBC", nes_addr_mode::ABSX, 3, 0, 4}, //0xFD, 253
         {"INC", nes_addr_mode::ABSX, 3, 0, 7}, //0xFE, 254
         {"ISC", nes_addr_mode::UNKNOWN, 0, 0, 0}, //0xFF, 255
-};
\ No newline at end of file
+};
+
+//
+// Every opcode and the handler that implements it, in opcode order
+// OP(code, handler, mode) - handler takes the operand decoded with the given addressing mode
+// IMP(code, handler)      - implied addressing, handler takes no operand
+//
+#define NES_CPU_OPCODES(OP, IMP) \
+    IMP(0x00, BRK)             \
+    OP(0x01, ORA_IND, INDX)    \
+    IMP(0x02, UNKNOWN)         \
+    OP(0x03, UNOFFICIAL, INDX) \
+    OP(0x04, UNOFFICIAL, ZP)   \
+    OP(0x05, ORA_IND, ZP)      \
+    OP(0x06, ASL, ZP)          \
+    OP(0x07, UNOFFICIAL, ZP)   \
+    IMP(0x08, PHP)             \
+    OP(0x09, ORA, IMD)         \
+    OP(0x0a, ASL_ACC, ACC)     \
+    OP(0x0b, UNOFFICIAL, IMD)  \
+    OP(0x0c, UNOFFICIAL, ABS)  \
+    OP(0x0d, ORA_IND, ABS)     \
+    OP(0x0e, ASL, ABS)         \
+    OP(0x0f, UNOFFICIAL, ABS)  \
+    OP(0x10, BPL, REL)         \
+    OP(0x11, ORA_IND, INDY)    \
+    IMP(0x12, UNKNOWN)         \
+    OP(0x13, UNOFFICIAL, INDY) \
+    OP(0x14, UNOFFICIAL, ZPX)  \
+    OP(0x15, ORA_IND, ZPX)     \
+    OP(0x16, ASL, ZPX)         \
+    OP(0x17, UNOFFICIAL, ZPX)  \
+    IMP(0x18, CLC)             \
+    OP(0x19, ORA_IND, ABSY)    \
+    IMP(0x1a, UNOFFICIAL)      \
+    OP(0x1b, UNOFFICIAL, ABSY) \
+    OP(0x1c, UNOFFICIAL, ABSX) \
+    OP(0x1d, ORA_IND, ABSX)    \
+    OP(0x1e, ASL, ABSX)        \
+    OP(0x1f, UNOFFICIAL, ABSX) \
+    OP(0x20, JSR, ABS)         \
+    OP(0x21, AND_IND, INDX)    \
+    IMP(0x22, UNKNOWN)         \
+    OP(0x23, UNOFFICIAL, INDX) \
+    OP(0x24, BIT, ZP)          \
+    OP(0x25, AND_IND, ZP)      \
+    OP(0x26, ROL, ZP)          \
+    OP(0x27, UNOFFICIAL, ZP)   \
+    IMP(0x28, PLP)             \
+    OP(0x29, AND, IMD)         \
+    OP(0x2a, ROL_ACC, ACC)     \
+    OP(0x2b, UNOFFICIAL, IMD)  \
+    OP(0x2c, BIT, ABS)         \
+    OP(0x2d, AND_IND, ABS)     \
+    OP(0x2e, ROL, ABS)         \
+    OP(0x2f, UNOFFICIAL, ABS)  \
+    OP(0x30, BMI, REL)         \
+    OP(0x31, AND_IND, INDY)    \
+    IMP(0x32, UNKNOWN)         \
+    OP(0x33, UNOFFICIAL, INDY) \
+    OP(0x34, UNOFFICIAL, ZPX)  \
+    OP(0x35, AND_IND, ZPX)     \
+    OP(0x36, ROL, ZPX)         \
+    OP(0x37, UNOFFICIAL, ZPX)  \
+    IMP(0x38, SEC)             \
+    OP(0x39, AND_IND, ABSY)    \
+    IMP(0x3a, UNOFFICIAL)      \
+    OP(0x3b, UNOFFICIAL, ABSY) \
+    OP(0x3c, UNOFFICIAL, ABSX) \
+    OP(0x3d, AND_IND, ABSX)    \
+    OP(0x3e, ROL, ABSX)        \
+    OP(0x3f, UNOFFICIAL, ABSX) \
+    IMP(0x40, RTI)             \
+    OP(0x41, EOR_IND, INDX)    \
+    IMP(0x42, UNKNOWN)         \
+    OP(0x43, UNOFFICIAL, INDX) \
+    OP(0x44, UNOFFICIAL, ZP)   \
+    OP(0x45, EOR_IND, ZP)      \
+    OP(0x46, LSR, ZP)          \
+    OP(0x47, UNOFFICIAL, ZP)   \
+    IMP(0x48, PHA)             \
+    OP(0x49, EOR, IMD)         \
+    OP(0x4a, LSR_ACC, ACC)     \
+    OP(0x4b, UNOFFICIAL, IMD)  \
+    OP(0x4c, JMP, ABS)         \
+    OP(0x4d, EOR_IND, ABS)     \
+    OP(0x4e, LSR, ABS)         \
+    OP(0x4f, UNOFFICIAL, ABS)  \
+    OP(0x50, BVC, REL)         \
+    OP(0x51, EOR_IND, INDY)    \
+    IMP(0x52, UNKNOWN)         \
+    OP(0x53, UNOFFICIAL, INDY) \
+    OP(0x54, UNOFFICIAL, ZPX)  \
+    OP(0x55, EOR_IND, ZPX)     \
+    OP(0x56, LSR, ZPX)         \
+    OP(0x57, UNOFFICIAL, ZPX)  \
+    IMP(0x58, CLI)             \
+    OP(0x59, EOR_IND, ABSY)    \
+    IMP(0x5a, UNOFFICIAL)      \
+    OP(0x5b, UNOFFICIAL, ABSY) \
+    OP(0x5c, UNOFFICIAL, ABSX) \
+    OP(0x5d, EOR_IND, ABSX)    \
+    OP(0x5e, LSR, ABSX)        \
+    OP(0x5f, UNOFFICIAL, ABSX) \
+    IMP(0x60, RTS)             \
+    OP(0x61, ADC, INDX)        \
+    IMP(0x62, UNKNOWN)         \
+    OP(0x63, UNOFFICIAL, INDX) \
+    OP(0x64, UNOFFICIAL, ZP)   \
+    OP(0x65, ADC, ZP)          \
+    OP(0x66, ROR, ZP)          \
+    OP(0x67, UNOFFICIAL, ZP)   \
+    IMP(0x68, PLA)             \
+    OP(0x69, ADC_IMD, IMD)     \
+    OP(0x6a, ROR_ACC, ACC)     \
+    OP(0x6b, UNOFFICIAL, IMD)  \
+    OP(0x6c, JMP, IND_JMP)     \
+    OP(0x6d, ADC, ABS)         \
+    OP(0x6e, ROR, ABS)         \
+    OP(0x6f, UNOFFICIAL, ABS)  \
+    OP(0x70, BVS, REL)         \
+    OP(0x71, ADC, INDY)        \
+    IMP(0x72, UNKNOWN)         \
+    OP(0x73, UNOFFICIAL, INDY) \
+    OP(0x74, UNOFFICIAL, ZPX)  \
+    OP(0x75, ADC, ZPX)         \
+    OP(0x76, ROR, ZPX)         \
+    OP(0x77, UNOFFICIAL, ZPX)  \
+    IMP(0x78, SEI)             \
+    OP(0x79, ADC, ABSY)        \
+    IMP(0x7a, UNOFFICIAL)      \
+    OP(0x7b, UNOFFICIAL, ABSY) \
+    OP(0x7c, UNOFFICIAL, ABSX) \
+    OP(0x7d, ADC, ABSX)        \
+    OP(0x7e, ROR, ABSX)        \
+    OP(0x7f, UNOFFICIAL, ABSX) \
+    OP(0x80, UNOFFICIAL, IMD)  \
+    OP(0x81, STA, INDX)        \
+    OP(0x82, UNOFFICIAL, IMD)  \
+    OP(0x83, UNOFFICIAL, INDX) \
+    OP(0x84, STY, ZP)          \
+    OP(0x85, STA, ZP)          \
+    OP(0x86, STX, ZP)          \
+    OP(0x87, UNOFFICIAL, ZP)   \
+    IMP(0x88, DEY)             \
+    OP(0x89, UNOFFICIAL, IMD)  \
+    IMP(0x8a, TXA)             \
+    OP(0x8b, UNOFFICIAL, IMD)  \
+    OP(0x8c, STY, ABS)         \
+    OP(0x8d, STA, ABS)         \
+    OP(0x8e, STX, ABS)         \
+    OP(0x8f, UNOFFICIAL, ABS)  \
+    OP(0x90, BCC, REL)         \
+    OP(0x91, STA, INDY)        \
+    IMP(0x92, UNKNOWN)         \
+    OP(0x93, UNOFFICIAL, INDY) \
+    OP(0x94, STY, ZPX)         \
+    OP(0x95, STA, ZPX)         \
+    OP(0x96, STX, ZPY)         \
+    OP(0x97, UNOFFICIAL, ZPY)  \
+    IMP(0x98, TYA)             \
+    OP(0x99, STA, ABSY)        \
+    IMP(0x9a, TXS)             \
+    OP(0x9b, UNOFFICIAL, ABSY) \
+    IMP(0x9c, UNKNOWN)         \
+    OP(0x9d, STA, ABSX)        \
+    IMP(0x9e, UNKNOWN)         \
+    OP(0x9f, UNOFFICIAL, ABSY) \
+    OP(0xa0, LDY, IMD)         \
+    OP(0xa1, LDA_ABS, INDX)    \
+    OP(0xa2, LDX, IMD)         \
+    OP(0xa3, LAX, INDX)        \
+    OP(0xa4, LDY_ABS, ZP)      \
+    OP(0xa5, LDA_ABS, ZP)      \
+    OP(0xa6, LDX_ABS, ZP)      \
+    OP(0xa7, LAX, ZP)          \
+    IMP(0xa8, TAY)             \
+    OP(0xa9, LDA, IMD)         \
+    IMP(0xaa, TAX)             \
+    OP(0xab, UNOFFICIAL, IMD)  \
+    OP(0xac, LDY_ABS, ABS)     \
+    OP(0xad, LDA_ABS, ABS)     \
+    OP(0xae, LDX_ABS, ABS)     \
+    OP(0xaf, LAX, ABS)         \
+    OP(0xb0, BCS, REL)         \
+    OP(0xb1, LDA_ABS, INDY)    \
+    IMP(0xb2, UNKNOWN)         \
+    OP(0xb3, LAX, INDY)        \
+    OP(0xb4, LDY_ABS, ZPX)     \
+    OP(0xb5, LDA_ABS, ZPX)     \
+    OP(0xb6, LDX_ABS, ZPY)     \
+    OP(0xb7, LAX, ZPY)         \
+    IMP(0xb8, CLV)             \
+    OP(0xb9, LDA_ABS, ABSY)    \
+    IMP(0xba, TSX)             \
+    OP(0xbb, UNOFFICIAL, ZPY)  \
+    OP(0xbc, LDY_ABS, ABSX)    \
+    OP(0xbd, LDA_ABS, ABSX)    \
+    OP(0xbe, LDX_ABS, ABSY)    \
+    OP(0xbf, UNOFFICIAL, ABSY) \
+    OP(0xc0, CPY_IMD, IMD)     \
+    OP(0xc1, CMP_IND, INDX)    \
+    OP(0xc2, UNOFFICIAL, IMD)  \
+    OP(0xc3, UNOFFICIAL, INDX) \
+    OP(0xc4, CPY, ZP)          \
+    OP(0xc5, CMP_IND, ZP)      \
+    OP(0xc6, DEC, ZP)          \
+    OP(0xc7, UNOFFICIAL, ZP)   \
+    IMP(0xc8, INY)             \
+    OP(0xc9, CMP, IMD)         \
+    IMP(0xca, DEX)             \
+    OP(0xcb, UNOFFICIAL, IMD)  \
+    OP(0xcc, CPY, ABS)         \
+    OP(0xcd, CMP_IND, ABS)     \
+    OP(0xce, DEC, ABS)         \
+    OP(0xcf, UNOFFICIAL, ABS)  \
+    OP(0xd0, BNE, REL)         \
+    OP(0xd1, CMP_IND, INDY)    \
+    IMP(0xd2, UNKNOWN)         \
+    OP(0xd3, UNOFFICIAL, ABSY) \
+    OP(0xd4, UNOFFICIAL, ZPX)  \
+    OP(0xd5, CMP_IND, ZPX)     \
+    OP(0xd6, DEC, ZPX)         \
+    OP(0xd7, UNOFFICIAL, ZPX)  \
+    IMP(0xd8, CLD)             \
+    OP(0xd9, CMP_IND, ABSY)    \
+    IMP(0xda, UNOFFICIAL)      \
+    OP(0xdb, UNOFFICIAL, ABSY) \
+    OP(0xdc, UNOFFICIAL, ABSX) \
+    OP(0xdd, CMP_IND, ABSX)    \
+    OP(0xde, DEC, ABSX)        \
+    OP(0xdf, UNOFFICIAL, ABSX) \
+    OP(0xe0, CPX_IMD, IMD)     \
+    OP(0xe1, SBC, INDX)        \
+    OP(0xe2, UNOFFICIAL, IMD)  \
+    OP(0xe3, ISC, INDX)        \
+    OP(0xe4, CPX, ZP)          \
+    OP(0xe5, SBC, ZP)          \
+    OP(0xe6, INC, ZP)          \
+    OP(0xe7, UNOFFICIAL, ZP)   \
+    IMP(0xe8, INX)             \
+    OP(0xe9, SBC_IMD, IMD)     \
+    IMP(0xea, NOP)             \
+    OP(0xeb, UNOFFICIAL, IMD)  \
+    OP(0xec, CPX, ABS)         \
+    OP(0xed, SBC, ABS)         \
+    OP(0xee, INC, ABS)         \
+    OP(0xef, UNOFFICIAL, ABS)  \
+    OP(0xf0, BEQ, REL)         \
+    OP(0xf1, SBC, INDY)        \
+    IMP(0xf2, UNKNOWN)         \
+    OP(0xf3, UNOFFICIAL, INDY) \
+    OP(0xf4, UNOFFICIAL, ZPX)  \
+    OP(0xf5, SBC, ZPX)         \
+    OP(0xf6, INC, ZPX)         \
+    OP(0xf7, UNOFFICIAL, ZPX)  \
+    IMP(0xf8, SED)             \
+    OP(0xf9, SBC, ABSY)        \
+    IMP(0xfa, UNOFFICIAL)      \
+    OP(0xfb, UNOFFICIAL, ABSY) \
+    OP(0xfc, UNOFFICIAL, ABSX) \
+    OP(0xfd, SBC, ABSX)        \
+    OP(0xfe, INC, ABSX)        \
+    OP(0xff, UNOFFICIAL, ABSX)